@@ -0,0 +1,87 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * The latency histogram shared by shdict-bench and shdict-load: values
+ * below 128 get a bucket of their own, and every power of two above that
+ * is split into 64 linear buckets, about 1.5% precision up to 2^45.
+ */
+
+
+#ifndef _BENCH_HIST_H_
+#define _BENCH_HIST_H_
+
+
+#include <stdint.h>
+
+
+#define BENCH_HIST_SUB       64
+#define BENCH_HIST_SIZE      (BENCH_HIST_SUB * 40)
+
+
+static inline unsigned
+bench_hist_index(uint64_t v)
+{
+    unsigned  shift;
+
+    if (v < 2 * BENCH_HIST_SUB) {
+        return (unsigned) v;
+    }
+
+    shift = 63 - __builtin_clzll(v) - 6;
+
+    if (shift + 1 >= BENCH_HIST_SIZE / BENCH_HIST_SUB) {
+        return BENCH_HIST_SIZE - 1;
+    }
+
+    return (shift + 1) * BENCH_HIST_SUB
+           + (unsigned) (v >> shift) - BENCH_HIST_SUB;
+}
+
+
+static inline uint64_t
+bench_hist_value(unsigned i)
+{
+    unsigned  shift;
+
+    if (i < 2 * BENCH_HIST_SUB) {
+        return i;
+    }
+
+    shift = i / BENCH_HIST_SUB - 1;
+
+    return (uint64_t) (i % BENCH_HIST_SUB + BENCH_HIST_SUB) << shift;
+}
+
+
+/* the lower bound of the bucket holding the q-quantile of "count" values */
+
+static inline uint64_t
+bench_hist_quantile(const uint64_t *hist, uint64_t count, double q)
+{
+    unsigned  i;
+    uint64_t  seen, rank;
+
+    rank = (uint64_t) (q * count);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    seen = 0;
+
+    for (i = 0; i < BENCH_HIST_SIZE; i++) {
+        seen += hist[i];
+
+        if (seen >= rank) {
+            return bench_hist_value(i);
+        }
+    }
+
+    return 0;
+}
+
+
+#endif /* _BENCH_HIST_H_ */
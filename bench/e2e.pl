@@ -0,0 +1,340 @@
+#!/usr/bin/env perl
+
+# The end-to-end benchmark suite, run by "make bench" and
+# "make bench-baseline" from the top directory.
+#
+# Starts nginx with a zone served over http and another one over stream,
+# like t/http-shdict.t and t/stream-shdict.t do, drives every workload
+# with bench/shdict-load, and compares the throughput and the 99th
+# percentile latency with the baseline saved by --save on the same
+# machine.
+
+use strict;
+use warnings;
+
+use Cwd qw(cwd);
+use File::Path qw(make_path remove_tree);
+use Getopt::Long;
+use IO::Socket::INET;
+use Time::HiRes qw(sleep);
+
+my %opt = (
+    nginx               => 'nginx',
+    port                => $ENV{TEST_NGINX_SERVER_PORT} || 1984,
+    workers             => 2,
+    duration            => 5,
+    connections         => 32,
+    keys                => 10000,
+    threshold           => 10,
+    latency_threshold   => 25,
+    baseline            => 'bench/baseline.txt',
+    save                => 0,
+);
+
+GetOptions(\%opt, 'nginx=s', 'port=i', 'workers=i', 'duration=f',
+           'connections=i', 'keys=i', 'threshold=f',
+           'latency_threshold|latency-threshold=f', 'baseline=s', 'save')
+    or die "usage: $0 [--save] [--baseline file] [--duration seconds] "
+         . "[--connections n] [--keys n] [--workers n] [--threshold pct] "
+         . "[--latency-threshold pct] [--nginx path] [--port port]\n";
+
+# name, the op under load, and the op of the single connection running
+# next to it, if any
+
+my @scenarios = (
+    [ 'get',            'get' ],
+    [ 'set',            'set' ],
+    [ 'incr',           'incr' ],
+    [ 'list',           'list' ],
+    [ 'get_keys',       'get',      'get_keys' ],
+    [ 'flush_expired',  'set_ttl',  'flush_expired' ],
+);
+
+my $pwd = cwd();
+my $servroot = "$pwd/bench/servroot";
+my $load = "$pwd/bench/shdict-load";
+my %port = (http => $opt{port}, stream => $opt{port} + 1);
+
+-x $load or die "$load not found, run \"make -C bench shdict-load\"\n";
+
+start_nginx();
+
+my (%results, @names);
+
+eval {
+    for my $sub (qw(http stream)) {
+        for my $s (@scenarios) {
+            my ($name, $op, $side) = @$s;
+
+            request($sub, 'prefill', $opt{keys});
+
+            my @runs = ([ $op, $opt{connections} ]);
+            push @runs, [ $side, 1 ] if $side;
+
+            my @res = run_load($sub, @runs);
+
+            my $main = $side ? "$sub.$op+$side" : "$sub.$name";
+            $results{$main} = $res[0];
+            push @names, $main;
+
+            if ($side) {
+                $results{"$sub.$side"} = $res[1];
+                push @names, "$sub.$side";
+            }
+        }
+    }
+};
+
+my $err = $@;
+
+stop_nginx();
+
+die $err if $err;
+
+my @errors = check_error_log();
+
+report();
+
+if ($opt{save}) {
+    save_baseline();
+    print "baseline saved to $opt{baseline}\n";
+    exit(@errors ? 1 : 0);
+}
+
+if (!-f $opt{baseline}) {
+    print "no baseline in $opt{baseline}, run \"make bench-baseline\" "
+          . "to save one\n";
+    exit(@errors ? 1 : 0);
+}
+
+my @regressions = compare_baseline();
+
+print "$_\n" for @errors, @regressions;
+
+exit((@errors || @regressions) ? 1 : 0);
+
+
+sub start_nginx {
+    remove_tree($servroot);
+    make_path("$servroot/conf", "$servroot/logs");
+
+    my $lua_path = "$pwd/bench/?.lua;$pwd/lib/?.lua;;";
+
+    open my $out, '>', "$servroot/conf/nginx.conf"
+        or die "cannot write nginx.conf: $!\n";
+
+    print $out <<"_EOC_";
+worker_processes $opt{workers};
+daemon on;
+master_process on;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 1024;
+}
+
+http {
+    access_log off;
+    keepalive_requests 100000000;
+    lua_package_path "$lua_path";
+    lua_shared_mem bench_http 64m;
+    lua_shared_mem bench_stream 64m;
+
+    server {
+        listen 127.0.0.1:$port{http};
+
+        location / {
+            content_by_lua_block {
+                require("shdict_e2e").http("bench_http")
+            }
+        }
+    }
+}
+
+stream {
+    lua_package_path "$lua_path";
+
+    server {
+        listen 127.0.0.1:$port{stream};
+
+        content_by_lua_block {
+            require("shdict_e2e").stream("bench_stream")
+        }
+    }
+}
+_EOC_
+
+    close $out;
+
+    system($opt{nginx}, '-p', "$servroot/", '-c', 'conf/nginx.conf') == 0
+        or die "failed to start nginx\n";
+
+    for my $p (values %port) {
+        for (1 .. 100) {
+            last if IO::Socket::INET->new(PeerAddr => "127.0.0.1:$p");
+            sleep 0.05;
+        }
+    }
+}
+
+
+sub stop_nginx {
+    open my $in, '<', "$servroot/logs/nginx.pid" or return;
+    chomp(my $pid = <$in>);
+    close $in;
+
+    kill 'QUIT', $pid;
+
+    for (1 .. 100) {
+        last unless kill 0, $pid;
+        sleep 0.05;
+    }
+}
+
+
+# one request outside of the measurements, for the prefill
+
+sub request {
+    my ($sub, $op, $key) = @_;
+
+    my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port{$sub}")
+        or die "cannot connect to the $sub server: $!\n";
+
+    if ($sub eq 'http') {
+        print $sock "GET /$op?k=$key HTTP/1.1\r\nHost: localhost\r\n"
+                    . "Connection: close\r\n\r\n";
+
+        my $status = <$sock>;
+        die "$op failed: $status" unless $status =~ m{^HTTP/1\.1 200};
+
+    } else {
+        print $sock "$op $key\n";
+
+        my $line = <$sock>;
+        die "$op failed: " . ($line // "connection closed\n")
+            if !defined $line || $line =~ /^ERR/;
+    }
+
+    close $sock;
+}
+
+
+# runs the generators side by side and returns their results in order
+
+sub run_load {
+    my ($sub, @runs) = @_;
+
+    my @pipes;
+
+    for my $r (@runs) {
+        my ($op, $conns) = @$r;
+
+        my @cmd = ($load, '-P', $port{$sub},
+                   '-m', $sub eq 'http' ? 'http' : 'line', '-o', $op,
+                   '-k', $opt{keys}, '-c', $conns, '-d', $opt{duration});
+
+        open my $fh, '-|', @cmd or die "cannot run $load: $!\n";
+        push @pipes, $fh;
+    }
+
+    my @res;
+
+    for my $fh (@pipes) {
+        my $line = <$fh>;
+        close $fh or die "$load failed\n";
+
+        die "no output from $load\n" unless defined $line;
+
+        push @res, { split ' ', $line };
+    }
+
+    return @res;
+}
+
+
+sub check_error_log {
+    my @errors;
+
+    open my $in, '<', "$servroot/logs/error.log" or return;
+
+    while (<$in>) {
+        push @errors, "ERROR LOG: $_" if /\[(error|crit|alert|emerg)\]/;
+    }
+
+    close $in;
+
+    for my $name (@names) {
+        my $n = $results{$name}{errors};
+        push @errors, "ERRORS: $name: $n failed requests" if $n;
+    }
+
+    chomp @errors;
+
+    return @errors;
+}
+
+
+sub report {
+    printf "%-32s %10s %9s %9s %9s %9s\n", 'workload', 'req/s', 'p50 us',
+           'p99 us', 'p999 us', 'max us';
+
+    for my $name (@names) {
+        my $r = $results{$name};
+
+        printf "%-32s %10.0f %9.1f %9.1f %9.1f %9.1f\n", $name, $r->{rps},
+               $r->{p50}, $r->{p99}, $r->{p999}, $r->{max};
+    }
+}
+
+
+sub save_baseline {
+    open my $out, '>', $opt{baseline}
+        or die "cannot write $opt{baseline}: $!\n";
+
+    print $out "# workload req/s p99_us, written by \"make bench-baseline\"\n";
+
+    for my $name (@names) {
+        my $r = $results{$name};
+        printf $out "%s %.0f %.1f\n", $name, $r->{rps}, $r->{p99};
+    }
+
+    close $out;
+}
+
+
+sub compare_baseline {
+    my @regressions;
+
+    open my $in, '<', $opt{baseline}
+        or die "cannot read $opt{baseline}: $!\n";
+
+    while (<$in>) {
+        next if /^\s*(#|$)/;
+
+        my ($name, $rps, $p99) = split;
+        my $r = $results{$name} or next;
+
+        if ($rps > 0 && $r->{rps} < $rps * (1 - $opt{threshold} / 100)) {
+            push @regressions,
+                 sprintf "REGRESSION: %s: %.0f req/s, baseline %.0f (%+.1f%%)",
+                         $name, $r->{rps}, $rps,
+                         ($r->{rps} - $rps) / $rps * 100;
+        }
+
+        if ($p99 > 0
+            && $r->{p99} > $p99 * (1 + $opt{latency_threshold} / 100))
+        {
+            push @regressions,
+                 sprintf "REGRESSION: %s: p99 %.1f us, baseline %.1f us "
+                         . "(%+.1f%%)", $name, $r->{p99}, $p99,
+                         ($r->{p99} - $p99) / $p99 * 100;
+        }
+    }
+
+    close $in;
+
+    print "no regressions against $opt{baseline}\n" unless @regressions;
+
+    return @regressions;
+}
@@ -0,0 +1,6 @@
+# prints a variable of nginx's objs/Makefile, used by bench/Makefile as in
+#
+#   make -s -C /path/to/nginx -f objs/Makefile -f ngx-var.mk ngx-var-CFLAGS
+
+ngx-var-%:
+	@echo '$($*)'
@@ -0,0 +1,963 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * shdict-bench: drives the FFI helpers of the module from several forked
+ * processes sharing one anonymous mapping initialized exactly like an
+ * nginx shared memory zone, and reports throughput and latency
+ * percentiles per operation. See the "Benchmarks" section of README.md.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+#include "bench_hist.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+
+#define BENCH_OP_GET         0
+#define BENCH_OP_SET         1
+#define BENCH_OP_INCR        2
+#define BENCH_OP_PUSH        3
+#define BENCH_OP_POP         4
+#define BENCH_NOPS           5
+
+#define BENCH_KEY_LEN_MIN    12
+
+
+typedef struct {
+    uint64_t                     ops;
+    uint64_t                     errors;
+    uint64_t                     hits;
+    uint64_t                     rejected;
+    uint64_t                     max;
+    uint64_t                     hist[BENCH_HIST_SIZE];
+} bench_stat_t;
+
+
+typedef struct {
+    ngx_atomic_t                 ready;
+    ngx_atomic_t                 go;
+    bench_stat_t                 stats[1][BENCH_NOPS];
+} bench_shared_t;
+
+
+typedef struct {
+    const char                  *workload;
+    ngx_uint_t                   procs;
+    ngx_uint_t                   keys;
+    size_t                       key_len;
+    size_t                       value_len;
+    double                       zipf;
+    double                       reads;
+    double                       duration;
+    size_t                       zone_size;
+    ngx_uint_t                   hot_keys;
+    ngx_uint_t                   hot_sample;
+    ngx_uint_t                   admission;
+    double                       scan;
+    const char                  *trace;
+} bench_conf_t;
+
+
+int ngx_lua_ffi_shdict_store_helper(ngx_shm_zone_t *zone, int op,
+    u_char *key, size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, long exptime, int user_flags,
+    char **errmsg, int *forcible);
+int ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
+    u_char *key, size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int *is_stale, char **errmsg);
+int ngx_lua_ffi_shdict_incr_helper(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, double *value, char **err, int has_init, double init,
+    long init_ttl, int *forcible);
+int ngx_lua_ffi_shdict_push_helper(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, ngx_lua_shdict_value_t *values, int nvalues,
+    long max_len, int *value_len, int flags, char **errmsg, int *forcible);
+int ngx_lua_ffi_shdict_pop_helper(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, int count, u_char **buf, size_t *buf_len,
+    int *nvalues, int flags, char **errmsg);
+int ngx_lua_ffi_shdict_hot_keys(ngx_shm_zone_t *zone, int n, u_char **buf,
+    size_t *buf_len, int *nkeys, char **errmsg);
+
+
+static ngx_int_t bench_zone_init(bench_conf_t *conf);
+static void bench_keys_init(bench_conf_t *conf);
+static ngx_int_t bench_trace_load(bench_conf_t *conf);
+static ngx_int_t bench_prefill(bench_conf_t *conf);
+static void bench_worker(bench_conf_t *conf, ngx_uint_t n);
+static ngx_uint_t bench_op(bench_conf_t *conf, bench_stat_t *stats, int op,
+    u_char *key, size_t key_len);
+static ngx_uint_t bench_next_key(bench_conf_t *conf, uint64_t *rnd);
+static uint64_t bench_random(uint64_t *state);
+static void bench_report(bench_conf_t *conf, double elapsed);
+static void bench_report_hot_keys(void);
+static void bench_usage(void);
+
+
+static const char *bench_op_names[BENCH_NOPS] = {
+    "get", "set", "incr", "push", "pop"
+};
+
+static ngx_open_file_t           bench_log_file;
+static ngx_log_t                 bench_log;
+static ngx_cycle_t               bench_cycle;
+static ngx_shm_zone_t            bench_zone;
+static ngx_lua_shdict_ctx_t      bench_ctx;
+static bench_shared_t           *bench_shared;
+static u_char                   *bench_keys;
+static double                   *bench_cdf;
+static u_char                   *bench_value;
+static ngx_str_t                *bench_trace;
+static ngx_uint_t                bench_trace_len;
+
+
+int
+main(int argc, char *const *argv)
+{
+    int                          c, status;
+    double                       elapsed;
+    size_t                       size;
+    ngx_uint_t                   i;
+    ngx_pid_t                    pid;
+    struct timespec              start, end;
+    bench_conf_t                 conf;
+
+    conf.workload = "mixed";
+    conf.procs = (ngx_uint_t) sysconf(_SC_NPROCESSORS_ONLN);
+    conf.keys = 100000;
+    conf.key_len = 16;
+    conf.value_len = 64;
+    conf.zipf = 0;
+    conf.reads = 0.9;
+    conf.duration = 5;
+    conf.zone_size = 64 * 1024 * 1024;
+    conf.hot_keys = 0;
+    conf.hot_sample = NGX_LUA_SHDICT_HOT_SAMPLE;
+    conf.admission = 0;
+    conf.scan = 0;
+    conf.trace = NULL;
+
+    while ((c = getopt(argc, argv, "w:p:k:K:v:z:r:d:m:H:S:As:T:h")) != -1) {
+        switch (c) {
+
+        case 'w':
+            conf.workload = optarg;
+            break;
+
+        case 'p':
+            conf.procs = (ngx_uint_t) atoi(optarg);
+            break;
+
+        case 'k':
+            conf.keys = (ngx_uint_t) atol(optarg);
+            break;
+
+        case 'K':
+            conf.key_len = (size_t) atol(optarg);
+            break;
+
+        case 'v':
+            conf.value_len = (size_t) atol(optarg);
+            break;
+
+        case 'z':
+            conf.zipf = atof(optarg);
+            break;
+
+        case 'r':
+            conf.reads = atof(optarg);
+            break;
+
+        case 'd':
+            conf.duration = atof(optarg);
+            break;
+
+        case 'm':
+            conf.zone_size = (size_t) atol(optarg) * 1024 * 1024;
+            break;
+
+        case 'H':
+            conf.hot_keys = (ngx_uint_t) atol(optarg);
+            break;
+
+        case 'S':
+            conf.hot_sample = (ngx_uint_t) atol(optarg);
+            break;
+
+        case 'A':
+            conf.admission = 1;
+            break;
+
+        case 's':
+            conf.scan = atof(optarg);
+            break;
+
+        case 'T':
+            conf.trace = optarg;
+            break;
+
+        default:
+            bench_usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (strcmp(conf.workload, "mixed") != 0
+        && strcmp(conf.workload, "get") != 0
+        && strcmp(conf.workload, "set") != 0
+        && strcmp(conf.workload, "incr") != 0
+        && strcmp(conf.workload, "list") != 0
+        && strcmp(conf.workload, "cache") != 0)
+    {
+        fprintf(stderr, "unknown workload \"%s\"\n", conf.workload);
+        return 1;
+    }
+
+    if (conf.procs == 0 || conf.keys == 0 || conf.duration <= 0
+        || conf.key_len < BENCH_KEY_LEN_MIN || conf.key_len > 65535
+        || conf.reads < 0 || conf.reads > 1 || conf.zipf < 0
+        || conf.hot_keys > NGX_LUA_SHDICT_HOT_MAX || conf.hot_sample == 0
+        || conf.scan < 0 || conf.scan > 1)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    if (conf.trace && strcmp(conf.workload, "cache") != 0) {
+        fprintf(stderr, "-T needs the cache workload\n");
+        return 1;
+    }
+
+    if (strcmp(conf.workload, "get") == 0) {
+        conf.reads = 1;
+
+    } else if (strcmp(conf.workload, "set") == 0) {
+        conf.reads = 0;
+    }
+
+    if (bench_zone_init(&conf) != NGX_OK) {
+        return 1;
+    }
+
+    size = sizeof(bench_shared_t)
+           + (conf.procs - 1) * sizeof(bench_stat_t) * BENCH_NOPS;
+
+    bench_shared = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                        MAP_ANON|MAP_SHARED, -1, 0);
+    if (bench_shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    bench_keys_init(&conf);
+
+    if (conf.trace && bench_trace_load(&conf) != NGX_OK) {
+        return 1;
+    }
+
+    if (bench_prefill(&conf) != NGX_OK) {
+        return 1;
+    }
+
+    for (i = 0; i < conf.procs; i++) {
+        pid = fork();
+
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            bench_worker(&conf, i);
+            _exit(0);
+        }
+    }
+
+    while (bench_shared->ready != conf.procs) {
+        usleep(1000);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    (void) ngx_atomic_fetch_add(&bench_shared->go, 1);
+
+    for (i = 0; i < conf.procs; i++) {
+        if (wait(&status) == -1) {
+            perror("wait");
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec)
+              + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    bench_report(&conf, elapsed);
+
+    if (conf.hot_keys) {
+        bench_report_hot_keys();
+    }
+
+    return 0;
+}
+
+
+/* what main() and ngx_init_zone_pool() do for a real zone */
+
+static ngx_int_t
+bench_zone_init(bench_conf_t *conf)
+{
+    u_char                      *addr;
+    ngx_uint_t                   n;
+    ngx_slab_pool_t             *sp;
+
+    ngx_pid = ngx_getpid();
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    for (n = ngx_pagesize; n >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_time_init();
+
+#if (NGX_BENCH_SLAB_SIZES_INIT)
+    ngx_slab_sizes_init();
+#endif
+
+    bench_log_file.fd = ngx_stderr;
+    bench_log.file = &bench_log_file;
+    bench_log.log_level = NGX_LOG_NOTICE;
+
+    bench_cycle.log = &bench_log;
+    ngx_cycle = &bench_cycle;
+
+    addr = mmap(NULL, conf->zone_size, PROT_READ|PROT_WRITE,
+                MAP_ANON|MAP_SHARED, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return NGX_ERROR;
+    }
+
+    sp = (ngx_slab_pool_t *) addr;
+
+    sp->end = addr + conf->zone_size;
+    sp->min_shift = 3;
+    sp->addr = addr;
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(sp);
+
+    ngx_str_set(&bench_zone.shm.name, "bench");
+    bench_zone.shm.addr = addr;
+    bench_zone.shm.size = conf->zone_size;
+    bench_zone.shm.log = &bench_log;
+    bench_zone.data = &bench_ctx;
+
+    bench_ctx.name = bench_zone.shm.name;
+    bench_ctx.log = &bench_log;
+
+    if (conf->hot_keys) {
+        bench_ctx.hot_keys = conf->hot_keys;
+        bench_ctx.hot_sample = conf->hot_sample;
+        bench_ctx.hot_countdown = conf->hot_sample;
+    }
+
+    bench_ctx.admission = conf->admission;
+
+    return ngx_lua_shdict_init(&bench_zone, NULL);
+}
+
+
+/*
+ * fixed length keys, and the cumulative distribution of the Zipfian key
+ * popularity, rank i being key i
+ */
+
+static void
+bench_keys_init(bench_conf_t *conf)
+{
+    u_char                      *p, *last;
+    u_char                       num[NGX_INT_T_LEN];
+    double                       sum;
+    ngx_uint_t                   i;
+
+    bench_keys = ngx_alloc(conf->keys * conf->key_len, &bench_log);
+    bench_value = ngx_alloc(conf->value_len + 1, &bench_log);
+
+    if (bench_keys == NULL || bench_value == NULL) {
+        exit(1);
+    }
+
+    /* "k" followed by the zero padded key number */
+
+    ngx_memset(bench_keys, '0', conf->keys * conf->key_len);
+
+    for (i = 0; i < conf->keys; i++) {
+        p = bench_keys + i * conf->key_len;
+        last = ngx_sprintf(num, "%ui", i);
+
+        p[0] = 'k';
+        ngx_memcpy(p + conf->key_len - (last - num), num, last - num);
+    }
+
+    ngx_memset(bench_value, 'v', conf->value_len);
+
+    if (conf->zipf == 0) {
+        return;
+    }
+
+    bench_cdf = ngx_alloc(conf->keys * sizeof(double), &bench_log);
+    if (bench_cdf == NULL) {
+        exit(1);
+    }
+
+    sum = 0;
+
+    for (i = 0; i < conf->keys; i++) {
+        sum += 1.0 / pow((double) (i + 1), conf->zipf);
+        bench_cdf[i] = sum;
+    }
+
+    for (i = 0; i < conf->keys; i++) {
+        bench_cdf[i] /= sum;
+    }
+}
+
+
+static ngx_int_t
+bench_prefill(bench_conf_t *conf)
+{
+    int                          rc, forcible;
+    char                        *errmsg;
+    u_char                      *key;
+    ngx_uint_t                   i;
+
+    /* the cache workload starts cold, filling the zone on misses */
+
+    if (strcmp(conf->workload, "list") == 0
+        || strcmp(conf->workload, "cache") == 0)
+    {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < conf->keys; i++) {
+        key = bench_keys + i * conf->key_len;
+
+        if (strcmp(conf->workload, "incr") == 0) {
+            rc = ngx_lua_ffi_shdict_store_helper(&bench_zone, 0, key,
+                                                 conf->key_len,
+                                                 SHDICT_TNUMBER, NULL, 0, 0,
+                                                 0, 0, &errmsg, &forcible);
+
+        } else {
+            rc = ngx_lua_ffi_shdict_store_helper(&bench_zone, 0, key,
+                                                 conf->key_len,
+                                                 SHDICT_TSTRING, bench_value,
+                                                 conf->value_len, 0, 0, 0,
+                                                 &errmsg, &forcible);
+        }
+
+        if (rc != NGX_OK) {
+            fprintf(stderr, "prefill failed: %s\n", errmsg);
+            return NGX_ERROR;
+        }
+
+        if (forcible) {
+            fprintf(stderr, "warning: the zone is too small to hold all "
+                    "the keys, try a larger -m\n");
+            return NGX_OK;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * the keys of the trace, one per line, which the processes replay in turns,
+ * process n taking lines n, n + procs, n + 2 * procs...
+ */
+
+static ngx_int_t
+bench_trace_load(bench_conf_t *conf)
+{
+    u_char                      *p, *last, *eol, *data;
+    size_t                       size;
+    ngx_uint_t                   n;
+    ngx_fd_t                     fd;
+    ngx_file_info_t              fi;
+
+    fd = ngx_open_file(conf->trace, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE || ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        perror(conf->trace);
+        return NGX_ERROR;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    data = ngx_alloc(size + 1, &bench_log);
+    if (data == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (size && read(fd, data, size) != (ssize_t) size) {
+        perror(conf->trace);
+        return NGX_ERROR;
+    }
+
+    (void) ngx_close_file(fd);
+
+    last = data + size;
+    n = 0;
+
+    for (p = data; p < last; p++) {
+        if (*p == '\n') {
+            n++;
+        }
+    }
+
+    bench_trace = ngx_alloc((n + 1) * sizeof(ngx_str_t), &bench_log);
+    if (bench_trace == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (p = data; p < last; p = eol + 1) {
+        eol = ngx_strlchr(p, last, '\n');
+        if (eol == NULL) {
+            eol = last;
+        }
+
+        size = eol - p;
+
+        if (size && p[size - 1] == '\r') {
+            size--;
+        }
+
+        if (size == 0 || size > 65535) {
+            continue;
+        }
+
+        bench_trace[bench_trace_len].data = p;
+        bench_trace[bench_trace_len++].len = size;
+    }
+
+    if (bench_trace_len == 0) {
+        fprintf(stderr, "no keys in %s\n", conf->trace);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+bench_worker(bench_conf_t *conf, ngx_uint_t n)
+{
+    int                          op;
+    u_char                      *key, *last, *scan_key;
+    u_char                       num[NGX_INT_T_LEN];
+    double                       deadline;
+    size_t                       key_len;
+    uint64_t                     rnd;
+    ngx_uint_t                   k, iter, list, cache;
+    bench_stat_t                *stats;
+    struct timespec              t0;
+
+    ngx_pid = ngx_getpid();
+
+    /* the sampling of the hot key tracker, as nginx seeds its workers */
+    srandom(((unsigned) ngx_pid << 16) ^ (unsigned) n);
+
+    rnd = (uint64_t) ngx_pid * 0x9e3779b97f4a7c15ULL + n;
+
+    stats = bench_shared->stats[0] + n * BENCH_NOPS;
+
+    list = (strcmp(conf->workload, "list") == 0);
+    cache = (strcmp(conf->workload, "cache") == 0);
+
+    /* the keys of the scan share, "s" followed by a number never reused */
+
+    scan_key = ngx_alloc(conf->key_len, &bench_log);
+    if (scan_key == NULL) {
+        return;
+    }
+
+    ngx_memset(scan_key, '0', conf->key_len);
+    scan_key[0] = 's';
+
+    (void) ngx_atomic_fetch_add(&bench_shared->ready, 1);
+
+    while (bench_shared->go == 0) {
+        ngx_cpu_pause();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    deadline = t0.tv_sec + t0.tv_nsec / 1e9 + conf->duration;
+
+    for (iter = 0; /* void */ ; iter++) {
+
+        if ((iter & 1023) == 0) {
+            ngx_time_update();
+
+            if (bench_trace == NULL) {
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                if (t0.tv_sec + t0.tv_nsec / 1e9 >= deadline) {
+                    break;
+                }
+            }
+        }
+
+        key_len = conf->key_len;
+
+        if (bench_trace) {
+            k = iter * conf->procs + n;
+
+            if (k >= bench_trace_len) {
+                break;
+            }
+
+            key = bench_trace[k].data;
+            key_len = bench_trace[k].len;
+
+        } else if (conf->scan
+                   && bench_random(&rnd) % 10000 < conf->scan * 10000)
+        {
+            key = scan_key;
+            last = ngx_sprintf(num, "%ui", iter * conf->procs + n);
+            ngx_memcpy(key + key_len - (last - num), num, last - num);
+
+        } else {
+            k = bench_next_key(conf, &rnd);
+            key = bench_keys + k * conf->key_len;
+        }
+
+        if (list) {
+            op = (iter & 1) ? BENCH_OP_POP : BENCH_OP_PUSH;
+
+        } else if (strcmp(conf->workload, "incr") == 0) {
+            op = BENCH_OP_INCR;
+
+        } else if (cache) {
+            op = BENCH_OP_GET;
+
+        } else {
+            op = (bench_random(&rnd) % 10000 < conf->reads * 10000)
+                 ? BENCH_OP_GET : BENCH_OP_SET;
+        }
+
+        if (!bench_op(conf, stats, op, key, key_len) && cache) {
+            /* the read-through of a cache in front of a slower backend */
+            (void) bench_op(conf, stats, BENCH_OP_SET, key, key_len);
+        }
+    }
+}
+
+
+/* runs and times one operation, returns 0 when a get finds nothing */
+
+static ngx_uint_t
+bench_op(bench_conf_t *conf, bench_stat_t *stats, int op, u_char *key,
+    size_t key_len)
+{
+    int                          rc, value_type, user_flags, is_stale;
+    int                          forcible, nvalues, value_len;
+    char                        *errmsg;
+    u_char                      *buf;
+    u_char                       str_buf[4096];
+    double                       num;
+    size_t                       len;
+    uint64_t                     ns;
+    ngx_uint_t                   found;
+    bench_stat_t                *st;
+    struct timespec              t0, t1;
+    ngx_lua_shdict_value_t       value;
+
+    value.value_type = SHDICT_TSTRING;
+    value.str_value_buf = bench_value;
+    value.str_value_len = conf->value_len;
+
+    value_type = SHDICT_TNIL;
+    found = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    switch (op) {
+
+    case BENCH_OP_GET:
+        buf = str_buf;
+        len = sizeof(str_buf);
+
+        rc = ngx_lua_ffi_shdict_fetch_helper(&bench_zone, 0, key, key_len,
+                                             &value_type, &buf, &len, &num,
+                                             &user_flags, &is_stale,
+                                             &errmsg);
+        if (buf != str_buf) {
+            free(buf);
+        }
+
+        found = (value_type != SHDICT_TNIL);
+        break;
+
+    case BENCH_OP_SET:
+        rc = ngx_lua_ffi_shdict_store_helper(&bench_zone, 0, key, key_len,
+                                             SHDICT_TSTRING, bench_value,
+                                             conf->value_len, 0, 0, 0,
+                                             &errmsg, &forcible);
+        break;
+
+    case BENCH_OP_INCR:
+        num = 1;
+
+        rc = ngx_lua_ffi_shdict_incr_helper(&bench_zone, key, key_len, &num,
+                                            &errmsg, 1, 0, 0, &forcible);
+        break;
+
+    case BENCH_OP_PUSH:
+        rc = ngx_lua_ffi_shdict_push_helper(&bench_zone, key, key_len,
+                                            &value, 1, 0, &value_len, 0,
+                                            &errmsg, &forcible);
+        break;
+
+    default: /* BENCH_OP_POP */
+        buf = str_buf;
+        len = sizeof(str_buf);
+
+        rc = ngx_lua_ffi_shdict_pop_helper(&bench_zone, key, key_len, 1,
+                                           &buf, &len, &nvalues, 1, &errmsg);
+        if (buf != str_buf) {
+            free(buf);
+        }
+
+        break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ns = (uint64_t) (t1.tv_sec - t0.tv_sec) * 1000000000
+         + t1.tv_nsec - t0.tv_nsec;
+
+    st = &stats[op];
+
+    st->ops++;
+    st->hist[bench_hist_index(ns)]++;
+
+    if (ns > st->max) {
+        st->max = ns;
+    }
+
+    if (rc == NGX_DECLINED && op == BENCH_OP_SET) {
+        /* refused by the admission filter */
+        st->rejected++;
+
+    } else if (rc != NGX_OK) {
+        st->errors++;
+
+    } else if (found && op == BENCH_OP_GET) {
+        st->hits++;
+    }
+
+    return found;
+}
+
+
+static ngx_uint_t
+bench_next_key(bench_conf_t *conf, uint64_t *rnd)
+{
+    double                       u;
+    ngx_uint_t                   lo, hi, mid;
+
+    if (bench_cdf == NULL) {
+        return bench_random(rnd) % conf->keys;
+    }
+
+    u = (bench_random(rnd) >> 11) * (1.0 / 9007199254740992.0);
+
+    lo = 0;
+    hi = conf->keys - 1;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (bench_cdf[mid] < u) {
+            lo = mid + 1;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+/* xorshift64* */
+
+static uint64_t
+bench_random(uint64_t *state)
+{
+    uint64_t  x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    *state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+
+static void
+bench_report(bench_conf_t *conf, double elapsed)
+{
+    uint64_t                     total, gets, hits, rejected;
+    ngx_uint_t                   i, op, n;
+    bench_stat_t                 st;
+
+    if (conf->trace) {
+        printf("workload %s, processes %lu, trace %s, %lu keys read, "
+               "value %lu bytes, zone %lum\n", conf->workload,
+               (unsigned long) conf->procs, conf->trace,
+               (unsigned long) bench_trace_len,
+               (unsigned long) conf->value_len,
+               (unsigned long) (conf->zone_size / 1024 / 1024));
+
+    } else {
+        printf("workload %s, processes %lu, keys %lu, zipf %.2f, "
+               "key %lu bytes, value %lu bytes, zone %lum\n",
+               conf->workload, (unsigned long) conf->procs,
+               (unsigned long) conf->keys, conf->zipf,
+               (unsigned long) conf->key_len,
+               (unsigned long) conf->value_len,
+               (unsigned long) (conf->zone_size / 1024 / 1024));
+    }
+
+    total = 0;
+    gets = 0;
+    hits = 0;
+    rejected = 0;
+
+    for (op = 0; op < BENCH_NOPS; op++) {
+        ngx_memzero(&st, sizeof(bench_stat_t));
+
+        for (n = 0; n < conf->procs; n++) {
+            bench_stat_t  *s = &bench_shared->stats[0][n * BENCH_NOPS + op];
+
+            st.ops += s->ops;
+            st.errors += s->errors;
+            st.hits += s->hits;
+            st.rejected += s->rejected;
+            st.max = ngx_max(st.max, s->max);
+
+            for (i = 0; i < BENCH_HIST_SIZE; i++) {
+                st.hist[i] += s->hist[i];
+            }
+        }
+
+        if (st.ops == 0) {
+            continue;
+        }
+
+        total += st.ops;
+
+        if (op == BENCH_OP_GET) {
+            gets = st.ops;
+            hits = st.hits;
+
+        } else if (op == BENCH_OP_SET) {
+            rejected = st.rejected;
+        }
+
+        printf("%-5s %10.0f ops/s  p50 %6lu ns  p99 %6lu ns  "
+               "p999 %7lu ns  max %9lu ns  errors %lu\n",
+               bench_op_names[op], st.ops / elapsed,
+               (unsigned long) bench_hist_quantile(st.hist, st.ops, 0.5),
+               (unsigned long) bench_hist_quantile(st.hist, st.ops, 0.99),
+               (unsigned long) bench_hist_quantile(st.hist, st.ops, 0.999),
+               (unsigned long) st.max, (unsigned long) st.errors);
+    }
+
+    if (strcmp(conf->workload, "cache") == 0 && gets) {
+        printf("hit ratio %.2f%%, %lu sets not admitted\n",
+               hits * 100.0 / gets, (unsigned long) rejected);
+    }
+
+    printf("total %10.0f ops/s in %.2f s\n", total / elapsed, elapsed);
+}
+
+
+/* the keys the tracker found most accessed */
+
+static void
+bench_report_hot_keys(void)
+{
+    int                          i, nkeys;
+    char                        *errmsg;
+    u_char                      *buf;
+    size_t                       buf_len;
+    ngx_lua_shdict_value_t      *values;
+
+    buf = NULL;
+    buf_len = 0;
+
+    if (ngx_lua_ffi_shdict_hot_keys(&bench_zone, 5, &buf, &buf_len, &nkeys,
+                                    &errmsg)
+        != NGX_OK)
+    {
+        fprintf(stderr, "hot_keys failed: %s\n", errmsg);
+        return;
+    }
+
+    values = (ngx_lua_shdict_value_t *) buf;
+
+    for (i = 0; i < nkeys; i++) {
+        printf("hot   %.*s %.0f\n", (int) values[i].str_value_len,
+               values[i].str_value_buf, values[i].num_value);
+    }
+
+    free(buf);
+}
+
+
+static void
+bench_usage(void)
+{
+    fprintf(stderr,
+        "usage: shdict-bench [-w workload] [-p procs] [-d seconds] "
+        "[-k keys] [-K key_len]\n"
+        "                    [-v value_len] [-z zipf_s] [-r read_ratio] "
+        "[-m zone_mb]\n"
+        "                    [-H hot_keys] [-S hot_keys_sample] [-A] "
+        "[-s scan_share]\n"
+        "                    [-T trace_file]\n\n"
+        "  -w  mixed (default), get, set, incr, list or cache\n"
+        "  -p  number of processes, the number of CPUs by default\n"
+        "  -d  duration in seconds, 5 by default\n"
+        "  -k  number of distinct keys, 100000 by default\n"
+        "  -K  key length in bytes, 16 by default\n"
+        "  -v  value length in bytes, 64 by default\n"
+        "  -z  Zipfian exponent of the key popularity, 0 (uniform) "
+        "by default\n"
+        "  -r  share of gets in the mixed workload, 0.9 by default\n"
+        "  -m  zone size in megabytes, 64 by default\n"
+        "  -H  number of hot keys tracked, 0 (off) by default\n"
+        "  -S  one lookup in this many is sampled by the tracker, 100 "
+        "by default\n"
+        "  -A  the zone uses admission=tinylfu\n"
+        "  -s  share of the cache workload going to keys never seen "
+        "again, 0 by default\n"
+        "  -T  replays the keys of this file, one per line, with the "
+        "cache workload\n"
+        "      until the end instead of for -d seconds\n");
+}
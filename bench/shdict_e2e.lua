@@ -0,0 +1,139 @@
+-- The request handlers of the end-to-end benchmark suite, see bench/e2e.pl.
+-- Every operation takes the key number sent by bench/shdict-load and
+-- returns the one line answer, or nil and an error.
+
+local t = require "resty.shdict"
+
+local ngx = ngx
+local tonumber = tonumber
+local tostring = tostring
+
+local VALUE = string.rep("v", 64)
+
+local _M = {}
+
+local ops = {
+    get = function (dict, key)
+        local val, err = dict:get(key)
+        if val == nil and err then
+            return nil, err
+        end
+
+        return val and #val or 0
+    end,
+
+    set = function (dict, key)
+        return dict:set(key, VALUE)
+    end,
+
+    -- keys which expire right away, left for flush_expired
+    set_ttl = function (dict, key)
+        return dict:set(key, VALUE, 0.01)
+    end,
+
+    incr = function (dict, key)
+        return dict:incr("n" .. key, 1, 0)
+    end,
+
+    list = function (dict, key)
+        local len, err = dict:rpush("l" .. key, VALUE)
+        if not len then
+            return nil, err
+        end
+
+        return dict:lpop("l" .. key)
+    end,
+
+    get_keys = function (dict)
+        local keys, err = dict:get_keys()
+        if not keys then
+            return nil, err
+        end
+
+        return #keys
+    end,
+
+    flush_expired = function (dict)
+        return dict:flush_expired()
+    end,
+
+    -- stores the keys 0 to key - 1, what the get workload reads
+    prefill = function (dict, key)
+        dict:flush_all()
+        dict:flush_expired()
+
+        for i = 0, tonumber(key) - 1 do
+            local ok, err = dict:set(tostring(i), VALUE)
+            if not ok then
+                return nil, err
+            end
+        end
+
+        return key
+    end,
+}
+
+
+local function run(dict, op, key)
+    local f = ops[op]
+    if not f then
+        return nil, "unknown op \"" .. tostring(op) .. "\""
+    end
+
+    local res, err = f(dict, key)
+    if not res and err then
+        return nil, err
+    end
+
+    return tostring(res)
+end
+
+
+function _M.http(zone)
+    local res, err = run(t[zone], ngx.var.uri:sub(2), ngx.var.arg_k or "0")
+    if not res then
+        ngx.log(ngx.ERR, err)
+        return ngx.exit(500)
+    end
+
+    res = res .. "\n"
+
+    ngx.header["Content-Length"] = #res
+    ngx.print(res)
+end
+
+
+function _M.stream(zone)
+    local dict = t[zone]
+
+    local sock, err = ngx.req.socket()
+    if not sock then
+        ngx.log(ngx.ERR, "failed to get the request socket: ", err)
+        return
+    end
+
+    while true do
+        local line = sock:receive()
+        if not line then
+            return
+        end
+
+        local op, key = line:match("^(%S+) (%S+)$")
+
+        local res
+        res, err = run(dict, op, key)
+        if not res then
+            ngx.log(ngx.ERR, err)
+            res = "ERR " .. err
+        end
+
+        local ok
+        ok, err = sock:send(res .. "\n")
+        if not ok then
+            return
+        end
+    end
+end
+
+
+return _M
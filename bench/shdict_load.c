@@ -0,0 +1,437 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * shdict-load: the closed loop load generator of the end-to-end benchmark
+ * suite, see bench/e2e.pl. Every connection sends a request for a random
+ * key, waits for the whole response and sends the next one, either as
+ * keep-alive HTTP/1.1 requests "GET /<op>?k=<key>" answered with a
+ * Content-Length, or as "<op> <key>" lines answered with one line each.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_hist.h"
+
+
+#define LOAD_BUF_SIZE        16384
+#define LOAD_REQ_SIZE        256
+
+
+typedef struct {
+    int                          fd;
+    size_t                       req_len;
+    size_t                       sent;
+    size_t                       len;
+    uint64_t                     start;
+    char                         req[LOAD_REQ_SIZE];
+    char                         buf[LOAD_BUF_SIZE];
+} load_conn_t;
+
+
+typedef struct {
+    const char                  *host;
+    int                          port;
+    int                          http;
+    const char                  *op;
+    unsigned long                keys;
+    int                          conns;
+    double                       duration;
+} load_conf_t;
+
+
+static int load_connect(load_conn_t *c);
+static void load_close(load_conn_t *c);
+static void load_next(load_conn_t *c);
+static int load_handle(load_conn_t *c);
+static int load_parse(load_conn_t *c);
+static uint64_t load_now(void);
+static uint64_t load_random(void);
+static void load_usage(void);
+
+
+static load_conf_t               conf;
+static int                       ep;
+static struct sockaddr_in        addr;
+static uint64_t                  rnd = 0x9e3779b97f4a7c15ULL;
+static uint64_t                  requests;
+static uint64_t                  errors;
+static uint64_t                  max;
+static uint64_t                  hist[BENCH_HIST_SIZE];
+
+
+int
+main(int argc, char *const *argv)
+{
+    int                          c, i, n;
+    double                       elapsed;
+    uint64_t                     start, deadline, now;
+    load_conn_t                 *conns, *lc;
+    struct epoll_event           events[256];
+
+    conf.host = "127.0.0.1";
+    conf.port = 1984;
+    conf.http = 1;
+    conf.op = "get";
+    conf.keys = 10000;
+    conf.conns = 32;
+    conf.duration = 5;
+
+    while ((c = getopt(argc, argv, "H:P:m:o:k:c:d:h")) != -1) {
+        switch (c) {
+
+        case 'H':
+            conf.host = optarg;
+            break;
+
+        case 'P':
+            conf.port = atoi(optarg);
+            break;
+
+        case 'm':
+            if (strcmp(optarg, "http") == 0) {
+                conf.http = 1;
+
+            } else if (strcmp(optarg, "line") == 0) {
+                conf.http = 0;
+
+            } else {
+                load_usage();
+                return 1;
+            }
+
+            break;
+
+        case 'o':
+            conf.op = optarg;
+            break;
+
+        case 'k':
+            conf.keys = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'c':
+            conf.conns = atoi(optarg);
+            break;
+
+        case 'd':
+            conf.duration = atof(optarg);
+            break;
+
+        default:
+            load_usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (conf.keys == 0 || conf.conns <= 0 || conf.duration <= 0
+        || strlen(conf.op) > LOAD_REQ_SIZE / 2)
+    {
+        load_usage();
+        return 1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) conf.port);
+
+    if (inet_pton(AF_INET, conf.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address \"%s\"\n", conf.host);
+        return 1;
+    }
+
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    conns = calloc(conf.conns, sizeof(load_conn_t));
+    if (conns == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    rnd ^= (uint64_t) getpid() << 32;
+
+    start = load_now();
+    deadline = start + (uint64_t) (conf.duration * 1e9);
+
+    for (i = 0; i < conf.conns; i++) {
+        if (load_connect(&conns[i]) != 0) {
+            return 1;
+        }
+    }
+
+    for ( ;; ) {
+        n = epoll_wait(ep, events, 256, 100);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            lc = events[i].data.ptr;
+
+            if (load_handle(lc) != 0) {
+                errors++;
+                load_close(lc);
+
+                if (load_connect(lc) != 0) {
+                    return 1;
+                }
+            }
+        }
+
+        now = load_now();
+        if (now >= deadline) {
+            break;
+        }
+    }
+
+    elapsed = (now - start) / 1e9;
+
+    /* latencies are reported in microseconds */
+
+    printf("requests %llu errors %llu rps %.0f p50 %.1f p99 %.1f "
+           "p999 %.1f max %.1f\n",
+           (unsigned long long) requests, (unsigned long long) errors,
+           requests / elapsed,
+           bench_hist_quantile(hist, requests, 0.5) / 1e3,
+           bench_hist_quantile(hist, requests, 0.99) / 1e3,
+           bench_hist_quantile(hist, requests, 0.999) / 1e3,
+           max / 1e3);
+
+    return 0;
+}
+
+
+static int
+load_connect(load_conn_t *c)
+{
+    int                  one = 1;
+    struct epoll_event   ev;
+
+    c->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    (void) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        && errno != EINPROGRESS)
+    {
+        perror("connect");
+        return -1;
+    }
+
+    ev.events = EPOLLIN|EPOLLOUT|EPOLLET;
+    ev.data.ptr = c;
+
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    load_next(c);
+
+    return 0;
+}
+
+
+static void
+load_close(load_conn_t *c)
+{
+    (void) close(c->fd);
+    c->fd = -1;
+}
+
+
+static void
+load_next(load_conn_t *c)
+{
+    unsigned long  key;
+
+    key = (unsigned long) (load_random() % conf.keys);
+
+    if (conf.http) {
+        c->req_len = snprintf(c->req, LOAD_REQ_SIZE,
+                              "GET /%s?k=%lu HTTP/1.1\r\n"
+                              "Host: localhost\r\n\r\n", conf.op, key);
+
+    } else {
+        c->req_len = snprintf(c->req, LOAD_REQ_SIZE, "%s %lu\n",
+                              conf.op, key);
+    }
+
+    c->sent = 0;
+    c->len = 0;
+    c->start = load_now();
+}
+
+
+/* edge triggered: send and receive until EAGAIN */
+
+static int
+load_handle(load_conn_t *c)
+{
+    int        rc;
+    ssize_t    n;
+    uint64_t   ns;
+
+    for ( ;; ) {
+
+        while (c->sent < c->req_len) {
+            n = send(c->fd, c->req + c->sent, c->req_len - c->sent,
+                     MSG_NOSIGNAL);
+
+            if (n == -1) {
+                return (errno == EAGAIN || errno == ENOTCONN) ? 0 : -1;
+            }
+
+            c->sent += n;
+        }
+
+        n = recv(c->fd, c->buf + c->len, LOAD_BUF_SIZE - c->len, 0);
+
+        if (n == -1) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        if (n == 0) {
+            return -1;
+        }
+
+        c->len += n;
+
+        rc = load_parse(c);
+
+        if (rc == 0) {
+            if (c->len == LOAD_BUF_SIZE) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        ns = load_now() - c->start;
+
+        requests++;
+        hist[bench_hist_index(ns)]++;
+
+        if (ns > max) {
+            max = ns;
+        }
+
+        if (rc == -1) {
+            errors++;
+        }
+
+        load_next(c);
+    }
+}
+
+
+/*
+ * returns 1 for a complete response, 0 when more data is needed, and -1
+ * for a complete response reporting a failure, which is not a 200 status
+ * over HTTP and a line starting with "ERR" otherwise
+ */
+
+static int
+load_parse(load_conn_t *c)
+{
+    char    *p, *end, *hdr;
+    size_t   total, body;
+
+    if (!conf.http) {
+        if (memchr(c->buf, '\n', c->len) == NULL) {
+            return 0;
+        }
+
+        return (c->len >= 3 && memcmp(c->buf, "ERR", 3) == 0) ? -1 : 1;
+    }
+
+    end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return 0;
+    }
+
+    body = 0;
+
+    for (p = c->buf; p < end; p = hdr + 2) {
+        hdr = memmem(p, end + 2 - p, "\r\n", 2);
+
+        if (hdr - p > 15 && strncasecmp(p, "Content-Length:", 15) == 0) {
+            body = strtoul(p + 15, NULL, 10);
+            break;
+        }
+    }
+
+    total = end + 4 - c->buf + body;
+
+    if (c->len < total) {
+        return 0;
+    }
+
+    return (c->len >= 12 && memcmp(c->buf + 9, "200", 3) == 0) ? 1 : -1;
+}
+
+
+static uint64_t
+load_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* xorshift64* */
+
+static uint64_t
+load_random(void)
+{
+    rnd ^= rnd >> 12;
+    rnd ^= rnd << 25;
+    rnd ^= rnd >> 27;
+
+    return rnd * 0x2545f4914f6cdd1dULL;
+}
+
+
+static void
+load_usage(void)
+{
+    fprintf(stderr,
+        "usage: shdict-load [-H host] [-P port] [-m http|line] [-o op] "
+        "[-k keys]\n"
+        "                   [-c connections] [-d seconds]\n");
+}
@@ -1,16 +1,32 @@
 
 
 local ffi          = require 'ffi'
+local bit          = require 'bit'
+local msgpack      = require 'resty.shdict.msgpack'
 
 local ffi_new      = ffi.new
 local ffi_str      = ffi.string
+local ffi_cast     = ffi.cast
+local ffi_copy     = ffi.copy
+local ffi_istype   = ffi.istype
 local C            = ffi.C
+local msgpack_encode = msgpack.encode
+local msgpack_decode = msgpack.decode
 
 local tonumber     = tonumber
 local tostring     = tostring
 local type         = type
 local error        = error
+local select       = select
+local math_ceil    = math.ceil
+local math_floor   = math.floor
+local math_log     = math.log
+local math_sqrt    = math.sqrt
+local math_huge    = math.huge
 local setmetatable = setmetatable
+local pairs        = pairs
+local pcall        = pcall
+local ngx          = ngx
 local FFI_OK       = 0
 local FFI_ERROR    = -1
 local FFI_BUSY     = -3
@@ -19,6 +35,7 @@ local FFI_DECLINED = -5
 
 
 local ZONE_INDEX   = 1
+local RECORD_INDEX = 2
 local func         = {}
 local _M           = {}
 func.__index       = func
@@ -38,6 +55,13 @@ end
 
 
 ffi.cdef[[
+    typedef struct {
+        int                    value_type;
+        size_t                 str_value_len;
+        const unsigned char   *str_value_buf;
+        double                 num_value;
+    } ngx_lua_shdict_value_t;
+
     int ngx_lua_ffi_shdict_find_zone(void **zone,
         const unsigned char *name_data, size_t name_len,
         char **errmsg);
@@ -71,24 +95,216 @@ ffi.cdef[[
         double num_value, long exptime, int user_flags, char **errmsg,
         int *forcible);
 
+    int ngx_lua_ffi_shdict_get_multi(void *zone, ngx_str_t *keys, int nkeys,
+        ngx_lua_shdict_value_t *values, unsigned char **buf,
+        size_t *buf_len, char **errmsg);
+
     int ngx_lua_ffi_shdict_incr_helper(void *zone, const unsigned char *key,
         size_t key_len, double *value, char **err, int has_init, double init,
         long init_ttl, int *forcible);
 
+    typedef struct {
+        uint32_t               cost;
+        uint32_t               stale_ttl;
+        uint32_t               priority;
+        uint64_t               lease;
+    } ngx_lua_shdict_store_opts_t;
+
+    typedef struct {
+        double                 early_refresh;
+        int                    refresh;
+        uint32_t               lease;
+        uint64_t               token;
+    } ngx_lua_shdict_fetch_opts_t;
+
+    int ngx_lua_ffi_shdict_store_ext(void *zone, int op,
+        const unsigned char *key, size_t key_len, int value_type,
+        const unsigned char *str_value_buf, size_t str_value_len,
+        double num_value, long exptime, int user_flags,
+        ngx_lua_shdict_store_opts_t *opts, char **errmsg, int *forcible);
+
+    int ngx_lua_ffi_shdict_fetch_ext(void *zone, int get_stale,
+        const unsigned char *key, size_t key_len, int *value_type,
+        unsigned char **str_value_buf, size_t *str_value_len,
+        double *num_value, int *user_flags, int *is_stale,
+        ngx_lua_shdict_fetch_opts_t *opts, char **errmsg);
+
 
     int ngx_lua_ffi_shdict_pop_helper(void *zone, const unsigned char *key,
-        size_t key_len, int *value_type, unsigned char **str_value_buf,
-        size_t *str_value_len, double *num_value, int flags, char **errmsg);
+        size_t key_len, int count, unsigned char **buf, size_t *buf_len,
+        int *nvalues, int flags, char **errmsg);
 
     int ngx_lua_ffi_shdict_push_helper(void *zone, const unsigned char *key,
-        size_t key_len, int value_type, const unsigned char *str_value_buf,
-        size_t str_value_len, double num_value, int *value_len,
-        int flags, char **errmsg);
+        size_t key_len, ngx_lua_shdict_value_t *values, int nvalues,
+        long max_len, int *value_len, int flags, char **errmsg,
+        int *forcible);
+
+    int ngx_lua_ffi_shdict_bpop_helper(void *zone, const unsigned char *key,
+        size_t key_len, unsigned char **buf, size_t *buf_len, int *nvalues,
+        int flags, long timeout, void *sema, void *post, void **waiter,
+        uint64_t *id, char **errmsg);
+
+    void ngx_lua_ffi_shdict_bpop_cancel(void *zone, void *waiter,
+        uint64_t id);
+
+    int ngx_lua_ffi_shdict_sem_acquire(void *zone, const unsigned char *key,
+        size_t key_len, int limit, long exptime, long timeout, void *sema,
+        void *post, void **waiter, uint64_t *id, uint64_t *token,
+        long *retry, char **errmsg);
+
+    int ngx_lua_ffi_shdict_sem_release(void *zone, const unsigned char *key,
+        size_t key_len, uint64_t token, char **errmsg);
 
     int ngx_lua_ffi_shdict_llen(void *zone, const unsigned char *key,
         size_t key_len, int *value_len, char **errmsg);
 
+    int ngx_lua_ffi_shdict_lrange(void *zone, const unsigned char *key,
+        size_t key_len, long start, long stop, unsigned char **buf,
+        size_t *buf_len, int *nvalues, char **errmsg);
+
+    int ngx_lua_ffi_shdict_lindex(void *zone, const unsigned char *key,
+        size_t key_len, long index, unsigned char **buf, size_t *buf_len,
+        int *nvalues, char **errmsg);
+
+    int ngx_lua_ffi_shdict_lset(void *zone, const unsigned char *key,
+        size_t key_len, long index, ngx_lua_shdict_value_t *value,
+        char **errmsg);
+
+    int ngx_lua_ffi_shdict_ltrim(void *zone, const unsigned char *key,
+        size_t key_len, long start, long stop, int *value_len,
+        char **errmsg);
+
     size_t ngx_lua_ffi_shdict_capacity(void *zone);
+
+    int ngx_lua_ffi_shdict_hot_keys(void *zone, int n, unsigned char **buf,
+        size_t *buf_len, int *nkeys, char **errmsg);
+
+    typedef struct {
+        size_t                 size;
+        size_t                 pages;
+        size_t                 total;
+        size_t                 used;
+        size_t                 reqs;
+        size_t                 fails;
+    } ngx_lua_shdict_slab_report_t;
+
+    typedef struct {
+        size_t                 size;
+        size_t                 pages;
+        size_t                 free_pages;
+        size_t                 nslabs;
+        ngx_lua_shdict_slab_report_t  slabs[16];
+        size_t                 items;
+        size_t                 expired;
+        size_t                 list_values;
+        size_t                 type_items[11];
+        size_t                 type_bytes[11];
+        size_t                 key_sizes[32];
+        size_t                 value_sizes[32];
+        size_t                 key_bytes;
+        size_t                 value_bytes;
+        size_t                 header_bytes;
+        size_t                 slack_bytes;
+        size_t                 complete;
+    } ngx_lua_shdict_report_t;
+
+    int ngx_lua_ffi_shdict_memory_report(void *zone, int max_items,
+        ngx_lua_shdict_report_t *report, char **errmsg);
+
+    typedef struct {
+        size_t                 quota;
+        size_t                 used;
+        size_t                 items;
+        size_t                 evictions;
+        size_t                 prefix_len;
+        unsigned char          prefix[32];
+    } ngx_lua_shdict_ns_stat_t;
+
+    int ngx_lua_ffi_shdict_ns_stats(void *zone,
+        ngx_lua_shdict_ns_stat_t *stats, int *n, char **errmsg);
+
+    size_t ngx_lua_ffi_shdict_pinned(void *zone, size_t *limit);
+
+    typedef struct {
+        uint64_t               seq;
+        uint64_t               hash;
+        uint64_t               spill;
+        unsigned short         key_len;
+        uint8_t                op;
+        unsigned char          key[96];
+    } ngx_lua_shdict_change_t;
+
+    int ngx_lua_ffi_shdict_changes(void *zone, uint64_t since, int max,
+        ngx_lua_shdict_change_t *out, int *n, uint64_t *last,
+        uint32_t *epoch, char **errmsg);
+
+    int ngx_lua_ffi_shdict_change_key(void *zone, uint64_t spill,
+        size_t key_len, unsigned char *buf);
+
+    typedef struct {
+        uint32_t               offset;
+        uint8_t                kind;
+        uint8_t                op;
+        double                 num;
+        int64_t                inum;
+    } ngx_lua_shdict_field_op_t;
+
+    int ngx_lua_ffi_shdict_update_fields(void *zone,
+        const unsigned char *key, size_t key_len, uint32_t schema,
+        size_t size, ngx_lua_shdict_field_op_t *ops, int nops,
+        char **errmsg);
+
+    int ngx_lua_ffi_shdict_setbit(void *zone, const unsigned char *key,
+        size_t key_len, size_t offset, int value, int *old, char **errmsg,
+        int *forcible);
+
+    int ngx_lua_ffi_shdict_getbit(void *zone, const unsigned char *key,
+        size_t key_len, size_t offset, int *bit, char **errmsg);
+
+    int ngx_lua_ffi_shdict_bitcount(void *zone, const unsigned char *key,
+        size_t key_len, long start, long stop, size_t *count,
+        char **errmsg);
+
+    int ngx_lua_ffi_shdict_bitop(void *zone, int op,
+        const unsigned char *dst, size_t dst_len, ngx_str_t *keys,
+        int nkeys, size_t *len, char **errmsg, int *forcible);
+
+    int ngx_lua_ffi_shdict_bf_add(void *zone, const unsigned char *key,
+        size_t key_len, uint32_t bits, uint32_t hashes, int reserve,
+        ngx_str_t *items, int nitems, int *added, char **errmsg,
+        int *forcible);
+
+    int ngx_lua_ffi_shdict_bf_exists(void *zone, const unsigned char *key,
+        size_t key_len, const unsigned char *item, size_t item_len,
+        int *exists, char **errmsg);
+
+    int ngx_lua_ffi_shdict_pfadd(void *zone, const unsigned char *key,
+        size_t key_len, ngx_str_t *items, int nitems, int *changed,
+        char **errmsg, int *forcible);
+
+    int ngx_lua_ffi_shdict_pfcount(void *zone, ngx_str_t *keys, int nkeys,
+        int *hist, char **errmsg);
+
+    int ngx_lua_ffi_shdict_pfmerge(void *zone, const unsigned char *dst,
+        size_t dst_len, ngx_str_t *keys, int nkeys, char **errmsg,
+        int *forcible);
+
+    typedef struct {
+        int                    op;
+        int                    flags;
+        ngx_str_t              key;
+        ngx_lua_shdict_value_t value;
+        double                 init;
+        long                   exptime;
+        int                    user_flags;
+        int                    has_init;
+        int                    rc;
+        int                    forcible;
+        char                  *errmsg;
+    } ngx_lua_shdict_tx_op_t;
+
+    int ngx_lua_ffi_shdict_exec(void *zone, ngx_lua_shdict_tx_op_t *ops,
+        int nops, unsigned char **buf, size_t *buf_len, char **errmsg);
 ]]
 
 if not pcall(function () return C.ngx_lua_ffi_shdict_free_space end) then
@@ -114,6 +330,49 @@ local str_value_len  = ffi_new("size_t[1]")
 local errmsg         = ffi_new("char *[1]")
 local ngx_str_buf    = ffi_new("ngx_str_t *[1]")
 
+local list_values_size = 8
+local list_values      = ffi_new("ngx_lua_shdict_value_t[?]",
+                                 list_values_size)
+local value_ptr_type   = ffi.typeof("ngx_lua_shdict_value_t *")
+
+local multi_keys_size  = 16
+local multi_keys       = ffi_new("ngx_str_t[?]", multi_keys_size)
+
+local store_opts       = ffi_new("ngx_lua_shdict_store_opts_t[1]")
+local fetch_opts       = ffi_new("ngx_lua_shdict_fetch_opts_t[1]")
+
+local changes_buf_size = 128
+local changes_buf      = ffi_new("ngx_lua_shdict_change_t[?]",
+                                 changes_buf_size)
+local change_seq       = ffi_new("uint64_t[1]")
+local change_epoch     = ffi_new("uint32_t[1]")
+
+local field_ops_size   = 8
+local field_ops        = ffi_new("ngx_lua_shdict_field_op_t[?]",
+                                 field_ops_size)
+
+-- the registers of a HyperLogLog, and the values of the registers
+local hll_m            = 16384
+local hll_q            = 50
+local hll_hist         = ffi_new("int[?]", hll_q + 2)
+local uint32_ptr_type  = ffi.typeof("uint32_t *")
+local size_tmp         = ffi_new("size_t[1]")
+local uint64_type      = ffi.typeof("uint64_t")
+
+local waiter_buf       = ffi_new("void *[1]")
+local waiter_id        = ffi_new("uint64_t[1]")
+local sem_token        = ffi_new("uint64_t[1]")
+local sem_retry        = ffi_new("long[1]")
+
+-- a blocked pop or lock sleeps at most this long between two attempts
+local wait_slice       = 1
+
+-- semaphores whose waiter may still be registered in shared memory, they
+-- must stay alive until then since other workers can get them posted
+local wait_semas       = {}
+
+local semaphore, sema_post
+
 
 local function check_zone(zone)
     if not zone or type(zone) ~= "table" then
@@ -161,7 +420,70 @@ local function shdict_find(name)
 end
 
 
-local function shdict_push(zone, flag, key, value)
+local function set_list_value(v, value)
+    local valtyp = type(value)
+
+    if valtyp == "string" then
+        v.value_type = 4  -- LUA_TSTRING
+        v.str_value_buf = value
+        v.str_value_len = #value
+
+    elseif valtyp == "number" then
+        v.value_type = 3  -- LUA_TNUMBER
+        v.str_value_buf = nil
+        v.num_value = value
+
+    else
+        return nil
+    end
+
+    return true
+end
+
+
+local function get_list_value(v)
+    local typ = v.value_type
+
+    if typ == 4 then -- LUA_TSTRING
+        return ffi_str(v.str_value_buf, v.str_value_len)
+
+    elseif typ == 3 then -- LUA_TNUMBER
+        return tonumber(v.num_value)
+    end
+
+    error("unknown value type: " .. typ)
+end
+
+
+-- reads the values the list helpers left in str_value_buf[0] and
+-- releases the buffer when the C side had to malloc a larger one
+local function get_list_values(n, single)
+    local buf = str_value_buf[0]
+    local values = ffi_cast(value_ptr_type, buf)
+
+    local res
+
+    if single then
+        if n > 0 then
+            res = get_list_value(values[0])
+        end
+
+    else
+        res = {}
+        for i = 0, n - 1 do
+            res[i + 1] = get_list_value(values[i])
+        end
+    end
+
+    if buf ~= str_buf then
+        C.free(buf)
+    end
+
+    return res
+end
+
+
+local function shdict_push(zone, flag, key, ...)
     local meta_zone = check_zone(zone)
 
     local key, key_len = check_key(key)
@@ -169,53 +491,80 @@ local function shdict_push(zone, flag, key, value)
         return key, key_len
     end
 
-    local str_value_buf
-    local str_value_len = 0
-    local num_value = 0
-    local valtyp = type(value)
+    local n = select("#", ...)
 
-    if valtyp == "string" then
-        valtyp = 4  -- LUA_TSTRING
-        str_value_buf = value
-        str_value_len = #value
+    local max_len = 0
 
-    elseif valtyp == "number" then
-        valtyp = 3  -- LUA_TNUMBER
-        num_value = value
+    -- an options table may follow the values
+    local opts = n > 1 and select(n, ...)
+    if type(opts) == "table" then
+        n = n - 1
 
-    else
+        if opts.max_len ~= nil then
+            max_len = tonumber(opts.max_len)
+            if not max_len or max_len < 1 then
+                error("bad \"max_len\" option")
+            end
+        end
+    end
+
+    if n == 0 then
         return nil, "bad value type"
     end
 
+    if n > list_values_size then
+        list_values_size = n
+        list_values = ffi_new("ngx_lua_shdict_value_t[?]", n)
+    end
+
+    for i = 1, n do
+        if not set_list_value(list_values[i - 1], (select(i, ...))) then
+            return nil, "bad value type"
+        end
+    end
+
     local value_len = int_tmp[0]
+    local forcible = int_tmp[1]
 
     local rc = C.ngx_lua_ffi_shdict_push_helper(meta_zone, key, key_len,
-                                                valtyp, str_value_buf,
-                                                str_value_len, num_value,
-                                                value_len, flag, errmsg)
+                                                list_values, n, max_len,
+                                                value_len, flag, errmsg,
+                                                forcible)
 
     if rc == FFI_OK then
-        return tonumber(value_len[0])
+        return tonumber(value_len[0]), nil, forcible[0] == 1
     end
 
     -- NGX_DECLINED or NGX_ERROR
-    return nil, ffi_str(errmsg[0])
+    return nil, ffi_str(errmsg[0]), forcible[0] == 1
 end
 
 
-local function shdict_lpush(zone, key, value)
-    return shdict_push(zone, 1, key, value)
+local function shdict_lpush(zone, key, ...)
+    return shdict_push(zone, 1, key, ...)
 end
 
 
-local function shdict_rpush(zone, key, value)
-    return shdict_push(zone, 0, key, value)
+local function shdict_rpush(zone, key, ...)
+    return shdict_push(zone, 0, key, ...)
 end
 
 
-local function shdict_pop(zone, flag, key)
+local function shdict_pop(zone, flag, key, count)
     local meta_zone = check_zone(zone)
 
+    local single = count == nil
+
+    if single then
+        count = 1
+
+    else
+        count = tonumber(count)
+        if not count or count < 1 then
+            error("bad \"count\" argument")
+        end
+    end
+
     local key, key_len = check_key(key)
     if key == nil then
         return key, key_len
@@ -224,86 +573,91 @@ local function shdict_pop(zone, flag, key)
     str_value_buf[0] = str_buf
     str_value_len[0] = str_buf_size
 
-    local value_type = int_tmp[0]
+    local nvalues = int_tmp[0]
 
     local rc = C.ngx_lua_ffi_shdict_pop_helper(meta_zone, key, key_len,
-                                               value_type, str_value_buf,
-                                               str_value_len, num_value,
+                                               count, str_value_buf,
+                                               str_value_len, nvalues,
                                                flag, errmsg)
 
     if rc ~= FFI_OK then
         return nil, ffi_str(errmsg[0])
     end
 
-    local typ = tonumber(value_type[0])
+    local n = tonumber(nvalues[0])
 
-    local val
+    if n == 0 then
+        return nil
+    end
 
-    if typ == 4 then -- LUA_TSTRING
-        val = ffi_str(str_value_buf[0], str_value_len[0])
-        if str_value_buf[0] ~= str_buf then
-            C.free(str_value_buf[0])
-        end
+    return get_list_values(n, single)
+end
 
-    elseif typ == 3 then -- LUA_TNUMBER
-        val = tonumber(num_value[0])
 
-    elseif typ == 0 then -- LUA_TNIL
-        val = nil
+local function shdict_lpop(zone, key, count)
+    return shdict_pop(zone, 1, key, count)
+end
 
-    else
-        error("unknown value type: " .. typ)
-    end
 
-    return val
+local function shdict_rpop(zone, key, count)
+    return shdict_pop(zone, 0, key, count)
 end
 
 
-local function shdict_lpop(zone, key)
-    return shdict_pop(zone, 1, key)
-end
+local function wait_init()
+    local ok, sema = pcall(require, "ngx.semaphore")
+    if not ok then
+        semaphore = false
+        return
+    end
 
+    local subsystem = ngx.config and ngx.config.subsystem or "http"
 
-local function shdict_rpop(zone, key)
-    return shdict_pop(zone, 0, key)
+    ok, sema_post = pcall(function ()
+        return ffi_cast("void *", C["ngx_" .. subsystem .. "_lua_ffi_sema_post"])
+    end)
+
+    semaphore = ok and sema or false
 end
 
 
-local function shdict_llen(zone, key)
-    local meta_zone = check_zone(zone)
+-- sleeps up to "wait" seconds on the waiter the last helper call registered
+local function wait_waiter(meta_zone, sema, wait)
+    local waiter = waiter_buf[0]
 
-    local key, key_len = check_key(key)
-    if key == nil then
-        return key, key_len
+    if waiter == nil then
+        -- no shared memory for the waiter, or no semaphore API
+        ngx.sleep(wait < 0.01 and wait or 0.01)
+        return
     end
 
-    local value_len = int_tmp[0]
+    local id = waiter_id[0]
+    local now = ngx.now
 
-    local rc = C.ngx_lua_ffi_shdict_llen(meta_zone, key, key_len,
-                                         value_len, errmsg)
+    wait_semas[sema] = now() + wait + wait_slice
 
-    if rc ~= FFI_OK then
-        return nil, ffi_str(errmsg[0])
-    end
+    sema:wait(wait)
 
-    return tonumber(value_len[0])
-end
+    C.ngx_lua_ffi_shdict_bpop_cancel(meta_zone, waiter, id)
 
+    wait_semas[sema] = nil
 
-local function shdict_store(zone, op, key, value, exptime, flags)
-    local meta_zone = check_zone(zone)
+    -- drop the semaphores of light threads killed while blocked
+    local t = now()
+    for s, expires in pairs(wait_semas) do
+        if expires < t then
+            wait_semas[s] = nil
+        end
+    end
+end
 
-    exptime = tonumber(exptime)
-    if not exptime then
-        exptime = 0
 
-    elseif exptime < 0 then
-        error("bad \"exptime\" argument")
-    end
+local function shdict_bpop(zone, flag, key, timeout)
+    local meta_zone = check_zone(zone)
 
-    flags = tonumber(flags)
-    if not flags then
-        flags = 0
+    timeout = tonumber(timeout or 0)
+    if not timeout or timeout < 0 then
+        error("bad \"timeout\" argument")
     end
 
     local key, key_len = check_key(key)
@@ -311,171 +665,215 @@ local function shdict_store(zone, op, key, value, exptime, flags)
         return key, key_len
     end
 
-    local str_value_buf
-    local str_value_len = 0
-    local num_value = 0
-    local valtyp = type(value)
+    if semaphore == nil then
+        wait_init()
+    end
 
-    if valtyp == "string" then
-        valtyp = 4  -- LUA_TSTRING
-        str_value_buf = value
-        str_value_len = #value
+    local now = ngx.now
+    local deadline = timeout > 0 and now() + timeout
 
-    elseif valtyp == "number" then
-        valtyp = 3  -- LUA_TNUMBER
-        num_value = value
+    local sema = semaphore and semaphore.new(0)
+    local sema_ptr = sema and sema.sem
 
-    elseif value == nil then
-        valtyp = 0  -- LUA_TNIL
+    local nvalues = int_tmp[0]
 
-    elseif valtyp == "boolean" then
-        valtyp = 1  -- LUA_TBOOLEAN
-        num_value = value and 1 or 0
+    while true do
+        local wait = wait_slice
+        if deadline then
+            wait = deadline - now()
+            if wait > wait_slice then
+                wait = wait_slice
+            end
+        end
 
-    else
-        return false, "bad value type"
-    end
+        str_value_buf[0] = str_buf
+        str_value_len[0] = str_buf_size
+
+        -- a last attempt after the deadline must not register a waiter
+        local rc = C.ngx_lua_ffi_shdict_bpop_helper(meta_zone, key, key_len,
+                                                    str_value_buf,
+                                                    str_value_len, nvalues,
+                                                    flag, wait * 1000,
+                                                    wait > 0 and sema_ptr
+                                                    or nil,
+                                                    sema_post, waiter_buf,
+                                                    waiter_id, errmsg)
+        if rc ~= FFI_OK then
+            return nil, ffi_str(errmsg[0])
+        end
 
-    local forcible = int_tmp[0]
+        local n = tonumber(nvalues[0])
+        if n > 0 then
+            return get_list_values(n, true)
+        end
 
-    local rc = C.ngx_lua_ffi_shdict_store_helper(meta_zone, op, key, key_len,
-                                                 valtyp, str_value_buf,
-                                                 str_value_len, num_value,
-                                                 exptime * 1000, flags, errmsg,
-                                                 forcible)
+        if wait <= 0 then
+            return nil, "timeout"
+        end
 
-    if rc == FFI_OK then
-        return true, nil, forcible[0] == 1
+        wait_waiter(meta_zone, sema, wait)
     end
-
-    -- NGX_DECLINED or NGX_ERROR
-    return false, ffi_str(errmsg[0]), forcible[0] == 1
-end
-
-
-local function shdict_set(zone, key, value, exptime, flags)
-    return shdict_store(zone, 0, key, value, exptime, flags)
 end
 
 
-local function shdict_safe_set(zone, key, value, exptime, flags)
-    return shdict_store(zone, 0x0004, key, value, exptime, flags)
+local function shdict_blpop(zone, key, timeout)
+    return shdict_bpop(zone, 1, key, timeout)
 end
 
 
-local function shdict_add(zone, key, value, exptime, flags)
-    return shdict_store(zone, 0x0001, key, value, exptime, flags)
+local function shdict_brpop(zone, key, timeout)
+    return shdict_bpop(zone, 0, key, timeout)
 end
 
 
-local function shdict_safe_add(zone, key, value, exptime, flags)
-    return shdict_store(zone, 0x0005, key, value, exptime, flags)
-end
-
+local function shdict_acquire(zone, key, limit, opts)
+    local meta_zone = check_zone(zone)
 
-local function shdict_replace(zone, key, value, exptime, flags)
-    return shdict_store(zone, 0x0002, key, value, exptime, flags)
-end
+    limit = tonumber(limit)
+    if not limit or limit < 1 or limit > 2147483647 or limit % 1 ~= 0 then
+        error("bad \"limit\" argument")
+    end
 
+    local timeout, exptime = 5, 30
 
-local function shdict_delete(zone, key)
-    return shdict_set(zone, key, nil)
-end
+    if opts ~= nil then
+        if type(opts) ~= "table" then
+            error("bad \"opts\" argument")
+        end
 
+        if opts.timeout ~= nil then
+            timeout = tonumber(opts.timeout)
+            if not timeout or timeout < 0 then
+                error("bad \"timeout\" option")
+            end
+        end
 
-local function shdict_ttl(zone, key)
-    zone = check_zone(zone)
+        if opts.exptime ~= nil then
+            exptime = tonumber(opts.exptime)
+            if not exptime or exptime < 0 then
+                error("bad \"exptime\" option")
+            end
+        end
+    end
 
+    local key, key_len = check_key(key)
     if key == nil then
-        return nil, "nil key"
+        return key, key_len
     end
 
-    if type(key) ~= "string" then
-        key = tostring(key)
+    if semaphore == nil then
+        wait_init()
     end
 
-    local key_len = #key
-    if key_len == 0 then
-        return nil, "empty key"
-    end
+    local now = ngx.now
+    local deadline = now() + timeout
 
-    if key_len > 65535 then
-        return nil, "key too long"
-    end
+    local sema, sema_ptr
 
-    local rc = C.ngx_lua_ffi_shdict_get_ttl(zone, key, key_len)
+    while true do
+        local wait = deadline - now()
+        if wait > wait_slice then
+            wait = wait_slice
+        end
 
-    if rc == FFI_ERROR then
-        return nil, "bad zone"
-    end
+        if wait > 0 and sema == nil and semaphore then
+            sema = semaphore.new(0)
+            sema_ptr = sema.sem
+        end
 
-    if rc == FFI_DECLINED then
-        return nil, "not found"
-    end
+        -- a last attempt after the deadline must not register a waiter
+        local rc = C.ngx_lua_ffi_shdict_sem_acquire(meta_zone, key, key_len,
+                                                    limit, exptime * 1000,
+                                                    wait * 1000,
+                                                    wait > 0 and sema_ptr
+                                                    or nil,
+                                                    sema_post, waiter_buf,
+                                                    waiter_id, sem_token,
+                                                    sem_retry, errmsg)
+        if rc == FFI_OK then
+            return tonumber(sem_token[0])
+        end
 
-    return tonumber(rc) / 1000
-end
+        if rc ~= FFI_DECLINED then
+            return nil, ffi_str(errmsg[0])
+        end
 
+        if wait <= 0 then
+            return nil, "timeout"
+        end
 
-local function shdict_expire(zone, key, exptime)
-    zone = check_zone(zone)
+        -- try again as soon as the permit of a dead holder expires
+        local retry = tonumber(sem_retry[0])
+        if retry >= 0 and retry < wait * 1000 then
+            wait = retry / 1000
+        end
 
-    exptime = tonumber(exptime)
-    if not exptime then
-        error('bad "exptime" argument', 2)
+        wait_waiter(meta_zone, sema, wait)
     end
+end
 
-    if key == nil then
-        return nil, "nil key"
-    end
 
-    if type(key) ~= "string" then
-        key = tostring(key)
+local function shdict_release(zone, key, token)
+    local meta_zone = check_zone(zone)
+
+    if type(token) ~= "number" then
+        error("bad \"token\" argument")
     end
 
-    local key_len = #key
-    if key_len == 0 then
-        return nil, "empty key"
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
     end
 
-    if key_len > 65535 then
-        return nil, "key too long"
+    local rc = C.ngx_lua_ffi_shdict_sem_release(meta_zone, key, key_len,
+                                                token, errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
     end
 
-    local rc = C.ngx_lua_ffi_shdict_set_expire(zone, key, key_len,
-                                                    exptime * 1000)
-
-    if rc == FFI_ERROR then
-        return nil, "bad zone"
-    end
-
-    if rc == FFI_DECLINED then
-        return nil, "not found"
-    end
+    return true
+end
 
-    -- NGINX_OK/FFI_OK
 
-    return true
+local function shdict_lock(zone, key, opts)
+    return shdict_acquire(zone, key, 1, opts)
 end
 
 
-local function shdict_capacity(zone)
-    zone = check_zone(zone)
+local function shdict_llen(zone, key)
+    local meta_zone = check_zone(zone)
 
-    return tonumber(C.ngx_lua_ffi_shdict_capacity(zone))
-end
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
 
+    local value_len = int_tmp[0]
 
-local function shdict_free_space(zone)
-    zone = check_zone(zone)
+    local rc = C.ngx_lua_ffi_shdict_llen(meta_zone, key, key_len,
+                                         value_len, errmsg)
 
-    return tonumber(C.ngx_lua_ffi_shdict_free_space(zone))
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    return tonumber(value_len[0])
 end
 
 
-local function shdict_fetch(zone, key, get_stale)
+local function shdict_lrange(zone, key, start, stop)
     local meta_zone = check_zone(zone)
 
+    start = tonumber(start)
+    if not start then
+        error("bad \"start\" argument")
+    end
+
+    stop = tonumber(stop)
+    if not stop then
+        error("bad \"stop\" argument")
+    end
+
     local key, key_len = check_key(key)
     if key == nil then
         return key, key_len
@@ -484,169 +882,2086 @@ local function shdict_fetch(zone, key, get_stale)
     str_value_buf[0] = str_buf
     str_value_len[0] = str_buf_size
 
-    local value_type = int_tmp[0]
-    local user_flags = int_tmp[1]
-    local is_stale   = int_tmp[2]
+    local nvalues = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_lrange(meta_zone, key, key_len, start,
+                                           stop, str_value_buf,
+                                           str_value_len, nvalues, errmsg)
 
-    local rc = C.ngx_lua_ffi_shdict_fetch_helper(meta_zone, get_stale, key,
-                                                 key_len, value_type,
-                                                 str_value_buf, str_value_len,
-                                                 num_value, user_flags,
-                                                 is_stale, errmsg)
     if rc ~= FFI_OK then
         return nil, ffi_str(errmsg[0])
     end
 
-    local typ = value_type[0]
+    local n = tonumber(nvalues[0])
 
-    if typ == 0 then -- LUA_TNIL
-        return nil
+    if n == 0 then
+        return {}
     end
 
-    local flags = tonumber(user_flags[0])
+    return get_list_values(n)
+end
 
-    local val
 
-    if typ == 4 then -- LUA_TSTRING
-        val = ffi_str(str_value_buf[0], str_value_len[0])
-        if str_value_buf[0] ~= str_buf then
-            C.free(str_value_buf[0])
-        end
+local function shdict_lindex(zone, key, index)
+    local meta_zone = check_zone(zone)
 
-    elseif typ == 3 then -- LUA_TNUMBER
-        val = tonumber(num_value[0])
+    index = tonumber(index)
+    if not index then
+        error("bad \"index\" argument")
+    end
 
-    elseif typ == 1 then -- LUA_TBOOLEAN
-        val = (tonumber(str_value_buf[0][0]) ~= 0)
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
 
-    else
-        error("unknown value type: " .. typ)
+    str_value_buf[0] = str_buf
+    str_value_len[0] = str_buf_size
+
+    local nvalues = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_lindex(meta_zone, key, key_len, index,
+                                           str_value_buf, str_value_len,
+                                           nvalues, errmsg)
+
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
     end
 
-    if get_stale == 0 then
-        if flags == 0 then
-            return val
-        end
-        return val, flags
-    else
-        if flags == 0 then
-            return val, nil, is_stale[0] == 1
-        end
-        return val, flags, is_stale[0] == 1
+    local n = tonumber(nvalues[0])
+
+    if n == 0 then
+        return nil
     end
+
+    return get_list_values(n, true)
 end
 
 
-local function shdict_get(zone, key)
-    return shdict_fetch(zone, key, 0)
-end
+local function shdict_lset(zone, key, index, value)
+    local meta_zone = check_zone(zone)
 
+    index = tonumber(index)
+    if not index then
+        error("bad \"index\" argument")
+    end
 
-local function shdict_get_stale(zone, key)
-    return shdict_fetch(zone, key, 1)
-end
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
 
+    if not set_list_value(list_values[0], value) then
+        return nil, "bad value type"
+    end
 
-local function shdict_flush_all(zone)
-    local meta_zone = check_zone(zone)
+    local rc = C.ngx_lua_ffi_shdict_lset(meta_zone, key, key_len, index,
+                                         list_values, errmsg)
 
-    local rc = C.ngx_lua_ffi_shdict_flush_all(meta_zone, errmsg)
     if rc ~= FFI_OK then
-        return nil, "failed to flush"
+        return nil, ffi_str(errmsg[0])
     end
 
     return true
 end
 
 
-local function shdict_flush_expired(zone, attempts)
+local function shdict_ltrim(zone, key, start, stop)
     local meta_zone = check_zone(zone)
 
-    attempts = tonumber(attempts)
-    if not attempts then
-        attempts = 0
+    start = tonumber(start)
+    if not start then
+        error("bad \"start\" argument")
     end
 
-    local freed = int_tmp[0]
+    stop = tonumber(stop)
+    if not stop then
+        error("bad \"stop\" argument")
+    end
 
-    local rc = C.ngx_lua_ffi_shdict_flush_expired(meta_zone, attempts,
-                                                  freed, errmsg)
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local value_len = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_ltrim(meta_zone, key, key_len, start,
+                                          stop, value_len, errmsg)
 
     if rc ~= FFI_OK then
-        error("failed get flush expire")
+        return nil, ffi_str(errmsg[0])
     end
 
-    return tonumber(freed[0])
+    return tonumber(value_len[0])
 end
 
 
-local function shdict_incr(zone, key, value, init, init_ttl)
-    local meta_zone = check_zone(zone)
+-- the kinds of ngx_lua_shdict_field_op_t by the C type of a record field
+local field_kinds = {
+    ["int8_t"] = 1, ["char"] = 1, ["signed char"] = 1,
+    ["uint8_t"] = 2, ["unsigned char"] = 2, ["bool"] = 2,
+    ["int16_t"] = 3, ["short"] = 3,
+    ["uint16_t"] = 4, ["unsigned short"] = 4,
+    ["int32_t"] = 5, ["int"] = 5,
+    ["uint32_t"] = 6, ["unsigned int"] = 6, ["unsigned"] = 6,
+    ["int64_t"] = 7, ["long long"] = 7,
+    ["uint64_t"] = 8, ["unsigned long long"] = 8,
+    ["float"] = 9,
+    ["double"] = 10,
+}
+
+-- the record types by schema, the same schema must give the same ctype
+-- to every zone declaring it
+local record_types = {}
+
+
+-- a 32-bit hash of the schema, heading the values stored with it so that
+-- a worker declaring another schema for the zone tells them apart
+local function record_id(schema)
+    local h = 5381
+
+    for i = 1, #schema do
+        h = bit.tobit(h * 33 + schema:byte(i))
+    end
 
-    local key, key_len = check_key(key)
-    if key == nil then
-        return key, key_len
+    if h < 0 then
+        h = h + 4294967296
     end
 
-    if type(value) ~= "number" then
-        value = tonumber(value)
+    return h
+end
+
+
+local function new_record_type(schema)
+    local ok, ctype = pcall(ffi.typeof, schema)
+    if not ok then
+        error("bad \"schema\" argument: " .. ctype, 3)
     end
-    num_value[0] = value
 
-    local has_init
+    local body = schema:match("^%s*struct%s*[%w_]*%s*{(.*)}%s*$")
+    if not body then
+        error("bad \"schema\" argument: struct expected", 3)
+    end
 
-    if init then
-        local typ = type(init)
-        if typ ~= "number" then
-            init = tonumber(init)
+    local size = ffi.sizeof(ctype)
+    local fields = {}
 
-            if not init then
-                error("bad init arg: number expected, got " .. typ, 2)
+    -- the scalar fields can be updated in place, the others, arrays and
+    -- nested structs, are only read and written with the whole record
+
+    for decl in body:gmatch("[^;]+") do
+        local first, others = decl:match("^([^,]*)(.*)$")
+        local typ, name = first:match("^%s*(.-)%s*([%a_][%w_]*)%s*$")
+        local kind = typ and field_kinds[typ]
+
+        if kind then
+            fields[name] = { offset = ffi.offsetof(ctype, name), kind = kind }
+
+            for other in others:gmatch("[^,]+") do
+                name = other:match("^%s*([%a_][%w_]*)%s*$")
+
+                if name then
+                    fields[name] = { offset = ffi.offsetof(ctype, name),
+                                     kind = kind }
+                end
             end
         end
     end
 
-    if init_ttl ~= nil then
-        local typ = type(init_ttl)
-        if typ ~= "number" then
-            init_ttl = tonumber(init_ttl)
+    local id = record_id(schema)
 
-            if not init_ttl then
-                error("bad init_ttl arg: number expected, got " .. typ, 2)
-            end
+    -- the value stored: the id, then the bytes of the struct
+    local buf = ffi_new("unsigned char[?]", 4 + size)
+    ffi_cast(uint32_ptr_type, buf)[0] = id
+
+    return {
+        ctype = ctype,
+        size = size,
+        id = id,
+        fields = fields,
+        buf = buf,
+    }
+end
+
+
+-- a cdata of the record type of "zone" copied from a value read
+local function get_record(zone, buf, len)
+    local rt = zone[RECORD_INDEX]
+    if not rt then
+        return nil, "no record schema"
+    end
+
+    if len ~= 4 + rt.size or ffi_cast(uint32_ptr_type, buf)[0] ~= rt.id then
+        return nil, "record schema mismatch"
+    end
+
+    local val = ffi_new(rt.ctype)
+    ffi_copy(val, buf + 4, rt.size)
+
+    return val
+end
+
+
+-- the priority classes of the items, as in ngx_lua_shdict_common.h
+local priorities = { normal = 0, low = 1, pinned = 2 }
+
+-- the class of the item replaced, normal for a new one
+local PRIO_KEEP = 3
+
+
+-- the store_opts of an options table, or nil when it sets none
+local function get_store_opts(opts)
+    if type(opts) ~= "table" then
+        error("bad \"opts\" argument")
+    end
+
+    local cost, stale_ttl, lease = opts.cost, opts.stale_ttl, opts.lease
+    local priority = opts.priority
+    if cost == nil and stale_ttl == nil and lease == nil and priority == nil
+    then
+        return nil
+    end
+
+    if cost == nil then
+        cost = 0
+
+    else
+        cost = tonumber(cost)
+        if not cost or cost < 0 then
+            error("bad \"cost\" option")
         end
+    end
 
-        if init_ttl < 0 then
-            error('bad "init_ttl" argument', 2)
+    if stale_ttl == nil then
+        stale_ttl = 0
+
+    else
+        stale_ttl = tonumber(stale_ttl)
+        if not stale_ttl or stale_ttl < 0 then
+            error("bad \"stale_ttl\" option")
         end
+    end
 
-        if not init then
-            error('must provide "init" when providing "init_ttl"', 2)
+    if lease == nil then
+        lease = 0
+
+    elseif type(lease) ~= "number" or lease < 1 or lease % 1 ~= 0 then
+        error("bad \"lease\" option")
+    end
+
+    if priority == nil then
+        priority = PRIO_KEEP
+
+    else
+        priority = priorities[priority]
+        if not priority then
+            error("bad \"priority\" option")
+        end
+    end
+
+    -- in milliseconds, saturated at the 49 days a uint32_t holds
+    store_opts[0].cost = cost < 4294967 and cost * 1000 or 4294967295
+    store_opts[0].stale_ttl = stale_ttl < 4294967 and stale_ttl * 1000
+                              or 4294967295
+    store_opts[0].priority = priority
+    store_opts[0].lease = lease
+
+    return store_opts
+end
+
+
+local function shdict_store(zone, op, key, value, exptime, flags, opts)
+    local meta_zone = check_zone(zone)
+
+    exptime = tonumber(exptime)
+    if not exptime then
+        exptime = 0
+
+    elseif exptime < 0 then
+        error("bad \"exptime\" argument")
+    end
+
+    flags = tonumber(flags)
+    if not flags then
+        flags = 0
+    end
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local str_value_buf
+    local str_value_len = 0
+    local num_value = 0
+    local valtyp = type(value)
+
+    if valtyp == "string" then
+        valtyp = 4  -- LUA_TSTRING
+        str_value_buf = value
+        str_value_len = #value
+
+    elseif valtyp == "number" then
+        valtyp = 3  -- LUA_TNUMBER
+        num_value = value
+
+    elseif value == nil then
+        valtyp = 0  -- LUA_TNIL
+
+    elseif valtyp == "boolean" then
+        valtyp = 1  -- LUA_TBOOLEAN
+        num_value = value and 1 or 0
+
+    elseif valtyp == "table" then
+        str_value_buf, str_value_len = msgpack_encode(value)
+        if not str_value_buf then
+            return false, str_value_len
         end
 
+        valtyp = 10  -- a table
+
+    elseif valtyp == "cdata" and zone[RECORD_INDEX]
+           and ffi_istype(zone[RECORD_INDEX].ctype, value)
+    then
+        local rt = zone[RECORD_INDEX]
+
+        valtyp = 6  -- a record
+        ffi_copy(rt.buf + 4, value, rt.size)
+        str_value_buf = rt.buf
+        str_value_len = 4 + rt.size
+
     else
-        init_ttl = 0
+        return false, "bad value type"
     end
 
     local forcible = int_tmp[0]
 
-    local rc = C.ngx_lua_ffi_shdict_incr_helper(meta_zone, key, key_len,
-                                                num_value, errmsg,
-                                                init and 1 or 0, init or 0,
-                                                init_ttl * 1000, forcible)
-
-    if rc ~= FFI_OK then
-        return nil, ffi_str(errmsg[0])
+    if opts ~= nil then
+        opts = get_store_opts(opts)
     end
 
-    if not init then
-        return tonumber(num_value[0])
+    local rc
+
+    if opts then
+        rc = C.ngx_lua_ffi_shdict_store_ext(meta_zone, op, key, key_len,
+                                            valtyp, str_value_buf,
+                                            str_value_len, num_value,
+                                            exptime * 1000, flags, opts,
+                                            errmsg, forcible)
+
+    else
+        rc = C.ngx_lua_ffi_shdict_store_helper(meta_zone, op, key, key_len,
+                                               valtyp, str_value_buf,
+                                               str_value_len, num_value,
+                                               exptime * 1000, flags, errmsg,
+                                               forcible)
+    end
+
+    if rc == FFI_OK then
+        return true, nil, forcible[0] == 1
+    end
+
+    -- NGX_DECLINED or NGX_ERROR
+    return false, ffi_str(errmsg[0]), forcible[0] == 1
+end
+
+
+local function shdict_set(zone, key, value, exptime, flags, opts)
+    return shdict_store(zone, 0, key, value, exptime, flags, opts)
+end
+
+
+local function shdict_safe_set(zone, key, value, exptime, flags, opts)
+    return shdict_store(zone, 0x0004, key, value, exptime, flags, opts)
+end
+
+
+local function shdict_add(zone, key, value, exptime, flags, opts)
+    return shdict_store(zone, 0x0001, key, value, exptime, flags, opts)
+end
+
+
+local function shdict_safe_add(zone, key, value, exptime, flags, opts)
+    return shdict_store(zone, 0x0005, key, value, exptime, flags, opts)
+end
+
+
+local function shdict_replace(zone, key, value, exptime, flags, opts)
+    return shdict_store(zone, 0x0002, key, value, exptime, flags, opts)
+end
+
+
+local function shdict_delete(zone, key)
+    return shdict_set(zone, key, nil)
+end
+
+
+local function shdict_ttl(zone, key)
+    zone = check_zone(zone)
+
+    if key == nil then
+        return nil, "nil key"
+    end
+
+    if type(key) ~= "string" then
+        key = tostring(key)
+    end
+
+    local key_len = #key
+    if key_len == 0 then
+        return nil, "empty key"
+    end
+
+    if key_len > 65535 then
+        return nil, "key too long"
+    end
+
+    local rc = C.ngx_lua_ffi_shdict_get_ttl(zone, key, key_len)
+
+    if rc == FFI_ERROR then
+        return nil, "bad zone"
+    end
+
+    if rc == FFI_DECLINED then
+        return nil, "not found"
+    end
+
+    return tonumber(rc) / 1000
+end
+
+
+local function shdict_expire(zone, key, exptime)
+    zone = check_zone(zone)
+
+    exptime = tonumber(exptime)
+    if not exptime then
+        error('bad "exptime" argument', 2)
+    end
+
+    if key == nil then
+        return nil, "nil key"
+    end
+
+    if type(key) ~= "string" then
+        key = tostring(key)
+    end
+
+    local key_len = #key
+    if key_len == 0 then
+        return nil, "empty key"
+    end
+
+    if key_len > 65535 then
+        return nil, "key too long"
+    end
+
+    local rc = C.ngx_lua_ffi_shdict_set_expire(zone, key, key_len,
+                                                    exptime * 1000)
+
+    if rc == FFI_ERROR then
+        return nil, "bad zone"
+    end
+
+    if rc == FFI_DECLINED then
+        return nil, "not found"
+    end
+
+    -- NGINX_OK/FFI_OK
+
+    return true
+end
+
+
+local function shdict_capacity(zone)
+    zone = check_zone(zone)
+
+    return tonumber(C.ngx_lua_ffi_shdict_capacity(zone))
+end
+
+
+local function shdict_free_space(zone)
+    zone = check_zone(zone)
+
+    return tonumber(C.ngx_lua_ffi_shdict_free_space(zone))
+end
+
+
+local function shdict_hot_keys(zone, n)
+    local meta_zone = check_zone(zone)
+
+    if n == nil then
+        n = 0
+
+    else
+        n = tonumber(n)
+        if not n or n < 1 then
+            error("bad \"n\" argument")
+        end
+    end
+
+    str_value_buf[0] = str_buf
+    str_value_len[0] = str_buf_size
+
+    local nkeys = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_hot_keys(meta_zone, n, str_value_buf,
+                                             str_value_len, nkeys, errmsg)
+
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    local buf = str_value_buf[0]
+    local values = ffi_cast(value_ptr_type, buf)
+
+    local res = {}
+
+    for i = 0, tonumber(nkeys[0]) - 1 do
+        local v = values[i]
+
+        res[i + 1] = {
+            key = ffi_str(v.str_value_buf, v.str_value_len),
+            count = tonumber(v.num_value),
+        }
+    end
+
+    if buf ~= str_buf then
+        C.free(buf)
+    end
+
+    return res
+end
+
+
+local report_type_names = {
+    [1] = "boolean",
+    [3] = "number",
+    [4] = "string",
+    [5] = "list",
+    [6] = "record",
+    [7] = "bitmap",
+    [8] = "bloom",
+    [9] = "hyperloglog",
+    [10] = "table",
+}
+
+
+-- the counts of a size histogram keyed by the upper bound of their bucket
+local function report_sizes(buckets)
+    local res = {}
+
+    for b = 0, 31 do
+        local n = tonumber(buckets[b])
+        if n > 0 then
+            res[2 ^ b] = n
+        end
+    end
+
+    return res
+end
+
+
+local function shdict_memory_report(zone, max_items)
+    local meta_zone = check_zone(zone)
+
+    if max_items == nil then
+        max_items = 0
+
+    else
+        max_items = tonumber(max_items)
+        if not max_items or max_items < 1 then
+            error("bad \"max_items\" argument")
+        end
+    end
+
+    local r = ffi_new("ngx_lua_shdict_report_t")
+
+    local rc = C.ngx_lua_ffi_shdict_memory_report(meta_zone, max_items, r,
+                                                  errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    local slabs = {}
+
+    for i = 0, tonumber(r.nslabs) - 1 do
+        local slab = r.slabs[i]
+
+        if slab.reqs > 0 then
+            slabs[#slabs + 1] = {
+                size = tonumber(slab.size),
+                pages = tonumber(slab.pages),
+                total = tonumber(slab.total),
+                used = tonumber(slab.used),
+                free = tonumber(slab.total - slab.used),
+                reqs = tonumber(slab.reqs),
+                fails = tonumber(slab.fails),
+            }
+        end
+    end
+
+    local types = {}
+    local bytes = 0
+
+    for t, name in pairs(report_type_names) do
+        local n = tonumber(r.type_items[t])
+        if n > 0 then
+            types[name] = { items = n, bytes = tonumber(r.type_bytes[t]) }
+            bytes = bytes + types[name].bytes
+        end
+    end
+
+    local header_bytes = tonumber(r.header_bytes)
+    local slack_bytes = tonumber(r.slack_bytes)
+
+    return {
+        capacity = tonumber(r.size),
+        pages = tonumber(r.pages),
+        free_pages = tonumber(r.free_pages),
+        slabs = slabs,
+        items = tonumber(r.items),
+        expired = tonumber(r.expired),
+        list_values = tonumber(r.list_values),
+        types = types,
+        key_sizes = report_sizes(r.key_sizes),
+        value_sizes = report_sizes(r.value_sizes),
+        bytes = bytes,
+        key_bytes = tonumber(r.key_bytes),
+        value_bytes = tonumber(r.value_bytes),
+        header_bytes = header_bytes,
+        slack_bytes = slack_bytes,
+        overhead = bytes > 0 and (header_bytes + slack_bytes) / bytes or 0,
+        complete = r.complete == 1,
+    }
+end
+
+
+-- the namespaces of a zone, NGX_LUA_SHDICT_NS_MAX of them at most
+local ns_stats
+
+
+local function shdict_stats(zone)
+    local meta_zone = check_zone(zone)
+
+    if not ns_stats then
+        ns_stats = ffi_new("ngx_lua_shdict_ns_stat_t[64]")
+    end
+
+    local stats = {}
+    local n = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_ns_stats(meta_zone, ns_stats, n, errmsg)
+
+    if rc == FFI_OK then
+        local namespaces = {}
+
+        for i = 0, n[0] - 1 do
+            local ns = ns_stats[i]
+
+            namespaces[ffi_str(ns.prefix, ns.prefix_len)] = {
+                quota = tonumber(ns.quota),
+                used = tonumber(ns.used),
+                items = tonumber(ns.items),
+                evictions = tonumber(ns.evictions),
+            }
+        end
+
+        stats.namespaces = namespaces
+    end
+
+    stats.pinned_bytes = tonumber(C.ngx_lua_ffi_shdict_pinned(meta_zone,
+                                                              size_tmp))
+    stats.pinned_limit = tonumber(size_tmp[0])
+
+    return stats
+end
+
+
+-- the "op" of a change record, as in ngx_lua_shdict_common.h
+local change_ops = {
+    "set", "delete", "incr", "expire", "evict", "list", "ttl", "flush",
+}
+
+local change_key_len = 96
+
+
+local function shdict_changes(zone, since, max)
+    local meta_zone = check_zone(zone)
+
+    if max == nil then
+        max = changes_buf_size
+
+    else
+        max = tonumber(max)
+        if not max or max < 1 then
+            error("bad \"max\" argument")
+        end
+    end
+
+    if since == nil then
+        -- the current sequence number, to follow the changes from now on
+        max = 0
+        since = 0
+
+    else
+        since = tonumber(since)
+        if not since or since < 0 then
+            error("bad \"since\" argument")
+        end
+    end
+
+    if max > changes_buf_size then
+        changes_buf_size = max
+        changes_buf = ffi_new("ngx_lua_shdict_change_t[?]", max)
+    end
+
+    local n = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_changes(meta_zone, since, max,
+                                            changes_buf, n, change_seq,
+                                            change_epoch, errmsg)
+
+    if rc == FFI_DECLINED then
+        return nil, "overflow", tonumber(change_seq[0])
+    end
+
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    if max == 0 then
+        return {}, tonumber(change_seq[0]), tonumber(change_epoch[0])
+    end
+
+    local res = {}
+
+    for i = 0, tonumber(n[0]) - 1 do
+        local rec = changes_buf[i]
+        local op = change_ops[rec.op]
+
+        local change = { seq = tonumber(rec.seq), op = op }
+
+        if op ~= "flush" then
+            local len = rec.key_len
+
+            if len <= change_key_len then
+                change.key = ffi_str(rec.key, len)
+
+            else
+                -- the whole key is in the spill area, unless overwritten
+                local buf = str_buf
+                if len > str_buf_size then
+                    buf = ffi_new("char [?]", len)
+                end
+
+                rc = C.ngx_lua_ffi_shdict_change_key(meta_zone, rec.spill, len,
+                                                     buf)
+
+                if rc == FFI_OK then
+                    change.key = ffi_str(buf, len)
+
+                else
+                    change.key = ffi_str(rec.key, change_key_len)
+                    change.key_len = len
+                    change.truncated = true
+                end
+            end
+        end
+
+        res[i + 1] = change
+    end
+
+    return res, tonumber(change_seq[0])
+end
+
+
+local function shdict_fetch(zone, key, get_stale, opts)
+    local meta_zone = check_zone(zone)
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    if opts ~= nil then
+        if type(opts) ~= "table" then
+            error("bad \"opts\" argument")
+        end
+
+        local beta, lease = opts.early_refresh, opts.lease
+        if beta == nil and lease == nil then
+            opts = nil
+
+        else
+            if beta == nil then
+                beta = 0
+
+            else
+                beta = tonumber(beta)
+                if not beta or beta <= 0 then
+                    error("bad \"early_refresh\" option")
+                end
+            end
+
+            if lease == nil then
+                lease = 0
+
+            else
+                lease = tonumber(lease)
+                if not lease or lease <= 0 then
+                    error("bad \"lease\" option")
+                end
+
+                -- the stale value is returned to the workers not granted
+                -- the lease
+                get_stale = 1
+            end
+
+            fetch_opts[0].early_refresh = beta
+            fetch_opts[0].lease = lease < 4294967 and lease * 1000
+                                  or 4294967295
+            opts = fetch_opts
+        end
+    end
+
+    str_value_buf[0] = str_buf
+    str_value_len[0] = str_buf_size
+
+    local value_type = int_tmp[0]
+    local user_flags = int_tmp[1]
+    local is_stale   = int_tmp[2]
+
+    local rc
+
+    if opts then
+        rc = C.ngx_lua_ffi_shdict_fetch_ext(meta_zone, get_stale, key,
+                                            key_len, value_type,
+                                            str_value_buf, str_value_len,
+                                            num_value, user_flags, is_stale,
+                                            opts, errmsg)
+
+    else
+        rc = C.ngx_lua_ffi_shdict_fetch_helper(meta_zone, get_stale, key,
+                                               key_len, value_type,
+                                               str_value_buf, str_value_len,
+                                               num_value, user_flags,
+                                               is_stale, errmsg)
+    end
+
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    local typ = value_type[0]
+
+    -- the lease, false when another worker holds it, nil on a fresh hit
+    local lease
+
+    if opts and opts[0].lease ~= 0 then
+        local token = opts[0].token
+
+        if token ~= 0 then
+            lease = tonumber(token)
+
+        elseif typ == 0 or is_stale[0] == 1 then
+            lease = false
+        end
+
+        if typ == 0 then -- LUA_TNIL
+            return nil, nil, lease
+        end
+    end
+
+    if typ == 0 then -- LUA_TNIL
+        return nil
+    end
+
+    local flags = tonumber(user_flags[0])
+
+    local val
+
+    if typ == 4 then -- LUA_TSTRING
+        val = ffi_str(str_value_buf[0], str_value_len[0])
+        if str_value_buf[0] ~= str_buf then
+            C.free(str_value_buf[0])
+        end
+
+    elseif typ == 3 then -- LUA_TNUMBER
+        val = tonumber(num_value[0])
+
+    elseif typ == 1 then -- LUA_TBOOLEAN
+        val = (tonumber(str_value_buf[0][0]) ~= 0)
+
+    elseif typ == 6 then -- a record
+        local err
+
+        val, err = get_record(zone, str_value_buf[0],
+                              tonumber(str_value_len[0]))
+        if str_value_buf[0] ~= str_buf then
+            C.free(str_value_buf[0])
+        end
+
+        if not val then
+            return nil, err
+        end
+
+    elseif typ == 10 then -- a table
+        local err
+
+        val, err = msgpack_decode(str_value_buf[0],
+                                  tonumber(str_value_len[0]))
+        if str_value_buf[0] ~= str_buf then
+            C.free(str_value_buf[0])
+        end
+
+        if not val then
+            return nil, err
+        end
+
+    else
+        error("unknown value type: " .. typ)
+    end
+
+    if opts then
+        if opts[0].lease ~= 0 then
+            return val, flags ~= 0 and flags or nil, lease
+        end
+
+        return val, flags ~= 0 and flags or nil, opts[0].refresh == 1
+    end
+
+    if get_stale == 0 then
+        if flags == 0 then
+            return val
+        end
+        return val, flags
+    else
+        if flags == 0 then
+            return val, nil, is_stale[0] == 1
+        end
+        return val, flags, is_stale[0] == 1
+    end
+end
+
+
+local function shdict_get(zone, key, opts)
+    return shdict_fetch(zone, key, 0, opts)
+end
+
+
+local function shdict_get_stale(zone, key)
+    return shdict_fetch(zone, key, 1)
+end
+
+
+local function shdict_get_multi(zone, keys)
+    local meta_zone = check_zone(zone)
+
+    if type(keys) ~= "table" then
+        error("bad \"keys\" argument")
+    end
+
+    local n = #keys
+    if n == 0 then
+        return {}
+    end
+
+    if n > multi_keys_size then
+        multi_keys_size = n
+        multi_keys = ffi_new("ngx_str_t[?]", n)
+    end
+
+    if n > list_values_size then
+        list_values_size = n
+        list_values = ffi_new("ngx_lua_shdict_value_t[?]", n)
+    end
+
+    -- also keeps the keys converted by tostring() alive during the call
+    local strs = {}
+
+    for i = 1, n do
+        local key, key_len = check_key(keys[i])
+        if key == nil then
+            return nil, key_len
+        end
+
+        strs[i] = key
+
+        multi_keys[i - 1].data = key
+        multi_keys[i - 1].len = key_len
+    end
+
+    str_value_buf[0] = str_buf
+    str_value_len[0] = str_buf_size
+
+    local rc = C.ngx_lua_ffi_shdict_get_multi(meta_zone, multi_keys, n,
+                                              list_values, str_value_buf,
+                                              str_value_len, errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    local res = {}
+    local err
+
+    for i = 0, n - 1 do
+        local v = list_values[i]
+        local typ = v.value_type
+
+        if typ == 1 then -- LUA_TBOOLEAN
+            res[strs[i + 1]] = (v.num_value ~= 0)
+
+        elseif typ == 6 then -- a record
+            res[strs[i + 1]], err = get_record(zone, v.str_value_buf,
+                                               tonumber(v.str_value_len))
+            if err then
+                res = nil
+                break
+            end
+
+        elseif typ == 10 then -- a table
+            res[strs[i + 1]], err = msgpack_decode(v.str_value_buf,
+                                                   tonumber(v.str_value_len))
+            if err then
+                res = nil
+                break
+            end
+
+        elseif typ ~= 0 then
+            res[strs[i + 1]] = get_list_value(v)
+        end
+    end
+
+    local buf = str_value_buf[0]
+    if buf ~= str_buf then
+        C.free(buf)
+    end
+
+    return res, err
+end
+
+
+local function shdict_flush_all(zone)
+    local meta_zone = check_zone(zone)
+
+    local rc = C.ngx_lua_ffi_shdict_flush_all(meta_zone, errmsg)
+    if rc ~= FFI_OK then
+        return nil, "failed to flush"
+    end
+
+    return true
+end
+
+
+local function shdict_flush_expired(zone, attempts)
+    local meta_zone = check_zone(zone)
+
+    attempts = tonumber(attempts)
+    if not attempts then
+        attempts = 0
+    end
+
+    local freed = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_flush_expired(meta_zone, attempts,
+                                                  freed, errmsg)
+
+    if rc ~= FFI_OK then
+        error("failed get flush expire")
+    end
+
+    return tonumber(freed[0])
+end
+
+
+local function shdict_incr(zone, key, value, init, init_ttl)
+    local meta_zone = check_zone(zone)
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    if type(value) ~= "number" then
+        value = tonumber(value)
+    end
+    num_value[0] = value
+
+    local has_init
+
+    if init then
+        local typ = type(init)
+        if typ ~= "number" then
+            init = tonumber(init)
+
+            if not init then
+                error("bad init arg: number expected, got " .. typ, 2)
+            end
+        end
+    end
+
+    if init_ttl ~= nil then
+        local typ = type(init_ttl)
+        if typ ~= "number" then
+            init_ttl = tonumber(init_ttl)
+
+            if not init_ttl then
+                error("bad init_ttl arg: number expected, got " .. typ, 2)
+            end
+        end
+
+        if init_ttl < 0 then
+            error('bad "init_ttl" argument', 2)
+        end
+
+        if not init then
+            error('must provide "init" when providing "init_ttl"', 2)
+        end
+
+    else
+        init_ttl = 0
+    end
+
+    local forcible = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_incr_helper(meta_zone, key, key_len,
+                                                num_value, errmsg,
+                                                init and 1 or 0, init or 0,
+                                                init_ttl * 1000, forcible)
+
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    if not init then
+        return tonumber(num_value[0])
     end
 
     return tonumber(num_value[0]), nil, forcible[0] == 1
 end
 
 
+-- declares the schema of the record values of the zone in this worker, a
+-- struct cdecl, and returns its ctype, the current one without "schema"
+local function shdict_record(zone, schema)
+    check_zone(zone)
+
+    if schema == nil then
+        local rt = zone[RECORD_INDEX]
+        return rt and rt.ctype
+    end
+
+    if type(schema) ~= "string" then
+        error("bad \"schema\" argument", 2)
+    end
+
+    schema = schema:gsub("%s+", " ")
+
+    local rt = record_types[schema]
+    if not rt then
+        rt = new_record_type(schema)
+        record_types[schema] = rt
+    end
+
+    zone[RECORD_INDEX] = rt
+
+    return rt.ctype
+end
+
+
+local function set_field_op(fop, rt, name, value, op)
+    local f = rt.fields[name]
+    if not f then
+        error("bad field \"" .. tostring(name) .. "\"", 3)
+    end
+
+    fop.offset = f.offset
+    fop.kind = f.kind
+    fop.op = op
+
+    local typ = type(value)
+
+    if typ == "boolean" then
+        value = value and 1 or 0
+
+    elseif typ ~= "number" and typ ~= "cdata" then
+        value = tonumber(value)
+        if not value then
+            error("bad value of field \"" .. name .. "\"", 3)
+        end
+    end
+
+    if f.kind >= 9 then -- float or double
+        fop.num = value
+
+    else
+        fop.inum = value
+    end
+end
+
+
+-- the new value of a field, as LuaJIT reads the field of a cdata
+local function get_field_value(fop)
+    local kind = fop.kind
+
+    if kind >= 9 then
+        return fop.num
+    end
+
+    if kind == 7 then
+        return fop.inum
+    end
+
+    if kind == 8 then
+        return ffi_cast(uint64_type, fop.inum)
+    end
+
+    return tonumber(fop.inum)
+end
+
+
+local function update_fields(meta_zone, key, key_len, rt, n)
+    local rc = C.ngx_lua_ffi_shdict_update_fields(meta_zone, key, key_len,
+                                                  rt.id, rt.size, field_ops,
+                                                  n, errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    return true
+end
+
+
+local function shdict_update_fields(zone, key, fields)
+    local meta_zone = check_zone(zone)
+
+    if type(fields) ~= "table" then
+        error("bad \"fields\" argument", 2)
+    end
+
+    local rt = zone[RECORD_INDEX]
+    if not rt then
+        return nil, "no record schema"
+    end
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local n = 0
+
+    for _ in pairs(fields) do
+        n = n + 1
+    end
+
+    if n == 0 then
+        return true
+    end
+
+    if n > field_ops_size then
+        field_ops_size = n
+        field_ops = ffi_new("ngx_lua_shdict_field_op_t[?]", n)
+    end
+
+    local i = 0
+
+    for name, value in pairs(fields) do
+        set_field_op(field_ops[i], rt, name, value, 0)
+        i = i + 1
+    end
+
+    return update_fields(meta_zone, key, key_len, rt, n)
+end
+
+
+local function shdict_incr_field(zone, key, field, delta)
+    local meta_zone = check_zone(zone)
+
+    local typ = type(delta)
+    if typ ~= "number" and typ ~= "cdata" then
+        error("bad \"delta\" argument", 2)
+    end
+
+    local rt = zone[RECORD_INDEX]
+    if not rt then
+        return nil, "no record schema"
+    end
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    set_field_op(field_ops[0], rt, field, delta, 1)
+
+    local ok, err = update_fields(meta_zone, key, key_len, rt, 1)
+    if not ok then
+        return nil, err
+    end
+
+    return get_field_value(field_ops[0])
+end
+
+
+local bitops = {
+    ["and"] = 0,
+    ["or"] = 1,
+    ["xor"] = 2,
+    ["not"] = 3,
+}
+
+-- the size of a Bloom filter created by dict:bf_add()
+local bf_capacity   = 1024
+local bf_error_rate = 0.01
+
+
+local function check_offset(offset)
+    offset = tonumber(offset)
+
+    if not offset or offset < 0 or offset % 1 ~= 0 then
+        error("bad \"offset\" argument", 3)
+    end
+
+    return offset
+end
+
+
+-- sets multi_keys to the strings of the arguments, returned in a table
+-- keeping them alive during the call, or nil when one of them is nil
+local function set_multi_keys(n, ...)
+    if n > multi_keys_size then
+        multi_keys_size = n
+        multi_keys = ffi_new("ngx_str_t[?]", n)
+    end
+
+    local strs = {}
+
+    for i = 1, n do
+        local str = select(i, ...)
+        if str == nil then
+            return nil
+        end
+
+        str = tostring(str)
+        strs[i] = str
+
+        multi_keys[i - 1].data = str
+        multi_keys[i - 1].len = #str
+    end
+
+    return strs
+end
+
+
+local function shdict_setbit(zone, key, offset, value)
+    local meta_zone = check_zone(zone)
+
+    offset = check_offset(offset)
+
+    if value ~= 0 and value ~= 1 then
+        error("bad \"value\" argument", 2)
+    end
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local old = int_tmp[1]
+    local forcible = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_setbit(meta_zone, key, key_len, offset,
+                                           value, old, errmsg, forcible)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0]), forcible[0] == 1
+    end
+
+    return old[0], nil, forcible[0] == 1
+end
+
+
+local function shdict_getbit(zone, key, offset)
+    local meta_zone = check_zone(zone)
+
+    offset = check_offset(offset)
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local bit = int_tmp[1]
+
+    local rc = C.ngx_lua_ffi_shdict_getbit(meta_zone, key, key_len, offset,
+                                           bit, errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    return bit[0]
+end
+
+
+local function shdict_bitcount(zone, key, start, stop)
+    local meta_zone = check_zone(zone)
+
+    start = tonumber(start or 0)
+    stop = tonumber(stop or -1)
+
+    if not start or not stop then
+        error("bad range arguments", 2)
+    end
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local rc = C.ngx_lua_ffi_shdict_bitcount(meta_zone, key, key_len, start,
+                                             stop, size_tmp, errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    return tonumber(size_tmp[0])
+end
+
+
+local function shdict_bitop(zone, op, dst, ...)
+    local meta_zone = check_zone(zone)
+
+    local bitop = bitops[op]
+    if not bitop then
+        error("bad \"op\" argument", 2)
+    end
+
+    local n = select("#", ...)
+    if n == 0 or (bitop == 3 and n ~= 1) then
+        error("bad number of keys", 2)
+    end
+
+    local dst, dst_len = check_key(dst)
+    if dst == nil then
+        return dst, dst_len
+    end
+
+    local strs = set_multi_keys(n, ...)
+    if not strs then
+        return nil, "nil key"
+    end
+
+    local forcible = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_bitop(meta_zone, bitop, dst, dst_len,
+                                          multi_keys, n, size_tmp, errmsg,
+                                          forcible)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0]), forcible[0] == 1
+    end
+
+    return tonumber(size_tmp[0]), nil, forcible[0] == 1
+end
+
+
+-- the number of bits and of hashes of a Bloom filter holding "capacity"
+-- items with a false positive rate of "error_rate"
+local function bf_size(capacity, error_rate)
+    local bits = math_ceil(-capacity * math_log(error_rate)
+                           / (math_log(2) * math_log(2)))
+    local hashes = math_floor(bits / capacity * math_log(2) + 0.5)
+
+    if hashes < 1 then
+        hashes = 1
+    end
+
+    return bits, hashes
+end
+
+
+local bf_default_bits, bf_default_hashes = bf_size(bf_capacity,
+                                                   bf_error_rate)
+
+
+local function bf_add(zone, key, bits, hashes, reserve, n, ...)
+    local meta_zone = check_zone(zone)
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local strs = set_multi_keys(n, ...)
+    if not strs then
+        error("bad \"item\" argument", 3)
+    end
+
+    local added = int_tmp[1]
+    local forcible = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_bf_add(meta_zone, key, key_len, bits,
+                                           hashes, reserve, multi_keys, n,
+                                           added, errmsg, forcible)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0]), forcible[0] == 1
+    end
+
+    return added[0], nil, forcible[0] == 1
+end
+
+
+local function shdict_bf_reserve(zone, key, capacity, error_rate)
+    capacity = tonumber(capacity)
+    if not capacity or capacity < 1 then
+        error("bad \"capacity\" argument", 2)
+    end
+
+    error_rate = tonumber(error_rate or bf_error_rate)
+    if not error_rate or error_rate <= 0 or error_rate >= 1 then
+        error("bad \"error_rate\" argument", 2)
+    end
+
+    local bits, hashes = bf_size(capacity, error_rate)
+
+    if bits > 4294967295 then
+        error("bad \"capacity\" argument", 2)
+    end
+
+    local ok, err, forcible = bf_add(zone, key, bits, hashes, 1, 0)
+    if not ok then
+        return nil, err, forcible
+    end
+
+    return true, nil, forcible
+end
+
+
+local function shdict_bf_add(zone, key, ...)
+    local n = select("#", ...)
+    if n == 0 then
+        error("bad \"item\" argument", 2)
+    end
+
+    return bf_add(zone, key, bf_default_bits, bf_default_hashes, 0, n, ...)
+end
+
+
+local function shdict_bf_exists(zone, key, item)
+    local meta_zone = check_zone(zone)
+
+    if item == nil then
+        error("bad \"item\" argument", 2)
+    end
+
+    item = tostring(item)
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local exists = int_tmp[1]
+
+    local rc = C.ngx_lua_ffi_shdict_bf_exists(meta_zone, key, key_len, item,
+                                              #item, exists, errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    return exists[0] == 1
+end
+
+
+local function shdict_pfadd(zone, key, ...)
+    local meta_zone = check_zone(zone)
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        return key, key_len
+    end
+
+    local n = select("#", ...)
+
+    local strs = set_multi_keys(n, ...)
+    if not strs then
+        error("bad \"item\" argument", 2)
+    end
+
+    local changed = int_tmp[1]
+    local forcible = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_pfadd(meta_zone, key, key_len,
+                                          multi_keys, n, changed, errmsg,
+                                          forcible)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0]), forcible[0] == 1
+    end
+
+    return changed[0] == 1, nil, forcible[0] == 1
+end
+
+
+-- the functions sigma and tau of the estimator of Otmar Ertl, "New
+-- cardinality estimation algorithms for HyperLogLog sketches", as in Redis
+
+local function hll_sigma(x)
+    if x == 1 then
+        return math_huge
+    end
+
+    local y, z, prev = 1, x
+
+    repeat
+        x = x * x
+        prev = z
+        z = z + x * y
+        y = y + y
+    until z == prev
+
+    return z
+end
+
+
+local function hll_tau(x)
+    if x == 0 or x == 1 then
+        return 0
+    end
+
+    local y, z, prev = 1, 1 - x
+
+    repeat
+        x = math_sqrt(x)
+        prev = z
+        y = y * 0.5
+        z = z - (1 - x) * (1 - x) * y
+    until z == prev
+
+    return z / 3
+end
+
+
+local function shdict_pfcount(zone, ...)
+    local meta_zone = check_zone(zone)
+
+    local n = select("#", ...)
+    if n == 0 then
+        error("bad number of keys", 2)
+    end
+
+    local strs = set_multi_keys(n, ...)
+    if not strs then
+        return nil, "nil key"
+    end
+
+    local rc = C.ngx_lua_ffi_shdict_pfcount(meta_zone, multi_keys, n,
+                                            hll_hist, errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    local z = hll_m * hll_tau((hll_m - hll_hist[hll_q + 1]) / hll_m)
+
+    for k = hll_q, 1, -1 do
+        z = (z + hll_hist[k]) * 0.5
+    end
+
+    z = z + hll_m * hll_sigma(hll_hist[0] / hll_m)
+
+    return math_floor(0.5 / math_log(2) * hll_m * hll_m / z + 0.5)
+end
+
+
+local function shdict_pfmerge(zone, dst, ...)
+    local meta_zone = check_zone(zone)
+
+    local dst, dst_len = check_key(dst)
+    if dst == nil then
+        return dst, dst_len
+    end
+
+    local n = select("#", ...)
+
+    local strs = set_multi_keys(n, ...)
+    if not strs then
+        return nil, "nil key"
+    end
+
+    local forcible = int_tmp[0]
+
+    local rc = C.ngx_lua_ffi_shdict_pfmerge(meta_zone, dst, dst_len,
+                                            multi_keys, n, errmsg, forcible)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0]), forcible[0] == 1
+    end
+
+    return true, nil, forcible[0] == 1
+end
+
+
+-- the operations of ngx_lua_ffi_shdict_exec(), as in ngx_lua_shdict_common.h
+local TX_GET   = 0
+local TX_STORE = 1
+local TX_INCR  = 2
+local TX_PUSH  = 3
+local TX_GUARD = 4
+
+local tx_op_type = ffi.typeof("ngx_lua_shdict_tx_op_t[?]")
+local tx_op_size = ffi.sizeof("ngx_lua_shdict_tx_op_t")
+
+
+-- a transaction of dict:multi(): its operations are queued in an array of
+-- ngx_lua_shdict_tx_op_t, the strings they point to being kept alive in
+-- "strs", and all run by exec() under a single lock of the zone; the
+-- first bad argument is kept in "err" and returned by exec(), so that the
+-- calls can be chained
+local tx = {}
+tx.__index = tx
+
+
+-- appends an operation on "key", returning nil when the key is bad
+local function tx_add(self, op, key)
+    if self.err then
+        return nil
+    end
+
+    local key, key_len = check_key(key)
+    if key == nil then
+        self.err = key_len
+        return nil
+    end
+
+    local n = self.n
+
+    if n == self.size then
+        local ops = ffi_new(tx_op_type, n * 2)
+        ffi_copy(ops, self.ops, n * tx_op_size)
+
+        self.ops = ops
+        self.size = n * 2
+    end
+
+    self.n = n + 1
+
+    local strs = self.strs
+    strs[#strs + 1] = key
+
+    local o = self.ops[n]
+    o.op = op
+    o.key.data = key
+    o.key.len = key_len
+
+    return o
+end
+
+
+-- sets the value of the operation "o" as shdict_store() does
+local function tx_set_value(self, o, value)
+    local v = o.value
+    local valtyp = type(value)
+
+    if valtyp == "string" then
+        v.value_type = 4  -- LUA_TSTRING
+        v.str_value_buf = value
+        v.str_value_len = #value
+
+    elseif valtyp == "number" then
+        v.value_type = 3  -- LUA_TNUMBER
+        v.num_value = value
+
+    elseif value == nil then
+        v.value_type = 0  -- LUA_TNIL
+
+    elseif valtyp == "boolean" then
+        v.value_type = 1  -- LUA_TBOOLEAN
+        v.num_value = value and 1 or 0
+
+    elseif valtyp == "table" then
+        local buf, len = msgpack_encode(value)
+        if not buf then
+            self.err = len
+            return
+        end
+
+        -- copied, the buffer of the encoder being reused
+        value = ffi_str(buf, len)
+
+        v.value_type = 10  -- a table
+        v.str_value_buf = value
+        v.str_value_len = len
+
+    elseif valtyp == "cdata" and self.zone[RECORD_INDEX]
+           and ffi_istype(self.zone[RECORD_INDEX].ctype, value)
+    then
+        local rt = self.zone[RECORD_INDEX]
+
+        ffi_copy(rt.buf + 4, value, rt.size)
+        value = ffi_str(rt.buf, 4 + rt.size)
+
+        v.value_type = 6  -- a record
+        v.str_value_buf = value
+        v.str_value_len = 4 + rt.size
+
+    else
+        self.err = "bad value type"
+        return
+    end
+
+    if v.str_value_buf ~= nil then
+        local strs = self.strs
+        strs[#strs + 1] = value
+    end
+end
+
+
+local function tx_store(self, op, key, value, exptime, flags)
+    exptime = tonumber(exptime)
+    if not exptime then
+        exptime = 0
+
+    elseif exptime < 0 then
+        error("bad \"exptime\" argument", 3)
+    end
+
+    local o = tx_add(self, TX_STORE, key)
+    if o then
+        o.flags = op
+        o.exptime = exptime * 1000
+        o.user_flags = tonumber(flags) or 0
+        tx_set_value(self, o, value)
+    end
+
+    return self
+end
+
+
+function tx:get(key)
+    tx_add(self, TX_GET, key)
+    return self
+end
+
+
+function tx:set(key, value, exptime, flags)
+    return tx_store(self, 0, key, value, exptime, flags)
+end
+
+
+function tx:safe_set(key, value, exptime, flags)
+    return tx_store(self, 0x0004, key, value, exptime, flags)
+end
+
+
+function tx:add(key, value, exptime, flags)
+    return tx_store(self, 0x0001, key, value, exptime, flags)
+end
+
+
+function tx:safe_add(key, value, exptime, flags)
+    return tx_store(self, 0x0005, key, value, exptime, flags)
+end
+
+
+function tx:replace(key, value, exptime, flags)
+    return tx_store(self, 0x0002, key, value, exptime, flags)
+end
+
+
+function tx:delete(key)
+    return tx_store(self, 0, key, nil)
+end
+
+
+function tx:incr(key, value, init, init_ttl)
+    value = tonumber(value)
+    if not value then
+        error("bad \"value\" argument", 2)
+    end
+
+    if init ~= nil then
+        init = tonumber(init)
+        if not init then
+            error("bad \"init\" argument", 2)
+        end
+    end
+
+    if init_ttl ~= nil then
+        init_ttl = tonumber(init_ttl)
+        if not init_ttl or init_ttl < 0 then
+            error("bad \"init_ttl\" argument", 2)
+        end
+
+        if not init then
+            error('must provide "init" when providing "init_ttl"', 2)
+        end
+    end
+
+    local o = tx_add(self, TX_INCR, key)
+    if o then
+        o.value.num_value = value
+        o.has_init = init and 1 or 0
+        o.init = init or 0
+        o.exptime = (init_ttl or 0) * 1000
+    end
+
+    return self
+end
+
+
+local function tx_push(self, flag, key, ...)
+    for i = 1, select("#", ...) do
+        local value = select(i, ...)
+
+        local o = tx_add(self, TX_PUSH, key)
+        if not o then
+            break
+        end
+
+        o.flags = flag
+
+        if not set_list_value(o.value, value) then
+            self.err = "bad value type"
+            break
+        end
+
+        if type(value) == "string" then
+            local strs = self.strs
+            strs[#strs + 1] = value
+        end
+    end
+
+    return self
+end
+
+
+function tx:lpush(key, ...)
+    return tx_push(self, 1, key, ...)
+end
+
+
+function tx:rpush(key, ...)
+    return tx_push(self, 0, key, ...)
+end
+
+
+-- aborts the transaction unless "key" holds "value", nil for no item
+function tx:guard(key, value)
+    local typ = type(value)
+
+    if value ~= nil and typ ~= "string" and typ ~= "number"
+       and typ ~= "boolean"
+    then
+        error("bad \"value\" argument", 2)
+    end
+
+    local o = tx_add(self, TX_GUARD, key)
+    if o then
+        tx_set_value(self, o, value)
+    end
+
+    return self
+end
+
+
+function tx:exec()
+    if self.err then
+        return nil, self.err
+    end
+
+    -- the results overwrite the values of the operations
+    self.err = "transaction already executed"
+
+    local n = self.n
+    local ops = self.ops
+
+    local res = { n = n }
+
+    if n == 0 then
+        return res
+    end
+
+    str_value_buf[0] = str_buf
+    str_value_len[0] = str_buf_size
+
+    local rc = C.ngx_lua_ffi_shdict_exec(self.zone[ZONE_INDEX], ops, n,
+                                         str_value_buf, str_value_len,
+                                         errmsg)
+    if rc ~= FFI_OK then
+        return nil, ffi_str(errmsg[0])
+    end
+
+    local errors
+
+    for i = 0, n - 1 do
+        local o = ops[i]
+        local op = o.op
+        local v = o.value
+        local val, err
+
+        if o.rc ~= FFI_OK then
+            err = o.errmsg ~= nil and ffi_str(o.errmsg) or "failed"
+
+        elseif op == TX_GET then
+            local typ = v.value_type
+
+            if typ == 1 then -- LUA_TBOOLEAN
+                val = (v.num_value ~= 0)
+
+            elseif typ == 6 then -- a record
+                val, err = get_record(self.zone, v.str_value_buf,
+                                      tonumber(v.str_value_len))
+
+            elseif typ == 10 then -- a table
+                val, err = msgpack_decode(v.str_value_buf,
+                                          tonumber(v.str_value_len))
+
+            elseif typ ~= 0 then
+                val = get_list_value(v)
+            end
+
+        elseif op == TX_INCR or op == TX_PUSH then
+            val = tonumber(v.num_value)
+
+        else
+            val = true
+        end
+
+        if err then
+            errors = errors or {}
+            errors[i + 1] = err
+            val = false
+        end
+
+        res[i + 1] = val
+
+        if o.forcible == 1 then
+            res.forcible = true
+        end
+    end
+
+    res.errors = errors
+
+    local buf = str_value_buf[0]
+    if buf ~= str_buf then
+        C.free(buf)
+    end
+
+    return res
+end
+
+
+local function shdict_multi(zone)
+    check_zone(zone)
+
+    return setmetatable({
+        zone = zone,
+        ops = ffi_new(tx_op_type, 8),
+        size = 8,
+        n = 0,
+        strs = {},
+    }, tx)
+end
+
+
 local function shdict_get_keys(zone, attempts)
     local meta_zone = check_zone(zone)
 
@@ -682,6 +2997,7 @@ end
 func.get_keys           = shdict_get_keys
 func.get                = shdict_get
 func.get_stale          = shdict_get_stale
+func.get_multi          = shdict_get_multi
 func.set                = shdict_set
 func.safe_set           = shdict_safe_set
 func.add                = shdict_add
@@ -692,7 +3008,17 @@ func.lpush              = shdict_lpush
 func.rpush              = shdict_rpush
 func.lpop               = shdict_lpop
 func.rpop               = shdict_rpop
+func.blpop              = shdict_blpop
+func.brpop              = shdict_brpop
+func.lock               = shdict_lock
+func.unlock             = shdict_release
+func.acquire            = shdict_acquire
+func.release            = shdict_release
 func.llen               = shdict_llen
+func.lrange             = shdict_lrange
+func.lindex             = shdict_lindex
+func.lset               = shdict_lset
+func.ltrim              = shdict_ltrim
 func.incr               = shdict_incr
 func.flush_expired      = shdict_flush_expired
 func.flush_all          = shdict_flush_all
@@ -700,6 +3026,24 @@ func.expire             = shdict_expire
 func.ttl                = shdict_ttl
 func.capacity           = shdict_capacity
 func.free_space         = shdict_free_space
+func.hot_keys           = shdict_hot_keys
+func.memory_report      = shdict_memory_report
+func.stats              = shdict_stats
+func.changes            = shdict_changes
+func.record             = shdict_record
+func.update_fields      = shdict_update_fields
+func.incr_field         = shdict_incr_field
+func.setbit             = shdict_setbit
+func.getbit             = shdict_getbit
+func.bitcount           = shdict_bitcount
+func.bitop              = shdict_bitop
+func.bf_reserve         = shdict_bf_reserve
+func.bf_add             = shdict_bf_add
+func.bf_exists          = shdict_bf_exists
+func.pfadd              = shdict_pfadd
+func.pfcount            = shdict_pfcount
+func.pfmerge            = shdict_pfmerge
+func.multi              = shdict_multi
 
 
 do
@@ -0,0 +1,481 @@
+-- The serializer of the table values of the zones: dict:set() stores a
+-- table as the MessagePack encoding of it, under a value type of its own,
+-- and dict:get() decodes it back into a new table, with no JSON round trip
+-- in Lua. The encoding is written straight into a buffer of the worker,
+-- grown as needed and reused by every call, and read straight from the
+-- buffer the value was fetched into.
+--
+-- A table is encoded as an array when its keys are the integers 1 to n,
+-- and as a map otherwise, the empty table being an empty map. The numbers
+-- which are integers of at most 53 bits are encoded as the smallest
+-- MessagePack integer holding them, the others as 64-bit floats. Strings,
+-- booleans and nested tables are supported, other values, cyclic tables
+-- and tables nested deeper than "max_depth" are not. The decoder reads
+-- every MessagePack type but the extensions, binary strings being
+-- returned as strings, and nil is decoded as nil in an array, keeping its
+-- length, but drops the entry of a map.
+
+local ffi = require "ffi"
+local bit = require "bit"
+
+local ffi_new      = ffi.new
+local ffi_str      = ffi.string
+local ffi_copy     = ffi.copy
+local bit_band     = bit.band
+local bit_rshift   = bit.rshift
+local math_floor   = math.floor
+local type         = type
+local pairs        = pairs
+local error        = error
+local pcall        = pcall
+local tostring     = tostring
+
+
+local max_depth = 100
+
+local buf_size = 4096
+local buf      = ffi_new("uint8_t[?]", buf_size)
+
+-- the bytes of the 64 and 32-bit floats, in the byte order of the host
+local num      = ffi_new("union { double d; float f; uint8_t b[8]; }")
+local le       = ffi.abi("le")
+
+
+local _M = {}
+
+
+-- makes room for "n" more bytes at "pos"
+local function reserve(pos, n)
+    if pos + n <= buf_size then
+        return
+    end
+
+    local size = buf_size * 2
+    while size < pos + n do
+        size = size * 2
+    end
+
+    local new = ffi_new("uint8_t[?]", size)
+    ffi_copy(new, buf, pos)
+
+    buf = new
+    buf_size = size
+end
+
+
+-- writes the "n" bytes of the unsigned integer "v" below 2^32, big endian
+local function put_uint(pos, v, n)
+    for i = n - 1, 0, -1 do
+        buf[pos + i] = bit_band(v, 0xff)
+        v = bit_rshift(v, 8)
+    end
+
+    return pos + n
+end
+
+
+local function put_head(pos, small, fix, code16, code32, n)
+    reserve(pos, 5)
+
+    if n < small then
+        buf[pos] = fix + n
+        return pos + 1
+    end
+
+    if n < 65536 then
+        buf[pos] = code16
+        return put_uint(pos + 1, n, 2)
+    end
+
+    buf[pos] = code32
+    return put_uint(pos + 1, n, 4)
+end
+
+
+local function put_number(pos, v)
+    reserve(pos, 9)
+
+    if v % 1 ~= 0 or v > 9007199254740991 or v < -9007199254740991 then
+        -- fractional, too large to be exact, infinite or NaN
+        buf[pos] = 0xcb
+        num.d = v
+
+        for i = 0, 7 do
+            buf[pos + 1 + i] = num.b[le and 7 - i or i]
+        end
+
+        return pos + 9
+    end
+
+    if v >= 0 then
+        if v < 128 then
+            buf[pos] = v
+            return pos + 1
+        end
+
+        if v < 256 then
+            buf[pos] = 0xcc
+            return put_uint(pos + 1, v, 1)
+        end
+
+        if v < 65536 then
+            buf[pos] = 0xcd
+            return put_uint(pos + 1, v, 2)
+        end
+
+        if v < 4294967296 then
+            buf[pos] = 0xce
+            return put_uint(pos + 1, v, 4)
+        end
+
+        buf[pos] = 0xcf
+
+    else
+        if v >= -32 then
+            buf[pos] = 0x100 + v
+            return pos + 1
+        end
+
+        if v >= -128 then
+            buf[pos] = 0xd0
+            return put_uint(pos + 1, 0x100 + v, 1)
+        end
+
+        if v >= -32768 then
+            buf[pos] = 0xd1
+            return put_uint(pos + 1, 0x10000 + v, 2)
+        end
+
+        if v >= -2147483648 then
+            buf[pos] = 0xd2
+            return put_uint(pos + 1, 4294967296 + v, 4)
+        end
+
+        buf[pos] = 0xd3
+    end
+
+    -- two's complement, the high half floored
+    local hi = math_floor(v / 4294967296)
+
+    pos = put_uint(pos + 1, hi % 4294967296, 4)
+    return put_uint(pos, v - hi * 4294967296, 4)
+end
+
+
+local encode
+
+
+local function put_value(pos, v, seen, depth)
+    local typ = type(v)
+
+    if typ == "string" then
+        local n = #v
+
+        if n < 32 then
+            reserve(pos, 1 + n)
+            buf[pos] = 0xa0 + n
+            pos = pos + 1
+
+        elseif n < 256 then
+            reserve(pos, 2 + n)
+            buf[pos] = 0xd9
+            buf[pos + 1] = n
+            pos = pos + 2
+
+        else
+            pos = put_head(pos, 0, 0, 0xda, 0xdb, n)
+            reserve(pos, n)
+        end
+
+        ffi_copy(buf + pos, v, n)
+
+        return pos + n
+    end
+
+    if typ == "number" then
+        return put_number(pos, v)
+    end
+
+    if typ == "boolean" then
+        reserve(pos, 1)
+        buf[pos] = v and 0xc3 or 0xc2
+        return pos + 1
+    end
+
+    if typ == "table" then
+        return encode(pos, v, seen, depth + 1)
+    end
+
+    error("cannot serialize a " .. typ, 0)
+end
+
+
+encode = function (pos, tbl, seen, depth)
+    if depth > max_depth then
+        error("table too deep", 0)
+    end
+
+    if seen[tbl] then
+        error("cannot serialize a cyclic table", 0)
+    end
+
+    seen[tbl] = true
+
+    local n = 0
+    local count = 0
+
+    for k in pairs(tbl) do
+        count = count + 1
+
+        if type(k) == "number" and k > n and k % 1 == 0 then
+            n = k
+        end
+    end
+
+    if n == count and n > 0 then
+        pos = put_head(pos, 16, 0x90, 0xdc, 0xdd, n)
+
+        for i = 1, n do
+            pos = put_value(pos, tbl[i], seen, depth)
+        end
+
+    else
+        pos = put_head(pos, 16, 0x80, 0xde, 0xdf, count)
+
+        for k, v in pairs(tbl) do
+            local typ = type(k)
+
+            if typ ~= "string" and typ ~= "number" and typ ~= "boolean" then
+                error("cannot serialize a key of type " .. typ, 0)
+            end
+
+            pos = put_value(pos, k, seen, depth)
+            pos = put_value(pos, v, seen, depth)
+        end
+    end
+
+    seen[tbl] = nil
+
+    return pos
+end
+
+
+-- returns a pointer to the MessagePack encoding of "tbl" and its length,
+-- valid until the next call, or nil and a message
+function _M.encode(tbl)
+    local ok, pos = pcall(encode, 0, tbl, {}, 1)
+    if not ok then
+        return nil, tostring(pos)
+    end
+
+    return buf, pos
+end
+
+
+-- the decoder, reading from "p", of "len" bytes
+
+local p, len
+
+
+local function get_uint(pos, n)
+    if pos + n > len then
+        error("truncated", 0)
+    end
+
+    local v = 0
+
+    for i = 0, n - 1 do
+        v = v * 256 + p[pos + i]
+    end
+
+    return v, pos + n
+end
+
+
+local function get_int(pos, n)
+    local v, lo
+
+    if n == 8 then
+        -- by halves, the 64-bit unsigned value being inexact as a double
+        v, pos = get_int(pos, 4)
+        lo, pos = get_uint(pos, 4)
+
+        return v * 4294967296 + lo, pos
+    end
+
+    v, pos = get_uint(pos, n)
+
+    local max = 2 ^ (8 * n)
+
+    if v >= max / 2 then
+        v = v - max
+    end
+
+    return v, pos
+end
+
+
+local function get_float(pos, n)
+    if pos + n > len then
+        error("truncated", 0)
+    end
+
+    for i = 0, n - 1 do
+        num.b[le and n - 1 - i or i] = p[pos + i]
+    end
+
+    return n == 8 and num.d or num.f, pos + n
+end
+
+
+local function get_str(pos, n)
+    if pos + n > len then
+        error("truncated", 0)
+    end
+
+    return ffi_str(p + pos, n), pos + n
+end
+
+
+local decode
+
+
+local function get_array(pos, n, depth)
+    local tbl = {}
+
+    for i = 1, n do
+        tbl[i], pos = decode(pos, depth)
+    end
+
+    return tbl, pos
+end
+
+
+local function get_map(pos, n, depth)
+    local tbl = {}
+    local k, v
+
+    for _ = 1, n do
+        k, pos = decode(pos, depth)
+        v, pos = decode(pos, depth)
+
+        if k == nil or k ~= k then
+            error("bad map key", 0)
+        end
+
+        tbl[k] = v
+    end
+
+    return tbl, pos
+end
+
+
+decode = function (pos, depth)
+    if pos >= len then
+        error("truncated", 0)
+    end
+
+    if depth > max_depth then
+        error("table too deep", 0)
+    end
+
+    local c = p[pos]
+    pos = pos + 1
+
+    if c < 0x80 then
+        return c, pos
+    end
+
+    if c >= 0xe0 then
+        return c - 0x100, pos
+    end
+
+    if c < 0x90 then
+        return get_map(pos, c - 0x80, depth + 1)
+    end
+
+    if c < 0xa0 then
+        return get_array(pos, c - 0x90, depth + 1)
+    end
+
+    if c < 0xc0 then
+        return get_str(pos, c - 0xa0)
+    end
+
+    if c == 0xc0 then
+        return nil, pos
+    end
+
+    if c == 0xc2 or c == 0xc3 then
+        return c == 0xc3, pos
+    end
+
+    local n
+
+    if c == 0xc4 or c == 0xd9 then
+        n, pos = get_uint(pos, 1)
+        return get_str(pos, n)
+    end
+
+    if c == 0xc5 or c == 0xda then
+        n, pos = get_uint(pos, 2)
+        return get_str(pos, n)
+    end
+
+    if c == 0xc6 or c == 0xdb then
+        n, pos = get_uint(pos, 4)
+        return get_str(pos, n)
+    end
+
+    if c == 0xca then
+        return get_float(pos, 4)
+    end
+
+    if c == 0xcb then
+        return get_float(pos, 8)
+    end
+
+    if c >= 0xcc and c <= 0xcf then
+        return get_uint(pos, 2 ^ (c - 0xcc))
+    end
+
+    if c >= 0xd0 and c <= 0xd3 then
+        return get_int(pos, 2 ^ (c - 0xd0))
+    end
+
+    if c == 0xdc or c == 0xdd then
+        n, pos = get_uint(pos, c == 0xdc and 2 or 4)
+        return get_array(pos, n, depth + 1)
+    end
+
+    if c == 0xde or c == 0xdf then
+        n, pos = get_uint(pos, c == 0xde and 2 or 4)
+        return get_map(pos, n, depth + 1)
+    end
+
+    error("unsupported type", 0)
+end
+
+
+-- decodes the table encoded in the "n" bytes of "ptr", or returns nil and
+-- a message
+function _M.decode(ptr, n)
+    p, len = ptr, n
+
+    local ok, tbl, pos = pcall(decode, 0, 1)
+
+    p = nil
+
+    if not ok then
+        return nil, "bad table value: " .. tostring(tbl)
+    end
+
+    if type(tbl) ~= "table" or pos ~= n then
+        return nil, "bad table value"
+    end
+
+    return tbl
+end
+
+
+return _M
@@ -0,0 +1,550 @@
+-- Asynchronous replication of a zone: the leader streams the keys changed
+-- in a zone declared with the "changes" parameter of lua_shared_mem, as
+-- read from its change log with dict:changes(), to the followers
+-- connected to a stream server of its own, which store them into a zone
+-- of theirs. The current value of a changed key is sent rather than the
+-- change itself, so that a key changed many times between two batches is
+-- sent once, and a follower which missed changes, or connects for the
+-- first time, is sent the whole zone, a batch of keys at a time. So is a
+-- follower sent a change whose key the change log kept the first bytes
+-- of only.
+--
+-- The frames of the protocol are a line of space separated fields,
+-- followed by the bytes of the key and of the values it announces:
+--
+--   SYNC <epoch> <seq>                 follower, once connected
+--   S <klen> <type> <vlen> <flags> <ttl>   key value
+--   L <klen> <n> <ttl>                 key, then n times "<type> <vlen>"
+--                                      and the value, a whole list
+--   D <klen>                           key, removed
+--   F                                  the zone was flushed
+--   C <epoch> <seq>                    the end of a batch, or of the
+--                                      batches of the whole zone, sent
+--                                      every "keepalive" seconds at least
+--
+-- with the types "s", "n" and "b" for strings, numbers and booleans, "r"
+-- for the bytes of records, which both sides must have declared the same
+-- schema for with dict:record(), "t" for the MessagePack encoding of
+-- tables, and the ttl in seconds, 0 for none.
+-- The bitmaps, the Bloom filters and the HyperLogLogs, which dict:get()
+-- does not read, are not replicated, and removed from the followers.
+
+local ffi     = require "ffi"
+local shdict  = require "resty.shdict"
+local msgpack = require "resty.shdict.msgpack"
+
+local ngx          = ngx
+local ngx_log      = ngx.log
+local ngx_sleep    = ngx.sleep
+local ngx_now      = ngx.now
+local ngx_ERR      = ngx.ERR
+local ngx_WARN     = ngx.WARN
+local ngx_INFO     = ngx.INFO
+local tonumber     = tonumber
+local tostring     = tostring
+local type         = type
+local error        = error
+local unpack       = unpack
+local str_format   = string.format
+local str_match    = string.match
+local str_sub      = string.sub
+
+
+-- the values of a list pushed at once by a follower
+local push_batch = 64
+
+-- the errors of dict:get() for the values not replicated
+local unreplicated = {
+    ["no record schema"] = true,
+    ["record schema mismatch"] = true,
+    ["value is a bitmap"] = true,
+    ["value is a bloom filter"] = true,
+    ["value is a hyperloglog"] = true,
+}
+
+-- the errors above logged already by this worker
+local warned = {}
+
+
+local _M = {}
+
+
+local function find_zone(name)
+    local dict = shdict[name]
+    if not dict then
+        error("no lua_shared_mem zone \"" .. tostring(name) .. "\"")
+    end
+
+    return dict
+end
+
+
+local function encode_value(v)
+    local typ = type(v)
+
+    if typ == "string" then
+        return "s", v
+    end
+
+    if typ == "number" then
+        return "n", str_format("%.17g", v)
+    end
+
+    if typ == "cdata" then
+        return "r", ffi.string(v, ffi.sizeof(v))
+    end
+
+    if typ == "table" then
+        return "t", ffi.string(msgpack.encode(v))
+    end
+
+    return "b", v and "1" or "0"
+end
+
+
+local function decode_value(dict, typ, data)
+    if typ == "n" then
+        return tonumber(data)
+    end
+
+    if typ == "b" then
+        return data == "1"
+    end
+
+    if typ == "r" then
+        local ctype = dict:record()
+
+        if not ctype then
+            return nil, "no record schema"
+        end
+
+        if ffi.sizeof(ctype) ~= #data then
+            return nil, "record schema mismatch"
+        end
+
+        local v = ffi.new(ctype)
+        ffi.copy(v, data, #data)
+
+        return v
+    end
+
+    if typ == "t" then
+        return msgpack.decode(ffi.cast("const uint8_t *", data), #data)
+    end
+
+    return data
+end
+
+
+-- appends the frames restoring the current value of "key" to "frames"
+local function encode_key(dict, key, frames)
+    local n = #frames
+
+    local value, flags = dict:get(key)
+    local ttl = dict:ttl(key)
+
+    -- not to be rounded to 0, which is no expiration at all
+    if ttl and ttl > 0 and ttl < 0.001 then
+        ttl = 0.001
+    end
+
+    if value == nil and flags == "value is a list" then
+        local values = dict:lrange(key, 0, -1)
+
+        if values and #values > 0 and ttl and ttl >= 0 then
+            frames[n + 1] = str_format("L %d %d %.3f\n", #key, #values, ttl)
+            frames[n + 2] = key
+            n = n + 2
+
+            for i = 1, #values do
+                local typ, data = encode_value(values[i])
+
+                frames[n + 1] = str_format("%s %d\n", typ, #data)
+                frames[n + 2] = data
+                n = n + 2
+            end
+
+            return
+        end
+
+    elseif value == nil and unreplicated[flags] then
+        if not warned[flags] then
+            warned[flags] = true
+            ngx_log(ngx_WARN, "not replicating key \"", key,
+                    "\" nor the further ones failing with: ", flags)
+        end
+
+    elseif value ~= nil and ttl and ttl >= 0 then
+        local typ, data = encode_value(value)
+
+        frames[n + 1] = str_format("S %d %s %d %d %.3f\n", #key, typ, #data,
+                                   flags or 0, ttl)
+        frames[n + 2] = key
+        frames[n + 3] = data
+        return
+    end
+
+    -- removed, expired meanwhile, an empty list being filled, or not
+    -- replicated
+
+    frames[n + 1] = str_format("D %d\n", #key)
+    frames[n + 2] = key
+end
+
+
+-- appends the frames of at most "max" keys of the snapshot "snap" of the
+-- zone to "frames", and the end of the batch after the last ones
+local function snapshot(dict, epoch, snap, max, frames)
+    local keys = snap.keys
+    local last = snap.pos + max - 1
+
+    if last > #keys then
+        last = #keys
+    end
+
+    for i = snap.pos, last do
+        encode_key(dict, keys[i], frames)
+    end
+
+    snap.pos = last + 1
+
+    if last < #keys then
+        return snap
+    end
+
+    frames[#frames + 1] = str_format("C %d %d\n", epoch, snap.seq)
+
+    return snap.seq
+end
+
+
+local function start_snapshot(dict, epoch, max, frames)
+    -- the changes made while the keys are sent go in the next batches
+    local _, seq = dict:changes()
+
+    frames[#frames + 1] = "F\n"
+
+    local snap = { keys = dict:get_keys(0), pos = 1, seq = seq }
+
+    return snapshot(dict, epoch, snap, max, frames)
+end
+
+
+-- returns the frames of the changes of "dict" following "since", at most
+-- "max" of them, or of at most "max" keys of the whole zone when "since"
+-- is nil or too old, or is the snapshot of the zone being sent, what to
+-- pass as "since" next, a sequence number or the snapshot, and the number
+-- of changes sent, nil for the keys of the whole zone
+function _M.batch(dict, epoch, since, max)
+    local frames = {}
+
+    if since == nil then
+        return frames, start_snapshot(dict, epoch, max, frames)
+    end
+
+    if type(since) == "table" then
+        return frames, snapshot(dict, epoch, since, max, frames)
+    end
+
+    local list, seq = dict:changes(since, max)
+
+    if not list then
+        if seq ~= "overflow" then
+            return nil, seq
+        end
+
+        return frames, start_snapshot(dict, epoch, max, frames)
+    end
+
+    local seen = {}
+
+    for i = 1, #list do
+        local c = list[i]
+
+        if c.truncated then
+            -- the key is known by its first bytes only, so the follower
+            -- is sent the whole zone instead of the keys changed
+            return frames, start_snapshot(dict, epoch, max, frames)
+        end
+    end
+
+    for i = 1, #list do
+        local c = list[i]
+
+        if c.op == "flush" then
+            frames[#frames + 1] = "F\n"
+            seen = {}
+
+        elseif not seen[c.key] then
+            seen[c.key] = true
+            encode_key(dict, c.key, frames)
+        end
+    end
+
+    frames[#frames + 1] = str_format("C %d %d\n", epoch, seq)
+
+    return frames, seq, #list
+end
+
+
+local function receive(sock, len)
+    if len == 0 then
+        return ""
+    end
+
+    return sock:receive(len)
+end
+
+
+local function apply_list(dict, sock, key, n, ttl)
+    local values = {}
+
+    for i = 1, n do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        local typ, len = str_match(line, "^([snb]) (%d+)$")
+        if not typ then
+            return nil, "bad frame"
+        end
+
+        local data, err = receive(sock, tonumber(len))
+        if not data then
+            return nil, err
+        end
+
+        values[i] = decode_value(dict, typ, data)
+    end
+
+    dict:delete(key)
+
+    for i = 1, n, push_batch do
+        local last = i + push_batch - 1
+        if last > n then
+            last = n
+        end
+
+        local ok, err = dict:rpush(key, unpack(values, i, last))
+        if not ok then
+            ngx_log(ngx_WARN, "failed to replicate list \"", key, "\": ",
+                    err)
+            return true
+        end
+    end
+
+    if ttl > 0 then
+        dict:expire(key, ttl)
+    end
+
+    return true
+end
+
+
+-- applies the frames read from "sock" to "dict" up to the end of a batch,
+-- and returns the epoch and the sequence number of the leader there
+function _M.apply(dict, sock)
+    while true do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        local op = str_sub(line, 1, 1)
+
+        if op == "C" then
+            local epoch, seq = str_match(line, "^C (%d+) (%d+)$")
+            if not epoch then
+                return nil, "bad frame"
+            end
+
+            return tonumber(epoch), tonumber(seq)
+        end
+
+        if op == "F" then
+            dict:flush_all()
+
+        else
+            local klen, rest = str_match(line, "^[SLD] (%d+)(.*)$")
+            if not klen then
+                return nil, "bad frame"
+            end
+
+            local key, err = receive(sock, tonumber(klen))
+            if not key then
+                return nil, err
+            end
+
+            if op == "D" then
+                dict:delete(key)
+
+            elseif op == "L" then
+                local n, ttl = str_match(rest, "^ (%d+) ([%d.]+)$")
+                if not n then
+                    return nil, "bad frame"
+                end
+
+                local ok, err = apply_list(dict, sock, key, tonumber(n),
+                                           tonumber(ttl))
+                if not ok then
+                    return nil, err
+                end
+
+            else
+                local typ, len, flags, ttl =
+                    str_match(rest, "^ ([snbrt]) (%d+) (%d+) ([%d.]+)$")
+                if not typ then
+                    return nil, "bad frame"
+                end
+
+                local data, err = receive(sock, tonumber(len))
+                if not data then
+                    return nil, err
+                end
+
+                local ok
+                local value, err = decode_value(dict, typ, data)
+
+                if value ~= nil then
+                    ok, err = dict:set(key, value, tonumber(ttl),
+                                       tonumber(flags))
+                end
+
+                if not ok then
+                    ngx_log(ngx_WARN, "failed to replicate key \"", key,
+                            "\": ", err)
+                end
+            end
+        end
+    end
+end
+
+
+-- the content handler of the stream server of the leader
+function _M.serve(name, opts)
+    local dict = find_zone(name)
+
+    opts = opts or {}
+
+    local max = opts.batch or 128
+    local interval = opts.interval or 0.1
+    local keepalive = opts.keepalive or 1
+
+    local _, _, epoch = dict:changes()
+    if not epoch then
+        error("zone \"" .. name .. "\" declared without \"changes\"")
+    end
+
+    local sock, err = ngx.req.socket(true)
+    if not sock then
+        ngx_log(ngx_ERR, "failed to get the replication socket: ", err)
+        return
+    end
+
+    sock:settimeout((opts.timeout or 5) * 1000)
+
+    local line, err = sock:receive()
+    if not line then
+        ngx_log(ngx_INFO, "failed to read the replication handshake: ", err)
+        return
+    end
+
+    local their_epoch, since = str_match(line, "^SYNC (%d+) (%d+)$")
+    if not their_epoch then
+        ngx_log(ngx_ERR, "bad replication handshake")
+        return
+    end
+
+    -- a follower of a previous run of the zone is sent the whole zone
+
+    since = tonumber(their_epoch) == epoch and tonumber(since) or nil
+
+    local sent = 0
+
+    while not ngx.worker.exiting() do
+        local frames, seq, n = _M.batch(dict, epoch, since, max)
+        if not frames then
+            ngx_log(ngx_ERR, "failed to read the changes of \"", name,
+                    "\": ", seq)
+            return
+        end
+
+        if n ~= 0 or ngx_now() - sent >= keepalive then
+            local ok, err = sock:send(frames)
+            if not ok then
+                ngx_log(ngx_INFO, "replication follower gone: ", err)
+                return
+            end
+
+            sent = ngx_now()
+        end
+
+        since = seq
+
+        -- wait for more changes to send them in larger batches
+
+        if n and n < max then
+            ngx_sleep(interval)
+        end
+    end
+end
+
+
+local function follow(premature, dict, name, opts, state)
+    if premature then
+        return
+    end
+
+    local timeout = (opts.timeout or 5) * 1000
+    local retry = opts.retry or 1
+
+    while not ngx.worker.exiting() do
+        local sock = ngx.socket.tcp()
+
+        sock:settimeout(timeout)
+
+        local ok, err = sock:connect(opts.host, opts.port)
+
+        if ok then
+            ok, err = sock:send(str_format("SYNC %d %d\n", state.epoch,
+                                           state.since))
+        end
+
+        while ok do
+            local epoch, seq = _M.apply(dict, sock)
+
+            if not epoch then
+                ok, err = nil, seq
+                break
+            end
+
+            state.epoch = epoch
+            state.since = seq
+        end
+
+        sock:close()
+
+        ngx_log(ngx_WARN, "replication of \"", name, "\" from ", opts.host,
+                ":", opts.port, " interrupted: ", err)
+
+        ngx_sleep(retry)
+    end
+end
+
+
+-- starts following the leader at opts.host:opts.port into the zone "name"
+-- in a timer of the calling worker
+function _M.follow(name, opts)
+    local dict = find_zone(name)
+
+    if type(opts) ~= "table" or not opts.host or not opts.port then
+        error("bad \"opts\" argument")
+    end
+
+    return ngx.timer.at(0, follow, dict, name, opts,
+                        { epoch = 0, since = 0 })
+end
+
+
+return _M
@@ -0,0 +1,349 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+#include <ngx_event.h>
+#include <pthread.h>
+
+#include "shdict.h"
+
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+#error libshdict needs the atomic operations of the nginx core
+#endif
+
+
+#define SHDICT_MIN_SIZE  8192
+
+
+static ngx_int_t shdict_process_init(char **errmsg);
+static void shdict_atfork_child(void);
+static shdict_t *shdict_add(void *addr, size_t size, const char *name,
+    ngx_uint_t exists, char **errmsg);
+
+
+/*
+ * the globals the nginx core objects linked in refer to, which nginx.c,
+ * ngx_cycle.c and the process code define in nginx
+ */
+
+volatile ngx_cycle_t            *ngx_cycle;
+ngx_pid_t                        ngx_pid;
+ngx_int_t                        ngx_ncpu;
+ngx_uint_t                       ngx_process;
+ngx_uint_t                       ngx_worker;
+ngx_module_t                     ngx_core_module;
+ngx_event_actions_t              ngx_event_actions;
+
+
+static ngx_cycle_t               shdict_cycle;
+static ngx_log_t                 shdict_log;
+static ngx_open_file_t           shdict_log_file;
+static ngx_lua_shdict_conf_t    *shdict_conf;
+
+static ngx_str_t                 shdict_err_levels[] = {
+    ngx_null_string,
+    ngx_string("emerg"),
+    ngx_string("alert"),
+    ngx_string("crit"),
+    ngx_string("error"),
+    ngx_string("warn"),
+    ngx_string("notice"),
+    ngx_string("info"),
+    ngx_string("debug")
+};
+
+
+shdict_t *
+shdict_init(void *addr, size_t size, const char *name, char **errmsg)
+{
+    ngx_slab_pool_t  *sp;
+
+    if (shdict_process_init(errmsg) != NGX_OK) {
+        return NULL;
+    }
+
+    if (size < SHDICT_MIN_SIZE) {
+        *errmsg = "zone too small";
+        return NULL;
+    }
+
+    /* what ngx_init_zone_pool() does for a new zone */
+
+    sp = (ngx_slab_pool_t *) addr;
+
+    sp->end = (u_char *) addr + size;
+    sp->min_shift = 3;
+    sp->addr = addr;
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        *errmsg = "failed to create the zone mutex";
+        return NULL;
+    }
+
+    ngx_slab_init(sp);
+
+    return shdict_add(addr, size, name, 0, errmsg);
+}
+
+
+shdict_t *
+shdict_attach(void *addr, size_t size, const char *name, char **errmsg)
+{
+    ngx_slab_pool_t  *sp;
+
+    if (shdict_process_init(errmsg) != NGX_OK) {
+        return NULL;
+    }
+
+    sp = (ngx_slab_pool_t *) addr;
+
+    /* the zone holds absolute pointers, the same as in nginx */
+
+    if (sp->addr != addr || sp->end != (u_char *) addr + size) {
+        *errmsg = "zone not initialized or mapped at another address";
+        return NULL;
+    }
+
+    return shdict_add(addr, size, name, 1, errmsg);
+}
+
+
+void
+shdict_detach(shdict_t *dict)
+{
+    ngx_uint_t         i;
+    ngx_shm_zone_t   **zone;
+
+    zone = shdict_conf->shdict_zones->elts;
+
+    for (i = 0; i < shdict_conf->shdict_zones->nelts; i++) {
+        if (zone[i] == (ngx_shm_zone_t *) dict) {
+            zone[i] = zone[--shdict_conf->shdict_zones->nelts];
+            break;
+        }
+    }
+
+    ngx_free(((ngx_shm_zone_t *) dict)->data);
+    ngx_free(dict);
+}
+
+
+void
+shdict_time_update(void)
+{
+    ngx_time_update();
+}
+
+
+/*
+ * sets up the process as nginx does before reading its configuration,
+ * with a cycle holding the ngx_lua_shdict_conf_t of the zones, as the
+ * lua_shared_mem directive would
+ */
+
+static ngx_int_t
+shdict_process_init(char **errmsg)
+{
+    ngx_uint_t   n;
+    ngx_conf_t   cf;
+
+    if (ngx_cycle != NULL) {
+        ngx_time_update();
+        return NGX_OK;
+    }
+
+    ngx_pid = ngx_getpid();
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    for (n = ngx_pagesize; n >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_time_init();
+
+#if (NGX_LUA_SHDICT_SLAB_SIZES_INIT)
+    ngx_slab_sizes_init();
+#endif
+
+    shdict_log_file.fd = ngx_stderr;
+    shdict_log.file = &shdict_log_file;
+    shdict_log.log_level = NGX_LOG_ERR;
+
+    shdict_cycle.log = &shdict_log;
+
+    shdict_cycle.pool = ngx_create_pool(NGX_CYCLE_POOL_SIZE, &shdict_log);
+    if (shdict_cycle.pool == NULL) {
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+    shdict_cycle.conf_ctx = ngx_pcalloc(shdict_cycle.pool, sizeof(void *));
+    if (shdict_cycle.conf_ctx == NULL) {
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+    ngx_lua_shdict_module.index = 0;
+
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+
+    cf.cycle = &shdict_cycle;
+    cf.pool = shdict_cycle.pool;
+    cf.log = &shdict_log;
+
+    if (ngx_lua_shdict_conf_init(&cf, &shdict_conf) != NGX_CONF_OK) {
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+    if (pthread_atfork(NULL, NULL, shdict_atfork_child) != 0) {
+        *errmsg = "pthread_atfork() failed";
+        return NGX_ERROR;
+    }
+
+    ngx_cycle = &shdict_cycle;
+
+    return NGX_OK;
+}
+
+
+/* the zone mutexes are taken with the pid of the owner as the lock value */
+
+static void
+shdict_atfork_child(void)
+{
+    ngx_pid = ngx_getpid();
+}
+
+
+static shdict_t *
+shdict_add(void *addr, size_t size, const char *name, ngx_uint_t exists,
+    char **errmsg)
+{
+    size_t                   len;
+    ngx_shm_zone_t          *zone, **zp;
+    ngx_lua_shdict_ctx_t    *ctx;
+
+    len = ngx_strlen(name);
+
+    if (len == 0) {
+        *errmsg = "empty zone name";
+        return NULL;
+    }
+
+    zone = ngx_calloc(sizeof(ngx_shm_zone_t) + len, &shdict_log);
+    ctx = ngx_calloc(sizeof(ngx_lua_shdict_ctx_t), &shdict_log);
+
+    if (zone == NULL || ctx == NULL) {
+        ngx_free(zone);
+        ngx_free(ctx);
+        *errmsg = "no memory";
+        return NULL;
+    }
+
+    zone->shm.name.data = (u_char *) zone + sizeof(ngx_shm_zone_t);
+    zone->shm.name.len = len;
+    ngx_memcpy(zone->shm.name.data, name, len);
+
+    zone->shm.addr = addr;
+    zone->shm.size = size;
+    zone->shm.log = &shdict_log;
+    zone->shm.exists = exists;
+    zone->data = ctx;
+    zone->tag = &ngx_lua_shdict_module;
+
+    ctx->name = zone->shm.name;
+    ctx->log = &shdict_log;
+
+    if (ngx_lua_shdict_init(zone, NULL) != NGX_OK) {
+        *errmsg = "no memory";
+        goto failed;
+    }
+
+    zp = ngx_array_push(shdict_conf->shdict_zones);
+    if (zp == NULL) {
+        *errmsg = "no memory";
+        goto failed;
+    }
+
+    *zp = zone;
+
+    return (shdict_t *) zone;
+
+failed:
+
+    ngx_free(zone);
+    ngx_free(ctx);
+
+    return NULL;
+}
+
+
+/*
+ * nginx functions referred to by the parts of the module run by nginx only,
+ * the configuration directive and the blocking pop notifications
+ */
+
+ngx_shm_zone_t *
+ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size,
+    void *tag)
+{
+    return NULL;
+}
+
+
+void ngx_cdecl
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+ngx_connection_t *
+ngx_get_connection(ngx_socket_t s, ngx_log_t *log)
+{
+    return NULL;
+}
+
+
+void
+ngx_free_connection(ngx_connection_t *c)
+{
+}
+
+
+/* the errors of the engine and of the nginx core go to stderr */
+
+void ngx_cdecl
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+    u_char    *p, *last;
+    va_list    args;
+    u_char     errstr[NGX_MAX_ERROR_STR];
+
+    last = errstr + NGX_MAX_ERROR_STR;
+
+    p = ngx_slprintf(errstr, last, "libshdict: [%V] %P: ",
+                     &shdict_err_levels[level], ngx_pid);
+
+    va_start(args, fmt);
+    p = ngx_vslprintf(p, last, fmt, args);
+    va_end(args);
+
+    if (err) {
+        p = ngx_slprintf(p, last, " (%d: %s)", err, strerror(err));
+    }
+
+    if (p > last - NGX_LINEFEED_SIZE) {
+        p = last - NGX_LINEFEED_SIZE;
+    }
+
+    ngx_linefeed(p);
+
+    (void) ngx_write_fd(ngx_stderr, errstr, p - errstr);
+}
@@ -0,0 +1,227 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * libshdict: the storage engine of the lua_shared_mem zones outside of
+ * nginx. A zone lives in a memory region the caller maps into its
+ * processes, shared by all of them at the same address, and is guarded by
+ * the process-shared mutex of the nginx slab pool heading the region, as
+ * in nginx itself. Every function below but shdict_init(), shdict_attach()
+ * and shdict_detach() is the very FFI helper lib/resty/shdict.lua calls
+ * inside nginx, and is used the same way: the value buffers passed in are
+ * replaced by a malloc()'ed block, which the caller frees, when they are
+ * too small, and the list helpers return an array of shdict_value_t
+ * followed by the strings it points to.
+ */
+
+
+#ifndef _SHDICT_H_
+#define _SHDICT_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define SHDICT_OK              0
+#define SHDICT_ERROR          -1
+#define SHDICT_DECLINED       -5
+
+#define SHDICT_NIL             0
+#define SHDICT_BOOLEAN         1
+#define SHDICT_NUMBER          3
+#define SHDICT_STRING          4
+#define SHDICT_LIST            5
+#define SHDICT_RECORD          6
+#define SHDICT_BITMAP          7
+#define SHDICT_BLOOM           8
+#define SHDICT_HLL             9
+#define SHDICT_TABLE          10
+
+/* the "op" of ngx_lua_ffi_shdict_store_helper(), a bit mask */
+#define SHDICT_ADD             0x0001
+#define SHDICT_REPLACE         0x0002
+#define SHDICT_SAFE_STORE      0x0004
+
+/* the "flags" of the list helpers */
+#define SHDICT_LEFT            0x0001
+
+/* the "op" of ngx_lua_ffi_shdict_bitop() */
+#define SHDICT_BITOP_AND       0
+#define SHDICT_BITOP_OR        1
+#define SHDICT_BITOP_XOR       2
+#define SHDICT_BITOP_NOT       3
+
+
+typedef struct shdict_s  shdict_t;
+
+
+typedef struct {
+    size_t                       len;
+    unsigned char               *data;
+} shdict_str_t;
+
+
+typedef struct {
+    int                          value_type;
+    size_t                       str_value_len;
+    const unsigned char         *str_value_buf;
+    double                       num_value;
+} shdict_value_t;
+
+
+/* the options of the _ext variants of the fetch and store helpers */
+typedef struct {
+    uint32_t                     cost;          /* ms */
+    uint32_t                     stale_ttl;     /* ms */
+    uint64_t                     lease;         /* token, 0 for none */
+} shdict_store_opts_t;
+
+
+typedef struct {
+    double                       early_refresh;
+    int                          refresh;       /* out */
+    uint32_t                     lease;         /* ms, 0 for none */
+    uint64_t                     token;         /* out */
+} shdict_fetch_opts_t;
+
+
+/* a field update of ngx_lua_ffi_shdict_update_fields() */
+typedef struct {
+    uint32_t                     offset;
+    uint8_t                      kind;          /* 1 int8_t ... 10 double */
+    uint8_t                      op;            /* 0 set, 1 add */
+    double                       num;           /* in and out, floats */
+    int64_t                      inum;          /* in and out, integers */
+} shdict_field_op_t;
+
+
+/*
+ * shdict_init() formats "size" bytes at "addr" as an empty zone named
+ * "name", and shdict_attach() uses a zone formatted by shdict_init() in
+ * another process, which must have mapped it at the same address. Both
+ * return NULL and set *errmsg on failure. The returned handle is the
+ * "zone" argument of the helpers below, and ngx_lua_ffi_shdict_find_zone()
+ * finds it by name until shdict_detach().
+ *
+ * The expiration times are checked against a clock cached the way nginx
+ * caches it, refreshed by shdict_init(), shdict_attach() and
+ * shdict_time_update(), which long running callers invoke periodically,
+ * like the nginx event loop does on every iteration.
+ */
+
+shdict_t *shdict_init(void *addr, size_t size, const char *name,
+    char **errmsg);
+shdict_t *shdict_attach(void *addr, size_t size, const char *name,
+    char **errmsg);
+void shdict_detach(shdict_t *dict);
+void shdict_time_update(void);
+
+
+int ngx_lua_ffi_shdict_find_zone(shdict_t **zone,
+    const unsigned char *name_data, size_t name_len, char **errmsg);
+
+int ngx_lua_ffi_shdict_fetch_helper(shdict_t *zone, int get_stale,
+    const unsigned char *key, size_t key_len, int *value_type,
+    unsigned char **str_value_buf, size_t *str_value_len,
+    double *num_value, int *user_flags, int *is_stale, char **errmsg);
+int ngx_lua_ffi_shdict_store_helper(shdict_t *zone, int op,
+    const unsigned char *key, size_t key_len, int value_type,
+    const unsigned char *str_value_buf, size_t str_value_len,
+    double num_value, long exptime, int user_flags, char **errmsg,
+    int *forcible);
+int ngx_lua_ffi_shdict_fetch_ext(shdict_t *zone, int get_stale,
+    const unsigned char *key, size_t key_len, int *value_type,
+    unsigned char **str_value_buf, size_t *str_value_len,
+    double *num_value, int *user_flags, int *is_stale,
+    shdict_fetch_opts_t *opts, char **errmsg);
+int ngx_lua_ffi_shdict_store_ext(shdict_t *zone, int op,
+    const unsigned char *key, size_t key_len, int value_type,
+    const unsigned char *str_value_buf, size_t str_value_len,
+    double num_value, long exptime, int user_flags,
+    shdict_store_opts_t *opts, char **errmsg, int *forcible);
+int ngx_lua_ffi_shdict_get_multi(shdict_t *zone, shdict_str_t *keys,
+    int nkeys, shdict_value_t *values, unsigned char **buf,
+    size_t *buf_len, char **errmsg);
+int ngx_lua_ffi_shdict_incr_helper(shdict_t *zone,
+    const unsigned char *key, size_t key_len, double *value, char **err,
+    int has_init, double init, long init_ttl, int *forcible);
+int ngx_lua_ffi_shdict_update_fields(shdict_t *zone,
+    const unsigned char *key, size_t key_len, uint32_t schema, size_t size,
+    shdict_field_op_t *ops, int nops, char **errmsg);
+
+int ngx_lua_ffi_shdict_setbit(shdict_t *zone, const unsigned char *key,
+    size_t key_len, size_t offset, int value, int *old, char **errmsg,
+    int *forcible);
+int ngx_lua_ffi_shdict_getbit(shdict_t *zone, const unsigned char *key,
+    size_t key_len, size_t offset, int *bit, char **errmsg);
+int ngx_lua_ffi_shdict_bitcount(shdict_t *zone, const unsigned char *key,
+    size_t key_len, long start, long stop, size_t *count, char **errmsg);
+int ngx_lua_ffi_shdict_bitop(shdict_t *zone, int op,
+    const unsigned char *dst, size_t dst_len, shdict_str_t *keys, int nkeys,
+    size_t *len, char **errmsg, int *forcible);
+int ngx_lua_ffi_shdict_bf_add(shdict_t *zone, const unsigned char *key,
+    size_t key_len, uint32_t bits, uint32_t hashes, int reserve,
+    shdict_str_t *items, int nitems, int *added, char **errmsg,
+    int *forcible);
+int ngx_lua_ffi_shdict_bf_exists(shdict_t *zone, const unsigned char *key,
+    size_t key_len, const unsigned char *item, size_t item_len, int *exists,
+    char **errmsg);
+
+int ngx_lua_ffi_shdict_pfadd(shdict_t *zone, const unsigned char *key,
+    size_t key_len, shdict_str_t *items, int nitems, int *changed,
+    char **errmsg, int *forcible);
+int ngx_lua_ffi_shdict_pfcount(shdict_t *zone, shdict_str_t *keys,
+    int nkeys, int *hist, char **errmsg);
+int ngx_lua_ffi_shdict_pfmerge(shdict_t *zone, const unsigned char *dst,
+    size_t dst_len, shdict_str_t *keys, int nkeys, char **errmsg,
+    int *forcible);
+
+int ngx_lua_ffi_shdict_push_helper(shdict_t *zone,
+    const unsigned char *key, size_t key_len, shdict_value_t *values,
+    int nvalues, long max_len, int *value_len, int flags, char **errmsg,
+    int *forcible);
+int ngx_lua_ffi_shdict_pop_helper(shdict_t *zone, const unsigned char *key,
+    size_t key_len, int count, unsigned char **buf, size_t *buf_len,
+    int *nvalues, int flags, char **errmsg);
+int ngx_lua_ffi_shdict_llen(shdict_t *zone, const unsigned char *key,
+    size_t key_len, int *value_len, char **errmsg);
+int ngx_lua_ffi_shdict_lrange(shdict_t *zone, const unsigned char *key,
+    size_t key_len, long start, long stop, unsigned char **buf,
+    size_t *buf_len, int *nvalues, char **errmsg);
+int ngx_lua_ffi_shdict_lindex(shdict_t *zone, const unsigned char *key,
+    size_t key_len, long index, unsigned char **buf, size_t *buf_len,
+    int *nvalues, char **errmsg);
+int ngx_lua_ffi_shdict_lset(shdict_t *zone, const unsigned char *key,
+    size_t key_len, long index, shdict_value_t *value, char **errmsg);
+int ngx_lua_ffi_shdict_ltrim(shdict_t *zone, const unsigned char *key,
+    size_t key_len, long start, long stop, int *value_len, char **errmsg);
+
+/*
+ * the waiters need the nginx event loop, so "sema" and "post" are NULL
+ * here, and a caller finding the permits taken retries within "*retry" ms
+ */
+int ngx_lua_ffi_shdict_sem_acquire(shdict_t *zone, const unsigned char *key,
+    size_t key_len, int limit, long exptime, long timeout, void *sema,
+    void *post, void **waiter, uint64_t *id, uint64_t *token, long *retry,
+    char **errmsg);
+int ngx_lua_ffi_shdict_sem_release(shdict_t *zone, const unsigned char *key,
+    size_t key_len, uint64_t token, char **errmsg);
+
+int ngx_lua_ffi_shdict_get_keys(shdict_t *zone, int attempts,
+    shdict_str_t **keys_buf, int *keys_num, char **errmsg);
+int ngx_lua_ffi_shdict_flush_all(shdict_t *zone, char **errmsg);
+int ngx_lua_ffi_shdict_flush_expired(shdict_t *zone, int attempts,
+    int *freed, char **errmsg);
+long ngx_lua_ffi_shdict_get_ttl(shdict_t *zone, const unsigned char *key,
+    size_t key_len);
+int ngx_lua_ffi_shdict_set_expire(shdict_t *zone,
+    const unsigned char *key, size_t key_len, long exptime);
+size_t ngx_lua_ffi_shdict_capacity(shdict_t *zone);
+size_t ngx_lua_ffi_shdict_free_space(shdict_t *zone);
+
+
+#endif /* _SHDICT_H_ */
@@ -0,0 +1,870 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * bitmaps and Bloom filters: values held in a single slab allocation, the
+ * bits following a small header, and updated in place under the zone
+ * lock, so that setting a bit or adding an item costs no more than an
+ * incr. A bitmap keeps its length in bytes, the bits being numbered from
+ * the most significant bit of its first byte as in Redis, and doubles its
+ * allocation when a bit past it is set, so that growing one a bit at a
+ * time copies it a logarithmic number of times only. A Bloom filter is
+ * sized once by dict:bf_reserve(), or on its first dict:bf_add(), and
+ * derives its "hashes" bit positions from the two halves of the 64-bit
+ * hash of an item, as Kirsch and Mitzenmacher do.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+#if ((defined __GNUC__ || defined __clang__) && defined __x86_64__)
+#include <immintrin.h>
+#define NGX_LUA_SHDICT_AVX2  1
+#endif
+
+
+/* the length of a bitmap heads its allocation, the bits follow */
+#define NGX_LUA_SHDICT_BITMAP_HDR   sizeof(uint32_t)
+
+/* the largest bitmap, 2^32 bits */
+#define NGX_LUA_SHDICT_BITMAP_MAX   ((size_t) 1 << 29)
+
+#define NGX_LUA_SHDICT_BITOP_AND    0
+#define NGX_LUA_SHDICT_BITOP_OR     1
+#define NGX_LUA_SHDICT_BITOP_XOR    2
+#define NGX_LUA_SHDICT_BITOP_NOT    3
+
+
+/* the header of a Bloom filter, its bits follow */
+typedef struct {
+    uint32_t                      bits;
+    uint32_t                      hashes;
+} ngx_lua_shdict_bloom_t;
+
+
+static size_t ngx_lua_shdict_popcount(u_char *p, size_t len);
+static ngx_inline uint64_t ngx_lua_shdict_bits_word(u_char *p, size_t len,
+    size_t i);
+
+
+/*
+ * allocates an item of "type" for "key" with a value of "size" bytes,
+ * zeroed, to be linked by ngx_lua_shdict_bits_link(); the item "old",
+ * when there is one, is removed, and its value copied at the beginning
+ * of the new one. Also used by the HyperLogLogs
+ */
+
+ngx_lua_shdict_node_t *
+ngx_lua_shdict_bits_alloc(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *old, ngx_uint_t hash, u_char *key, size_t key_len,
+    ngx_uint_t type, size_t size, int *forcible)
+{
+    size_t                       n, grow;
+    ngx_rbtree_node_t           *node;
+    ngx_lua_shdict_node_t       *sd;
+
+    n = offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_lua_shdict_node_t, data)
+        + key_len
+        + size;
+
+    /* the old item is counted in its namespace until it is removed */
+
+    grow = n;
+
+    if (old != NULL) {
+        grow -= ngx_min(n, ngx_lua_shdict_node_size(old));
+    }
+
+    if (ngx_lua_shdict_ns_reserve(ctx, key, key_len, old, grow)) {
+        *forcible = 1;
+    }
+
+    node = ngx_lua_shdict_alloc(ctx, old, n, forcible);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    sd = (ngx_lua_shdict_node_t *) &node->color;
+
+    node->key = hash;
+    sd->key_len = (u_short) key_len;
+    sd->value_len = (uint32_t) size;
+    sd->value_type = (uint8_t) type;
+    sd->chunked = 0;
+
+    ngx_memcpy(sd->data, key, key_len);
+    ngx_memzero(sd->data + key_len, size);
+
+    if (old != NULL) {
+        sd->expires = old->expires;
+        sd->user_flags = old->user_flags;
+        sd->cost = old->cost;
+        sd->stale_ttl = old->stale_ttl;
+        sd->priority = old->priority;
+
+        ngx_memcpy(sd->data + key_len, old->data + key_len, old->value_len);
+
+        ngx_lua_shdict_remove(ctx, old);
+
+    } else {
+        sd->expires = 0;
+        sd->user_flags = 0;
+        sd->cost = 0;
+        sd->stale_ttl = 0;
+        sd->priority = NGX_LUA_SHDICT_PRIO_NORMAL;
+    }
+
+    return sd;
+}
+
+
+void
+ngx_lua_shdict_bits_link(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd)
+{
+    ngx_rbtree_node_t           *node;
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_lua_shdict_ns_link(ctx, sd);
+}
+
+
+/*
+ * looks "key" up for an update, and returns NGX_OK with "*sdp" set to it
+ * when it holds a value of "type", NGX_DECLINED with "*sdp" set to NULL
+ * when it does not exist, or has expired and was removed, and NGX_ERROR
+ * when it holds a value of another type
+ */
+
+ngx_int_t
+ngx_lua_shdict_bits_lookup(ngx_shm_zone_t *zone, ngx_uint_t hash,
+    u_char *key, size_t key_len, ngx_uint_t type,
+    ngx_lua_shdict_node_t **sdp)
+{
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+
+    ctx = zone->data;
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc == NGX_DONE) {
+        ngx_lua_shdict_remove(ctx, sd);
+        rc = NGX_DECLINED;
+    }
+
+    if (rc == NGX_DECLINED) {
+        *sdp = NULL;
+        return NGX_DECLINED;
+    }
+
+    if (sd->value_type != type) {
+        return NGX_ERROR;
+    }
+
+    ngx_lua_shdict_touch(ctx, sd);
+
+    *sdp = sd;
+
+    return NGX_OK;
+}
+
+
+/* sets the bit "offset" of the bitmap "key" to "value", "*old" to its value */
+
+int
+ngx_lua_ffi_shdict_setbit(ngx_shm_zone_t *zone, u_char *key, size_t key_len,
+    size_t offset, int value, int *old, char **errmsg, int *forcible)
+{
+    u_char                      *p, mask;
+    size_t                       len, cap, size;
+    uint32_t                     n;
+    ngx_uint_t                   hash;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+
+    ctx = zone->data;
+
+    *forcible = 0;
+    *old = 0;
+
+    if (offset >= NGX_LUA_SHDICT_BITMAP_MAX * 8) {
+        *errmsg = "bit offset out of range";
+        return NGX_ERROR;
+    }
+
+    len = offset / 8 + 1;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_lua_shdict_bits_lookup(zone, hash, key, key_len,
+                                    SHDICT_TBITMAP, &sd);
+
+    if (rc == NGX_ERROR) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not a bitmap";
+        return NGX_ERROR;
+    }
+
+    cap = sd ? sd->value_len - NGX_LUA_SHDICT_BITMAP_HDR : 0;
+
+    if (len > cap) {
+        size = ngx_max(len, ngx_min(cap * 2, NGX_LUA_SHDICT_BITMAP_MAX));
+        size = ngx_align(size, 8);
+
+        sd = ngx_lua_shdict_bits_alloc(ctx, sd, hash, key, key_len,
+                                       SHDICT_TBITMAP,
+                                       NGX_LUA_SHDICT_BITMAP_HDR + size,
+                                       forcible);
+        if (sd == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+
+        ngx_lua_shdict_bits_link(ctx, sd);
+    }
+
+    p = sd->data + key_len;
+
+    ngx_memcpy(&n, p, sizeof(uint32_t));
+
+    if (len > n) {
+        n = (uint32_t) len;
+        ngx_memcpy(p, &n, sizeof(uint32_t));
+    }
+
+    p += NGX_LUA_SHDICT_BITMAP_HDR + offset / 8;
+    mask = (u_char) (0x80 >> (offset % 8));
+
+    *old = (*p & mask) ? 1 : 0;
+
+    if (value) {
+        *p |= mask;
+
+    } else {
+        *p &= (u_char) ~mask;
+    }
+
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_SET, hash, key,
+                          key_len);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+int
+ngx_lua_ffi_shdict_getbit(ngx_shm_zone_t *zone, u_char *key, size_t key_len,
+    size_t offset, int *bit, char **errmsg)
+{
+    u_char                      *p;
+    uint32_t                     n;
+    ngx_uint_t                   hash;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+
+    ctx = zone->data;
+
+    *bit = 0;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc == NGX_OK) {
+        if (sd->value_type != SHDICT_TBITMAP) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "not a bitmap";
+            return NGX_ERROR;
+        }
+
+        p = sd->data + key_len;
+
+        ngx_memcpy(&n, p, sizeof(uint32_t));
+
+        if (offset / 8 < n) {
+            p += NGX_LUA_SHDICT_BITMAP_HDR + offset / 8;
+            *bit = (*p & (0x80 >> (offset % 8))) ? 1 : 0;
+        }
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/*
+ * counts the bits set in the bytes "start" to "stop" of the bitmap "key",
+ * negative positions counting from its end as in Redis
+ */
+
+int
+ngx_lua_ffi_shdict_bitcount(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, long start, long stop, size_t *count, char **errmsg)
+{
+    u_char                      *p;
+    uint32_t                     n;
+    ngx_uint_t                   hash;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+
+    ctx = zone->data;
+
+    *count = 0;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc != NGX_OK) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    if (sd->value_type != SHDICT_TBITMAP) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not a bitmap";
+        return NGX_ERROR;
+    }
+
+    p = sd->data + key_len;
+
+    ngx_memcpy(&n, p, sizeof(uint32_t));
+
+    if (start < 0) {
+        start += n;
+        if (start < 0) {
+            start = 0;
+        }
+    }
+
+    if (stop < 0) {
+        stop += n;
+    }
+
+    if (stop >= (long) n) {
+        stop = (long) n - 1;
+    }
+
+    if (start <= stop) {
+        *count = ngx_lua_shdict_popcount(p + NGX_LUA_SHDICT_BITMAP_HDR
+                                         + start, stop - start + 1);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/*
+ * stores the bitwise "op" of the bitmaps "keys" into the bitmap "dst", as
+ * long as the longest of them, a missing one counting as empty, and sets
+ * "*len" to its length; "dst" is deleted when all of them are missing
+ */
+
+int
+ngx_lua_ffi_shdict_bitop(ngx_shm_zone_t *zone, int op, u_char *dst,
+    size_t dst_len, ngx_str_t *keys, int nkeys, size_t *len, char **errmsg,
+    int *forcible)
+{
+    int                          i;
+    u_char                      *p, *src;
+    size_t                       j, w, n, size;
+    uint32_t                     slen;
+    uint64_t                     word, v;
+    ngx_uint_t                   hash, found, left;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd, *dsd;
+
+    ctx = zone->data;
+
+    *forcible = 0;
+    *len = 0;
+
+    if (nkeys <= 0 || (op == NGX_LUA_SHDICT_BITOP_NOT && nkeys != 1)) {
+        *errmsg = "bad number of keys";
+        return NGX_ERROR;
+    }
+
+    hash = ngx_lua_shdict_hash(dst, dst_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, dst, dst_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    /*
+     * the sources go to the head of the LRU queue, out of reach of the
+     * evictions the allocation of "dst" can make
+     */
+
+    n = 0;
+    found = 0;
+
+    for (i = 0; i < nkeys; i++) {
+        rc = ngx_lua_shdict_lookup(zone,
+                                   ngx_lua_shdict_hash(keys[i].data,
+                                                       keys[i].len),
+                                   keys[i].data, keys[i].len, &sd);
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        found++;
+
+        if (sd->value_type != SHDICT_TBITMAP) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "not a bitmap";
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(&slen, sd->data + sd->key_len, sizeof(uint32_t));
+        n = ngx_max(n, slen);
+
+        ngx_lua_shdict_touch(ctx, sd);
+    }
+
+    rc = ngx_lua_shdict_lookup(zone, hash, dst, dst_len, &dsd);
+
+    if (rc == NGX_DECLINED) {
+        dsd = NULL;
+    }
+
+    if (n == 0) {
+        if (dsd != NULL) {
+            ngx_lua_shdict_remove(ctx, dsd);
+
+            ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_DELETE, hash,
+                                  dst, dst_len);
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    size = NGX_LUA_SHDICT_BITMAP_HDR + ngx_align(n, 8);
+
+    /*
+     * the result is computed into a new item, linked in place of "dst"
+     * when done, as "dst" may be one of the sources
+     */
+
+    sd = ngx_lua_shdict_bits_alloc(ctx, NULL, hash, dst, dst_len,
+                                   SHDICT_TBITMAP, size, forcible);
+    if (sd == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+    p = sd->data + dst_len + NGX_LUA_SHDICT_BITMAP_HDR;
+    left = 0;
+
+    for (i = 0; i < nkeys; i++) {
+        rc = ngx_lua_shdict_lookup(zone,
+                                   ngx_lua_shdict_hash(keys[i].data,
+                                                       keys[i].len),
+                                   keys[i].data, keys[i].len, &dsd);
+
+        if (rc == NGX_OK) {
+            left++;
+
+            src = dsd->data + dsd->key_len;
+            ngx_memcpy(&slen, src, sizeof(uint32_t));
+            src += NGX_LUA_SHDICT_BITMAP_HDR;
+
+        } else {
+            src = NULL;
+            slen = 0;
+        }
+
+        for (j = 0; j < n; j += 8) {
+            w = ngx_min(8, n - j);
+
+            v = ngx_lua_shdict_bits_word(src, slen, j);
+
+            if (i == 0) {
+                word = (op == NGX_LUA_SHDICT_BITOP_NOT) ? ~v : v;
+
+            } else {
+                ngx_memcpy(&word, p + j, sizeof(uint64_t));
+
+                switch (op) {
+
+                case NGX_LUA_SHDICT_BITOP_AND:
+                    word &= v;
+                    break;
+
+                case NGX_LUA_SHDICT_BITOP_OR:
+                    word |= v;
+                    break;
+
+                default: /* NGX_LUA_SHDICT_BITOP_XOR */
+                    word ^= v;
+                    break;
+                }
+            }
+
+            /* the bytes past "n" stay zero, whatever the "op" */
+
+            ngx_memcpy(p + j, &word, w);
+        }
+    }
+
+    /*
+     * a zone too full for "dst" may have evicted sources all the same, the
+     * result would take them for empty ones
+     */
+
+    if (left != found) {
+        ngx_slab_free_locked(ctx->shpool,
+                             (u_char *) sd - offsetof(ngx_rbtree_node_t,
+                                                      color));
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+    slen = (uint32_t) n;
+    ngx_memcpy(p - NGX_LUA_SHDICT_BITMAP_HDR, &slen, sizeof(uint32_t));
+
+    rc = ngx_lua_shdict_lookup(zone, hash, dst, dst_len, &dsd);
+
+    if (rc != NGX_DECLINED) {
+        ngx_lua_shdict_remove(ctx, dsd);
+    }
+
+    ngx_lua_shdict_bits_link(ctx, sd);
+
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_SET, hash, dst,
+                          dst_len);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    *len = n;
+
+    return NGX_OK;
+}
+
+
+/* the 8 bytes of "p" from "i", the bytes past "len" reading as 0 */
+
+static ngx_inline uint64_t
+ngx_lua_shdict_bits_word(u_char *p, size_t len, size_t i)
+{
+    uint64_t                     w;
+
+    w = 0;
+
+    if (i + 8 <= len) {
+        ngx_memcpy(&w, p + i, sizeof(uint64_t));
+
+    } else if (i < len) {
+        ngx_memcpy(&w, p + i, len - i);
+    }
+
+    return w;
+}
+
+
+/*
+ * adds the "nitems" items to the Bloom filter "key", and creates it with
+ * "bits" bits and "hashes" hash functions first when it does not exist;
+ * "*added" is set to the number of items which were not in it yet. With
+ * "reserve", only creates the filter, and returns NGX_DECLINED when it
+ * exists already
+ */
+
+int
+ngx_lua_ffi_shdict_bf_add(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, uint32_t bits, uint32_t hashes, int reserve,
+    ngx_str_t *items, int nitems, int *added, char **errmsg, int *forcible)
+{
+    int                          i;
+    u_char                      *p, mask;
+    uint32_t                     k, h1, h2;
+    uint64_t                     h, bit;
+    ngx_uint_t                   hash, found;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+    ngx_lua_shdict_bloom_t       bf;
+
+    ctx = zone->data;
+
+    *forcible = 0;
+    *added = 0;
+
+    if (bits == 0 || hashes == 0) {
+        *errmsg = "bad bloom filter size";
+        return NGX_ERROR;
+    }
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_lua_shdict_bits_lookup(zone, hash, key, key_len, SHDICT_TBLOOM,
+                                    &sd);
+
+    if (rc == NGX_ERROR) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not a bloom filter";
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_OK && reserve) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "exists";
+        return NGX_DECLINED;
+    }
+
+    if (sd == NULL) {
+        sd = ngx_lua_shdict_bits_alloc(ctx, NULL, hash, key, key_len,
+                                       SHDICT_TBLOOM,
+                                       sizeof(ngx_lua_shdict_bloom_t)
+                                       + ((size_t) bits + 7) / 8,
+                                       forcible);
+        if (sd == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+
+        bf.bits = bits;
+        bf.hashes = hashes;
+
+        ngx_memcpy(sd->data + key_len, &bf, sizeof(ngx_lua_shdict_bloom_t));
+
+        ngx_lua_shdict_bits_link(ctx, sd);
+    }
+
+    p = sd->data + key_len;
+
+    ngx_memcpy(&bf, p, sizeof(ngx_lua_shdict_bloom_t));
+
+    p += sizeof(ngx_lua_shdict_bloom_t);
+
+    for (i = 0; i < nitems; i++) {
+        h = ngx_lua_shdict_hash64(items[i].data, items[i].len);
+
+        h1 = (uint32_t) h;
+        h2 = (uint32_t) (h >> 32) | 1;
+
+        found = 1;
+
+        for (k = 0; k < bf.hashes; k++) {
+            bit = ((uint64_t) h1 + (uint64_t) k * h2) % bf.bits;
+            mask = (u_char) (0x80 >> (bit % 8));
+
+            if (!(p[bit / 8] & mask)) {
+                p[bit / 8] |= mask;
+                found = 0;
+            }
+        }
+
+        if (!found) {
+            (*added)++;
+        }
+    }
+
+    if (*added || reserve) {
+        ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_SET, hash, key,
+                              key_len);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* sets "*exists" when "item" may be in the Bloom filter "key" */
+
+int
+ngx_lua_ffi_shdict_bf_exists(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, u_char *item, size_t item_len, int *exists,
+    char **errmsg)
+{
+    u_char                      *p;
+    uint32_t                     k, h1, h2;
+    uint64_t                     h, bit;
+    ngx_uint_t                   hash;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+    ngx_lua_shdict_bloom_t       bf;
+
+    ctx = zone->data;
+
+    *exists = 0;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    /* hashed before the lock is taken */
+
+    h = ngx_lua_shdict_hash64(item, item_len);
+
+    h1 = (uint32_t) h;
+    h2 = (uint32_t) (h >> 32) | 1;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc != NGX_OK) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    if (sd->value_type != SHDICT_TBLOOM) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not a bloom filter";
+        return NGX_ERROR;
+    }
+
+    p = sd->data + key_len;
+
+    ngx_memcpy(&bf, p, sizeof(ngx_lua_shdict_bloom_t));
+
+    p += sizeof(ngx_lua_shdict_bloom_t);
+
+    *exists = 1;
+
+    for (k = 0; k < bf.hashes; k++) {
+        bit = ((uint64_t) h1 + (uint64_t) k * h2) % bf.bits;
+
+        if (!(p[bit / 8] & (0x80 >> (bit % 8)))) {
+            *exists = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_LUA_SHDICT_AVX2)
+
+/*
+ * the nibble lookup popcount of Mula, Kurz and Lemire, 32 bytes at a time,
+ * for the CPUs with AVX2, picked at run time
+ */
+
+__attribute__ ((target ("avx2")))
+static size_t
+ngx_lua_shdict_popcount_avx2(u_char *p, size_t len)
+{
+    size_t                       i;
+    __m256i                      lookup, low, lo, hi, cnt, acc;
+
+    lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                              0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    low = _mm256_set1_epi8(0x0f);
+    acc = _mm256_setzero_si256();
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        cnt = _mm256_loadu_si256((__m256i *) (p + i));
+
+        lo = _mm256_and_si256(cnt, low);
+        hi = _mm256_and_si256(_mm256_srli_epi16(cnt, 4), low);
+
+        cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                              _mm256_shuffle_epi8(lookup, hi));
+
+        acc = _mm256_add_epi64(acc,
+                               _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+
+    return (size_t) (_mm256_extract_epi64(acc, 0)
+                     + _mm256_extract_epi64(acc, 1)
+                     + _mm256_extract_epi64(acc, 2)
+                     + _mm256_extract_epi64(acc, 3));
+}
+
+#endif
+
+
+static ngx_inline ngx_uint_t
+ngx_lua_shdict_popcount64(uint64_t w)
+{
+#if (defined __GNUC__ || defined __clang__)
+
+    return (ngx_uint_t) __builtin_popcountll(w);
+
+#else
+
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+    return (ngx_uint_t) ((w * 0x0101010101010101ULL) >> 56);
+
+#endif
+}
+
+
+static size_t
+ngx_lua_shdict_popcount(u_char *p, size_t len)
+{
+    size_t                       n, m;
+    uint64_t                     w;
+
+    n = 0;
+
+#if (NGX_LUA_SHDICT_AVX2)
+
+    if (len >= 256 && __builtin_cpu_supports("avx2")) {
+        m = len & ~(size_t) 31;
+
+        n = ngx_lua_shdict_popcount_avx2(p, m);
+
+        p += m;
+        len -= m;
+    }
+
+#endif
+
+    for (m = 0; m + 8 <= len; m += 8) {
+        ngx_memcpy(&w, p + m, sizeof(uint64_t));
+        n += ngx_lua_shdict_popcount64(w);
+    }
+
+    for ( /* void */ ; m < len; m++) {
+        n += ngx_lua_shdict_popcount64(p[m]);
+    }
+
+    return n;
+}
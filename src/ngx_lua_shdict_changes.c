@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * the change log of a zone: a ring of "changes" fixed-size records in the
+ * zone, numbered by a sequence which never goes back, to which every
+ * write, delete, expiry and eviction of an item appends one. The writers
+ * append under the zone lock they hold already, while the readers, every
+ * worker at its own pace, take no lock at all: a record being written has
+ * its sequence number cleared first and set last, so that a reader copying
+ * it checks the number before and after the copy, and a reader left
+ * behind by a full turn of the ring finds the numbers of the records it
+ * asks for gone and is told that it missed changes. The sequence belongs
+ * to an epoch, drawn when a zone is created, so that a reader can tell a
+ * sequence number of the zone from one of a zone of a previous run.
+ * The keys too long for a record are written whole to a ring of bytes
+ * following the records, the spill area, whose count of bytes ever
+ * written is raised before bytes are overwritten, so that a reader
+ * copying a key checks after the copy that none of its bytes was.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+static uint64_t ngx_lua_shdict_changes_spill(ngx_lua_shdict_changes_t *changes,
+    u_char *key, size_t key_len);
+
+
+/*
+ * sets the change log of the zone up for the configuration of "ctx". The
+ * log of a zone reused on reload is kept as it is, whatever the new
+ * "changes" parameter, since the workers of the previous cycle go on
+ * reading it without the lock until they exit
+ */
+
+ngx_int_t
+ngx_lua_shdict_changes_init(ngx_lua_shdict_ctx_t *ctx)
+{
+    size_t                        size;
+    ngx_uint_t                    n;
+    ngx_lua_shdict_changes_t     *changes;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    changes = ctx->sh->changes;
+
+    for (n = 1; n < ctx->changes; n <<= 1) {
+        /* void */
+    }
+
+    if (changes != NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (ctx->changes && changes->size != n) {
+            ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0,
+                          "lua shared dict \"%V\" keeps its change log of "
+                          "%ui records until a restart",
+                          &ctx->name, changes->size);
+        }
+
+        return NGX_OK;
+    }
+
+    if (ctx->changes == 0) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    size = offsetof(ngx_lua_shdict_changes_t, records)
+           + n * (sizeof(ngx_lua_shdict_change_t)
+                  + NGX_LUA_SHDICT_CHANGE_SPILL);
+
+    changes = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (changes == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                      "lua shared dict \"%V\" is too small for changes=%ui",
+                      &ctx->name, ctx->changes);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(changes, size);
+
+    changes->size = n;
+    changes->epoch = (uint32_t) ngx_random() + 1;
+    changes->spill = (u_char *) &changes->records[n];
+    changes->spill_size = n * NGX_LUA_SHDICT_CHANGE_SPILL;
+
+    ctx->sh->changes = changes;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* called with the zone locked, through ngx_lua_shdict_change() */
+
+void
+ngx_lua_shdict_changes_add(ngx_lua_shdict_changes_t *changes, ngx_uint_t op,
+    ngx_uint_t hash, u_char *key, size_t key_len)
+{
+    uint64_t                      seq;
+    ngx_lua_shdict_change_t      *rec;
+
+    seq = changes->last + 1;
+    rec = &changes->records[seq & (changes->size - 1)];
+
+    rec->seq = 0;
+
+    ngx_memory_barrier();
+
+    rec->hash = hash;
+    rec->key_len = (u_short) key_len;
+    rec->op = (uint8_t) op;
+    ngx_memcpy(rec->key, key, ngx_min(key_len, NGX_LUA_SHDICT_CHANGE_KEY_LEN));
+
+    if (key_len > NGX_LUA_SHDICT_CHANGE_KEY_LEN
+        && key_len <= changes->spill_size)
+    {
+        rec->spill = ngx_lua_shdict_changes_spill(changes, key, key_len);
+
+    } else {
+        rec->spill = (uint64_t) -1;
+    }
+
+    ngx_memory_barrier();
+
+    rec->seq = seq;
+
+    ngx_memory_barrier();
+
+    changes->last = seq;
+}
+
+
+/* writes "key" to the spill area and returns its offset there */
+
+static uint64_t
+ngx_lua_shdict_changes_spill(ngx_lua_shdict_changes_t *changes, u_char *key,
+    size_t key_len)
+{
+    size_t                        off, n;
+    uint64_t                      pos;
+
+    pos = changes->spill_last;
+
+    changes->spill_last = pos + key_len;
+
+    ngx_memory_barrier();
+
+    off = (size_t) (pos & (changes->spill_size - 1));
+    n = ngx_min(key_len, changes->spill_size - off);
+
+    ngx_memcpy(changes->spill + off, key, n);
+    ngx_memcpy(changes->spill, key + n, key_len - n);
+
+    return pos;
+}
+
+
+/*
+ * copies up to "max" records following "since" into "out" and sets "*last"
+ * to the sequence number of the last one copied, or just to the current
+ * one when "max" is 0, and "*epoch" to the epoch of the sequence; returns
+ * NGX_DECLINED, with "*last" set to the current sequence number, when
+ * records following "since" were overwritten already, or when "since"
+ * belongs to another log, newer than the current one
+ */
+
+int
+ngx_lua_ffi_shdict_changes(ngx_shm_zone_t *zone, uint64_t since, int max,
+    ngx_lua_shdict_change_t *out, int *n, uint64_t *last, uint32_t *epoch,
+    char **errmsg)
+{
+    int                           i;
+    uint64_t                      seq, first;
+    ngx_lua_shdict_ctx_t         *ctx;
+    ngx_lua_shdict_change_t      *rec;
+    ngx_lua_shdict_changes_t     *changes;
+
+    ctx = zone->data;
+
+    *n = 0;
+
+    changes = ctx->sh->changes;
+
+    if (ctx->changes == 0 || changes == NULL) {
+        *errmsg = "changes not enabled";
+        return NGX_ERROR;
+    }
+
+    seq = changes->last;
+
+    ngx_memory_barrier();
+
+    *last = seq;
+    *epoch = changes->epoch;
+
+    if (max == 0) {
+        return NGX_OK;
+    }
+
+    first = (seq - changes->base > changes->size)
+            ? seq - changes->size : changes->base;
+
+    if (since < first || since > seq) {
+        *errmsg = "overflow";
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < max && since + i < seq; i++) {
+        rec = &changes->records[(since + i + 1) & (changes->size - 1)];
+
+        if (rec->seq != since + i + 1) {
+            goto overflow;
+        }
+
+        ngx_memory_barrier();
+
+        ngx_memcpy(&out[i], rec, sizeof(ngx_lua_shdict_change_t));
+
+        ngx_memory_barrier();
+
+        if (rec->seq != since + i + 1) {
+            goto overflow;
+        }
+    }
+
+    *n = i;
+    *last = since + i;
+
+    return NGX_OK;
+
+overflow:
+
+    /* the writers went round the ring while the records were copied */
+
+    *last = changes->last;
+
+    *errmsg = "overflow";
+    return NGX_DECLINED;
+}
+
+
+/*
+ * copies the key of "key_len" bytes of a record, written to the spill area
+ * at "spill", into "buf", or returns NGX_DECLINED when it was overwritten
+ * already, or was too long for the spill area, so that the record holds
+ * the first NGX_LUA_SHDICT_CHANGE_KEY_LEN bytes of it only
+ */
+
+int
+ngx_lua_ffi_shdict_change_key(ngx_shm_zone_t *zone, uint64_t spill,
+    size_t key_len, u_char *buf)
+{
+    size_t                        off, n;
+    ngx_lua_shdict_ctx_t         *ctx;
+    ngx_lua_shdict_changes_t     *changes;
+
+    ctx = zone->data;
+
+    changes = ctx->sh->changes;
+
+    if (changes == NULL
+        || spill == (uint64_t) -1
+        || changes->spill_last - spill > changes->spill_size)
+    {
+        return NGX_DECLINED;
+    }
+
+    off = (size_t) (spill & (changes->spill_size - 1));
+    n = ngx_min(key_len, changes->spill_size - off);
+
+    ngx_memcpy(buf, changes->spill + off, n);
+    ngx_memcpy(buf + n, changes->spill, key_len - n);
+
+    ngx_memory_barrier();
+
+    if (changes->spill_last - spill > changes->spill_size) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * chunked values: a string or table value longer than the "chunked"
+ * parameter of the zone is held in a chain of chunks of half a page each,
+ * the last one being only as large as the rest of the value, and every
+ * chunk is allocated on its own. A value taking several pages in a single
+ * allocation needs a run of free pages, which a fragmented zone does not
+ * have even when most of it is free, so that storing it evicted up to 30
+ * items in the hope of freeing one; a chunk fits in any free slot of its
+ * size, and evicts an item at a time only when there is none.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+/*
+ * allocates the chunks of a value of "len" bytes, evicting items like the
+ * set method does when "evict" is set, or returns NULL with none of them
+ * allocated
+ */
+
+ngx_lua_shdict_chunk_t *
+ngx_lua_shdict_chunks_alloc(ngx_lua_shdict_ctx_t *ctx, size_t len,
+    ngx_uint_t evict, int *forcible)
+{
+    size_t                       n;
+    ngx_lua_shdict_chunk_t      *chunks, *chunk, **last;
+
+    chunks = NULL;
+    last = &chunks;
+
+    while (len) {
+        n = ngx_min(len, NGX_LUA_SHDICT_CHUNK_LEN);
+
+        n += offsetof(ngx_lua_shdict_chunk_t, data);
+
+        if (evict) {
+            chunk = ngx_lua_shdict_alloc(ctx, NULL, n, forcible);
+
+        } else {
+            chunk = ngx_slab_alloc_locked(ctx->shpool, n);
+        }
+
+        if (chunk == NULL) {
+            *last = NULL;
+            ngx_lua_shdict_chunks_free(ctx, chunks);
+            return NULL;
+        }
+
+        *last = chunk;
+        last = &chunk->next;
+
+        len -= n - offsetof(ngx_lua_shdict_chunk_t, data);
+    }
+
+    *last = NULL;
+
+    return chunks;
+}
+
+
+void
+ngx_lua_shdict_chunks_free(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_chunk_t *chunk)
+{
+    ngx_lua_shdict_chunk_t      *next;
+
+    while (chunk) {
+        next = chunk->next;
+        ngx_slab_free_locked(ctx->shpool, chunk);
+        chunk = next;
+    }
+}
+
+
+/* the bytes the chunks of a value of "len" bytes take */
+
+size_t
+ngx_lua_shdict_chunks_size(size_t len)
+{
+    size_t                       n;
+
+    n = (len + NGX_LUA_SHDICT_CHUNK_LEN - 1) / NGX_LUA_SHDICT_CHUNK_LEN;
+
+    return n * offsetof(ngx_lua_shdict_chunk_t, data) + len;
+}
+
+
+void
+ngx_lua_shdict_chunks_write(ngx_lua_shdict_chunk_t *chunk, u_char *data,
+    size_t len)
+{
+    size_t                       n;
+
+    for ( /* void */ ; len; chunk = chunk->next) {
+        n = ngx_min(len, NGX_LUA_SHDICT_CHUNK_LEN);
+
+        ngx_memcpy(chunk->data, data, n);
+
+        data += n;
+        len -= n;
+    }
+}
+
+
+void
+ngx_lua_shdict_chunks_read(ngx_lua_shdict_chunk_t *chunk, u_char *dst,
+    size_t len)
+{
+    size_t                       n;
+
+    for ( /* void */ ; len; chunk = chunk->next) {
+        n = ngx_min(len, NGX_LUA_SHDICT_CHUNK_LEN);
+
+        dst = ngx_cpymem(dst, chunk->data, n);
+
+        len -= n;
+    }
+}
+
+
+/* returns 0 when the value in the chunks is the "len" bytes of "data" */
+
+ngx_int_t
+ngx_lua_shdict_chunks_cmp(ngx_lua_shdict_chunk_t *chunk, u_char *data,
+    size_t len)
+{
+    size_t                       n;
+    ngx_int_t                    rc;
+
+    for ( /* void */ ; len; chunk = chunk->next) {
+        n = ngx_min(len, NGX_LUA_SHDICT_CHUNK_LEN);
+
+        rc = ngx_memcmp(chunk->data, data, n);
+        if (rc != 0) {
+            return rc;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * copies the chunks of a value of "len" bytes into the zone of "ctx",
+ * when it is resized, without evicting anything
+ */
+
+ngx_lua_shdict_chunk_t *
+ngx_lua_shdict_chunks_copy(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_chunk_t *chunk, size_t len)
+{
+    size_t                       n;
+    ngx_lua_shdict_chunk_t      *chunks, *p;
+
+    chunks = ngx_lua_shdict_chunks_alloc(ctx, len, 0, NULL);
+    if (chunks == NULL) {
+        return NULL;
+    }
+
+    for (p = chunks; len; p = p->next, chunk = chunk->next) {
+        n = ngx_min(len, NGX_LUA_SHDICT_CHUNK_LEN);
+
+        ngx_memcpy(p->data, chunk->data, n);
+
+        len -= n;
+    }
+
+    return chunks;
+}
@@ -32,6 +32,11 @@ typedef struct {
     uint64_t                     expires;
     ngx_queue_t                  queue;
     uint32_t                     user_flags;
+    uint32_t                     cost;      /* ms, for the early refresh */
+    uint32_t                     stale_ttl; /* ms kept after "expires" */
+    uint8_t                      ns;        /* namespace, 0 by default */
+    uint8_t                      priority;  /* NGX_LUA_SHDICT_PRIO_* */
+    uint8_t                      chunked;   /* the value is in chunks */
     u_char                       data[1];
 } ngx_lua_shdict_node_t;
 
@@ -44,10 +49,360 @@ typedef struct {
 } ngx_lua_shdict_list_node_t;
 
 
+/*
+ * a chunk of a value longer than the "chunked" parameter of the zone, see
+ * ngx_lua_shdict_chunk.c; the node of the item holds a pointer to the
+ * first one, after its key, instead of the value
+ */
+typedef struct ngx_lua_shdict_chunk_s  ngx_lua_shdict_chunk_t;
+
+struct ngx_lua_shdict_chunk_s {
+    ngx_lua_shdict_chunk_t      *next;
+    u_char                       data[1];
+};
+
+
+/*
+ * the bytes of the value in a chunk but the last one: a chunk takes half
+ * a page, the largest slab slot, and never needs a run of free pages
+ */
+#define NGX_LUA_SHDICT_CHUNK_LEN                                              \
+    (ngx_pagesize / 2 - offsetof(ngx_lua_shdict_chunk_t, data))
+
+
+/* a value passed to or returned from the batched list FFI helpers */
+typedef struct {
+    int                          value_type;
+    size_t                       str_value_len;
+    u_char                      *str_value_buf;
+    double                       num_value;
+} ngx_lua_shdict_value_t;
+
+
+/* the options of ngx_lua_ffi_shdict_store_ext() */
+typedef struct {
+    uint32_t                     cost;
+    uint32_t                     stale_ttl;
+    uint32_t                     priority;  /* NGX_LUA_SHDICT_PRIO_* */
+    uint64_t                     lease;     /* token, 0 for none */
+} ngx_lua_shdict_store_opts_t;
+
+
+/*
+ * the priority classes of the items: the low priority ones are evicted
+ * before all the others, and the pinned ones never are, see
+ * ngx_lua_shdict_victim()
+ */
+#define NGX_LUA_SHDICT_PRIO_NORMAL     0
+#define NGX_LUA_SHDICT_PRIO_LOW        1
+#define NGX_LUA_SHDICT_PRIO_PINNED     2
+
+/* a store option only, the class of the item replaced, normal for a new one */
+#define NGX_LUA_SHDICT_PRIO_KEEP       3
+
+
+/* the operations of ngx_lua_ffi_shdict_exec() */
+#define NGX_LUA_SHDICT_TX_GET          0
+#define NGX_LUA_SHDICT_TX_STORE        1
+#define NGX_LUA_SHDICT_TX_INCR         2
+#define NGX_LUA_SHDICT_TX_PUSH         3
+#define NGX_LUA_SHDICT_TX_GUARD        4
+
+/*
+ * an operation of a transaction, with its result, the same layout is
+ * declared in lib/resty/shdict.lua
+ */
+typedef struct {
+    int                          op;
+    int                          flags;     /* of a store, 1 to push left */
+    ngx_str_t                    key;
+    ngx_lua_shdict_value_t       value;     /* the argument, the result */
+    double                       init;      /* of incr */
+    long                         exptime;   /* ms, the init_ttl of incr */
+    int                          user_flags;
+    int                          has_init;
+    int                          rc;
+    int                          forcible;
+    char                        *errmsg;
+} ngx_lua_shdict_tx_op_t;
+
+
+/*
+ * the options of ngx_lua_ffi_shdict_fetch_ext(), "refresh" and "token" are
+ * set by it
+ */
+typedef struct {
+    double                       early_refresh;
+    int                          refresh;
+    uint32_t                     lease;     /* ms, 0 for none */
+    uint64_t                     token;
+} ngx_lua_shdict_fetch_opts_t;
+
+
+/*
+ * a worker blocked in blpop/brpop or waiting for a permit of a semaphore,
+ * linked into ngx_lua_shdict_shctx_t
+ */
+typedef struct {
+    ngx_queue_t                   queue;
+    uint64_t                      id;
+    uint64_t                      deadline;
+    ngx_uint_t                    hash;
+    ngx_uint_t                    slot;
+    ngx_uint_t                    generation;
+    ngx_pid_t                     master;
+    ngx_pid_t                     pid;
+    ngx_uint_t                    woken;
+    void                         *sema;      /* valid in "pid" only */
+    void                         *post;      /* valid in "pid" only */
+} ngx_lua_shdict_waiter_t;
+
+
+/* the longest key prefix the hot key tracker keeps and reports */
+#define NGX_LUA_SHDICT_HOT_KEY_LEN   64
+#define NGX_LUA_SHDICT_HOT_MAX       1024
+#define NGX_LUA_SHDICT_HOT_SAMPLE    100
+
+/* a key monitored by the hot key tracker, see ngx_lua_shdict_hot.c */
+typedef struct {
+    ngx_uint_t                    hash;
+    uint32_t                      count;
+    u_short                       key_len;
+    u_char                        key[NGX_LUA_SHDICT_HOT_KEY_LEN];
+} ngx_lua_shdict_hot_key_t;
+
+
+typedef struct {
+    ngx_uint_t                    nkeys;
+    ngx_uint_t                    size;
+    ngx_uint_t                    width;     /* of a sketch row, 2^n */
+    ngx_uint_t                    sample;
+    ngx_uint_t                    samples;   /* since the last aging */
+    ngx_lua_shdict_hot_key_t     *keys;
+    uint32_t                     *sketch;
+} ngx_lua_shdict_hot_t;
+
+
+/*
+ * the TinyLFU frequency sketch of a zone, sixteen 4-bit counters per
+ * word, see ngx_lua_shdict_lfu.c
+ */
+typedef struct {
+    ngx_uint_t                    mask;
+    ngx_uint_t                    additions;
+    ngx_uint_t                    cursor;
+    uint64_t                      table[1];
+} ngx_lua_shdict_lfu_t;
+
+
+/*
+ * the longest key a change record keeps, for 128-byte records, and the
+ * bytes of the spill area of the longer keys per record
+ */
+#define NGX_LUA_SHDICT_CHANGE_KEY_LEN  96
+#define NGX_LUA_SHDICT_CHANGE_SPILL    64
+#define NGX_LUA_SHDICT_CHANGES_MAX     1048576
+
+/* the "op" of a change record, the names are in lib/resty/shdict.lua */
+#define NGX_LUA_SHDICT_CHANGE_SET      1
+#define NGX_LUA_SHDICT_CHANGE_DELETE   2
+#define NGX_LUA_SHDICT_CHANGE_INCR     3
+#define NGX_LUA_SHDICT_CHANGE_EXPIRE   4
+#define NGX_LUA_SHDICT_CHANGE_EVICT    5
+#define NGX_LUA_SHDICT_CHANGE_LIST     6
+#define NGX_LUA_SHDICT_CHANGE_TTL      7
+#define NGX_LUA_SHDICT_CHANGE_FLUSH    8
+
+/*
+ * a change of the zone, as recorded in its change log and copied out by
+ * ngx_lua_ffi_shdict_changes(), the same layout is declared in
+ * lib/resty/shdict.lua; "key_len" is the length of the whole key, of
+ * which the first NGX_LUA_SHDICT_CHANGE_KEY_LEN bytes are kept, and a
+ * longer key is whole at the offset "spill" of the spill area
+ */
+typedef struct {
+    uint64_t                      seq;       /* 0 while being written */
+    uint64_t                      hash;
+    uint64_t                      spill;     /* (uint64_t) -1 for none */
+    u_short                       key_len;
+    uint8_t                       op;
+    u_char                        key[NGX_LUA_SHDICT_CHANGE_KEY_LEN];
+} ngx_lua_shdict_change_t;
+
+
+/* the change log of a zone, see ngx_lua_shdict_changes.c */
+typedef struct {
+    ngx_uint_t                    size;      /* records, 2^n */
+    uint32_t                      epoch;     /* of the sequence, not 0 */
+    uint64_t                      base;      /* the last seq before them */
+    volatile uint64_t             last;
+    u_char                       *spill;     /* after the records */
+    size_t                        spill_size;    /* 2^n */
+    volatile uint64_t             spill_last;    /* bytes ever spilled */
+    ngx_lua_shdict_change_t       records[1];
+} ngx_lua_shdict_changes_t;
+
+
+/*
+ * the namespaces of a zone, see ngx_lua_shdict_ns.c, the default one
+ * included; the longest prefix a namespace is named after; the entries of
+ * the hash of the prefixes, a power of 2 twice the namespaces
+ */
+#define NGX_LUA_SHDICT_NS_MAX          64
+#define NGX_LUA_SHDICT_NS_PREFIX_LEN   32
+#define NGX_LUA_SHDICT_NS_INDEX        128
+
+/* a namespace declared by lua_shared_mem */
+typedef struct {
+    ngx_str_t                     prefix;
+    size_t                        quota;
+} ngx_lua_shdict_ns_conf_t;
+
+
+/*
+ * a namespace of a zone; the items of the default one, numbered 0, are in
+ * the lru_queue of the zone rather than in its own; an inferred one whose
+ * items are all gone is free, with a prefix_len of 0
+ */
+typedef struct {
+    ngx_queue_t                   lru_queue;
+    size_t                        quota;     /* bytes, 0 for none */
+    size_t                        used;      /* bytes */
+    ngx_uint_t                    items;
+    ngx_uint_t                    evictions;
+    u_short                       prefix_len;
+    u_char                        prefix[NGX_LUA_SHDICT_NS_PREFIX_LEN];
+} ngx_lua_shdict_ns_t;
+
+
+typedef struct {
+    ngx_uint_t                    n;         /* in use, the default one too */
+    ngx_uint_t                    declared;
+    ngx_uint_t                    next;      /* of the expiry rounds */
+    u_char                        sep;       /* 0 to infer none */
+    u_char                        full;      /* logged that none is left */
+    size_t                        quota;     /* of the inferred ones */
+
+    /* the namespaces by prefix, linear probing, 0 for an empty entry */
+    u_char                        index[NGX_LUA_SHDICT_NS_INDEX];
+
+    /* the namespaces by length of their prefix */
+    u_char                        lens[NGX_LUA_SHDICT_NS_PREFIX_LEN + 1];
+
+    ngx_lua_shdict_ns_t           slots[NGX_LUA_SHDICT_NS_MAX];
+} ngx_lua_shdict_nss_t;
+
+
+/*
+ * a namespace, as copied out by ngx_lua_ffi_shdict_ns_stats(), the same
+ * layout is declared in lib/resty/shdict.lua
+ */
+typedef struct {
+    size_t                        quota;
+    size_t                        used;
+    size_t                        items;
+    size_t                        evictions;
+    size_t                        prefix_len;
+    u_char                        prefix[NGX_LUA_SHDICT_NS_PREFIX_LEN];
+} ngx_lua_shdict_ns_stat_t;
+
+
+/* the bytes of the schema id heading a record value */
+#define NGX_LUA_SHDICT_RECORD_ID_LEN   sizeof(uint32_t)
+
+/* the "kind" of a field of a record, by C type */
+#define NGX_LUA_SHDICT_FIELD_I8        1
+#define NGX_LUA_SHDICT_FIELD_U8        2
+#define NGX_LUA_SHDICT_FIELD_I16       3
+#define NGX_LUA_SHDICT_FIELD_U16       4
+#define NGX_LUA_SHDICT_FIELD_I32       5
+#define NGX_LUA_SHDICT_FIELD_U32       6
+#define NGX_LUA_SHDICT_FIELD_I64       7
+#define NGX_LUA_SHDICT_FIELD_U64       8
+#define NGX_LUA_SHDICT_FIELD_F32       9
+#define NGX_LUA_SHDICT_FIELD_F64       10
+
+/* the "op" of a field update */
+#define NGX_LUA_SHDICT_FIELD_SET       0
+#define NGX_LUA_SHDICT_FIELD_INCR      1
+
+/*
+ * an update of a field of a record, passed to
+ * ngx_lua_ffi_shdict_update_fields(), the same layout is declared in
+ * lib/resty/shdict.lua; "num" is the operand of the floating point fields
+ * and "inum" the one of the integer fields, both set to the new value of
+ * the field on return
+ */
+typedef struct {
+    uint32_t                      offset;
+    uint8_t                       kind;
+    uint8_t                       op;
+    double                        num;
+    int64_t                       inum;
+} ngx_lua_shdict_field_op_t;
+
+
+/* the size classes and size buckets of dict:memory_report() */
+#define NGX_LUA_SHDICT_REPORT_SLABS     16
+#define NGX_LUA_SHDICT_REPORT_BUCKETS   32
+#define NGX_LUA_SHDICT_REPORT_TYPES     11
+
+/* a slab size class, as in ngx_slab_stat_t */
+typedef struct {
+    size_t                        size;
+    size_t                        pages;
+    size_t                        total;     /* slots */
+    size_t                        used;
+    size_t                        reqs;
+    size_t                        fails;
+} ngx_lua_shdict_slab_report_t;
+
+
+/*
+ * filled by ngx_lua_ffi_shdict_memory_report(), the same layout is
+ * declared in lib/resty/shdict.lua; the type arrays are indexed by value
+ * type, the size buckets by the log2 of the size, rounded up
+ */
+typedef struct {
+    size_t                        size;
+    size_t                        pages;
+    size_t                        free_pages;
+    size_t                        nslabs;
+    ngx_lua_shdict_slab_report_t  slabs[NGX_LUA_SHDICT_REPORT_SLABS];
+    size_t                        items;
+    size_t                        expired;
+    size_t                        list_values;
+    size_t                        type_items[NGX_LUA_SHDICT_REPORT_TYPES];
+    size_t                        type_bytes[NGX_LUA_SHDICT_REPORT_TYPES];
+    size_t                        key_sizes[NGX_LUA_SHDICT_REPORT_BUCKETS];
+    size_t                        value_sizes[NGX_LUA_SHDICT_REPORT_BUCKETS];
+    size_t                        key_bytes;
+    size_t                        value_bytes;
+    size_t                        header_bytes;
+    size_t                        slack_bytes;
+    size_t                        complete;
+} ngx_lua_shdict_report_t;
+
+
 typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   lru_queue;
+    ngx_queue_t                   low_queue;
+    ngx_queue_t                   pinned_queue;
+    size_t                        pinned_bytes;
+    ngx_queue_t                   waiters;
+    uint64_t                      waiter_id;
+    ngx_rbtree_t                  sems;
+    ngx_rbtree_node_t             sems_sentinel;
+    uint64_t                      sem_token;
+    ngx_rbtree_t                  leases;
+    ngx_rbtree_node_t             leases_sentinel;
+    uint64_t                      lease_token;
+    ngx_lua_shdict_hot_t         *hot;
+    ngx_lua_shdict_lfu_t         *lfu;
+    ngx_lua_shdict_changes_t     *changes;
+    ngx_lua_shdict_nss_t         *ns;
 } ngx_lua_shdict_shctx_t;
 
 
@@ -56,6 +411,16 @@ typedef struct {
     ngx_slab_pool_t              *shpool;
     ngx_str_t                     name;
     ngx_log_t                    *log;
+    ngx_uint_t                    hot_keys;
+    ngx_uint_t                    hot_sample;
+    ngx_uint_t                    hot_countdown;  /* of this process */
+    ngx_uint_t                    admission;
+    ngx_uint_t                    changes;
+    ngx_array_t                  *namespaces; /* ngx_lua_shdict_ns_conf_t */
+    u_char                        ns_sep;
+    size_t                        ns_quota;
+    size_t                        pinned;     /* bytes, 0 for none */
+    size_t                        chunked;    /* longest unchunked value */
 } ngx_lua_shdict_ctx_t;
 
 
@@ -64,12 +429,34 @@ typedef struct {
 #define NGX_LUA_SHDICT_SAFE_STORE  0x0004
 
 
+/* the number of keys ngx_lua_shdict_lookup_batch() walks the tree for */
+#define NGX_LUA_SHDICT_BATCH       16
+
+/*
+ * the number of least recently used items a forced eviction looks through
+ * for an expired one before evicting the least recently used
+ */
+#define NGX_LUA_SHDICT_EVICT_SCAN  32
+
+
+#if (defined __GNUC__ || defined __clang__)
+#define ngx_lua_shdict_prefetch(p)  __builtin_prefetch(p)
+#else
+#define ngx_lua_shdict_prefetch(p)
+#endif
+
+
 enum {
     SHDICT_TNIL = 0,        /* same as LUA_TNIL */
     SHDICT_TBOOLEAN = 1,    /* same as LUA_TBOOLEAN */
     SHDICT_TNUMBER = 3,     /* same as LUA_TNUMBER */
     SHDICT_TSTRING = 4,     /* same as LUA_TSTRING */
     SHDICT_TLIST = 5,
+    SHDICT_TRECORD = 6,     /* a schema id, then the bytes of a struct */
+    SHDICT_TBITMAP = 7,     /* see ngx_lua_shdict_bits.c */
+    SHDICT_TBLOOM = 8,
+    SHDICT_THLL = 9,        /* see ngx_lua_shdict_hll.c */
+    SHDICT_TTABLE = 10,     /* a Lua table serialized as MessagePack */
 };
 
 
@@ -80,10 +467,178 @@ typedef struct {
 
 extern ngx_module_t ngx_lua_shdict_module;
 
+ngx_int_t ngx_lua_shdict_init(ngx_shm_zone_t *shm_zone, void *data);
+char *ngx_lua_shdict_conf_init(ngx_conf_t *cf, ngx_lua_shdict_conf_t **lscfp);
 int ngx_lua_shdict_expire(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t n);
+int ngx_lua_shdict_expire_queue(ngx_lua_shdict_ctx_t *ctx,
+    ngx_queue_t *queue, ngx_uint_t n);
+void *ngx_lua_shdict_alloc(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd, size_t size, int *forcible);
+void ngx_lua_shdict_remove(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd);
+ngx_queue_t *ngx_lua_shdict_victim(ngx_lua_shdict_ctx_t *ctx);
+
+int ngx_lua_shdict_store_locked(ngx_shm_zone_t *zone, int op,
+    ngx_uint_t hash, u_char *key, size_t key_len, int value_type,
+    u_char *str_value_buf, size_t str_value_len, double num_value,
+    long exptime, int user_flags, ngx_lua_shdict_store_opts_t *opts,
+    char **errmsg, int *forcible);
+int ngx_lua_shdict_incr_locked(ngx_shm_zone_t *zone, ngx_uint_t hash,
+    u_char *key, size_t key_len, double *value, char **err, int has_init,
+    double init, long init_ttl, int *forcible);
+int ngx_lua_shdict_list_push_locked(ngx_shm_zone_t *zone, ngx_uint_t hash,
+    u_char *key, size_t key_len, ngx_lua_shdict_value_t *values,
+    int nvalues, long max_len, int *value_len, int flags, char **errmsg,
+    int *forcible);
+ngx_int_t ngx_lua_shdict_copy_value(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd, ngx_lua_shdict_value_t *v, u_char **buf,
+    size_t *buf_len, size_t *used, u_char *orig, char **errmsg);
+
+ngx_lua_shdict_chunk_t *ngx_lua_shdict_chunks_alloc(
+    ngx_lua_shdict_ctx_t *ctx, size_t len, ngx_uint_t evict, int *forcible);
+void ngx_lua_shdict_chunks_free(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_chunk_t *chunk);
+size_t ngx_lua_shdict_chunks_size(size_t len);
+void ngx_lua_shdict_chunks_write(ngx_lua_shdict_chunk_t *chunk, u_char *data,
+    size_t len);
+void ngx_lua_shdict_chunks_read(ngx_lua_shdict_chunk_t *chunk, u_char *dst,
+    size_t len);
+ngx_int_t ngx_lua_shdict_chunks_cmp(ngx_lua_shdict_chunk_t *chunk,
+    u_char *data, size_t len);
+ngx_lua_shdict_chunk_t *ngx_lua_shdict_chunks_copy(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_chunk_t *chunk, size_t len);
+
+ngx_lua_shdict_node_t *ngx_lua_shdict_bits_alloc(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *old, ngx_uint_t hash, u_char *key, size_t key_len,
+    ngx_uint_t type, size_t size, int *forcible);
+void ngx_lua_shdict_bits_link(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd);
+ngx_int_t ngx_lua_shdict_bits_lookup(ngx_shm_zone_t *zone, ngx_uint_t hash,
+    u_char *key, size_t key_len, ngx_uint_t type,
+    ngx_lua_shdict_node_t **sdp);
+
+ngx_int_t ngx_lua_shdict_hot_init(ngx_lua_shdict_ctx_t *ctx);
+void ngx_lua_shdict_hot_sample(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *kdata, size_t klen);
+
+ngx_int_t ngx_lua_shdict_lfu_init(ngx_lua_shdict_ctx_t *ctx, size_t size);
+void ngx_lua_shdict_lfu_add(ngx_lua_shdict_lfu_t *lfu, ngx_uint_t hash);
+ngx_int_t ngx_lua_shdict_lfu_admit(ngx_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash);
+
+ngx_int_t ngx_lua_shdict_wait_init_module(ngx_cycle_t *cycle);
+ngx_int_t ngx_lua_shdict_wait_init_process(ngx_cycle_t *cycle);
+ngx_lua_shdict_waiter_t *ngx_lua_shdict_wait_add(ngx_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash, ngx_msec_t timeout, void *sema, void *post);
+void ngx_lua_shdict_wait_del(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_waiter_t *waiter, uint64_t id);
+void ngx_lua_shdict_wakeup(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    ngx_uint_t n);
+
+ngx_int_t ngx_lua_shdict_ns_init(ngx_lua_shdict_ctx_t *ctx);
+ngx_uint_t ngx_lua_shdict_ns_find(ngx_lua_shdict_ctx_t *ctx, u_char *key,
+    size_t key_len);
+void ngx_lua_shdict_ns_link(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd);
+void ngx_lua_shdict_ns_unlink(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd);
+size_t ngx_lua_shdict_ns_item_size(ngx_lua_shdict_node_t *sd);
+ngx_int_t ngx_lua_shdict_ns_reserve(ngx_lua_shdict_ctx_t *ctx, u_char *key,
+    size_t key_len, ngx_lua_shdict_node_t *sd, size_t size);
+ngx_queue_t *ngx_lua_shdict_ns_victim(ngx_lua_shdict_ctx_t *ctx);
+
+ngx_int_t ngx_lua_shdict_changes_init(ngx_lua_shdict_ctx_t *ctx);
+void ngx_lua_shdict_changes_add(ngx_lua_shdict_changes_t *changes,
+    ngx_uint_t op, ngx_uint_t hash, u_char *key, size_t key_len);
+
+void ngx_lua_shdict_sem_rbtree_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
+void ngx_lua_shdict_lease_rbtree_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+ngx_int_t ngx_lua_shdict_lease_grant(ngx_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash, u_char *key, size_t key_len, ngx_msec_t ttl,
+    uint64_t *token);
+ngx_int_t ngx_lua_shdict_lease_end(ngx_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash, u_char *key, size_t key_len, uint64_t token);
+void ngx_lua_shdict_lease_flush(ngx_lua_shdict_ctx_t *ctx);
 
 ngx_int_t ngx_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
     u_char *kdata, size_t klen, ngx_lua_shdict_node_t **sdp);
+void ngx_lua_shdict_lookup_batch(ngx_shm_zone_t *shm_zone, ngx_uint_t *hashes,
+    ngx_str_t *keys, ngx_uint_t n, ngx_lua_shdict_node_t **sds);
+
+
+/*
+ * MurmurHash64A, consuming 8 bytes of the key per round instead of the
+ * byte at a time of ngx_crc32_short(); the whole 64-bit result is used as
+ * the rbtree key where ngx_rbtree_key_t is that wide, which makes hash
+ * ties, and so full key comparisons, very unlikely
+ */
+
+static ngx_inline uint64_t
+ngx_lua_shdict_hash64(u_char *data, size_t len)
+{
+    uint64_t                     h, k;
+    const uint64_t               m = 0xc6a4a7935bd1e995ULL;
+    const int                    r = 47;
+
+    h = 0x5bd1e995 ^ (len * m);
+
+    while (len >= 8) {
+        ngx_memcpy(&k, data, sizeof(uint64_t));
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+
+        data += 8;
+        len -= 8;
+    }
+
+    switch (len) {
+    case 7: h ^= (uint64_t) data[6] << 48;  /* fall through */
+    case 6: h ^= (uint64_t) data[5] << 40;  /* fall through */
+    case 5: h ^= (uint64_t) data[4] << 32;  /* fall through */
+    case 4: h ^= (uint64_t) data[3] << 24;  /* fall through */
+    case 3: h ^= (uint64_t) data[2] << 16;  /* fall through */
+    case 2: h ^= (uint64_t) data[1] << 8;   /* fall through */
+    case 1: h ^= (uint64_t) data[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_lua_shdict_hash(u_char *data, size_t len)
+{
+    return (ngx_uint_t) ngx_lua_shdict_hash64(data, len);
+}
+
+
+/*
+ * called with the zone locked after a change of "key", the log of a zone
+ * whose "changes" parameter was removed on reload being kept but no
+ * longer written by the new workers
+ */
+
+static ngx_inline void
+ngx_lua_shdict_change(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t op,
+    ngx_uint_t hash, u_char *key, size_t key_len)
+{
+    if (ctx->changes && ctx->sh->changes) {
+        ngx_lua_shdict_changes_add(ctx->sh->changes, op, hash, key, key_len);
+    }
+}
 
 
 static ngx_inline ngx_queue_t *
@@ -94,4 +649,183 @@ ngx_lua_shdict_get_list_head(ngx_lua_shdict_node_t *sd, size_t len)
 }
 
 
+/* the first chunk of the value of "sd", aligned after its key */
+
+static ngx_inline ngx_lua_shdict_chunk_t **
+ngx_lua_shdict_get_chunks(ngx_lua_shdict_node_t *sd)
+{
+    return (ngx_lua_shdict_chunk_t **)
+               ngx_align_ptr(sd->data + sd->key_len, NGX_ALIGNMENT);
+}
+
+
+/*
+ * the size of the node of the item "sd", without the elements of a list
+ * or the chunks of a value
+ */
+
+static ngx_inline size_t
+ngx_lua_shdict_node_size(ngx_lua_shdict_node_t *sd)
+{
+    size_t                       n;
+
+    n = offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_lua_shdict_node_t, data)
+        + sd->key_len;
+
+    if (sd->value_type == SHDICT_TLIST) {
+        return (size_t) ngx_align_ptr(n + sizeof(ngx_queue_t), NGX_ALIGNMENT);
+    }
+
+    if (sd->chunked) {
+        return ngx_align(n, NGX_ALIGNMENT) + sizeof(ngx_lua_shdict_chunk_t *);
+    }
+
+    return n + sd->value_len;
+}
+
+
+/* copies the string value of "sd" to "dst", from its chunks if any */
+
+static ngx_inline void
+ngx_lua_shdict_read_value(ngx_lua_shdict_node_t *sd, u_char *dst)
+{
+    if (sd->chunked) {
+        ngx_lua_shdict_chunks_read(*ngx_lua_shdict_get_chunks(sd), dst,
+                                   sd->value_len);
+        return;
+    }
+
+    ngx_memcpy(dst, sd->data + sd->key_len, sd->value_len);
+}
+
+
+static ngx_inline size_t
+ngx_lua_shdict_list_node_size(ngx_lua_shdict_list_node_t *lnode)
+{
+    return offsetof(ngx_lua_shdict_list_node_t, data) + lnode->value_len;
+}
+
+
+/* the namespaces are counted from 0, the default one */
+
+static ngx_inline ngx_uint_t
+ngx_lua_shdict_ns_count(ngx_lua_shdict_ctx_t *ctx)
+{
+    return ctx->sh->ns ? ctx->sh->ns->n : 1;
+}
+
+
+static ngx_inline ngx_queue_t *
+ngx_lua_shdict_ns_queue(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t i)
+{
+    return i ? &ctx->sh->ns->slots[i].lru_queue : &ctx->sh->lru_queue;
+}
+
+
+/*
+ * the LRU queues of all the items, those of the namespaces, then the ones
+ * of the low priority and of the pinned items
+ */
+
+static ngx_inline ngx_uint_t
+ngx_lua_shdict_queue_count(ngx_lua_shdict_ctx_t *ctx)
+{
+    return ngx_lua_shdict_ns_count(ctx) + 2;
+}
+
+
+static ngx_inline ngx_queue_t *
+ngx_lua_shdict_nth_queue(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t i)
+{
+    ngx_uint_t                   n;
+
+    n = ngx_lua_shdict_ns_count(ctx);
+
+    if (i < n) {
+        return ngx_lua_shdict_ns_queue(ctx, i);
+    }
+
+    return i == n ? &ctx->sh->low_queue : &ctx->sh->pinned_queue;
+}
+
+
+/* the LRU queue of the item "sd", by priority and namespace */
+
+static ngx_inline ngx_queue_t *
+ngx_lua_shdict_item_queue(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd)
+{
+    switch (sd->priority) {
+
+    case NGX_LUA_SHDICT_PRIO_LOW:
+        return &ctx->sh->low_queue;
+
+    case NGX_LUA_SHDICT_PRIO_PINNED:
+        return &ctx->sh->pinned_queue;
+
+    default:
+        return ngx_lua_shdict_ns_queue(ctx, sd->ns);
+    }
+}
+
+
+/* makes "sd" the most recently used item of its queue */
+
+static ngx_inline void
+ngx_lua_shdict_touch(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd)
+{
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_head(ngx_lua_shdict_item_queue(ctx, sd), &sd->queue);
+}
+
+
+/*
+ * counts "size" bytes added to the item "sd", or removed from it when
+ * negative, in the pinned bytes of the zone for a pinned item, and in its
+ * namespace for an item of normal priority
+ */
+
+static ngx_inline void
+ngx_lua_shdict_ns_charge(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd, ssize_t size)
+{
+    if (sd->priority == NGX_LUA_SHDICT_PRIO_PINNED) {
+        ctx->sh->pinned_bytes += size;
+
+    } else if (ctx->sh->ns && sd->priority == NGX_LUA_SHDICT_PRIO_NORMAL) {
+        ctx->sh->ns->slots[sd->ns].used += size;
+    }
+}
+
+
+/* whether the item "sd" takes its namespace over its quota */
+
+static ngx_inline ngx_uint_t
+ngx_lua_shdict_ns_over(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd)
+{
+    ngx_lua_shdict_ns_t          *slot;
+
+    if (ctx->sh->ns == NULL || sd->priority != NGX_LUA_SHDICT_PRIO_NORMAL) {
+        return 0;
+    }
+
+    slot = &ctx->sh->ns->slots[sd->ns];
+
+    return slot->quota && slot->used > slot->quota;
+}
+
+
+/* frees the element "lnode" of the list "sd" */
+
+static ngx_inline void
+ngx_lua_shdict_list_free(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd,
+    ngx_lua_shdict_list_node_t *lnode)
+{
+    ngx_lua_shdict_ns_charge(ctx, sd,
+                             -(ssize_t) ngx_lua_shdict_list_node_size(lnode));
+    ngx_slab_free_locked(ctx->shpool, lnode);
+}
+
+
 #endif /* _NGX_LUA_SHDICT_COMMON_H_ */
@@ -0,0 +1,613 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * HyperLogLogs: 16384 registers of 6 bits, each the largest rank of the
+ * first bit set in the hashes of the items added falling to it, from
+ * which dict:pfcount() estimates the number of distinct items with a
+ * standard error of 0.81%. The registers are held dense, packed into
+ * 12 KiB as in Redis, once the HyperLogLog has seen enough items, and
+ * sparse before that, as a sorted array of the registers set, each a
+ * 32-bit word of its index and value, which grows by doubling up to the
+ * size past which the dense registers are smaller to scan. Items are
+ * added in place under the one lock of the call, however many there are.
+ * The registers are read here into a histogram of their values, which
+ * the Lua side turns into an estimate with the estimator of Ertl, as
+ * Redis does, so that no floating point math is done with the zone
+ * locked.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+#define NGX_LUA_SHDICT_HLL_P          14
+#define NGX_LUA_SHDICT_HLL_Q          (64 - NGX_LUA_SHDICT_HLL_P)
+#define NGX_LUA_SHDICT_HLL_REGISTERS  (1 << NGX_LUA_SHDICT_HLL_P)
+#define NGX_LUA_SHDICT_HLL_BITS       6
+#define NGX_LUA_SHDICT_HLL_MAX        ((1 << NGX_LUA_SHDICT_HLL_BITS) - 1)
+
+/* one byte more, for the last register to be read as two bytes as well */
+#define NGX_LUA_SHDICT_HLL_DENSE                                              \
+    (NGX_LUA_SHDICT_HLL_REGISTERS * NGX_LUA_SHDICT_HLL_BITS / 8 + 1)
+
+/* the sparse registers of a new HyperLogLog, and the most of them */
+#define NGX_LUA_SHDICT_HLL_SPARSE_MIN  8
+#define NGX_LUA_SHDICT_HLL_SPARSE_MAX  750
+
+#define NGX_LUA_SHDICT_HLL_SPARSE     0
+#define NGX_LUA_SHDICT_HLL_DENSE_ENC  1
+
+
+typedef struct {
+    uint32_t                     encoding;
+    uint32_t                     n;          /* the sparse registers set */
+} ngx_lua_shdict_hll_t;
+
+
+#define NGX_LUA_SHDICT_HLL_HDR  sizeof(ngx_lua_shdict_hll_t)
+
+
+static ngx_lua_shdict_node_t *ngx_lua_shdict_hll_dense(
+    ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd, ngx_uint_t hash,
+    int *forcible);
+static ngx_inline ngx_uint_t ngx_lua_shdict_hll_get(u_char *p, ngx_uint_t i);
+static ngx_inline void ngx_lua_shdict_hll_set(u_char *p, ngx_uint_t i,
+    ngx_uint_t v);
+static void ngx_lua_shdict_hll_merge(u_char *regs, u_char *p);
+
+
+/* the register and the rank of the item of 64-bit hash "h" */
+
+static ngx_inline void
+ngx_lua_shdict_hll_hash(uint64_t h, ngx_uint_t *index, ngx_uint_t *rank)
+{
+    ngx_uint_t                   r;
+
+    *index = (ngx_uint_t) (h & (NGX_LUA_SHDICT_HLL_REGISTERS - 1));
+
+    /* the rank of a hash with no bit set past the index is Q + 1 */
+
+    h >>= NGX_LUA_SHDICT_HLL_P;
+    h |= (uint64_t) 1 << NGX_LUA_SHDICT_HLL_Q;
+
+#if (defined __GNUC__ || defined __clang__)
+    r = (ngx_uint_t) __builtin_ctzll(h) + 1;
+#else
+    for (r = 1; !(h & 1); r++) {
+        h >>= 1;
+    }
+#endif
+
+    *rank = r;
+}
+
+
+/*
+ * adds the "nitems" items of "items" to the HyperLogLog "key", which is
+ * created first when it does not exist, and sets "*changed" when one of
+ * its registers changed, or it was created
+ */
+
+int
+ngx_lua_ffi_shdict_pfadd(ngx_shm_zone_t *zone, u_char *key, size_t key_len,
+    ngx_str_t *items, int nitems, int *changed, char **errmsg,
+    int *forcible)
+{
+    int                          i;
+    u_char                      *p, *entries;
+    uint32_t                     e;
+    ngx_uint_t                   hash, index, rank, lo, hi, mid, cap;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+    ngx_lua_shdict_hll_t         hll;
+
+    ctx = zone->data;
+
+    *forcible = 0;
+    *changed = 0;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_lua_shdict_bits_lookup(zone, hash, key, key_len, SHDICT_THLL,
+                                    &sd);
+
+    if (rc == NGX_ERROR) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not a hyperloglog";
+        return NGX_ERROR;
+    }
+
+    if (sd == NULL) {
+        sd = ngx_lua_shdict_bits_alloc(ctx, NULL, hash, key, key_len,
+                                       SHDICT_THLL,
+                                       NGX_LUA_SHDICT_HLL_HDR
+                                       + NGX_LUA_SHDICT_HLL_SPARSE_MIN
+                                         * sizeof(uint32_t),
+                                       forcible);
+        if (sd == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+
+        /* zeroed, an empty sparse HyperLogLog */
+
+        ngx_lua_shdict_bits_link(ctx, sd);
+
+        *changed = 1;
+    }
+
+    for (i = 0; i < nitems; i++) {
+        ngx_lua_shdict_hll_hash(ngx_lua_shdict_hash64(items[i].data,
+                                                      items[i].len),
+                                &index, &rank);
+
+        p = sd->data + key_len;
+
+        ngx_memcpy(&hll, p, NGX_LUA_SHDICT_HLL_HDR);
+
+        p += NGX_LUA_SHDICT_HLL_HDR;
+
+        if (hll.encoding == NGX_LUA_SHDICT_HLL_DENSE_ENC) {
+            if (ngx_lua_shdict_hll_get(p, index) < rank) {
+                ngx_lua_shdict_hll_set(p, index, rank);
+                *changed = 1;
+            }
+
+            continue;
+        }
+
+        /* the entries are sorted by index, which holds their upper bits */
+
+        entries = p;
+
+        lo = 0;
+        hi = hll.n;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            ngx_memcpy(&e, entries + mid * sizeof(uint32_t),
+                       sizeof(uint32_t));
+
+            if ((e >> 8) < index) {
+                lo = mid + 1;
+
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo < hll.n) {
+            ngx_memcpy(&e, entries + lo * sizeof(uint32_t),
+                       sizeof(uint32_t));
+
+            if ((e >> 8) == index) {
+                if ((e & 0xff) < rank) {
+                    e = (uint32_t) (index << 8 | rank);
+                    ngx_memcpy(entries + lo * sizeof(uint32_t), &e,
+                               sizeof(uint32_t));
+                    *changed = 1;
+                }
+
+                continue;
+            }
+        }
+
+        cap = (sd->value_len - NGX_LUA_SHDICT_HLL_HDR) / sizeof(uint32_t);
+
+        if (hll.n == cap) {
+
+            if (cap == NGX_LUA_SHDICT_HLL_SPARSE_MAX) {
+                sd = ngx_lua_shdict_hll_dense(ctx, sd, hash, forcible);
+                if (sd == NULL) {
+                    goto failed;
+                }
+
+                p = sd->data + key_len + NGX_LUA_SHDICT_HLL_HDR;
+
+                ngx_lua_shdict_hll_set(p, index, rank);
+                *changed = 1;
+
+                continue;
+            }
+
+            cap = ngx_min(cap * 2, NGX_LUA_SHDICT_HLL_SPARSE_MAX);
+
+            sd = ngx_lua_shdict_bits_alloc(ctx, sd, hash, key, key_len,
+                                           SHDICT_THLL,
+                                           NGX_LUA_SHDICT_HLL_HDR
+                                           + cap * sizeof(uint32_t),
+                                           forcible);
+            if (sd == NULL) {
+                goto failed;
+            }
+
+            ngx_lua_shdict_bits_link(ctx, sd);
+
+            entries = sd->data + key_len + NGX_LUA_SHDICT_HLL_HDR;
+        }
+
+        p = entries + lo * sizeof(uint32_t);
+
+        ngx_memmove(p + sizeof(uint32_t), p, (hll.n - lo) * sizeof(uint32_t));
+
+        e = (uint32_t) (index << 8 | rank);
+        ngx_memcpy(p, &e, sizeof(uint32_t));
+
+        hll.n++;
+        ngx_memcpy(sd->data + key_len, &hll, NGX_LUA_SHDICT_HLL_HDR);
+
+        *changed = 1;
+    }
+
+    if (*changed) {
+        ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_SET, hash, key,
+                              key_len);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+
+failed:
+
+    /* the items added so far stay */
+
+    if (*changed) {
+        ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_SET, hash, key,
+                              key_len);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    *errmsg = "no memory";
+    return NGX_ERROR;
+}
+
+
+/*
+ * turns the sparse HyperLogLog "sd" into a dense one, linked in its place;
+ * returns NULL, "sd" being left as it is, when out of memory
+ */
+
+static ngx_lua_shdict_node_t *
+ngx_lua_shdict_hll_dense(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd, ngx_uint_t hash, int *forcible)
+{
+    u_char                      *p;
+    uint32_t                     e, i, n;
+    ngx_lua_shdict_hll_t         hll;
+    uint32_t                     entries[NGX_LUA_SHDICT_HLL_SPARSE_MAX];
+
+    p = sd->data + sd->key_len;
+
+    ngx_memcpy(&hll, p, NGX_LUA_SHDICT_HLL_HDR);
+
+    n = hll.n;
+    ngx_memcpy(entries, p + NGX_LUA_SHDICT_HLL_HDR, n * sizeof(uint32_t));
+
+    sd = ngx_lua_shdict_bits_alloc(ctx, sd, hash, sd->data, sd->key_len,
+                                   SHDICT_THLL,
+                                   NGX_LUA_SHDICT_HLL_HDR
+                                   + NGX_LUA_SHDICT_HLL_DENSE,
+                                   forcible);
+    if (sd == NULL) {
+        return NULL;
+    }
+
+    p = sd->data + sd->key_len;
+
+    /* the sparse value was copied in, the registers start from zero */
+
+    ngx_memzero(p, NGX_LUA_SHDICT_HLL_HDR + NGX_LUA_SHDICT_HLL_DENSE);
+
+    hll.encoding = NGX_LUA_SHDICT_HLL_DENSE_ENC;
+    hll.n = 0;
+
+    ngx_memcpy(p, &hll, NGX_LUA_SHDICT_HLL_HDR);
+
+    p += NGX_LUA_SHDICT_HLL_HDR;
+
+    for (i = 0; i < n; i++) {
+        e = entries[i];
+        ngx_lua_shdict_hll_set(p, e >> 8, e & 0xff);
+    }
+
+    ngx_lua_shdict_bits_link(ctx, sd);
+
+    return sd;
+}
+
+
+/*
+ * sets "hist" to the histogram of the values of the registers of the
+ * union of the HyperLogLogs "keys", missing ones counting as empty
+ */
+
+int
+ngx_lua_ffi_shdict_pfcount(ngx_shm_zone_t *zone, ngx_str_t *keys, int nkeys,
+    int *hist, char **errmsg)
+{
+    int                          i;
+    u_char                      *p;
+    uint32_t                     e, j;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+    ngx_lua_shdict_hll_t         hll;
+    u_char                       regs[NGX_LUA_SHDICT_HLL_REGISTERS];
+
+    ctx = zone->data;
+
+    ngx_memzero(hist, (NGX_LUA_SHDICT_HLL_Q + 2) * sizeof(int));
+
+    if (nkeys <= 0) {
+        *errmsg = "bad number of keys";
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    if (nkeys == 1) {
+
+        /* counted off the value as it is, there is nothing to merge */
+
+        rc = ngx_lua_shdict_lookup(zone,
+                                   ngx_lua_shdict_hash(keys[0].data,
+                                                       keys[0].len),
+                                   keys[0].data, keys[0].len, &sd);
+        if (rc != NGX_OK) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            hist[0] = NGX_LUA_SHDICT_HLL_REGISTERS;
+            return NGX_OK;
+        }
+
+        if (sd->value_type != SHDICT_THLL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "not a hyperloglog";
+            return NGX_ERROR;
+        }
+
+        p = sd->data + sd->key_len;
+
+        ngx_memcpy(&hll, p, NGX_LUA_SHDICT_HLL_HDR);
+
+        p += NGX_LUA_SHDICT_HLL_HDR;
+
+        if (hll.encoding == NGX_LUA_SHDICT_HLL_DENSE_ENC) {
+            for (j = 0; j < NGX_LUA_SHDICT_HLL_REGISTERS; j++) {
+                hist[ngx_lua_shdict_hll_get(p, j)]++;
+            }
+
+        } else {
+            hist[0] = NGX_LUA_SHDICT_HLL_REGISTERS - hll.n;
+
+            for (j = 0; j < hll.n; j++) {
+                ngx_memcpy(&e, p + j * sizeof(uint32_t), sizeof(uint32_t));
+                hist[e & 0xff]++;
+            }
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        return NGX_OK;
+    }
+
+    ngx_memzero(regs, NGX_LUA_SHDICT_HLL_REGISTERS);
+
+    for (i = 0; i < nkeys; i++) {
+        rc = ngx_lua_shdict_lookup(zone,
+                                   ngx_lua_shdict_hash(keys[i].data,
+                                                       keys[i].len),
+                                   keys[i].data, keys[i].len, &sd);
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        if (sd->value_type != SHDICT_THLL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "not a hyperloglog";
+            return NGX_ERROR;
+        }
+
+        ngx_lua_shdict_hll_merge(regs, sd->data + sd->key_len);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    for (j = 0; j < NGX_LUA_SHDICT_HLL_REGISTERS; j++) {
+        hist[regs[j]]++;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * stores the union of the HyperLogLogs "keys" and of "dst", when it is one
+ * already, into "dst", missing ones counting as empty; "dst" is dense
+ * afterwards
+ */
+
+int
+ngx_lua_ffi_shdict_pfmerge(ngx_shm_zone_t *zone, u_char *dst,
+    size_t dst_len, ngx_str_t *keys, int nkeys, char **errmsg,
+    int *forcible)
+{
+    int                          i;
+    u_char                      *p;
+    uint32_t                     j;
+    ngx_uint_t                   hash;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+    ngx_lua_shdict_hll_t         hll;
+    u_char                       regs[NGX_LUA_SHDICT_HLL_REGISTERS];
+
+    ctx = zone->data;
+
+    *forcible = 0;
+
+    hash = ngx_lua_shdict_hash(dst, dst_len);
+
+    ngx_memzero(regs, NGX_LUA_SHDICT_HLL_REGISTERS);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, dst, dst_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    /*
+     * the sources are merged into "regs" before "dst" is allocated, so
+     * that its evictions can take them
+     */
+
+    for (i = 0; i < nkeys; i++) {
+        rc = ngx_lua_shdict_lookup(zone,
+                                   ngx_lua_shdict_hash(keys[i].data,
+                                                       keys[i].len),
+                                   keys[i].data, keys[i].len, &sd);
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        if (sd->value_type != SHDICT_THLL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "not a hyperloglog";
+            return NGX_ERROR;
+        }
+
+        ngx_lua_shdict_hll_merge(regs, sd->data + sd->key_len);
+    }
+
+    rc = ngx_lua_shdict_bits_lookup(zone, hash, dst, dst_len, SHDICT_THLL,
+                                    &sd);
+
+    if (rc == NGX_ERROR) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not a hyperloglog";
+        return NGX_ERROR;
+    }
+
+    if (sd != NULL) {
+        ngx_lua_shdict_hll_merge(regs, sd->data + dst_len);
+
+        ngx_memcpy(&hll, sd->data + dst_len, NGX_LUA_SHDICT_HLL_HDR);
+    }
+
+    if (sd == NULL || hll.encoding != NGX_LUA_SHDICT_HLL_DENSE_ENC) {
+        sd = ngx_lua_shdict_bits_alloc(ctx, sd, hash, dst, dst_len,
+                                       SHDICT_THLL,
+                                       NGX_LUA_SHDICT_HLL_HDR
+                                       + NGX_LUA_SHDICT_HLL_DENSE,
+                                       forcible);
+        if (sd == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+
+        ngx_lua_shdict_bits_link(ctx, sd);
+    }
+
+    p = sd->data + dst_len;
+
+    ngx_memzero(p, NGX_LUA_SHDICT_HLL_HDR + NGX_LUA_SHDICT_HLL_DENSE);
+
+    hll.encoding = NGX_LUA_SHDICT_HLL_DENSE_ENC;
+    hll.n = 0;
+
+    ngx_memcpy(p, &hll, NGX_LUA_SHDICT_HLL_HDR);
+
+    p += NGX_LUA_SHDICT_HLL_HDR;
+
+    for (j = 0; j < NGX_LUA_SHDICT_HLL_REGISTERS; j++) {
+        if (regs[j]) {
+            ngx_lua_shdict_hll_set(p, j, regs[j]);
+        }
+    }
+
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_SET, hash, dst,
+                          dst_len);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* raises the registers of "regs" to those of the HyperLogLog value "p" */
+
+static void
+ngx_lua_shdict_hll_merge(u_char *regs, u_char *p)
+{
+    uint32_t                     e, j;
+    ngx_uint_t                   v;
+    ngx_lua_shdict_hll_t         hll;
+
+    ngx_memcpy(&hll, p, NGX_LUA_SHDICT_HLL_HDR);
+
+    p += NGX_LUA_SHDICT_HLL_HDR;
+
+    if (hll.encoding == NGX_LUA_SHDICT_HLL_DENSE_ENC) {
+        for (j = 0; j < NGX_LUA_SHDICT_HLL_REGISTERS; j++) {
+            v = ngx_lua_shdict_hll_get(p, j);
+
+            if (regs[j] < v) {
+                regs[j] = (u_char) v;
+            }
+        }
+
+        return;
+    }
+
+    for (j = 0; j < hll.n; j++) {
+        ngx_memcpy(&e, p + j * sizeof(uint32_t), sizeof(uint32_t));
+
+        if (regs[e >> 8] < (e & 0xff)) {
+            regs[e >> 8] = (u_char) (e & 0xff);
+        }
+    }
+}
+
+
+/* the register "i" of the dense registers "p", little endian as in Redis */
+
+static ngx_inline ngx_uint_t
+ngx_lua_shdict_hll_get(u_char *p, ngx_uint_t i)
+{
+    ngx_uint_t                   b, s;
+
+    b = i * NGX_LUA_SHDICT_HLL_BITS / 8;
+    s = i * NGX_LUA_SHDICT_HLL_BITS % 8;
+
+    return ((p[b] >> s) | ((ngx_uint_t) p[b + 1] << (8 - s)))
+           & NGX_LUA_SHDICT_HLL_MAX;
+}
+
+
+static ngx_inline void
+ngx_lua_shdict_hll_set(u_char *p, ngx_uint_t i, ngx_uint_t v)
+{
+    ngx_uint_t                   b, s;
+
+    b = i * NGX_LUA_SHDICT_HLL_BITS / 8;
+    s = i * NGX_LUA_SHDICT_HLL_BITS % 8;
+
+    p[b] &= (u_char) ~(NGX_LUA_SHDICT_HLL_MAX << s);
+    p[b] |= (u_char) (v << s);
+    p[b + 1] &= (u_char) ~(NGX_LUA_SHDICT_HLL_MAX >> (8 - s));
+    p[b + 1] |= (u_char) (v >> (8 - s));
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * hot key detection: one in about "hot_keys_sample" lookups of a process
+ * is counted in a Count-Min sketch kept in the zone, and the keys with the
+ * highest estimates are monitored in a Space-Saving summary of "hot_keys"
+ * slots, whose least counted slot is taken over by a key estimated to be
+ * more popular. Both are updated under the zone lock the lookup holds
+ * already, and all the counts are halved every few sketch widths worth of
+ * samples so that keys which cooled down leave the summary.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+#define NGX_LUA_SHDICT_HOT_DEPTH     4
+#define NGX_LUA_SHDICT_HOT_WIDTH     256
+#define NGX_LUA_SHDICT_HOT_AGING     10
+
+
+static uint32_t ngx_lua_shdict_hot_count(ngx_lua_shdict_hot_t *hot,
+    ngx_uint_t hash);
+static void ngx_lua_shdict_hot_age(ngx_lua_shdict_hot_t *hot);
+static int ngx_libc_cdecl ngx_lua_shdict_hot_cmp(const void *one,
+    const void *two);
+
+
+/*
+ * sets the tracker of the zone up for the configuration of "ctx", keeping
+ * the counts of a zone reused on reload when "hot_keys" has not changed
+ */
+
+ngx_int_t
+ngx_lua_shdict_hot_init(ngx_lua_shdict_ctx_t *ctx)
+{
+    size_t                        size;
+    ngx_uint_t                    width;
+    ngx_lua_shdict_hot_t         *hot;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    hot = ctx->sh->hot;
+
+    if (hot != NULL) {
+
+        if (hot->size == ctx->hot_keys) {
+            hot->sample = ctx->hot_sample;
+
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return NGX_OK;
+        }
+
+        ctx->sh->hot = NULL;
+        ngx_slab_free_locked(ctx->shpool, hot);
+    }
+
+    if (ctx->hot_keys == 0) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    for (width = NGX_LUA_SHDICT_HOT_WIDTH;
+         width < ctx->hot_keys * 8;
+         width <<= 1)
+    {
+        /* void */
+    }
+
+    size = sizeof(ngx_lua_shdict_hot_t)
+           + ctx->hot_keys * sizeof(ngx_lua_shdict_hot_key_t)
+           + NGX_LUA_SHDICT_HOT_DEPTH * width * sizeof(uint32_t);
+
+    hot = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (hot == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                      "lua shared dict \"%V\" is too small for hot_keys=%ui",
+                      &ctx->name, ctx->hot_keys);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(hot, size);
+
+    hot->size = ctx->hot_keys;
+    hot->width = width;
+    hot->sample = ctx->hot_sample;
+    hot->keys = (ngx_lua_shdict_hot_key_t *) (hot + 1);
+    hot->sketch = (uint32_t *) (hot->keys + hot->size);
+
+    ctx->sh->hot = hot;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* called with the zone locked when the countdown of the process expires */
+
+void
+ngx_lua_shdict_hot_sample(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *kdata, size_t klen)
+{
+    uint32_t                      est;
+    ngx_uint_t                    i;
+    ngx_lua_shdict_hot_t         *hot;
+    ngx_lua_shdict_hot_key_t     *hk, *min;
+
+    /*
+     * the gaps between two samples are random with a mean of hot_sample,
+     * so that keys accessed at a fixed stride are not always missed
+     */
+
+    ctx->hot_countdown = 1 + (ngx_uint_t) ngx_random()
+                             % (2 * ctx->hot_sample - 1);
+
+    hot = ctx->sh->hot;
+    if (hot == NULL) {
+        return;
+    }
+
+    est = ngx_lua_shdict_hot_count(hot, hash);
+
+    min = NULL;
+
+    for (i = 0; i < hot->nkeys; i++) {
+        hk = &hot->keys[i];
+
+        if (hk->hash == hash
+            && hk->key_len == klen
+            && ngx_memcmp(hk->key, kdata,
+                          ngx_min(klen, NGX_LUA_SHDICT_HOT_KEY_LEN)) == 0)
+        {
+            hk->count = est;
+            goto done;
+        }
+
+        if (min == NULL || hk->count < min->count) {
+            min = hk;
+        }
+    }
+
+    if (hot->nkeys < hot->size) {
+        hk = &hot->keys[hot->nkeys++];
+
+    } else if (est > min->count) {
+        hk = min;
+
+    } else {
+        goto done;
+    }
+
+    hk->hash = hash;
+    hk->count = est;
+    hk->key_len = (u_short) klen;
+    ngx_memcpy(hk->key, kdata, ngx_min(klen, NGX_LUA_SHDICT_HOT_KEY_LEN));
+
+done:
+
+    if (++hot->samples >= hot->width * NGX_LUA_SHDICT_HOT_AGING) {
+        ngx_lua_shdict_hot_age(hot);
+    }
+}
+
+
+/*
+ * increments the counters of "hash" which hold its current estimate only,
+ * the conservative update, and returns the new estimate
+ */
+
+static uint32_t
+ngx_lua_shdict_hot_count(ngx_lua_shdict_hot_t *hot, ngx_uint_t hash)
+{
+    uint32_t                      h1, h2, min;
+    uint32_t                     *c[NGX_LUA_SHDICT_HOT_DEPTH];
+    ngx_uint_t                    i;
+
+    /* the rows are indexed by double hashing of the key hash */
+
+    h1 = (uint32_t) hash;
+    h2 = (uint32_t) (((uint64_t) hash * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+
+    min = NGX_MAX_UINT32_VALUE;
+
+    for (i = 0; i < NGX_LUA_SHDICT_HOT_DEPTH; i++) {
+        c[i] = &hot->sketch[i * hot->width
+                            + ((h1 + i * h2) & (hot->width - 1))];
+
+        if (*c[i] < min) {
+            min = *c[i];
+        }
+    }
+
+    if (min == NGX_MAX_UINT32_VALUE) {
+        return min;
+    }
+
+    for (i = 0; i < NGX_LUA_SHDICT_HOT_DEPTH; i++) {
+        if (*c[i] == min) {
+            (*c[i])++;
+        }
+    }
+
+    return min + 1;
+}
+
+
+static void
+ngx_lua_shdict_hot_age(ngx_lua_shdict_hot_t *hot)
+{
+    ngx_uint_t                    i;
+
+    for (i = 0; i < NGX_LUA_SHDICT_HOT_DEPTH * hot->width; i++) {
+        hot->sketch[i] >>= 1;
+    }
+
+    for (i = 0; i < hot->nkeys; i++) {
+        hot->keys[i].count >>= 1;
+    }
+
+    hot->samples = 0;
+}
+
+
+/*
+ * returns up to "n" monitored keys, or all of them when "n" is 0, most
+ * accessed first, as an array of ngx_lua_shdict_value_t whose num_value
+ * is the estimated number of lookups, followed by the keys, in "*buf",
+ * which is replaced by a malloc'ed block when it is too small
+ */
+
+int
+ngx_lua_ffi_shdict_hot_keys(ngx_shm_zone_t *zone, int n, u_char **buf,
+    size_t *buf_len, int *nkeys, char **errmsg)
+{
+    size_t                        size, len;
+    u_char                       *p;
+    ngx_uint_t                    i, k;
+    ngx_lua_shdict_ctx_t         *ctx;
+    ngx_lua_shdict_hot_t         *hot;
+    ngx_lua_shdict_value_t       *values;
+
+    ctx = zone->data;
+
+    *nkeys = 0;
+
+    if (ctx->hot_sample == 0) {
+        *errmsg = "hot_keys not enabled";
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    hot = ctx->sh->hot;
+
+    if (hot == NULL || hot->nkeys == 0) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    k = hot->nkeys;
+    size = k * sizeof(ngx_lua_shdict_value_t);
+
+    for (i = 0; i < k; i++) {
+        size += ngx_min(hot->keys[i].key_len, NGX_LUA_SHDICT_HOT_KEY_LEN);
+    }
+
+    if (*buf_len < size) {
+        *buf = malloc(size);
+        if (*buf == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+    }
+
+    *buf_len = size;
+
+    values = (ngx_lua_shdict_value_t *) *buf;
+    p = *buf + k * sizeof(ngx_lua_shdict_value_t);
+
+    for (i = 0; i < k; i++) {
+        len = ngx_min(hot->keys[i].key_len, NGX_LUA_SHDICT_HOT_KEY_LEN);
+
+        values[i].value_type = SHDICT_TSTRING;
+        values[i].str_value_buf = p;
+        values[i].str_value_len = len;
+        values[i].num_value = (double) hot->keys[i].count * hot->sample;
+
+        p = ngx_copy(p, hot->keys[i].key, len);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ngx_sort(values, k, sizeof(ngx_lua_shdict_value_t),
+             ngx_lua_shdict_hot_cmp);
+
+    *nkeys = (n > 0 && (ngx_uint_t) n < k) ? n : (int) k;
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_lua_shdict_hot_cmp(const void *one, const void *two)
+{
+    const ngx_lua_shdict_value_t  *a = one, *b = two;
+
+    if (a->num_value == b->num_value) {
+        return 0;
+    }
+
+    return a->num_value < b->num_value ? 1 : -1;
+}
@@ -52,7 +52,8 @@ int
 ngx_lua_ffi_shdict_get_keys(ngx_shm_zone_t *zone, int attempts,
     ngx_str_t **keys_buf, int *keys_num, char **errmsg)
 {
-    ngx_queue_t                 *q, *prev;
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q, *queue;
     ngx_time_t                  *tp;
     ngx_lua_shdict_ctx_t        *ctx;
     ngx_lua_shdict_node_t       *sd;
@@ -64,34 +65,32 @@ ngx_lua_ffi_shdict_get_keys(ngx_shm_zone_t *zone, int attempts,
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
-    if (ngx_queue_empty(&ctx->sh->lru_queue)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        keys_buf = NULL;
-        *keys_num = 0;
-        return NGX_OK;
-    }
-
     tp = ngx_timeofday();
 
     now = (uint64_t) tp->sec * 1000 + tp->msec;
 
     /* first run through: get total number of elements we need to allocate */
 
-    q = ngx_queue_last(&ctx->sh->lru_queue);
-
-    while (q != ngx_queue_sentinel(&ctx->sh->lru_queue)) {
-        prev = ngx_queue_prev(q);
+    for (i = 0; i < ngx_lua_shdict_queue_count(ctx); i++) {
+        queue = ngx_lua_shdict_nth_queue(ctx, i);
 
-        sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+        for (q = ngx_queue_last(queue);
+             q != ngx_queue_sentinel(queue)
+             && (attempts == 0 || total < attempts);
+             q = ngx_queue_prev(q))
+        {
+            sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
 
-        if (sd->expires == 0 || sd->expires > now) {
-            total++;
-            if (attempts && total == attempts) {
-                break;
+            if (sd->expires == 0 || sd->expires > now) {
+                total++;
             }
         }
+    }
 
-        q = prev;
+    if (total == 0) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *keys_num = 0;
+        return NGX_OK;
     }
 
     *keys_num = total;
@@ -109,23 +108,22 @@ ngx_lua_ffi_shdict_get_keys(ngx_shm_zone_t *zone, int attempts,
     /* second run through: add keys to table */
 
     total = 0;
-    q = ngx_queue_last(&ctx->sh->lru_queue);
 
-    while (q != ngx_queue_sentinel(&ctx->sh->lru_queue)) {
-        prev = ngx_queue_prev(q);
+    for (i = 0; i < ngx_lua_shdict_queue_count(ctx); i++) {
+        queue = ngx_lua_shdict_nth_queue(ctx, i);
 
-        sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+        for (q = ngx_queue_last(queue);
+             q != ngx_queue_sentinel(queue) && total < *keys_num;
+             q = ngx_queue_prev(q))
+        {
+            sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
 
-        if (sd->expires == 0 || sd->expires > now) {
-            keys[total].data = (u_char *) sd->data;
-            keys[total].len = sd->key_len;
-            ++total;
-            if (attempts && total == attempts) {
-                break;
+            if (sd->expires == 0 || sd->expires > now) {
+                keys[total].data = (u_char *) sd->data;
+                keys[total].len = sd->key_len;
+                ++total;
             }
         }
-
-        q = prev;
     }
 
     ngx_shmtx_unlock(&ctx->shpool->mutex);
@@ -137,7 +135,8 @@ ngx_lua_ffi_shdict_get_keys(ngx_shm_zone_t *zone, int attempts,
 int
 ngx_lua_ffi_shdict_flush_all(ngx_shm_zone_t *zone, char **errmsg)
 {
-    ngx_queue_t                 *q;
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q, *queue;
     ngx_lua_shdict_node_t       *sd;
     ngx_lua_shdict_ctx_t        *ctx;
 
@@ -145,16 +144,26 @@ ngx_lua_ffi_shdict_flush_all(ngx_shm_zone_t *zone, char **errmsg)
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
-    for (q = ngx_queue_head(&ctx->sh->lru_queue);
-         q != ngx_queue_sentinel(&ctx->sh->lru_queue);
-         q = ngx_queue_next(q))
-    {
-        sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
-        sd->expires = 1;
+    for (i = 0; i < ngx_lua_shdict_queue_count(ctx); i++) {
+        queue = ngx_lua_shdict_nth_queue(ctx, i);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+            sd->expires = 1;
+        }
     }
 
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_FLUSH, 0, NULL, 0);
+
     ngx_lua_shdict_expire(ctx, 0);
 
+    /* the values filled under the leases taken so far would be stale */
+
+    ngx_lua_shdict_lease_flush(ctx);
+
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
     return NGX_OK;
@@ -165,13 +174,13 @@ int
 ngx_lua_ffi_shdict_flush_expired(ngx_shm_zone_t *zone, int attempts,
     int *freed, char **errmsg)
 {
-    ngx_queue_t                     *q, *prev, *list_queue, *lq;
+    ngx_uint_t                       i;
+    ngx_queue_t                     *q, *prev, *queue;
     ngx_lua_shdict_node_t           *sd;
     ngx_lua_shdict_ctx_t            *ctx;
     ngx_time_t                      *tp;
     ngx_rbtree_node_t               *node;
     uint64_t                         now;
-    ngx_lua_shdict_list_node_t      *lnode;
 
     ctx = zone->data;
 
@@ -179,53 +188,35 @@ ngx_lua_ffi_shdict_flush_expired(ngx_shm_zone_t *zone, int attempts,
 
     *freed = 0;
 
-    if (ngx_queue_empty(&ctx->sh->lru_queue)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        return NGX_OK;
-    }
-
     tp = ngx_timeofday();
 
     now = (uint64_t) tp->sec * 1000 + tp->msec;
 
-    q = ngx_queue_last(&ctx->sh->lru_queue);
-
-    while (q != ngx_queue_sentinel(&ctx->sh->lru_queue)) {
-        prev = ngx_queue_prev(q);
-
-        sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+    for (i = 0; i < ngx_lua_shdict_queue_count(ctx); i++) {
+        queue = ngx_lua_shdict_nth_queue(ctx, i);
 
-        if (sd->expires != 0 && sd->expires <= now) {
-
-            if (sd->value_type == SHDICT_TLIST) {
-                list_queue = ngx_lua_shdict_get_list_head(sd, sd->key_len);
+        for (q = ngx_queue_last(queue);
+             q != ngx_queue_sentinel(queue)
+             && (attempts == 0 || *freed < attempts);
+             q = prev)
+        {
+            prev = ngx_queue_prev(q);
 
-                for (lq = ngx_queue_head(list_queue);
-                     lq != ngx_queue_sentinel(list_queue);
-                     lq = ngx_queue_next(lq))
-                {
-                    lnode = ngx_queue_data(lq, ngx_lua_shdict_list_node_t,
-                                           queue);
+            sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
 
-                    ngx_slab_free_locked(ctx->shpool, lnode);
-                }
+            if (sd->expires == 0 || sd->expires + sd->stale_ttl > now) {
+                continue;
             }
 
-            ngx_queue_remove(q);
-
             node = (ngx_rbtree_node_t *)
                 ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
 
-            ngx_rbtree_delete(&ctx->sh->rbtree, node);
-            ngx_slab_free_locked(ctx->shpool, node);
-            (*freed)++;
+            ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_EXPIRE,
+                                  node->key, sd->data, sd->key_len);
 
-            if (attempts && *freed == attempts) {
-                break;
-            }
+            ngx_lua_shdict_remove(ctx, sd);
+            (*freed)++;
         }
-
-        q = prev;
     }
 
     ngx_shmtx_unlock(&ctx->shpool->mutex);
@@ -285,7 +276,7 @@ long
 ngx_lua_ffi_shdict_get_ttl(ngx_shm_zone_t *zone, u_char *key,
     size_t key_len)
 {
-    uint32_t                     hash;
+    ngx_uint_t                   hash;
     uint64_t                     now;
     uint64_t                     expires;
     ngx_int_t                    rc;
@@ -298,7 +289,7 @@ ngx_lua_ffi_shdict_get_ttl(ngx_shm_zone_t *zone, u_char *key,
     }
 
     ctx = zone->data;
-    hash = ngx_crc32_short(key, key_len);
+    hash = ngx_lua_shdict_hash(key, key_len);
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
@@ -331,7 +322,7 @@ int
 ngx_lua_ffi_shdict_set_expire(ngx_shm_zone_t *zone, u_char *key,
     size_t key_len, long exptime)
 {
-    uint32_t                     hash;
+    ngx_uint_t                   hash;
     ngx_int_t                    rc;
     ngx_time_t                  *tp = NULL;
     ngx_lua_shdict_ctx_t        *ctx;
@@ -346,7 +337,7 @@ ngx_lua_ffi_shdict_set_expire(ngx_shm_zone_t *zone, u_char *key,
     }
 
     ctx = zone->data;
-    hash = ngx_crc32_short(key, key_len);
+    hash = ngx_lua_shdict_hash(key, key_len);
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
@@ -368,6 +359,8 @@ ngx_lua_ffi_shdict_set_expire(ngx_shm_zone_t *zone, u_char *key,
         sd->expires = 0;
     }
 
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_TTL, hash, key, key_len);
+
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
     return NGX_OK;
@@ -381,6 +374,26 @@ ngx_lua_ffi_shdict_capacity(ngx_shm_zone_t *zone)
 }
 
 
+/* the bytes taken by the pinned items, and the limit of them in "limit" */
+
+size_t
+ngx_lua_ffi_shdict_pinned(ngx_shm_zone_t *zone, size_t *limit)
+{
+    size_t                       bytes;
+    ngx_lua_shdict_ctx_t        *ctx;
+
+    ctx = zone->data;
+
+    *limit = ctx->pinned;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    bytes = ctx->sh->pinned_bytes;
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return bytes;
+}
+
+
 #if nginx_version >= 1011007
 size_t
 ngx_lua_ffi_shdict_free_space(ngx_shm_zone_t *zone)
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * read-through leases, as in memcached: dict:get() with the "lease" option
+ * hands the first worker missing a key a token, recorded in a tree of its
+ * own in the zone, and the other workers missing it meanwhile are told
+ * that it is being filled. dict:set() with the token stores the value only
+ * if the lease is still there: any other write of the key in between, a
+ * delete in the first place, ends the lease, so that a slow worker never
+ * overwrites a newer value with the stale data it computed before the key
+ * was invalidated. A lease expires after the time given to dict:get(), so
+ * that a worker dying while filling the key does not hold it forever.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+typedef struct {
+    ngx_rbtree_node_t             node;
+    uint64_t                      token;
+    uint64_t                      expires;
+    u_short                       key_len;
+    u_char                        key[1];
+} ngx_lua_shdict_lease_t;
+
+
+static ngx_lua_shdict_lease_t *ngx_lua_shdict_lease_lookup(
+    ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash, u_char *key, size_t key_len);
+static void ngx_lua_shdict_lease_free(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_lease_t *lease);
+static ngx_lua_shdict_lease_t *ngx_lua_shdict_lease_alloc(
+    ngx_lua_shdict_ctx_t *ctx, size_t size, uint64_t now);
+
+
+void
+ngx_lua_shdict_lease_rbtree_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_lua_shdict_lease_t       *ln, *lnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            ln = (ngx_lua_shdict_lease_t *) node;
+            lnt = (ngx_lua_shdict_lease_t *) temp;
+
+            p = ngx_memn2cmp(ln->key, lnt->key, ln->key_len, lnt->key_len)
+                < 0 ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+/*
+ * called with the zone locked on a miss: takes the lease of "key" for "ttl"
+ * ms and sets "*token" to it, or to 0 when another worker holds it
+ */
+
+ngx_int_t
+ngx_lua_shdict_lease_grant(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *key, size_t key_len, ngx_msec_t ttl, uint64_t *token)
+{
+    uint64_t                     now;
+    ngx_time_t                  *tp;
+    ngx_lua_shdict_lease_t      *lease;
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    *token = 0;
+
+    lease = ngx_lua_shdict_lease_lookup(ctx, hash, key, key_len);
+
+    if (lease == NULL) {
+        lease = ngx_lua_shdict_lease_alloc(ctx,
+                                           offsetof(ngx_lua_shdict_lease_t,
+                                                    key)
+                                           + key_len, now);
+        if (lease == NULL) {
+            return NGX_ERROR;
+        }
+
+        lease->node.key = hash;
+        lease->key_len = (u_short) key_len;
+        ngx_memcpy(lease->key, key, key_len);
+
+        ngx_rbtree_insert(&ctx->sh->leases, &lease->node);
+
+    } else if (lease->expires > now) {
+        return NGX_OK;
+    }
+
+    /* a new lease, or the one of a worker which gave up on the key */
+
+    lease->token = ++ctx->sh->lease_token;
+    lease->expires = now + ttl;
+
+    *token = lease->token;
+
+    return NGX_OK;
+}
+
+
+/*
+ * called with the zone locked before a write of "key": a write with the
+ * token of the lease ends it, and so does any write without a token, the
+ * ones with another token are refused
+ */
+
+ngx_int_t
+ngx_lua_shdict_lease_end(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *key, size_t key_len, uint64_t token)
+{
+    uint64_t                     now;
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp;
+    ngx_lua_shdict_lease_t      *lease;
+
+    if (ctx->sh->leases.root == ctx->sh->leases.sentinel) {
+        return token ? NGX_DECLINED : NGX_OK;
+    }
+
+    lease = ngx_lua_shdict_lease_lookup(ctx, hash, key, key_len);
+
+    if (token == 0) {
+        if (lease != NULL) {
+            ngx_lua_shdict_lease_free(ctx, lease);
+        }
+
+        return NGX_OK;
+    }
+
+    if (lease == NULL || lease->token != token) {
+        return NGX_DECLINED;
+    }
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    rc = (lease->expires > now) ? NGX_OK : NGX_DECLINED;
+
+    ngx_lua_shdict_lease_free(ctx, lease);
+
+    return rc;
+}
+
+
+/* called with the zone locked by flush_all() */
+
+void
+ngx_lua_shdict_lease_flush(ngx_lua_shdict_ctx_t *ctx)
+{
+    ngx_rbtree_node_t           *node, *sentinel;
+
+    sentinel = ctx->sh->leases.sentinel;
+
+    while (ctx->sh->leases.root != sentinel) {
+        node = ngx_rbtree_min(ctx->sh->leases.root, sentinel);
+
+        ngx_lua_shdict_lease_free(ctx, (ngx_lua_shdict_lease_t *) node);
+    }
+}
+
+
+static ngx_lua_shdict_lease_t *
+ngx_lua_shdict_lease_lookup(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *key, size_t key_len)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_lua_shdict_lease_t      *lease;
+
+    node = ctx->sh->leases.root;
+    sentinel = ctx->sh->leases.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lease = (ngx_lua_shdict_lease_t *) node;
+
+        rc = ngx_memn2cmp(key, lease->key, key_len, (size_t) lease->key_len);
+
+        if (rc == 0) {
+            return lease;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_lua_shdict_lease_free(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_lease_t *lease)
+{
+    ngx_rbtree_delete(&ctx->sh->leases, &lease->node);
+    ngx_slab_free_locked(ctx->shpool, lease);
+}
+
+
+/*
+ * when the zone is full, the expired leases, of workers which died or
+ * gave up, are reclaimed first, then the least recently used items are
+ * evicted, as a store would
+ */
+
+static ngx_lua_shdict_lease_t *
+ngx_lua_shdict_lease_alloc(ngx_lua_shdict_ctx_t *ctx, size_t size,
+    uint64_t now)
+{
+    void                        *p;
+    ngx_uint_t                   i;
+    ngx_rbtree_node_t           *node, *next, *sentinel;
+    ngx_lua_shdict_lease_t      *lease;
+
+    p = ngx_slab_alloc_locked(ctx->shpool, size);
+    if (p != NULL) {
+        return p;
+    }
+
+    sentinel = ctx->sh->leases.sentinel;
+
+    if (ctx->sh->leases.root != sentinel) {
+        node = ngx_rbtree_min(ctx->sh->leases.root, sentinel);
+
+        while (node != NULL) {
+            next = ngx_rbtree_next(&ctx->sh->leases, node);
+
+            lease = (ngx_lua_shdict_lease_t *) node;
+
+            if (lease->expires <= now) {
+                ngx_lua_shdict_lease_free(ctx, lease);
+            }
+
+            node = next;
+        }
+
+        p = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    for (i = 0; i < 30; i++) {
+        if (ngx_lua_shdict_expire(ctx, 0) == 0) {
+            break;
+        }
+
+        p = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * the TinyLFU admission filter: every lookup of a key, found or not, is
+ * counted in a frequency sketch of 4-bit counters kept in the zone, and a
+ * store that has to evict a live item to make room for a new key is
+ * refused unless the new key is estimated to be accessed more often than
+ * the least recently used item it would displace. Keys read once, like
+ * the ones of a crawl, thus stop pushing the popular ones out. The
+ * counters are halved every ten times as many lookups as the sketch has
+ * words, so that the frequencies follow the recent traffic. The halving
+ * goes through the sketch a few words at a time, and no lookup pays for
+ * the whole of it.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+/* one sketch word per this many bytes of the zone */
+#define NGX_LUA_SHDICT_LFU_RATIO     256
+#define NGX_LUA_SHDICT_LFU_MIN       64
+#define NGX_LUA_SHDICT_LFU_PERIOD    10
+
+/* the words halved at a time, a cache line */
+#define NGX_LUA_SHDICT_LFU_SLICE     8
+
+/*
+ * candidates this frequent are admitted at random now and then even when
+ * they lose, so that a flood of keys colliding with a popular victim in
+ * the sketch cannot keep it in the zone forever
+ */
+#define NGX_LUA_SHDICT_LFU_WARM      6
+
+
+static ngx_uint_t ngx_lua_shdict_lfu_estimate(ngx_lua_shdict_lfu_t *lfu,
+    ngx_uint_t hash);
+static void ngx_lua_shdict_lfu_age(ngx_lua_shdict_lfu_t *lfu);
+
+
+/*
+ * sets the sketch of the zone up for the configuration of "ctx", keeping
+ * the one of a zone reused on reload
+ */
+
+ngx_int_t
+ngx_lua_shdict_lfu_init(ngx_lua_shdict_ctx_t *ctx, size_t size)
+{
+    ngx_uint_t                    words;
+    ngx_lua_shdict_lfu_t         *lfu;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    lfu = ctx->sh->lfu;
+
+    if (lfu != NULL && !ctx->admission) {
+        ctx->sh->lfu = NULL;
+        ngx_slab_free_locked(ctx->shpool, lfu);
+    }
+
+    if (lfu != NULL || !ctx->admission) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    for (words = NGX_LUA_SHDICT_LFU_MIN;
+         words * 2 <= size / NGX_LUA_SHDICT_LFU_RATIO;
+         words <<= 1)
+    {
+        /* void */
+    }
+
+    lfu = ngx_slab_alloc_locked(ctx->shpool,
+                                offsetof(ngx_lua_shdict_lfu_t, table)
+                                + words * sizeof(uint64_t));
+
+    if (lfu == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                      "lua shared dict \"%V\" is too small for "
+                      "admission=tinylfu", &ctx->name);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(lfu->table, words * sizeof(uint64_t));
+
+    lfu->mask = words - 1;
+    lfu->additions = 0;
+    lfu->cursor = 0;
+
+    ctx->sh->lfu = lfu;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/*
+ * the four counters of a key are in the same word, one in each quarter of
+ * it, so that counting a lookup touches a single cache line
+ */
+
+void
+ngx_lua_shdict_lfu_add(ngx_lua_shdict_lfu_t *lfu, ngx_uint_t hash)
+{
+    uint64_t                      h, *word;
+    ngx_uint_t                    i, shift;
+
+    h = (uint64_t) hash * 0x9e3779b97f4a7c15ULL;
+    word = &lfu->table[(h >> 32) & lfu->mask];
+
+    for (i = 0; i < 4; i++) {
+        shift = ((i << 2) + ((h >> (i << 1)) & 3)) << 2;
+
+        if (((*word >> shift) & 0xf) != 0xf) {
+            *word += (uint64_t) 1 << shift;
+        }
+    }
+
+    if (++lfu->additions
+        >= NGX_LUA_SHDICT_LFU_PERIOD * NGX_LUA_SHDICT_LFU_SLICE)
+    {
+        ngx_lua_shdict_lfu_age(lfu);
+    }
+}
+
+
+static ngx_uint_t
+ngx_lua_shdict_lfu_estimate(ngx_lua_shdict_lfu_t *lfu, ngx_uint_t hash)
+{
+    uint64_t                      h, word;
+    ngx_uint_t                    i, c, min;
+
+    h = (uint64_t) hash * 0x9e3779b97f4a7c15ULL;
+    word = lfu->table[(h >> 32) & lfu->mask];
+
+    min = 0xf;
+
+    for (i = 0; i < 4; i++) {
+        c = (word >> ((((i << 2) + ((h >> (i << 1)) & 3))) << 2)) & 0xf;
+
+        if (c < min) {
+            min = c;
+        }
+    }
+
+    return min;
+}
+
+
+/*
+ * halves the counters of the next slice of words, the cursor going round
+ * the sketch once every ten times as many additions as it has words
+ */
+
+static void
+ngx_lua_shdict_lfu_age(ngx_lua_shdict_lfu_t *lfu)
+{
+    uint64_t                     *word, *last;
+
+    word = &lfu->table[lfu->cursor];
+    last = word + NGX_LUA_SHDICT_LFU_SLICE;
+
+    while (word < last) {
+        *word = (*word >> 1) & 0x7777777777777777ULL;
+        word++;
+    }
+
+    lfu->cursor = (lfu->cursor + NGX_LUA_SHDICT_LFU_SLICE) & lfu->mask;
+    lfu->additions = 0;
+}
+
+
+/*
+ * decides, with the zone locked, whether a new key of hash "hash" may
+ * displace the least recently used item, which expired items always may
+ */
+
+ngx_int_t
+ngx_lua_shdict_lfu_admit(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash)
+{
+    uint64_t                      now;
+    ngx_uint_t                    candidate, victim;
+    ngx_time_t                   *tp;
+    ngx_queue_t                  *queue, *q;
+    ngx_rbtree_node_t            *node;
+    ngx_lua_shdict_lfu_t         *lfu;
+    ngx_lua_shdict_node_t        *sd;
+
+    lfu = ctx->sh->lfu;
+
+    if (lfu == NULL) {
+        return NGX_OK;
+    }
+
+    /* the item a forced eviction would remove */
+
+    queue = ngx_lua_shdict_victim(ctx);
+
+    if (ngx_queue_empty(queue)) {
+        return NGX_OK;
+    }
+
+    q = ngx_queue_last(queue);
+    sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+
+    if (sd->expires != 0) {
+        tp = ngx_timeofday();
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+        if (sd->expires <= now) {
+            return NGX_OK;
+        }
+    }
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    candidate = ngx_lua_shdict_lfu_estimate(lfu, hash);
+    victim = ngx_lua_shdict_lfu_estimate(lfu, node->key);
+
+    if (candidate > victim) {
+        return NGX_OK;
+    }
+
+    if (candidate >= NGX_LUA_SHDICT_LFU_WARM && (ngx_random() & 127) == 0) {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
@@ -7,42 +7,243 @@
 #include "ngx_lua_shdict_common.h"
 
 
+static ngx_queue_t *ngx_lua_shdict_list_index(ngx_queue_t *queue,
+    ngx_int_t len, ngx_int_t index);
+static ngx_int_t ngx_lua_shdict_list_range(ngx_int_t len, ngx_int_t *start,
+    ngx_int_t *stop);
+static int ngx_lua_shdict_list_copy_values(ngx_lua_shdict_ctx_t *ctx,
+    ngx_queue_t *q, int n, int forward, u_char **buf, size_t *buf_len,
+    char **errmsg);
+
+
+/*
+ * returns the list node at the (already normalized) position "index",
+ * walking from whichever end of the list is closer
+ */
+
+static ngx_queue_t *
+ngx_lua_shdict_list_index(ngx_queue_t *queue, ngx_int_t len, ngx_int_t index)
+{
+    ngx_int_t                        i;
+    ngx_queue_t                     *q;
+
+    if (index < len / 2) {
+        q = ngx_queue_head(queue);
+
+        for (i = 0; i < index; i++) {
+            q = ngx_queue_next(q);
+        }
+
+        return q;
+    }
+
+    q = ngx_queue_last(queue);
+
+    for (i = len - 1; i > index; i--) {
+        q = ngx_queue_prev(q);
+    }
+
+    return q;
+}
+
+
+/*
+ * normalizes Redis-style (possibly negative) start/stop offsets,
+ * returns the number of elements covered by the range
+ */
+
+static ngx_int_t
+ngx_lua_shdict_list_range(ngx_int_t len, ngx_int_t *start, ngx_int_t *stop)
+{
+    if (*start < 0) {
+        *start += len;
+
+        if (*start < 0) {
+            *start = 0;
+        }
+    }
+
+    if (*stop < 0) {
+        *stop += len;
+    }
+
+    if (*stop >= len) {
+        *stop = len - 1;
+    }
+
+    if (*start > *stop) {
+        return 0;
+    }
+
+    return *stop - *start + 1;
+}
+
+
+/*
+ * copies "n" list values starting from "q" into "*buf", which holds an
+ * array of ngx_lua_shdict_value_t followed by the string data the array
+ * points to; "*buf" is replaced by a malloc'ed block when it is too small
+ */
+
+static int
+ngx_lua_shdict_list_copy_values(ngx_lua_shdict_ctx_t *ctx, ngx_queue_t *q,
+    int n, int forward, u_char **buf, size_t *buf_len, char **errmsg)
+{
+    int                              i;
+    size_t                           size;
+    u_char                          *p;
+    ngx_queue_t                     *lq;
+    ngx_lua_shdict_value_t          *values;
+    ngx_lua_shdict_list_node_t      *lnode;
+
+    size = n * sizeof(ngx_lua_shdict_value_t);
+
+    for (i = 0, lq = q; i < n; i++) {
+        lnode = ngx_queue_data(lq, ngx_lua_shdict_list_node_t, queue);
+
+        switch (lnode->value_type) {
+
+        case SHDICT_TSTRING:
+            size += lnode->value_len;
+            break;
+
+        case SHDICT_TNUMBER:
+
+            if (lnode->value_len != sizeof(double)) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                              "bad lua list node number value size found "
+                              "in shared_dict %V: %uD", &ctx->name,
+                              lnode->value_len);
+
+                *errmsg = "bad lua list node number value size";
+                return NGX_ERROR;
+            }
+
+            break;
+
+        default:
+
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "bad list node value type found in "
+                          "shared_dict %V: %d", &ctx->name,
+                          (int) lnode->value_type);
+
+            *errmsg = "bad list node value type";
+            return NGX_ERROR;
+        }
+
+        lq = forward ? ngx_queue_next(lq) : ngx_queue_prev(lq);
+    }
+
+    if (*buf_len < size) {
+        *buf = malloc(size);
+        if (*buf == NULL) {
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+    }
+
+    *buf_len = size;
+
+    values = (ngx_lua_shdict_value_t *) *buf;
+    p = *buf + n * sizeof(ngx_lua_shdict_value_t);
+
+    for (i = 0, lq = q; i < n; i++) {
+        lnode = ngx_queue_data(lq, ngx_lua_shdict_list_node_t, queue);
+
+        values[i].value_type = lnode->value_type;
+
+        if (lnode->value_type == SHDICT_TSTRING) {
+            values[i].str_value_buf = p;
+            values[i].str_value_len = lnode->value_len;
+            p = ngx_copy(p, lnode->data, lnode->value_len);
+
+        } else {
+            values[i].str_value_buf = NULL;
+            values[i].str_value_len = sizeof(double);
+            ngx_memcpy(&values[i].num_value, lnode->data, sizeof(double));
+        }
+
+        lq = forward ? ngx_queue_next(lq) : ngx_queue_prev(lq);
+    }
+
+    return NGX_OK;
+}
+
+
 int
 ngx_lua_ffi_shdict_push_helper(ngx_shm_zone_t *zone, u_char *key,
-    size_t key_len, int value_type, u_char *str_value_buf,
-    size_t str_value_len, double num_value, int *value_len,
-    int flags, char **errmsg)
+    size_t key_len, ngx_lua_shdict_value_t *values, int nvalues,
+    long max_len, int *value_len, int flags, char **errmsg, int *forcible)
+{
+    int                              rc;
+    ngx_uint_t                       hash;
+    ngx_lua_shdict_ctx_t            *ctx;
+
+    ctx = zone->data;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    rc = ngx_lua_shdict_list_push_locked(zone, hash, key, key_len, values,
+                                         nvalues, max_len, value_len, flags,
+                                         errmsg, forcible);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return rc;
+}
+
+
+/* pushes values like the push methods do, with the zone locked already */
+
+int
+ngx_lua_shdict_list_push_locked(ngx_shm_zone_t *zone, ngx_uint_t hash,
+    u_char *key, size_t key_len, ngx_lua_shdict_value_t *values,
+    int nvalues, long max_len, int *value_len, int flags, char **errmsg,
+    int *forcible)
 {
-    uint32_t                         hash;
-    int                              n;
+    int                              i, n, first;
     ngx_int_t                        rc;
     ngx_lua_shdict_ctx_t            *ctx;
     ngx_lua_shdict_node_t           *sd;
     ngx_rbtree_node_t               *node;
-    ngx_queue_t                     *queue, *q;
+    ngx_queue_t                      pending, *queue, *q;
     ngx_lua_shdict_list_node_t      *lnode;
+    u_char                          *str_value_buf;
+    size_t                           str_value_len;
 
     ctx = zone->data;
 
-    hash = ngx_crc32_short(key, key_len);
+    *forcible = 0;
 
-    switch (value_type) {
+    /*
+     * the values pushed first would be dropped right away again by a
+     * capped list, so never allocate them at all
+     */
 
-    case SHDICT_TSTRING:
-        /* do nothing */
-        break;
+    first = 0;
 
-    case SHDICT_TNUMBER:
-        str_value_buf = (u_char *) &num_value;
-        str_value_len = sizeof(double);
-        break;
+    if (max_len > 0 && nvalues > max_len) {
+        first = nvalues - (int) max_len;
+    }
 
-    default:
-        *errmsg = "unsupported value type";
-        return NGX_ERROR;
+    for (i = 0; i < nvalues; i++) {
+
+        switch (values[i].value_type) {
+
+        case SHDICT_TSTRING:
+        case SHDICT_TNUMBER:
+            break;
+
+        default:
+            *errmsg = "unsupported value type";
+            return NGX_ERROR;
+        }
     }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
 
     ngx_lua_shdict_expire(ctx, 1);
 
@@ -59,14 +260,7 @@ ngx_lua_ffi_shdict_push_helper(ngx_shm_zone_t *zone, u_char *key,
                            "lua shared dict push: found old entry and value "
                            "type not matched, remove it first");
 
-            ngx_queue_remove(&sd->queue);
-
-            node = (ngx_rbtree_node_t *)
-                        ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
-
-            ngx_rbtree_delete(&ctx->sh->rbtree, node);
-
-            ngx_slab_free_locked(ctx->shpool, node);
+            ngx_lua_shdict_remove(ctx, sd);
 
             goto init_list;
         }
@@ -87,13 +281,14 @@ ngx_lua_ffi_shdict_push_helper(ngx_shm_zone_t *zone, u_char *key,
         {
             /* TODO: reuse matched size list node */
             lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
-            ngx_slab_free_locked(ctx->shpool, lnode);
+            ngx_lua_shdict_list_free(ctx, sd, lnode);
         }
 
         ngx_queue_init(queue);
 
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+        sd->value_len = 0;
+
+        ngx_lua_shdict_touch(ctx, sd);
 
         goto push_node;
     }
@@ -103,16 +298,13 @@ ngx_lua_ffi_shdict_push_helper(ngx_shm_zone_t *zone, u_char *key,
     if (rc == NGX_OK) {
 
         if (sd->value_type != SHDICT_TLIST) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-
             *errmsg = "value not a list";
             return NGX_ERROR;
         }
 
         queue = ngx_lua_shdict_get_list_head(sd, key_len);
 
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+        ngx_lua_shdict_touch(ctx, sd);
 
         goto push_node;
     }
@@ -132,11 +324,13 @@ init_list:
 
     n = (int) (uintptr_t) ngx_align_ptr(n, NGX_ALIGNMENT);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, n);
+    if (ngx_lua_shdict_ns_reserve(ctx, key, key_len, NULL, n)) {
+        *forcible = 1;
+    }
 
-    if (node == NULL) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    node = ngx_lua_shdict_alloc(ctx, NULL, n, forcible);
 
+    if (node == NULL) {
         *errmsg = "no memory";
         return NGX_ERROR;
     }
@@ -149,10 +343,14 @@ init_list:
     sd->key_len = (u_short) key_len;
 
     sd->expires = 0;
+    sd->cost = 0;
+    sd->stale_ttl = 0;
 
     sd->value_len = 0;
 
     sd->value_type = (uint8_t) SHDICT_TLIST;
+    sd->priority = NGX_LUA_SHDICT_PRIO_NORMAL;
+    sd->chunked = 0;
 
     ngx_memcpy(sd->data, key, key_len);
 
@@ -160,209 +358,289 @@ init_list:
 
     ngx_rbtree_insert(&ctx->sh->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    ngx_lua_shdict_ns_link(ctx, sd);
 
 push_node:
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "lua shared dict list: creating a new list node");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict list: creating %d new list nodes",
+                   nvalues - first);
 
-    n = offsetof(ngx_lua_shdict_list_node_t, data)
-        + str_value_len;
+    /*
+     * all the list nodes are allocated before any of them is linked,
+     * so that a batch is either pushed entirely or not at all
+     */
 
-    lnode = ngx_slab_alloc_locked(ctx->shpool, n);
+    ngx_queue_init(&pending);
 
-    if (lnode == NULL) {
+    for (i = first; i < nvalues; i++) {
 
-        if (sd->value_len == 0) {
+        if (values[i].value_type == SHDICT_TNUMBER) {
+            str_value_buf = (u_char *) &values[i].num_value;
+            str_value_len = sizeof(double);
 
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                           "lua shared dict list: no memory for create"
-                           " list node and list empty, remove it");
+        } else {
+            str_value_buf = values[i].str_value_buf;
+            str_value_len = values[i].str_value_len;
+        }
+
+        n = offsetof(ngx_lua_shdict_list_node_t, data)
+            + str_value_len;
+
+        if (ngx_lua_shdict_ns_reserve(ctx, key, key_len, sd, n)) {
+            *forcible = 1;
+        }
+
+        lnode = ngx_lua_shdict_alloc(ctx, sd, n, forcible);
 
-            ngx_queue_remove(&sd->queue);
+        if (lnode == NULL) {
 
-            node = (ngx_rbtree_node_t *)
-                        ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+            while (!ngx_queue_empty(&pending)) {
+                q = ngx_queue_head(&pending);
+                ngx_queue_remove(q);
+
+                lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+                ngx_lua_shdict_list_free(ctx, sd, lnode);
+            }
 
-            ngx_rbtree_delete(&ctx->sh->rbtree, node);
+            if (sd->value_len == 0) {
+
+                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                               "lua shared dict list: no memory for create"
+                               " list node and list empty, remove it");
+
+                ngx_lua_shdict_remove(ctx, sd);
+            }
 
-            ngx_slab_free_locked(ctx->shpool, node);
+            *errmsg = "no memory";
+            return NGX_ERROR;
         }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        lnode->value_len = (uint32_t) str_value_len;
 
-        *errmsg = "no memory";
-        return NGX_ERROR;
-    }
+        lnode->value_type = (uint8_t) values[i].value_type;
 
-    sd->value_len = sd->value_len + 1;
+        ngx_memcpy(lnode->data, str_value_buf, str_value_len);
 
-    lnode->value_len = (uint32_t) str_value_len;
+        ngx_queue_insert_tail(&pending, &lnode->queue);
 
-    lnode->value_type = (uint8_t) value_type;
+        ngx_lua_shdict_ns_charge(ctx, sd, n);
+    }
 
-    ngx_memcpy(lnode->data, str_value_buf, str_value_len);
+    while (!ngx_queue_empty(&pending)) {
+        q = ngx_queue_head(&pending);
+        ngx_queue_remove(q);
 
-    if (flags) {
-        ngx_queue_insert_head(queue, &lnode->queue);
+        if (flags) {
+            ngx_queue_insert_head(queue, q);
 
-    } else {
-        ngx_queue_insert_tail(queue, &lnode->queue);
+        } else {
+            ngx_queue_insert_tail(queue, q);
+        }
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    sd->value_len = sd->value_len + (nvalues - first);
+
+    /* a capped list drops its oldest elements from the opposite end */
+
+    if (max_len > 0 && sd->value_len > (uint64_t) max_len) {
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict list: dropping %uD list nodes "
+                       "over max length", sd->value_len - (uint32_t) max_len);
+
+        while (sd->value_len > (uint64_t) max_len) {
+            q = flags ? ngx_queue_last(queue) : ngx_queue_head(queue);
+
+            ngx_queue_remove(q);
+
+            lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+            ngx_lua_shdict_list_free(ctx, sd, lnode);
+
+            sd->value_len--;
+        }
+    }
 
     *value_len = sd->value_len;
+
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_LIST, hash, key, key_len);
+
+    ngx_lua_shdict_wakeup(ctx, hash, (ngx_uint_t) (nvalues - first));
+
     return NGX_OK;
 }
 
 
-int
-ngx_lua_ffi_shdict_pop_helper(ngx_shm_zone_t *zone, u_char *key,
-    size_t key_len, int *value_type, u_char **str_value_buf,
-    size_t *str_value_len, double *num_value, int flags, char **errmsg)
+static int
+ngx_lua_shdict_list_pop_locked(ngx_shm_zone_t *zone, ngx_uint_t hash,
+    u_char *key, size_t key_len, int count, u_char **buf, size_t *buf_len,
+    int *nvalues, int flags, char **errmsg)
 {
-    ngx_str_t                        name;
-    uint32_t                         hash;
-    ngx_int_t                        rc;
+    int                              i, rc;
     ngx_lua_shdict_ctx_t            *ctx;
     ngx_lua_shdict_node_t           *sd;
-    int                              value_len;
-    ngx_rbtree_node_t               *node;
-    ngx_queue_t                     *queue;
+    ngx_queue_t                     *queue, *q, *next;
     ngx_lua_shdict_list_node_t      *lnode;
 
     ctx = zone->data;
-    name = ctx->name;
 
-    hash = ngx_crc32_short(key, key_len);
+    *nvalues = 0;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
 
     ngx_lua_shdict_expire(ctx, 1);
 
     rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
 
     if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        *value_type = LUA_TNIL;
         return NGX_OK;
     }
 
     /* rc == NGX_OK */
 
     if (sd->value_type != SHDICT_TLIST) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-
         *errmsg = "value not a list";
         return NGX_ERROR;
     }
 
     if (sd->value_len <= 0) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-
         ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                      "bad lua list length found for key %s "
-                      "in shared_dict %s: %lu", key, name.data,
-                      (unsigned long) sd->value_len);
+                      "bad lua list length found for key %*s "
+                      "in shared_dict %V: %uD", key_len, key, &ctx->name,
+                      sd->value_len);
 
         *errmsg = "bad lua list length";
         return NGX_ERROR;
     }
 
+    if ((uint32_t) count > sd->value_len) {
+        count = (int) sd->value_len;
+    }
+
     queue = ngx_lua_shdict_get_list_head(sd, key_len);
 
-    if (flags) {
-        queue = ngx_queue_head(queue);
+    q = flags ? ngx_queue_head(queue) : ngx_queue_last(queue);
 
-    } else {
-        queue = ngx_queue_last(queue);
+    rc = ngx_lua_shdict_list_copy_values(ctx, q, count, flags, buf, buf_len,
+                                         errmsg);
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    lnode = ngx_queue_data(queue, ngx_lua_shdict_list_node_t, queue);
+    if ((uint32_t) count == sd->value_len) {
 
-    *value_type = lnode->value_type;
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict list: empty node after pop, "
+                       "remove it");
 
-    value_len = lnode->value_len;
+        ngx_lua_shdict_remove(ctx, sd);
 
-    if (*str_value_len < (size_t) value_len) {
-        if (*value_type == SHDICT_TSTRING) {
-            *str_value_buf = malloc(value_len);
-            if (*str_value_buf == NULL) {
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
+    } else {
 
-                *errmsg = "no memory";
-                return NGX_ERROR;
-            }
+        for (i = 0; i < count; i++) {
+            next = flags ? ngx_queue_next(q) : ngx_queue_prev(q);
+
+            ngx_queue_remove(q);
+
+            lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+            ngx_lua_shdict_list_free(ctx, sd, lnode);
+
+            q = next;
         }
+
+        sd->value_len = sd->value_len - count;
+
+        ngx_lua_shdict_touch(ctx, sd);
     }
 
-    switch (*value_type) {
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_LIST, hash, key, key_len);
 
-    case SHDICT_TSTRING:
-        *str_value_len = value_len;
-        ngx_memcpy(*str_value_buf, lnode->data, value_len);
-        break;
+    *nvalues = count;
 
-    case SHDICT_TNUMBER:
+    return NGX_OK;
+}
 
-        if (value_len != sizeof(double)) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                          "bad lua list node number value size found "
-                          "for key %s in shared_dict %s: %lu", key,
-                          name.data, (unsigned long) value_len);
 
-            *errmsg = "bad lua list node number value size";
-            return NGX_ERROR;
-        }
+int
+ngx_lua_ffi_shdict_pop_helper(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, int count, u_char **buf, size_t *buf_len,
+    int *nvalues, int flags, char **errmsg)
+{
+    int                          rc;
+    ngx_uint_t                   hash;
+    ngx_lua_shdict_ctx_t        *ctx;
 
-        *str_value_len = value_len;
-        ngx_memcpy(num_value, lnode->data, sizeof(double));
-        break;
+    ctx = zone->data;
 
-    default:
+    hash = ngx_lua_shdict_hash(key, key_len);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                      "bad list node value type found for key %s in "
-                      "shared_dict %s: %d", key, name.data,
-                      *value_type);
+    ngx_shmtx_lock(&ctx->shpool->mutex);
 
-        *errmsg = "bad list node value type";
-        return NGX_ERROR;
-    }
+    rc = ngx_lua_shdict_list_pop_locked(zone, hash, key, key_len, count, buf,
+                                        buf_len, nvalues, flags, errmsg);
 
-    ngx_queue_remove(queue);
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-    ngx_slab_free_locked(ctx->shpool, lnode);
+    return rc;
+}
 
-    if (sd->value_len == 1) {
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                       "lua shared dict list: empty node after pop, "
-                       "remove it");
+/*
+ * pops one value, or registers the caller as a waiter on the key when the
+ * list is empty; the pushing process then posts the given semaphore
+ * through the notification fd of the waiting worker
+ */
 
-        ngx_queue_remove(&sd->queue);
+int
+ngx_lua_ffi_shdict_bpop_helper(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, u_char **buf, size_t *buf_len, int *nvalues, int flags,
+    long timeout, void *sema, void *post, void **waiter, uint64_t *id,
+    char **errmsg)
+{
+    int                              rc;
+    ngx_uint_t                       hash;
+    ngx_lua_shdict_ctx_t            *ctx;
+    ngx_lua_shdict_waiter_t         *w;
 
-        node = (ngx_rbtree_node_t *)
-                    ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+    ctx = zone->data;
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    hash = ngx_lua_shdict_hash(key, key_len);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+    *waiter = NULL;
 
-    } else {
-        sd->value_len = sd->value_len - 1;
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    rc = ngx_lua_shdict_list_pop_locked(zone, hash, key, key_len, 1, buf,
+                                        buf_len, nvalues, flags, errmsg);
 
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    if (rc == NGX_OK && *nvalues == 0) {
+        w = ngx_lua_shdict_wait_add(ctx, hash, (ngx_msec_t) timeout, sema,
+                                    post);
+        if (w != NULL) {
+            *waiter = w;
+            *id = w->id;
+        }
     }
 
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-    return NGX_OK;
+    return rc;
+}
+
+
+void
+ngx_lua_ffi_shdict_bpop_cancel(ngx_shm_zone_t *zone, void *waiter,
+    uint64_t id)
+{
+    ngx_lua_shdict_ctx_t        *ctx;
+
+    ctx = zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ngx_lua_shdict_wait_del(ctx, waiter, id);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
 }
 
 
@@ -370,14 +648,14 @@ int
 ngx_lua_ffi_shdict_llen(ngx_shm_zone_t *zone, u_char *key,
     size_t key_len, int *value_len, char **errmsg)
 {
-    uint32_t                     hash;
+    ngx_uint_t                   hash;
     ngx_int_t                    rc;
     ngx_lua_shdict_ctx_t        *ctx;
     ngx_lua_shdict_node_t       *sd;
 
     ctx = zone->data;
 
-    hash = ngx_crc32_short(key, key_len);
+    hash = ngx_lua_shdict_hash(key, key_len);
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
@@ -394,17 +672,321 @@ ngx_lua_ffi_shdict_llen(ngx_shm_zone_t *zone, u_char *key,
             return NGX_ERROR;
         }
 
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+        ngx_lua_shdict_touch(ctx, sd);
+
+        *value_len = sd->value_len;
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        return NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    *value_len = 0;
+    return NGX_OK;
+}
+
+
+int
+ngx_lua_ffi_shdict_lrange(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, long start, long stop, u_char **buf, size_t *buf_len,
+    int *nvalues, char **errmsg)
+{
+    int                          rc;
+    ngx_uint_t                   hash;
+    ngx_int_t                    first, last, n;
+    ngx_queue_t                 *queue, *q;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+
+    ctx = zone->data;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    *nvalues = 0;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != SHDICT_TLIST) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "value not a list";
+        return NGX_ERROR;
+    }
+
+    ngx_lua_shdict_touch(ctx, sd);
+
+    first = start;
+    last = stop;
+
+    n = ngx_lua_shdict_list_range(sd->value_len, &first, &last);
+
+    if (n == 0) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    queue = ngx_lua_shdict_get_list_head(sd, key_len);
+
+    /* the first element is located from whichever end is closer */
+
+    q = ngx_lua_shdict_list_index(queue, sd->value_len, first);
+
+    rc = ngx_lua_shdict_list_copy_values(ctx, q, n, 1, buf, buf_len, errmsg);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    *nvalues = (int) n;
+
+    return NGX_OK;
+}
+
+
+int
+ngx_lua_ffi_shdict_lindex(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, long index, u_char **buf, size_t *buf_len,
+    int *nvalues, char **errmsg)
+{
+    return ngx_lua_ffi_shdict_lrange(zone, key, key_len, index, index, buf,
+                                     buf_len, nvalues, errmsg);
+}
+
+
+int
+ngx_lua_ffi_shdict_lset(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, long index, ngx_lua_shdict_value_t *value,
+    char **errmsg)
+{
+    int                              n, forcible;
+    ngx_uint_t                       hash;
+    ngx_int_t                        rc;
+    u_char                          *str_value_buf;
+    size_t                           str_value_len;
+    ngx_queue_t                     *queue, *q;
+    ngx_lua_shdict_ctx_t            *ctx;
+    ngx_lua_shdict_node_t           *sd;
+    ngx_lua_shdict_list_node_t      *lnode, *old;
+
+    ctx = zone->data;
+
+    switch (value->value_type) {
+
+    case SHDICT_TSTRING:
+        str_value_buf = value->str_value_buf;
+        str_value_len = value->str_value_len;
+        break;
+
+    case SHDICT_TNUMBER:
+        str_value_buf = (u_char *) &value->num_value;
+        str_value_len = sizeof(double);
+        break;
+
+    default:
+        *errmsg = "unsupported value type";
+        return NGX_ERROR;
+    }
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "not found";
+        return NGX_DECLINED;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != SHDICT_TLIST) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "value not a list";
+        return NGX_ERROR;
+    }
+
+    if (index < 0) {
+        index += sd->value_len;
+    }
+
+    if (index < 0 || index >= (long) sd->value_len) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "index out of range";
+        return NGX_DECLINED;
+    }
+
+    queue = ngx_lua_shdict_get_list_head(sd, key_len);
+
+    q = ngx_lua_shdict_list_index(queue, sd->value_len, index);
+
+    old = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+
+    if (old->value_len == str_value_len) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict lset: value size matched, "
+                       "reusing list node");
+
+        old->value_type = (uint8_t) value->value_type;
+        ngx_memcpy(old->data, str_value_buf, str_value_len);
+
+        ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_LIST, hash, key,
+                              key_len);
 
         ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-        *value_len = sd->value_len;
         return NGX_OK;
     }
 
+    n = offsetof(ngx_lua_shdict_list_node_t, data)
+        + str_value_len;
+
+    forcible = 0;
+
+    (void) ngx_lua_shdict_ns_reserve(ctx, key, key_len, sd, n);
+
+    lnode = ngx_lua_shdict_alloc(ctx, sd, n, &forcible);
+
+    if (lnode == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+    lnode->value_len = (uint32_t) str_value_len;
+    lnode->value_type = (uint8_t) value->value_type;
+
+    ngx_memcpy(lnode->data, str_value_buf, str_value_len);
+
+    ngx_queue_insert_after(q, &lnode->queue);
+    ngx_queue_remove(q);
+
+    ngx_lua_shdict_ns_charge(ctx, sd, (ssize_t) n
+                                      - ngx_lua_shdict_list_node_size(old));
+    ngx_slab_free_locked(ctx->shpool, old);
+
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_LIST, hash, key, key_len);
+
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
+    return NGX_OK;
+}
+
+
+int
+ngx_lua_ffi_shdict_ltrim(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, long start, long stop, int *value_len, char **errmsg)
+{
+    ngx_uint_t                       hash;
+    ngx_int_t                        rc, first, last, n, i;
+    ngx_queue_t                     *queue, *q;
+    ngx_lua_shdict_ctx_t            *ctx;
+    ngx_lua_shdict_node_t           *sd;
+    ngx_lua_shdict_list_node_t      *lnode;
+
+    ctx = zone->data;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
     *value_len = 0;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != SHDICT_TLIST) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "value not a list";
+        return NGX_ERROR;
+    }
+
+    first = start;
+    last = stop;
+
+    n = ngx_lua_shdict_list_range(sd->value_len, &first, &last);
+
+    if (n == 0) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict list: empty node after trim, "
+                       "remove it");
+
+        ngx_lua_shdict_remove(ctx, sd);
+
+        ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_LIST, hash, key,
+                              key_len);
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        return NGX_OK;
+    }
+
+    queue = ngx_lua_shdict_get_list_head(sd, key_len);
+
+    /* both ends are trimmed in place, no walk over the kept range */
+
+    for (i = 0; i < first; i++) {
+        q = ngx_queue_head(queue);
+        ngx_queue_remove(q);
+
+        lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+        ngx_lua_shdict_list_free(ctx, sd, lnode);
+    }
+
+    for (i = last + 1; i < (ngx_int_t) sd->value_len; i++) {
+        q = ngx_queue_last(queue);
+        ngx_queue_remove(q);
+
+        lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+        ngx_lua_shdict_list_free(ctx, sd, lnode);
+    }
+
+    sd->value_len = (uint32_t) n;
+
+    ngx_lua_shdict_touch(ctx, sd);
+
+    *value_len = sd->value_len;
+
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_LIST, hash, key, key_len);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
     return NGX_OK;
 }
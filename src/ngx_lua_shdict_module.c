@@ -8,13 +8,19 @@
 
 
 static char *ngx_lua_shdict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_lua_shdict_ctx_t *ngx_lua_shdict_find_old_zone(
+    ngx_shm_zone_t *shm_zone);
+static void ngx_lua_shdict_migrate(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_ctx_t *octx);
+static ngx_int_t ngx_lua_shdict_copy_node(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *osd);
 
 
 static ngx_command_t ngx_lua_shdict_cmds[] = {
 
     /* NGX_HTTP_MAIN_CONF equal NGX_STREAM_MAIN_CONF */
     { ngx_string("lua_shared_mem"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2|NGX_MAIN_CONF,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE|NGX_MAIN_CONF,
       ngx_lua_shdict,
       0,
       0,
@@ -30,8 +36,8 @@ ngx_module_t ngx_lua_shdict_module = {
     ngx_lua_shdict_cmds,               /* module directives */
     NGX_CONF_MODULE,                   /* module type */
     NULL,                              /* init master */
-    NULL,                              /* init module */
-    NULL,                              /* init process */
+    ngx_lua_shdict_wait_init_module,   /* init module */
+    ngx_lua_shdict_wait_init_process,  /* init process */
     NULL,                              /* init thread */
     NULL,                              /* exit thread */
     NULL,                              /* exit process */
@@ -86,7 +92,7 @@ ngx_lua_shdict_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_lua_shdict_ctx_t       *octx = data;
     size_t                      len;
-    ngx_lua_shdict_ctx_t       *ctx;
+    ngx_lua_shdict_ctx_t       *ctx, *old;
 
     ctx = shm_zone->data;
 
@@ -94,7 +100,7 @@ ngx_lua_shdict_init(ngx_shm_zone_t *shm_zone, void *data)
         ctx->sh = octx->sh;
         ctx->shpool = octx->shpool;
 
-        return NGX_OK;
+        goto features;
     }
 
     ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
@@ -102,7 +108,7 @@ ngx_lua_shdict_init(ngx_shm_zone_t *shm_zone, void *data)
     if (shm_zone->shm.exists) {
         ctx->sh = ctx->shpool->data;
 
-        return NGX_OK;
+        goto features;
     }
 
     ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_lua_shdict_shctx_t));
@@ -116,6 +122,24 @@ ngx_lua_shdict_init(ngx_shm_zone_t *shm_zone, void *data)
                     ngx_lua_shdict_rbtree_insert_node);
 
     ngx_queue_init(&ctx->sh->lru_queue);
+    ngx_queue_init(&ctx->sh->low_queue);
+    ngx_queue_init(&ctx->sh->pinned_queue);
+    ngx_queue_init(&ctx->sh->waiters);
+
+    ngx_rbtree_init(&ctx->sh->sems, &ctx->sh->sems_sentinel,
+                    ngx_lua_shdict_sem_rbtree_insert);
+
+    ctx->sh->sem_token = 0;
+
+    ngx_rbtree_init(&ctx->sh->leases, &ctx->sh->leases_sentinel,
+                    ngx_lua_shdict_lease_rbtree_insert);
+
+    ctx->sh->lease_token = 0;
+    ctx->sh->pinned_bytes = 0;
+    ctx->sh->hot = NULL;
+    ctx->sh->lfu = NULL;
+    ctx->sh->changes = NULL;
+    ctx->sh->ns = NULL;
 
     len = sizeof(" in lua_shared_dict zone \"\"") + shm_zone->shm.name.len;
 
@@ -131,6 +155,274 @@ ngx_lua_shdict_init(ngx_shm_zone_t *shm_zone, void *data)
     ctx->shpool->log_nomem = 0;
 #endif
 
+    if (ngx_lua_shdict_hot_init(ctx) != NGX_OK
+        || ngx_lua_shdict_lfu_init(ctx, shm_zone->shm.size) != NGX_OK
+        || ngx_lua_shdict_changes_init(ctx) != NGX_OK
+        || ngx_lua_shdict_ns_init(ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the zone was resized on reload, carry its items over */
+
+    old = ngx_lua_shdict_find_old_zone(shm_zone);
+    if (old != NULL) {
+        ngx_lua_shdict_migrate(ctx, old);
+    }
+
+    return NGX_OK;
+
+features:
+
+    /* a zone reused on reload follows the parameters of the new cycle */
+
+    if (ngx_lua_shdict_hot_init(ctx) != NGX_OK
+        || ngx_lua_shdict_lfu_init(ctx, shm_zone->shm.size) != NGX_OK
+        || ngx_lua_shdict_changes_init(ctx) != NGX_OK
+        || ngx_lua_shdict_ns_init(ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * nginx maps a new segment when the size of a zone changes on reload, and
+ * releases the old one only after all the zones of the new cycle have been
+ * initialized, so the old zone is still around in the old cycle here
+ */
+
+static ngx_lua_shdict_ctx_t *
+ngx_lua_shdict_find_old_zone(ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t                   i;
+    ngx_shm_zone_t              *zone;
+    ngx_list_part_t             *part;
+    ngx_lua_shdict_ctx_t        *octx;
+
+    if (ngx_cycle == NULL) {
+        return NULL;
+    }
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (zone[i].tag != &ngx_lua_shdict_module
+            || zone[i].shm.addr == shm_zone->shm.addr
+            || zone[i].shm.name.len != shm_zone->shm.name.len
+            || ngx_strncmp(zone[i].shm.name.data, shm_zone->shm.name.data,
+                           shm_zone->shm.name.len) != 0)
+        {
+            continue;
+        }
+
+        octx = zone[i].data;
+
+        if (octx == NULL || octx->sh == NULL) {
+            return NULL;
+        }
+
+        return octx;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_lua_shdict_migrate(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_ctx_t *octx)
+{
+    uint64_t                     now;
+    ngx_uint_t                   i, n, carried, dropped, expired;
+    ngx_time_t                  *tp;
+    ngx_queue_t                 *q, *queue;
+    ngx_lua_shdict_node_t       *osd;
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    carried = 0;
+    dropped = 0;
+    expired = 0;
+
+    /* the workers of the old cycle keep on using the old zone meanwhile */
+
+    ngx_shmtx_lock(&octx->shpool->mutex);
+
+    /*
+     * walk every queue from the most recently used item on, so that the
+     * coldest ones are dropped when the zone shrinks, and keep the LRU
+     * order; the pinned items go first and the low priority ones last
+     */
+
+    n = ngx_lua_shdict_queue_count(octx);
+
+    for (i = 0; i < n; i++) {
+        queue = ngx_lua_shdict_nth_queue(octx, (i + n - 1) % n);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            osd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+
+            /* the stale items within their stale_ttl are carried over too */
+
+            if (osd->expires != 0 && osd->expires + osd->stale_ttl <= now) {
+                expired++;
+                continue;
+            }
+
+            if (ngx_lua_shdict_copy_node(ctx, osd) != NGX_OK) {
+                dropped++;
+                continue;
+            }
+
+            carried++;
+        }
+    }
+
+    /*
+     * the change log starts over empty at the sequence number and in the
+     * epoch of the old one: its readers which had caught up carry on, the
+     * others are told that they missed changes
+     */
+
+    if (ctx->sh->changes && octx->sh->changes) {
+        ctx->sh->changes->epoch = octx->sh->changes->epoch;
+        ctx->sh->changes->base = octx->sh->changes->last;
+        ctx->sh->changes->last = octx->sh->changes->last;
+    }
+
+    ngx_shmtx_unlock(&octx->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0,
+                  "lua shared dict \"%V\" resized: %ui items carried over, "
+                  "%ui dropped for lack of memory or over a quota, "
+                  "%ui expired",
+                  &ctx->name, carried, dropped, expired);
+}
+
+
+static ngx_int_t
+ngx_lua_shdict_copy_node(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *osd)
+{
+    size_t                           n;
+    ngx_queue_t                     *queue, *oqueue, *q;
+    ngx_rbtree_node_t               *node, *onode;
+    ngx_lua_shdict_node_t           *sd;
+    ngx_lua_shdict_chunk_t          *chunks;
+    ngx_lua_shdict_list_node_t      *lnode, *olnode;
+
+    onode = (ngx_rbtree_node_t *)
+                ((u_char *) osd - offsetof(ngx_rbtree_node_t, color));
+
+    n = ngx_lua_shdict_node_size(osd);
+
+    node = ngx_slab_alloc_locked(ctx->shpool, n);
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(node, onode, n);
+
+    sd = (ngx_lua_shdict_node_t *) &node->color;
+
+    /*
+     * a pinned item stays pinned only within the pinned limit of the new
+     * zone, and becomes an item of normal priority otherwise, which the
+     * forced evictions can take
+     */
+
+    if (sd->priority == NGX_LUA_SHDICT_PRIO_PINNED
+        && (ctx->pinned == 0
+            || ctx->sh->pinned_bytes + ngx_lua_shdict_ns_item_size(osd)
+               > ctx->pinned))
+    {
+        sd->priority = NGX_LUA_SHDICT_PRIO_NORMAL;
+    }
+
+    if (osd->chunked) {
+        chunks = ngx_lua_shdict_chunks_copy(ctx,
+                                            *ngx_lua_shdict_get_chunks(osd),
+                                            osd->value_len);
+        if (chunks == NULL) {
+            ngx_slab_free_locked(ctx->shpool, node);
+            return NGX_ERROR;
+        }
+
+        *ngx_lua_shdict_get_chunks(sd) = chunks;
+    }
+
+    if (osd->value_type == SHDICT_TLIST) {
+        queue = ngx_lua_shdict_get_list_head(sd, sd->key_len);
+        oqueue = ngx_lua_shdict_get_list_head(osd, osd->key_len);
+
+        ngx_queue_init(queue);
+
+        for (q = ngx_queue_head(oqueue);
+             q != ngx_queue_sentinel(oqueue);
+             q = ngx_queue_next(q))
+        {
+            olnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+
+            n = offsetof(ngx_lua_shdict_list_node_t, data) + olnode->value_len;
+
+            lnode = ngx_slab_alloc_locked(ctx->shpool, n);
+
+            if (lnode == NULL) {
+
+                while (!ngx_queue_empty(queue)) {
+                    q = ngx_queue_head(queue);
+                    ngx_queue_remove(q);
+
+                    lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t,
+                                           queue);
+                    ngx_slab_free_locked(ctx->shpool, lnode);
+                }
+
+                ngx_slab_free_locked(ctx->shpool, node);
+
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(lnode, olnode, n);
+
+            ngx_queue_insert_tail(queue, &lnode->queue);
+        }
+    }
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+    /* behind the items of its queue carried over before it */
+
+    ngx_lua_shdict_ns_link(ctx, sd);
+
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_tail(ngx_lua_shdict_item_queue(ctx, sd), &sd->queue);
+
+    /* an item taking its namespace over its quota is dropped */
+
+    if (ngx_lua_shdict_ns_over(ctx, sd)) {
+        ngx_lua_shdict_remove(ctx, sd);
+        return NGX_DECLINED;
+    }
+
     return NGX_OK;
 }
 
@@ -176,7 +468,11 @@ ngx_lua_shdict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_shm_zone_t               *zone;
     ngx_shm_zone_t              **zp;
     ngx_lua_shdict_ctx_t         *ctx;
-    ssize_t                       size;
+    ngx_lua_shdict_ns_conf_t     *nsc;
+    ssize_t                       size, quota;
+    ngx_int_t                     n;
+    ngx_uint_t                    i, j;
+    ngx_str_t                     s;
 
     value = cf->args->elts;
 
@@ -211,6 +507,183 @@ ngx_lua_shdict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ctx->name = name;
     ctx->log = &cf->cycle->new_log;
 
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "hot_keys=", 9) == 0) {
+
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+
+            if (n <= 0 || n > NGX_LUA_SHDICT_HOT_MAX) {
+                goto invalid;
+            }
+
+            ctx->hot_keys = n;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "admission=tinylfu") == 0) {
+            ctx->admission = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "changes=", 8) == 0) {
+
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+            if (n <= 0 || n > NGX_LUA_SHDICT_CHANGES_MAX) {
+                goto invalid;
+            }
+
+            ctx->changes = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "namespace=", 10) == 0) {
+
+            /* the prefix is up to the last colon, which may end it too */
+
+            s.data = value[i].data + 10;
+            s.len = value[i].len - 10;
+
+            for (j = s.len; j > 0 && s.data[j - 1] != ':'; j--) {
+                /* void */
+            }
+
+            if (j < 2 || j - 1 > NGX_LUA_SHDICT_NS_PREFIX_LEN) {
+                goto invalid;
+            }
+
+            s.data += j;
+            s.len -= j;
+
+            quota = ngx_parse_size(&s);
+
+            if (quota <= 0) {
+                goto invalid;
+            }
+
+            if (ctx->namespaces == NULL) {
+                ctx->namespaces = ngx_array_create(cf->pool, 4,
+                                            sizeof(ngx_lua_shdict_ns_conf_t));
+                if (ctx->namespaces == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            if (ctx->namespaces->nelts == NGX_LUA_SHDICT_NS_MAX - 1) {
+                goto invalid;
+            }
+
+            nsc = ctx->namespaces->elts;
+
+            for (n = 0; n < (ngx_int_t) ctx->namespaces->nelts; n++) {
+                if (nsc[n].prefix.len == j - 1
+                    && ngx_strncmp(nsc[n].prefix.data, value[i].data + 10,
+                                   j - 1) == 0)
+                {
+                    goto invalid;
+                }
+            }
+
+            nsc = ngx_array_push(ctx->namespaces);
+            if (nsc == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            nsc->prefix.data = value[i].data + 10;
+            nsc->prefix.len = j - 1;
+            nsc->quota = (size_t) quota;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "namespace_sep=", 14) == 0) {
+
+            if (value[i].len != 15) {
+                goto invalid;
+            }
+
+            ctx->ns_sep = value[i].data[14];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "namespace_quota=", 16) == 0) {
+
+            s.data = value[i].data + 16;
+            s.len = value[i].len - 16;
+
+            quota = ngx_parse_size(&s);
+
+            if (quota <= 0) {
+                goto invalid;
+            }
+
+            ctx->ns_quota = (size_t) quota;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "pinned=", 7) == 0) {
+
+            s.data = value[i].data + 7;
+            s.len = value[i].len - 7;
+
+            quota = ngx_parse_size(&s);
+
+            if (quota <= 0) {
+                goto invalid;
+            }
+
+            ctx->pinned = (size_t) quota;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "chunked=", 8) == 0) {
+
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            quota = ngx_parse_size(&s);
+
+            if (quota <= 0) {
+                goto invalid;
+            }
+
+            ctx->chunked = (size_t) quota;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hot_keys_sample=", 16) == 0) {
+
+            n = ngx_atoi(value[i].data + 16, value[i].len - 16);
+
+            if (n <= 0) {
+                goto invalid;
+            }
+
+            ctx->hot_sample = n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (ctx->hot_keys == 0 && ctx->hot_sample) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"hot_keys_sample\" requires \"hot_keys\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ctx->ns_quota && ctx->ns_sep == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"namespace_quota\" requires \"namespace_sep\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ctx->hot_keys && ctx->hot_sample == 0) {
+        ctx->hot_sample = NGX_LUA_SHDICT_HOT_SAMPLE;
+    }
+
+    ctx->hot_countdown = ctx->hot_sample;
+
     zone = ngx_shared_memory_add(cf, &name, (size_t) size, &ngx_lua_shdict_module);
 
     if (zone == NULL) {
@@ -237,4 +710,10 @@ ngx_lua_shdict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     *zp = zone;
 
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
 }
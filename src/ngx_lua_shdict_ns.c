@@ -0,0 +1,678 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * the namespaces of a zone: the keys starting with the prefix of a
+ * namespace, declared by lua_shared_mem or inferred from the part of a key
+ * up to a separator, belong to it, and the items of every namespace are
+ * in an LRU queue of their own, the other items staying in the one of the
+ * zone, which is the default namespace. The bytes taken by the items of
+ * every namespace are counted, list elements included, and a store which
+ * would take a namespace over its quota first evicts its own least
+ * recently used items, so that a tenant filling the zone only pushes its
+ * own keys out. When the zone itself is full, a namespace over its quota
+ * is evicted from first, then the largest of the namespaces without a
+ * quota, the default one included, and the ones within their quota last.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+/* FNV-1a, computed a byte at a time over the prefixes of a key */
+#define NGX_LUA_SHDICT_NS_HASH_INIT    2166136261U
+#define ngx_lua_shdict_ns_hash_step(h, c)  (((h) ^ (c)) * 16777619U)
+
+
+static ngx_int_t ngx_lua_shdict_ns_same(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_nss_t *ns);
+static ngx_uint_t ngx_lua_shdict_ns_add(ngx_lua_shdict_ctx_t *ctx,
+    u_char *key, size_t key_len);
+static void ngx_lua_shdict_ns_free(ngx_lua_shdict_nss_t *ns, ngx_uint_t i);
+static uint32_t ngx_lua_shdict_ns_hash(u_char *prefix, size_t len);
+static void ngx_lua_shdict_ns_index_add(ngx_lua_shdict_nss_t *ns,
+    ngx_uint_t i);
+static void ngx_lua_shdict_ns_index_del(ngx_lua_shdict_nss_t *ns,
+    ngx_uint_t i);
+
+
+/*
+ * sets the namespaces of the zone up for the configuration of "ctx",
+ * keeping the ones of a zone reused on reload when the namespaces declared
+ * have not changed, and sorting the items into the new ones otherwise
+ */
+
+ngx_int_t
+ngx_lua_shdict_ns_init(ngx_lua_shdict_ctx_t *ctx)
+{
+    ngx_uint_t                    i;
+    ngx_queue_t                  *q, *prev, *queue;
+    ngx_lua_shdict_ns_t          *slot;
+    ngx_lua_shdict_nss_t         *ns;
+    ngx_lua_shdict_node_t        *sd;
+    ngx_lua_shdict_ns_conf_t     *conf;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ns = ctx->sh->ns;
+
+    if (ns != NULL) {
+
+        if (ngx_lua_shdict_ns_same(ctx, ns) == NGX_OK) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return NGX_OK;
+        }
+
+        /* all the items go back to the default namespace first */
+
+        for (i = 1; i < ns->n; i++) {
+            queue = &ns->slots[i].lru_queue;
+
+            while (!ngx_queue_empty(queue)) {
+                q = ngx_queue_head(queue);
+                ngx_queue_remove(q);
+
+                sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+                sd->ns = 0;
+
+                ngx_queue_insert_tail(&ctx->sh->lru_queue, q);
+            }
+        }
+
+        ctx->sh->ns = NULL;
+        ngx_slab_free_locked(ctx->shpool, ns);
+    }
+
+    if (ctx->namespaces == NULL && ctx->ns_sep == 0) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    ns = ngx_slab_alloc_locked(ctx->shpool, sizeof(ngx_lua_shdict_nss_t));
+
+    if (ns == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                      "lua shared dict \"%V\" is too small for namespaces",
+                      &ctx->name);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(ns, sizeof(ngx_lua_shdict_nss_t));
+
+    ngx_queue_init(&ns->slots[0].lru_queue);
+
+    ns->n = 1;
+    ns->next = 0;
+    ns->sep = ctx->ns_sep;
+    ns->quota = ctx->ns_quota;
+
+    if (ctx->namespaces) {
+        conf = ctx->namespaces->elts;
+
+        for (i = 0; i < ctx->namespaces->nelts; i++) {
+            slot = &ns->slots[ns->n];
+
+            ngx_queue_init(&slot->lru_queue);
+
+            slot->quota = conf[i].quota;
+            slot->prefix_len = (u_short) conf[i].prefix.len;
+            ngx_memcpy(slot->prefix, conf[i].prefix.data, conf[i].prefix.len);
+
+            ngx_lua_shdict_ns_index_add(ns, ns->n++);
+        }
+    }
+
+    ns->declared = ns->n - 1;
+
+    ctx->sh->ns = ns;
+
+    /* sort the items in, keeping the LRU order of every namespace */
+
+    for (q = ngx_queue_last(&ctx->sh->lru_queue);
+         q != ngx_queue_sentinel(&ctx->sh->lru_queue);
+         q = prev)
+    {
+        prev = ngx_queue_prev(q);
+
+        sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
+        sd->ns = (uint8_t) ngx_lua_shdict_ns_add(ctx, sd->data, sd->key_len);
+
+        if (sd->ns) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&ns->slots[sd->ns].lru_queue, q);
+        }
+
+        ns->slots[sd->ns].used += ngx_lua_shdict_ns_item_size(sd);
+        ns->slots[sd->ns].items++;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_lua_shdict_ns_same(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_nss_t *ns)
+{
+    ngx_uint_t                    i, n;
+    ngx_lua_shdict_ns_t          *slot;
+    ngx_lua_shdict_ns_conf_t     *conf;
+
+    n = ctx->namespaces ? ctx->namespaces->nelts : 0;
+
+    if (ns->sep != ctx->ns_sep
+        || ns->quota != ctx->ns_quota
+        || ns->declared != n)
+    {
+        return NGX_DECLINED;
+    }
+
+    conf = n ? ctx->namespaces->elts : NULL;
+
+    for (i = 0; i < n; i++) {
+        slot = &ns->slots[i + 1];
+
+        if (slot->quota != conf[i].quota
+            || slot->prefix_len != conf[i].prefix.len
+            || ngx_memcmp(slot->prefix, conf[i].prefix.data,
+                          conf[i].prefix.len) != 0)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* the bytes the item "sd" takes, with the elements of a list or its chunks */
+
+size_t
+ngx_lua_shdict_ns_item_size(ngx_lua_shdict_node_t *sd)
+{
+    size_t                           size;
+    ngx_queue_t                     *queue, *q;
+    ngx_lua_shdict_list_node_t      *lnode;
+
+    size = ngx_lua_shdict_node_size(sd);
+
+    if (sd->value_type == SHDICT_TLIST) {
+        queue = ngx_lua_shdict_get_list_head(sd, sd->key_len);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+            size += ngx_lua_shdict_list_node_size(lnode);
+        }
+    }
+
+    if (sd->chunked) {
+        size += ngx_lua_shdict_chunks_size(sd->value_len);
+    }
+
+    return size;
+}
+
+
+/*
+ * returns the namespace of "key", that of the longest prefix of it, or 0,
+ * the default one, for a key which belongs to no namespace; the prefixes
+ * of the key are looked up in the hash only for the lengths some
+ * namespace has, hashing the key a byte at a time
+ */
+
+ngx_uint_t
+ngx_lua_shdict_ns_find(ngx_lua_shdict_ctx_t *ctx, u_char *key,
+    size_t key_len)
+{
+    size_t                        len, max;
+    uint32_t                      h;
+    ngx_uint_t                    i, best;
+    ngx_lua_shdict_ns_t          *slot;
+    ngx_lua_shdict_nss_t         *ns;
+
+    ns = ctx->sh->ns;
+
+    if (ns == NULL) {
+        return 0;
+    }
+
+    best = 0;
+    h = NGX_LUA_SHDICT_NS_HASH_INIT;
+
+    max = ngx_min(key_len, NGX_LUA_SHDICT_NS_PREFIX_LEN);
+
+    for (len = 1; len <= max; len++) {
+        h = ngx_lua_shdict_ns_hash_step(h, key[len - 1]);
+
+        if (ns->lens[len] == 0) {
+            continue;
+        }
+
+        for (i = h & (NGX_LUA_SHDICT_NS_INDEX - 1);
+             ns->index[i];
+             i = (i + 1) & (NGX_LUA_SHDICT_NS_INDEX - 1))
+        {
+            slot = &ns->slots[ns->index[i]];
+
+            if (slot->prefix_len == len
+                && ngx_memcmp(key, slot->prefix, len) == 0)
+            {
+                best = ns->index[i];
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+
+/*
+ * returns the namespace of "key" as ngx_lua_shdict_ns_find() does, or a
+ * namespace inferred from it, taken from the free ones, for an item about
+ * to be linked
+ */
+
+static ngx_uint_t
+ngx_lua_shdict_ns_add(ngx_lua_shdict_ctx_t *ctx, u_char *key, size_t key_len)
+{
+    u_char                       *p;
+    size_t                        len;
+    ngx_uint_t                    i;
+    ngx_lua_shdict_ns_t          *slot;
+    ngx_lua_shdict_nss_t         *ns;
+
+    i = ngx_lua_shdict_ns_find(ctx, key, key_len);
+
+    ns = ctx->sh->ns;
+
+    if (i || ns == NULL || ns->sep == 0) {
+        return i;
+    }
+
+    /* a namespace named after the key up to the separator, included */
+
+    p = ngx_strlchr(key, key + key_len, ns->sep);
+
+    if (p == NULL || p == key) {
+        return 0;
+    }
+
+    len = p - key + 1;
+
+    if (len > NGX_LUA_SHDICT_NS_PREFIX_LEN) {
+        return 0;
+    }
+
+    for (i = ns->declared + 1; i < ns->n; i++) {
+        if (ns->slots[i].prefix_len == 0) {
+            break;
+        }
+    }
+
+    if (i == NGX_LUA_SHDICT_NS_MAX) {
+
+        if (!ns->full) {
+            ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                          "lua shared dict \"%V\": no namespace left for "
+                          "\"%*s\", its keys go to the default one",
+                          &ctx->name, len, key);
+            ns->full = 1;
+        }
+
+        return 0;
+    }
+
+    if (i == ns->n) {
+        ns->n++;
+    }
+
+    slot = &ns->slots[i];
+
+    ngx_memzero(slot, sizeof(ngx_lua_shdict_ns_t));
+    ngx_queue_init(&slot->lru_queue);
+
+    slot->quota = ns->quota;
+    slot->prefix_len = (u_short) len;
+    ngx_memcpy(slot->prefix, key, len);
+
+    ngx_lua_shdict_ns_index_add(ns, i);
+
+    return i;
+}
+
+
+/* frees the inferred namespace "i", whose items are all gone */
+
+static void
+ngx_lua_shdict_ns_free(ngx_lua_shdict_nss_t *ns, ngx_uint_t i)
+{
+    ngx_lua_shdict_ns_t          *slot;
+
+    ngx_lua_shdict_ns_index_del(ns, i);
+
+    slot = &ns->slots[i];
+
+    slot->quota = 0;
+    slot->used = 0;
+    slot->evictions = 0;
+    slot->prefix_len = 0;
+
+    while (ns->n > ns->declared + 1 && ns->slots[ns->n - 1].prefix_len == 0) {
+        ns->n--;
+    }
+
+    ns->full = 0;
+}
+
+
+static uint32_t
+ngx_lua_shdict_ns_hash(u_char *prefix, size_t len)
+{
+    uint32_t                      h;
+
+    h = NGX_LUA_SHDICT_NS_HASH_INIT;
+
+    while (len--) {
+        h = ngx_lua_shdict_ns_hash_step(h, *prefix++);
+    }
+
+    return h;
+}
+
+
+static void
+ngx_lua_shdict_ns_index_add(ngx_lua_shdict_nss_t *ns, ngx_uint_t i)
+{
+    ngx_uint_t                    j;
+    ngx_lua_shdict_ns_t          *slot;
+
+    slot = &ns->slots[i];
+
+    for (j = ngx_lua_shdict_ns_hash(slot->prefix, slot->prefix_len)
+             & (NGX_LUA_SHDICT_NS_INDEX - 1);
+         ns->index[j];
+         j = (j + 1) & (NGX_LUA_SHDICT_NS_INDEX - 1))
+    {
+        /* void */
+    }
+
+    ns->index[j] = (u_char) i;
+    ns->lens[slot->prefix_len]++;
+}
+
+
+/*
+ * removes the namespace "i" from the hash, moving back the entries after
+ * it which would no longer be found past the empty entry it leaves
+ */
+
+static void
+ngx_lua_shdict_ns_index_del(ngx_lua_shdict_nss_t *ns, ngx_uint_t i)
+{
+    ngx_uint_t                    j, k, home, mask;
+    ngx_lua_shdict_ns_t          *slot;
+
+    mask = NGX_LUA_SHDICT_NS_INDEX - 1;
+
+    slot = &ns->slots[i];
+
+    ns->lens[slot->prefix_len]--;
+
+    j = ngx_lua_shdict_ns_hash(slot->prefix, slot->prefix_len) & mask;
+
+    while (ns->index[j] != i) {
+        j = (j + 1) & mask;
+    }
+
+    for ( ;; ) {
+        ns->index[j] = 0;
+
+        k = j;
+
+        for ( ;; ) {
+            k = (k + 1) & mask;
+
+            if (ns->index[k] == 0) {
+                return;
+            }
+
+            slot = &ns->slots[ns->index[k]];
+
+            home = ngx_lua_shdict_ns_hash(slot->prefix, slot->prefix_len)
+                   & mask;
+
+            /* the entry may move to j unless its home is in (j, k] */
+
+            if (((k - home) & mask) >= ((k - j) & mask)) {
+                break;
+            }
+        }
+
+        ns->index[j] = ns->index[k];
+        j = k;
+    }
+}
+
+
+/*
+ * links the new item "sd" into the namespace of its key, which is inferred
+ * from it here if need be, or into the queue of its priority class, which
+ * is outside of the namespaces
+ */
+
+void
+ngx_lua_shdict_ns_link(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd)
+{
+    if (sd->priority == NGX_LUA_SHDICT_PRIO_NORMAL) {
+        sd->ns = (uint8_t) ngx_lua_shdict_ns_add(ctx, sd->data, sd->key_len);
+
+    } else {
+        sd->ns = 0;
+    }
+
+    ngx_queue_insert_head(ngx_lua_shdict_item_queue(ctx, sd), &sd->queue);
+
+    ngx_lua_shdict_ns_charge(ctx, sd, ngx_lua_shdict_ns_item_size(sd));
+
+    if (ctx->sh->ns && sd->priority == NGX_LUA_SHDICT_PRIO_NORMAL) {
+        ctx->sh->ns->slots[sd->ns].items++;
+    }
+}
+
+
+/*
+ * unlinks the item "sd", about to be freed, from its namespace, which is
+ * freed with its last item when it was inferred
+ */
+
+void
+ngx_lua_shdict_ns_unlink(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd)
+{
+    ssize_t                       size;
+    ngx_lua_shdict_nss_t         *ns;
+
+    ngx_queue_remove(&sd->queue);
+
+    size = (ssize_t) ngx_lua_shdict_ns_item_size(sd);
+
+    ngx_lua_shdict_ns_charge(ctx, sd, -size);
+
+    ns = ctx->sh->ns;
+
+    if (ns && sd->priority == NGX_LUA_SHDICT_PRIO_NORMAL
+        && --ns->slots[sd->ns].items == 0
+        && sd->ns > ns->declared)
+    {
+        ngx_lua_shdict_ns_free(ns, sd->ns);
+    }
+}
+
+
+/*
+ * makes room for "size" more bytes in the namespace of "key" by evicting
+ * its least recently used items, but never the item "sd" itself, when
+ * they would take it over its quota, and returns the number of items
+ * evicted; a namespace yet to be inferred has no items to evict, and is
+ * only taken when the item is linked
+ */
+
+ngx_int_t
+ngx_lua_shdict_ns_reserve(ngx_lua_shdict_ctx_t *ctx, u_char *key,
+    size_t key_len, ngx_lua_shdict_node_t *sd, size_t size)
+{
+    int                           freed;
+    ngx_int_t                     evicted;
+    ngx_uint_t                    i;
+    ngx_queue_t                  *queue;
+    ngx_lua_shdict_ns_t          *slot;
+
+    if (ctx->sh->ns == NULL) {
+        return 0;
+    }
+
+    i = ngx_lua_shdict_ns_find(ctx, key, key_len);
+
+    slot = &ctx->sh->ns->slots[i];
+    queue = ngx_lua_shdict_ns_queue(ctx, i);
+
+    evicted = 0;
+
+    while (slot->quota
+           && slot->used + size > slot->quota
+           && !ngx_queue_empty(queue)
+           && (sd == NULL || ngx_queue_last(queue) != &sd->queue))
+    {
+        freed = ngx_lua_shdict_expire_queue(ctx, queue, 0);
+        if (freed == 0) {
+            break;
+        }
+
+        evicted += freed;
+    }
+
+    return evicted;
+}
+
+
+/* returns the LRU queue a forced eviction takes its victim from */
+
+ngx_queue_t *
+ngx_lua_shdict_ns_victim(ngx_lua_shdict_ctx_t *ctx)
+{
+    size_t                        over, most;
+    ngx_uint_t                    i, pass, victim;
+    ngx_lua_shdict_ns_t          *slot;
+    ngx_lua_shdict_nss_t         *ns;
+
+    ns = ctx->sh->ns;
+
+    if (ns == NULL) {
+        return &ctx->sh->lru_queue;
+    }
+
+    /* the namespace the most over its quota */
+
+    victim = 0;
+    over = 0;
+
+    for (i = 1; i < ns->n; i++) {
+        slot = &ns->slots[i];
+
+        if (slot->quota
+            && slot->used > slot->quota + over
+            && !ngx_queue_empty(&slot->lru_queue))
+        {
+            victim = i;
+            over = slot->used - slot->quota;
+        }
+    }
+
+    if (victim) {
+        return &ns->slots[victim].lru_queue;
+    }
+
+    /*
+     * the largest namespace without a quota, the default one included,
+     * then the largest one within its quota
+     */
+
+    for (pass = 0; pass < 2; pass++) {
+        most = 0;
+
+        for (i = 0; i < ns->n; i++) {
+            slot = &ns->slots[i];
+
+            if ((slot->quota != 0) != pass
+                || slot->used <= most
+                || ngx_queue_empty(ngx_lua_shdict_ns_queue(ctx, i)))
+            {
+                continue;
+            }
+
+            victim = i;
+            most = slot->used;
+        }
+
+        if (most) {
+            return ngx_lua_shdict_ns_queue(ctx, victim);
+        }
+    }
+
+    return &ctx->sh->lru_queue;
+}
+
+
+int
+ngx_lua_ffi_shdict_ns_stats(ngx_shm_zone_t *zone,
+    ngx_lua_shdict_ns_stat_t *stats, int *n, char **errmsg)
+{
+    ngx_uint_t                    i;
+    ngx_lua_shdict_ctx_t         *ctx;
+    ngx_lua_shdict_ns_t          *slot;
+    ngx_lua_shdict_nss_t         *ns;
+
+    ctx = zone->data;
+
+    *n = 0;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ns = ctx->sh->ns;
+
+    if (ns == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "namespaces not enabled";
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < ns->n; i++) {
+        slot = &ns->slots[i];
+
+        if (i && slot->prefix_len == 0) {
+            continue;
+        }
+
+        stats[*n].quota = slot->quota;
+        stats[*n].used = slot->used;
+        stats[*n].items = slot->items;
+        stats[*n].evictions = slot->evictions;
+        stats[*n].prefix_len = slot->prefix_len;
+        ngx_memcpy(stats[*n].prefix, slot->prefix, slot->prefix_len);
+
+        (*n)++;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
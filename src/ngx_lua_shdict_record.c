@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * record values: a fixed-size C struct declared by a schema in Lua, stored
+ * as the 32-bit id of the schema followed by the bytes of the struct, so
+ * that dict:get() copies it into a cdata of the struct as is. The offsets
+ * and types of the fields are worked out in Lua from the schema, and
+ * dict:update_fields() and dict:incr_field() hand them here to be read
+ * and written in place, under the one lock the update takes, rather than
+ * through a get and a set of the whole value. The fields are not aligned
+ * in the zone, the keys before them have any length, and are copied in
+ * and out with memcpy().
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+static void ngx_lua_shdict_field_apply(u_char *p,
+    ngx_lua_shdict_field_op_t *fop);
+
+
+/* the sizes of the fields, by kind */
+static size_t  ngx_lua_shdict_field_sizes[] = {
+    0, 1, 1, 2, 2, 4, 4, 8, 8, 4, 8
+};
+
+
+/*
+ * applies the "nops" updates of "ops" to the fields of the record "key",
+ * which must be of the schema "schema", of "size" bytes, and sets the
+ * operands of the updates to the new values of the fields; returns
+ * NGX_DECLINED when the key is not found
+ */
+
+int
+ngx_lua_ffi_shdict_update_fields(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, uint32_t schema, size_t size,
+    ngx_lua_shdict_field_op_t *ops, int nops, char **errmsg)
+{
+    int                          i;
+    u_char                      *p;
+    uint32_t                     id;
+    ngx_uint_t                   hash, op;
+    ngx_int_t                    rc;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+
+    ctx = zone->data;
+
+    for (i = 0; i < nops; i++) {
+        if (ops[i].kind < NGX_LUA_SHDICT_FIELD_I8
+            || ops[i].kind > NGX_LUA_SHDICT_FIELD_F64
+            || ops[i].offset + ngx_lua_shdict_field_sizes[ops[i].kind]
+               > size)
+        {
+            *errmsg = "bad field";
+            return NGX_ERROR;
+        }
+    }
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not found";
+        return NGX_DECLINED;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != SHDICT_TRECORD) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "not a record";
+        return NGX_ERROR;
+    }
+
+    p = sd->data + sd->key_len;
+
+    ngx_memcpy(&id, p, sizeof(uint32_t));
+
+    if (id != schema
+        || (size_t) sd->value_len != NGX_LUA_SHDICT_RECORD_ID_LEN + size)
+    {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        *errmsg = "record schema mismatch";
+        return NGX_ERROR;
+    }
+
+    p += NGX_LUA_SHDICT_RECORD_ID_LEN;
+
+    op = NGX_LUA_SHDICT_CHANGE_INCR;
+
+    for (i = 0; i < nops; i++) {
+        if (ops[i].op != NGX_LUA_SHDICT_FIELD_INCR) {
+            op = NGX_LUA_SHDICT_CHANGE_SET;
+        }
+
+        ngx_lua_shdict_field_apply(p + ops[i].offset, &ops[i]);
+    }
+
+    ngx_lua_shdict_touch(ctx, sd);
+
+    ngx_lua_shdict_change(ctx, op, hash, key, key_len);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/*
+ * the integer fields are added to with the wrap around of unsigned
+ * arithmetic, as C would for the unsigned ones
+ */
+
+#define ngx_lua_shdict_field_int(type, p, fop)                                \
+    {                                                                         \
+        type  v;                                                              \
+                                                                              \
+        if (fop->op == NGX_LUA_SHDICT_FIELD_INCR) {                           \
+            ngx_memcpy(&v, p, sizeof(type));                                  \
+            v = (type) ((uint64_t) v + (uint64_t) fop->inum);                 \
+                                                                              \
+        } else {                                                              \
+            v = (type) fop->inum;                                             \
+        }                                                                     \
+                                                                              \
+        ngx_memcpy(p, &v, sizeof(type));                                      \
+        fop->inum = (int64_t) v;                                              \
+    }
+
+
+#define ngx_lua_shdict_field_float(type, p, fop)                              \
+    {                                                                         \
+        type  v;                                                              \
+                                                                              \
+        if (fop->op == NGX_LUA_SHDICT_FIELD_INCR) {                           \
+            ngx_memcpy(&v, p, sizeof(type));                                  \
+            v = (type) (v + fop->num);                                        \
+                                                                              \
+        } else {                                                              \
+            v = (type) fop->num;                                              \
+        }                                                                     \
+                                                                              \
+        ngx_memcpy(p, &v, sizeof(type));                                      \
+        fop->num = (double) v;                                                \
+    }
+
+
+static void
+ngx_lua_shdict_field_apply(u_char *p, ngx_lua_shdict_field_op_t *fop)
+{
+    switch (fop->kind) {
+
+    case NGX_LUA_SHDICT_FIELD_I8:
+        ngx_lua_shdict_field_int(int8_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_U8:
+        ngx_lua_shdict_field_int(uint8_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_I16:
+        ngx_lua_shdict_field_int(int16_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_U16:
+        ngx_lua_shdict_field_int(uint16_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_I32:
+        ngx_lua_shdict_field_int(int32_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_U32:
+        ngx_lua_shdict_field_int(uint32_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_I64:
+        ngx_lua_shdict_field_int(int64_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_U64:
+        ngx_lua_shdict_field_int(uint64_t, p, fop);
+        break;
+
+    case NGX_LUA_SHDICT_FIELD_F32:
+        ngx_lua_shdict_field_float(float, p, fop);
+        break;
+
+    default: /* NGX_LUA_SHDICT_FIELD_F64 */
+        ngx_lua_shdict_field_float(double, p, fop);
+        break;
+    }
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * dict:memory_report(): the items of the zone are walked in the order of
+ * the rbtree, NGX_LUA_SHDICT_REPORT_BATCH of them per hold of the zone
+ * lock, the walk resuming after the last hash seen once the lock is taken
+ * again, so that a large zone is never locked for long. Items stored or
+ * removed between two batches may thus be missed, which a report meant
+ * for sizing zones can afford. The slot each allocation takes is worked
+ * out from the rules of the nginx slab allocator, and the statistics of
+ * its size classes are copied as they are.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+#define NGX_LUA_SHDICT_REPORT_BATCH  1024
+
+
+static ngx_rbtree_node_t *ngx_lua_shdict_report_after(ngx_rbtree_t *tree,
+    ngx_rbtree_key_t key);
+static void ngx_lua_shdict_report_item(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_report_t *report, ngx_lua_shdict_node_t *sd,
+    uint64_t now);
+static size_t ngx_lua_shdict_report_slot(ngx_slab_pool_t *pool, size_t size);
+static ngx_uint_t ngx_lua_shdict_report_bucket(size_t size);
+static void ngx_lua_shdict_report_slabs(ngx_slab_pool_t *pool,
+    ngx_lua_shdict_report_t *report);
+
+
+int
+ngx_lua_ffi_shdict_memory_report(ngx_shm_zone_t *zone, int max_items,
+    ngx_lua_shdict_report_t *report, char **errmsg)
+{
+    uint64_t                     now;
+    ngx_uint_t                   n, first;
+    ngx_time_t                  *tp;
+    ngx_rbtree_t                *tree;
+    ngx_rbtree_key_t             last;
+    ngx_rbtree_node_t           *node;
+    ngx_lua_shdict_ctx_t        *ctx;
+
+    ctx = zone->data;
+    tree = &ctx->sh->rbtree;
+
+    ngx_memzero(report, sizeof(ngx_lua_shdict_report_t));
+
+    report->size = zone->shm.size;
+
+    first = 1;
+    last = 0;
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        tp = ngx_timeofday();
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+        if (first) {
+            node = (tree->root == tree->sentinel)
+                   ? NULL : ngx_rbtree_min(tree->root, tree->sentinel);
+            first = 0;
+
+        } else {
+            node = ngx_lua_shdict_report_after(tree, last);
+        }
+
+        for (n = 0; node != NULL; n++) {
+
+            if (max_items
+                && report->items + report->expired == (size_t) max_items)
+            {
+                break;
+            }
+
+            /* a batch ends between two hashes only, see above */
+
+            if (n >= NGX_LUA_SHDICT_REPORT_BATCH && node->key != last) {
+                break;
+            }
+
+            ngx_lua_shdict_report_item(ctx, report,
+                                       (ngx_lua_shdict_node_t *) &node->color,
+                                       now);
+
+            last = node->key;
+            node = ngx_rbtree_next(tree, node);
+        }
+
+        if (node == NULL
+            || (max_items
+                && report->items + report->expired == (size_t) max_items))
+        {
+            break;
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    }
+
+    report->complete = (node == NULL);
+
+    ngx_lua_shdict_report_slabs(ctx->shpool, report);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* the first node of a hash greater than "key" */
+
+static ngx_rbtree_node_t *
+ngx_lua_shdict_report_after(ngx_rbtree_t *tree, ngx_rbtree_key_t key)
+{
+    ngx_rbtree_node_t           *node, *next;
+
+    node = tree->root;
+    next = NULL;
+
+    while (node != tree->sentinel) {
+
+        if (key < node->key) {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
+}
+
+
+static void
+ngx_lua_shdict_report_item(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_report_t *report, ngx_lua_shdict_node_t *sd, uint64_t now)
+{
+    size_t                           header, size, slot, bytes, len;
+    ngx_queue_t                     *queue, *q;
+    ngx_lua_shdict_chunk_t          *chunk;
+    ngx_lua_shdict_list_node_t      *lnode;
+
+    header = offsetof(ngx_rbtree_node_t, color)
+             + offsetof(ngx_lua_shdict_node_t, data);
+
+    if (sd->value_type == SHDICT_TLIST) {
+        size = (size_t) ngx_align_ptr(header + sd->key_len
+                                      + sizeof(ngx_queue_t), NGX_ALIGNMENT);
+
+        /* the list head and its alignment belong to the header */
+        header = size - sd->key_len;
+
+    } else if (sd->chunked) {
+        size = ngx_lua_shdict_node_size(sd);
+
+        /* the pointer to the chunks and its alignment too */
+        header = size - sd->key_len;
+
+        report->value_bytes += sd->value_len;
+        report->value_sizes[ngx_lua_shdict_report_bucket(sd->value_len)]++;
+
+    } else {
+        size = header + sd->key_len + sd->value_len;
+
+        report->value_bytes += sd->value_len;
+        report->value_sizes[ngx_lua_shdict_report_bucket(sd->value_len)]++;
+    }
+
+    slot = ngx_lua_shdict_report_slot(ctx->shpool, size);
+
+    report->header_bytes += header;
+    report->slack_bytes += slot - size;
+    report->key_bytes += sd->key_len;
+    report->key_sizes[ngx_lua_shdict_report_bucket(sd->key_len)]++;
+
+    bytes = slot;
+
+    if (sd->value_type == SHDICT_TLIST) {
+        queue = ngx_lua_shdict_get_list_head(sd, sd->key_len);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+
+            size = offsetof(ngx_lua_shdict_list_node_t, data)
+                   + lnode->value_len;
+            slot = ngx_lua_shdict_report_slot(ctx->shpool, size);
+
+            report->header_bytes += offsetof(ngx_lua_shdict_list_node_t,
+                                             data);
+            report->slack_bytes += slot - size;
+            report->value_bytes += lnode->value_len;
+            report->value_sizes[
+                ngx_lua_shdict_report_bucket(lnode->value_len)]++;
+            report->list_values++;
+
+            bytes += slot;
+        }
+    }
+
+    if (sd->chunked) {
+        len = sd->value_len;
+
+        for (chunk = *ngx_lua_shdict_get_chunks(sd);
+             chunk;
+             chunk = chunk->next)
+        {
+            size = ngx_min(len, NGX_LUA_SHDICT_CHUNK_LEN);
+            len -= size;
+
+            size += offsetof(ngx_lua_shdict_chunk_t, data);
+            slot = ngx_lua_shdict_report_slot(ctx->shpool, size);
+
+            report->header_bytes += offsetof(ngx_lua_shdict_chunk_t, data);
+            report->slack_bytes += slot - size;
+
+            bytes += slot;
+        }
+    }
+
+    if (sd->value_type < NGX_LUA_SHDICT_REPORT_TYPES) {
+        report->type_items[sd->value_type]++;
+        report->type_bytes[sd->value_type] += bytes;
+    }
+
+    if (sd->expires != 0 && sd->expires <= now) {
+        report->expired++;
+
+    } else {
+        report->items++;
+    }
+}
+
+
+/*
+ * the bytes ngx_slab_alloc_locked() takes for "size": a power of two of
+ * at least 1 << min_shift, or whole pages beyond half a page
+ */
+
+static size_t
+ngx_lua_shdict_report_slot(ngx_slab_pool_t *pool, size_t size)
+{
+    size_t                       slot;
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_align(size, ngx_pagesize);
+    }
+
+    for (slot = (size_t) 1 << pool->min_shift; slot < size; slot <<= 1) {
+        /* void */
+    }
+
+    return slot;
+}
+
+
+static ngx_uint_t
+ngx_lua_shdict_report_bucket(size_t size)
+{
+    ngx_uint_t                   b;
+
+    for (b = 0;
+         b < NGX_LUA_SHDICT_REPORT_BUCKETS - 1 && ((size_t) 1 << b) < size;
+         b++)
+    {
+        /* void */
+    }
+
+    return b;
+}
+
+
+static void
+ngx_lua_shdict_report_slabs(ngx_slab_pool_t *pool,
+    ngx_lua_shdict_report_t *report)
+{
+#if nginx_version >= 1011007
+    size_t                           map, per_page;
+    ngx_uint_t                       i, n, shift;
+    ngx_slab_stat_t                 *stat;
+    ngx_lua_shdict_slab_report_t    *slab;
+
+    report->pages = pool->last - pool->pages;
+    report->free_pages = pool->pfree;
+
+    n = ngx_min(ngx_pagesize_shift - pool->min_shift,
+                NGX_LUA_SHDICT_REPORT_SLABS);
+
+    for (i = 0; i < n; i++) {
+        stat = &pool->stats[i];
+        slab = &report->slabs[i];
+        shift = pool->min_shift + i;
+
+        /*
+         * the slots of a page, less the ones holding the bitmap of the
+         * page for the sizes below ngx_slab_exact_size
+         */
+
+        per_page = ngx_pagesize >> shift;
+
+        if (((size_t) 1 << shift) < ngx_pagesize / (8 * sizeof(uintptr_t))) {
+            map = per_page / ((size_t) 8 << shift);
+            per_page -= map ? map : 1;
+        }
+
+        slab->size = (size_t) 1 << shift;
+        slab->pages = stat->total / per_page;
+        slab->total = stat->total;
+        slab->used = stat->used;
+        slab->reqs = stat->reqs;
+        slab->fails = stat->fails;
+    }
+
+    report->nslabs = n;
+#endif
+}
@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * dict:lock() and dict:acquire(): a counting semaphore is a node of a tree
+ * of its own in the zone, apart from the items so that it is never evicted
+ * or overwritten, holding one record per permit taken, with the token the
+ * permit is given back with and the time it expires at, when the process
+ * which took it died without giving it back. The node lives as long as a
+ * permit is taken. A light thread finding all the permits taken registers
+ * a waiter in the same locked step, which the release of a permit wakes up
+ * as blpop waiters are; the waiters of a semaphore are keyed by the
+ * complement of its hash, so that they never take the wakeups of a list of
+ * the same name.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+typedef struct {
+    ngx_rbtree_node_t             node;
+    ngx_queue_t                   holders;
+    ngx_uint_t                    nholders;
+    u_short                       key_len;
+    u_char                        key[1];
+} ngx_lua_shdict_sem_t;
+
+
+typedef struct {
+    ngx_queue_t                   queue;
+    uint64_t                      token;
+    uint64_t                      expires;   /* 0 for never */
+} ngx_lua_shdict_holder_t;
+
+
+static ngx_lua_shdict_sem_t *ngx_lua_shdict_sem_lookup(
+    ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash, u_char *key, size_t key_len);
+static ngx_uint_t ngx_lua_shdict_sem_expire(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_sem_t *sem, uint64_t now);
+static void ngx_lua_shdict_sem_free(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_sem_t *sem);
+static void *ngx_lua_shdict_sem_alloc(ngx_lua_shdict_ctx_t *ctx, size_t size,
+    uint64_t now);
+
+
+void
+ngx_lua_shdict_sem_rbtree_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_lua_shdict_sem_t         *sn, *snt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            sn = (ngx_lua_shdict_sem_t *) node;
+            snt = (ngx_lua_shdict_sem_t *) temp;
+
+            p = ngx_memn2cmp(sn->key, snt->key, sn->key_len, snt->key_len)
+                < 0 ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+/*
+ * takes one of the "limit" permits of the semaphore "key", returning NGX_OK
+ * and the token of the permit, or NGX_DECLINED when they are all taken, in
+ * which case a waiter is registered if "sema" is given, and "*retry" is the
+ * time in ms before the first permit taken expires, or -1
+ */
+
+int
+ngx_lua_ffi_shdict_sem_acquire(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, int limit, long exptime, long timeout, void *sema,
+    void *post, void **waiter, uint64_t *id, uint64_t *token, long *retry,
+    char **errmsg)
+{
+    uint64_t                     now, first;
+    ngx_uint_t                   hash, freed;
+    ngx_time_t                  *tp;
+    ngx_queue_t                 *q;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_sem_t        *sem;
+    ngx_lua_shdict_holder_t     *h;
+    ngx_lua_shdict_waiter_t     *w;
+
+    ctx = zone->data;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    *waiter = NULL;
+    *retry = -1;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    freed = 0;
+
+    sem = ngx_lua_shdict_sem_lookup(ctx, hash, key, key_len);
+
+    if (sem != NULL) {
+        freed = ngx_lua_shdict_sem_expire(ctx, sem, now);
+
+        if (sem->nholders == 0) {
+            ngx_lua_shdict_sem_free(ctx, sem);
+            sem = NULL;
+        }
+    }
+
+    if (sem != NULL && sem->nholders >= (ngx_uint_t) limit) {
+
+        first = 0;
+
+        for (q = ngx_queue_head(&sem->holders);
+             q != ngx_queue_sentinel(&sem->holders);
+             q = ngx_queue_next(q))
+        {
+            h = ngx_queue_data(q, ngx_lua_shdict_holder_t, queue);
+
+            if (h->expires != 0 && (first == 0 || h->expires < first)) {
+                first = h->expires;
+            }
+        }
+
+        if (first) {
+            *retry = (long) (first - now);
+        }
+
+        if (freed) {
+            ngx_lua_shdict_wakeup(ctx, ~hash, freed);
+        }
+
+        if (sema != NULL) {
+            w = ngx_lua_shdict_wait_add(ctx, ~hash, (ngx_msec_t) timeout,
+                                        sema, post);
+            if (w != NULL) {
+                *waiter = w;
+                *id = w->id;
+            }
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        return NGX_DECLINED;
+    }
+
+    h = ngx_lua_shdict_sem_alloc(ctx, sizeof(ngx_lua_shdict_holder_t), now);
+    if (h == NULL) {
+        goto nomem;
+    }
+
+    if (sem == NULL) {
+        sem = ngx_lua_shdict_sem_alloc(ctx,
+                                       offsetof(ngx_lua_shdict_sem_t, key)
+                                       + key_len, now);
+        if (sem == NULL) {
+            ngx_slab_free_locked(ctx->shpool, h);
+            goto nomem;
+        }
+
+        sem->node.key = hash;
+        sem->nholders = 0;
+        sem->key_len = (u_short) key_len;
+        ngx_memcpy(sem->key, key, key_len);
+
+        ngx_queue_init(&sem->holders);
+
+        ngx_rbtree_insert(&ctx->sh->sems, &sem->node);
+    }
+
+    h->token = ++ctx->sh->sem_token;
+    h->expires = exptime ? now + exptime : 0;
+
+    ngx_queue_insert_tail(&sem->holders, &h->queue);
+    sem->nholders++;
+
+    /* the other permits freed go to the waiters */
+
+    if (freed > 1) {
+        ngx_lua_shdict_wakeup(ctx, ~hash, freed - 1);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    *token = h->token;
+
+    return NGX_OK;
+
+nomem:
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    *errmsg = "no memory";
+
+    return NGX_ERROR;
+}
+
+
+/* gives the permit "token" of the semaphore "key" back, waking up a waiter */
+
+int
+ngx_lua_ffi_shdict_sem_release(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, uint64_t token, char **errmsg)
+{
+    uint64_t                     now;
+    ngx_int_t                    rc;
+    ngx_uint_t                   hash, freed;
+    ngx_time_t                  *tp;
+    ngx_queue_t                 *q;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_sem_t        *sem;
+    ngx_lua_shdict_holder_t     *h;
+
+    ctx = zone->data;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    sem = ngx_lua_shdict_sem_lookup(ctx, hash, key, key_len);
+
+    if (sem == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "not held";
+        return NGX_DECLINED;
+    }
+
+    for (q = ngx_queue_head(&sem->holders);
+         q != ngx_queue_sentinel(&sem->holders);
+         q = ngx_queue_next(q))
+    {
+        h = ngx_queue_data(q, ngx_lua_shdict_holder_t, queue);
+
+        if (h->token == token) {
+            ngx_queue_remove(q);
+            ngx_slab_free_locked(ctx->shpool, h);
+            sem->nholders--;
+
+            rc = NGX_OK;
+            break;
+        }
+    }
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    freed = ngx_lua_shdict_sem_expire(ctx, sem, now) + (rc == NGX_OK);
+
+    if (sem->nholders == 0) {
+        ngx_lua_shdict_sem_free(ctx, sem);
+    }
+
+    if (freed) {
+        ngx_lua_shdict_wakeup(ctx, ~hash, freed);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (rc != NGX_OK) {
+        *errmsg = "not held";
+    }
+
+    return rc;
+}
+
+
+static ngx_lua_shdict_sem_t *
+ngx_lua_shdict_sem_lookup(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *key, size_t key_len)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_lua_shdict_sem_t        *sem;
+
+    node = ctx->sh->sems.root;
+    sentinel = ctx->sh->sems.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sem = (ngx_lua_shdict_sem_t *) node;
+
+        rc = ngx_memn2cmp(key, sem->key, key_len, (size_t) sem->key_len);
+
+        if (rc == 0) {
+            return sem;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* frees the permits of "sem" which have expired, returning their number */
+
+static ngx_uint_t
+ngx_lua_shdict_sem_expire(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_sem_t *sem, uint64_t now)
+{
+    ngx_uint_t                   freed;
+    ngx_queue_t                 *q, *next;
+    ngx_lua_shdict_holder_t     *h;
+
+    freed = 0;
+
+    for (q = ngx_queue_head(&sem->holders);
+         q != ngx_queue_sentinel(&sem->holders);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        h = ngx_queue_data(q, ngx_lua_shdict_holder_t, queue);
+
+        if (h->expires == 0 || h->expires > now) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                      "lua shared dict \"%V\": permit of \"%*s\" expired "
+                      "before it was released", &ctx->name,
+                      (size_t) sem->key_len, sem->key);
+
+        ngx_queue_remove(q);
+        ngx_slab_free_locked(ctx->shpool, h);
+
+        sem->nholders--;
+        freed++;
+    }
+
+    return freed;
+}
+
+
+static void
+ngx_lua_shdict_sem_free(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_sem_t *sem)
+{
+    ngx_rbtree_delete(&ctx->sh->sems, &sem->node);
+    ngx_slab_free_locked(ctx->shpool, sem);
+}
+
+
+/*
+ * when the zone is full, the expired permits of all the semaphores are
+ * reclaimed first, then the least recently used items are evicted, as a
+ * store would
+ */
+
+static void *
+ngx_lua_shdict_sem_alloc(ngx_lua_shdict_ctx_t *ctx, size_t size,
+    uint64_t now)
+{
+    void                        *p;
+    ngx_uint_t                   i, freed;
+    ngx_rbtree_node_t           *node, *next, *sentinel;
+    ngx_lua_shdict_sem_t        *sem;
+
+    p = ngx_slab_alloc_locked(ctx->shpool, size);
+    if (p != NULL) {
+        return p;
+    }
+
+    sentinel = ctx->sh->sems.sentinel;
+
+    if (ctx->sh->sems.root != sentinel) {
+        node = ngx_rbtree_min(ctx->sh->sems.root, sentinel);
+
+        while (node != NULL) {
+            next = ngx_rbtree_next(&ctx->sh->sems, node);
+
+            sem = (ngx_lua_shdict_sem_t *) node;
+
+            freed = ngx_lua_shdict_sem_expire(ctx, sem, now);
+
+            if (freed) {
+                ngx_lua_shdict_wakeup(ctx, ~node->key, freed);
+            }
+
+            if (sem->nholders == 0) {
+                ngx_lua_shdict_sem_free(ctx, sem);
+            }
+
+            node = next;
+        }
+
+        p = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    for (i = 0; i < 30; i++) {
+        if (ngx_lua_shdict_expire(ctx, 0) == 0) {
+            break;
+        }
+
+        p = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
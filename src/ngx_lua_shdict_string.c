@@ -6,33 +6,94 @@
 
 #include "ngx_lua_shdict_common.h"
 
+#include <math.h>
+
+
+static ngx_int_t ngx_lua_shdict_xfetch(ngx_lua_shdict_node_t *sd,
+    double beta);
+static ngx_int_t ngx_lua_shdict_pin_check(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *old, size_t key_len, size_t value_len,
+    ngx_uint_t chunked, char **errmsg);
+
 
 int
-ngx_lua_ffi_shdict_store_helper(ngx_shm_zone_t *zone, int op, u_char *key,
+ngx_lua_ffi_shdict_store_ext(ngx_shm_zone_t *zone, int op, u_char *key,
     size_t key_len, int value_type, u_char *str_value_buf,
     size_t str_value_len, double num_value, long exptime, int user_flags,
-    char **errmsg, int *forcible)
+    ngx_lua_shdict_store_opts_t *opts, char **errmsg, int *forcible)
+{
+    int                          rc;
+    ngx_uint_t                   hash;
+    ngx_lua_shdict_ctx_t        *ctx;
+
+    ctx = zone->data;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    rc = ngx_lua_shdict_store_locked(zone, op, hash, key, key_len,
+                                     value_type, str_value_buf,
+                                     str_value_len, num_value, exptime,
+                                     user_flags, opts, errmsg, forcible);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return rc;
+}
+
+
+/* stores a value like the set methods do, with the zone locked already */
+
+int
+ngx_lua_shdict_store_locked(ngx_shm_zone_t *zone, int op, ngx_uint_t hash,
+    u_char *key, size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, long exptime, int user_flags,
+    ngx_lua_shdict_store_opts_t *opts, char **errmsg, int *forcible)
 {
     int                          i, n;
     u_char                       c, *p;
-    uint32_t                     hash;
+    size_t                       size;
+    uint32_t                     cost, stale_ttl, priority;
     ngx_int_t                    rc;
+    ngx_uint_t                   chunked, keep;
     ngx_time_t                  *tp;
-    ngx_queue_t                 *queue, *q;
     ngx_rbtree_node_t           *node;
     ngx_lua_shdict_ctx_t        *ctx;
     ngx_lua_shdict_node_t       *sd;
+    ngx_lua_shdict_chunk_t      *chunks;
 
     ctx = zone->data;
 
     *forcible = 0;
 
-    hash = ngx_crc32_short(key, key_len);
+    chunks = NULL;
+
+    cost = opts ? opts->cost : 0;
+    stale_ttl = opts ? opts->stale_ttl : 0;
+    priority = opts ? opts->priority : NGX_LUA_SHDICT_PRIO_KEEP;
+
+    if (priority > NGX_LUA_SHDICT_PRIO_KEEP) {
+        *errmsg = "bad priority";
+        return NGX_ERROR;
+    }
+
+    chunked = 0;
 
     switch (value_type) {
 
     case SHDICT_TSTRING:
-        /* do nothing */
+    case SHDICT_TTABLE:
+        chunked = ctx->chunked && str_value_len > ctx->chunked;
+        break;
+
+    case SHDICT_TRECORD:
+
+        if (str_value_len <= NGX_LUA_SHDICT_RECORD_ID_LEN) {
+            *errmsg = "bad record value";
+            return NGX_ERROR;
+        }
+
         break;
 
     case SHDICT_TNUMBER:
@@ -61,16 +122,27 @@ ngx_lua_ffi_shdict_store_helper(ngx_shm_zone_t *zone, int op, u_char *key,
         return NGX_ERROR;
     }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    if (ngx_lua_shdict_lease_end(ctx, hash, key, key_len,
+                                 opts ? opts->lease : 0)
+        != NGX_OK)
+    {
+        *errmsg = "invalid lease";
+        return NGX_DECLINED;
+    }
 
     ngx_lua_shdict_expire(ctx, 1);
 
     rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
 
+    keep = (priority == NGX_LUA_SHDICT_PRIO_KEEP);
+
+    if (keep) {
+        priority = (rc == NGX_OK) ? sd->priority : NGX_LUA_SHDICT_PRIO_NORMAL;
+    }
+
     if (op & NGX_LUA_SHDICT_REPLACE) {
 
         if (rc == NGX_DECLINED || rc == NGX_DONE) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
             *errmsg = "not found";
             return NGX_DECLINED;
         }
@@ -83,7 +155,6 @@ ngx_lua_ffi_shdict_store_helper(ngx_shm_zone_t *zone, int op, u_char *key,
     if (op & NGX_LUA_SHDICT_ADD) {
 
         if (rc == NGX_OK) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
             *errmsg = "exists";
             return NGX_DECLINED;
         }
@@ -106,28 +177,55 @@ ngx_lua_ffi_shdict_store_helper(ngx_shm_zone_t *zone, int op, u_char *key,
 
 replace:
 
+        if (priority == NGX_LUA_SHDICT_PRIO_PINNED
+            && str_value_buf
+            && ngx_lua_shdict_pin_check(ctx, sd, key_len, str_value_len,
+                                        chunked, errmsg)
+               != NGX_OK)
+        {
+            if (!keep) {
+                return NGX_DECLINED;
+            }
+
+            /* a pinned item kept pinned by default no longer fits */
+
+            priority = NGX_LUA_SHDICT_PRIO_NORMAL;
+        }
+
         if (str_value_buf
             && str_value_len == (size_t) sd->value_len
-            && sd->value_type != SHDICT_TLIST)
+            && sd->value_type != SHDICT_TLIST
+            && sd->priority == priority
+            && sd->chunked == chunked)
         {
 
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
                            "lua shared dict set: found old entry and value "
                            "size matched, reusing it");
 
-            ngx_queue_remove(&sd->queue);
-            ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+            ngx_lua_shdict_touch(ctx, sd);
 
             sd->key_len = (u_short) key_len;
 
             sd->user_flags = user_flags;
 
+            sd->cost = cost;
+
+            sd->stale_ttl = stale_ttl;
+
             sd->value_len = (uint32_t) str_value_len;
 
             sd->value_type = (uint8_t) value_type;
 
-            p = ngx_copy(sd->data, key, key_len);
-            ngx_memcpy(p, str_value_buf, str_value_len);
+            if (chunked) {
+                ngx_memcpy(sd->data, key, key_len);
+                ngx_lua_shdict_chunks_write(*ngx_lua_shdict_get_chunks(sd),
+                                            str_value_buf, str_value_len);
+
+            } else {
+                p = ngx_copy(sd->data, key, key_len);
+                ngx_memcpy(p, str_value_buf, str_value_len);
+            }
 
             goto expire;
         }
@@ -138,30 +236,7 @@ replace:
 
 remove:
 
-        if (sd->value_type == SHDICT_TLIST) {
-            queue = ngx_lua_shdict_get_list_head(sd, key_len);
-
-            for (q = ngx_queue_head(queue);
-                 q != ngx_queue_sentinel(queue);
-                 q = ngx_queue_next(q))
-            {
-                p = (u_char *) ngx_queue_data(q,
-                                              ngx_lua_shdict_list_node_t,
-                                              queue);
-
-                ngx_slab_free_locked(ctx->shpool, p);
-            }
-        }
-
-        ngx_queue_remove(&sd->queue);
-
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
-
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
-
-        ngx_slab_free_locked(ctx->shpool, node);
-
+        ngx_lua_shdict_remove(ctx, sd);
     }
 
 insert:
@@ -169,27 +244,82 @@ insert:
     /* rc == NGX_DECLINED or value size unmatch */
 
     if (str_value_buf == NULL) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (rc != NGX_DECLINED) {
+            ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_DELETE, hash,
+                                  key, key_len);
+        }
+
         return NGX_OK;
     }
 
+    if (rc == NGX_DECLINED
+        && priority == NGX_LUA_SHDICT_PRIO_PINNED
+        && ngx_lua_shdict_pin_check(ctx, NULL, key_len, str_value_len,
+                                    chunked, errmsg)
+           != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
                    "lua shared dict set: creating a new entry");
 
     n = offsetof(ngx_rbtree_node_t, color)
         + offsetof(ngx_lua_shdict_node_t, data)
-        + key_len
-        + str_value_len;
+        + key_len;
+
+    if (chunked) {
+        n = ngx_align(n, NGX_ALIGNMENT) + sizeof(ngx_lua_shdict_chunk_t *);
+        size = ngx_lua_shdict_chunks_size(str_value_len);
+
+    } else {
+        n += str_value_len;
+        size = 0;
+    }
+
+    /* a namespace over its quota makes room by evicting its own items */
+
+    if (!(op & NGX_LUA_SHDICT_SAFE_STORE)
+        && priority == NGX_LUA_SHDICT_PRIO_NORMAL
+        && ngx_lua_shdict_ns_reserve(ctx, key, key_len, NULL, n + size))
+    {
+        *forcible = 1;
+    }
+
+    /*
+     * the chunks are allocated one at a time, and evict an item each only
+     * when no slot is free, the keys not in the zone yet being refused
+     * first by the admission filter
+     */
+
+    if (chunked) {
+        chunks = ngx_lua_shdict_chunks_alloc(ctx, str_value_len, 0, NULL);
+
+        if (chunks == NULL && !(op & NGX_LUA_SHDICT_SAFE_STORE)) {
+
+            if (rc == NGX_DECLINED
+                && ngx_lua_shdict_lfu_admit(ctx, hash) != NGX_OK)
+            {
+                *errmsg = "not admitted";
+                return NGX_DECLINED;
+            }
+
+            chunks = ngx_lua_shdict_chunks_alloc(ctx, str_value_len, 1,
+                                                 forcible);
+        }
+
+        if (chunks == NULL) {
+            goto failed;
+        }
+    }
 
     node = ngx_slab_alloc_locked(ctx->shpool, n);
 
     if (node == NULL) {
 
         if (op & NGX_LUA_SHDICT_SAFE_STORE) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-
-            *errmsg = "no memory";
-            return NGX_ERROR;
+            goto failed;
         }
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
@@ -198,6 +328,17 @@ insert:
                        key);
 
         for (i = 0; i < 30; i++) {
+
+            /* the keys in the zone already are never refused */
+
+            if (rc == NGX_DECLINED
+                && ngx_lua_shdict_lfu_admit(ctx, hash) != NGX_OK)
+            {
+                ngx_lua_shdict_chunks_free(ctx, chunks);
+                *errmsg = "not admitted";
+                return NGX_DECLINED;
+            }
+
             if (ngx_lua_shdict_expire(ctx, 0) == 0) {
                 break;
             }
@@ -210,10 +351,7 @@ insert:
             }
         }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-
-        *errmsg = "no memory";
-        return NGX_ERROR;
+        goto failed;
     }
 
 allocated:
@@ -224,14 +362,25 @@ allocated:
     sd->key_len = (u_short) key_len;
 
     sd->user_flags = user_flags;
+    sd->cost = cost;
+    sd->stale_ttl = stale_ttl;
     sd->value_len = (uint32_t) str_value_len;
     sd->value_type = (uint8_t) value_type;
+    sd->priority = (uint8_t) priority;
+    sd->chunked = (uint8_t) chunked;
 
-    p = ngx_copy(sd->data, key, key_len);
-    ngx_memcpy(p, str_value_buf, str_value_len);
+    if (chunked) {
+        ngx_memcpy(sd->data, key, key_len);
+        *ngx_lua_shdict_get_chunks(sd) = chunks;
+        ngx_lua_shdict_chunks_write(chunks, str_value_buf, str_value_len);
+
+    } else {
+        p = ngx_copy(sd->data, key, key_len);
+        ngx_memcpy(p, str_value_buf, str_value_len);
+    }
 
     ngx_rbtree_insert(&ctx->sh->rbtree, node);
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    ngx_lua_shdict_ns_link(ctx, sd);
 
 expire:
 
@@ -244,20 +393,48 @@ expire:
         sd->expires = 0;
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_SET, hash, key, key_len);
 
     return NGX_OK;
+
+failed:
+
+    ngx_lua_shdict_chunks_free(ctx, chunks);
+
+    /* the old value of a key stored anew is gone already */
+
+    if (rc != NGX_DECLINED) {
+        ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_DELETE, hash,
+                              key, key_len);
+    }
+
+    *errmsg = "no memory";
+    return NGX_ERROR;
 }
 
 
 int
-ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
+ngx_lua_ffi_shdict_store_helper(ngx_shm_zone_t *zone, int op, u_char *key,
+    size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, long exptime, int user_flags,
+    char **errmsg, int *forcible)
+{
+    return ngx_lua_ffi_shdict_store_ext(zone, op, key, key_len, value_type,
+                                        str_value_buf, str_value_len,
+                                        num_value, exptime, user_flags, NULL,
+                                        errmsg, forcible);
+}
+
+
+int
+ngx_lua_ffi_shdict_fetch_ext(ngx_shm_zone_t *zone, int get_stale,
     u_char *key, size_t key_len, int *value_type, u_char **str_value_buf,
     size_t *str_value_len, double *num_value, int *user_flags,
-    int *is_stale, char **errmsg)
+    int *is_stale, ngx_lua_shdict_fetch_opts_t *opts, char **errmsg)
 {
+    u_char                      *buf;
     ngx_str_t                    name;
-    uint32_t                     hash;
+    ngx_uint_t                   hash;
     ngx_int_t                    rc;
     ngx_lua_shdict_ctx_t        *ctx;
     ngx_lua_shdict_node_t       *sd;
@@ -266,7 +443,14 @@ ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
     ctx = zone->data;
     name = ctx->name;
 
-    hash = ngx_crc32_short(key, key_len);
+    buf = NULL;
+
+    if (opts) {
+        opts->refresh = 0;
+        opts->token = 0;
+    }
+
+    hash = ngx_lua_shdict_hash(key, key_len);
 
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
@@ -277,6 +461,17 @@ ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
     rc = ngx_lua_shdict_lookup(zone, hash, key, key_len, &sd);
 
     if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
+
+        if (opts && opts->lease
+            && ngx_lua_shdict_lease_grant(ctx, hash, key, key_len,
+                                          opts->lease, &opts->token)
+               != NGX_OK)
+        {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+
         ngx_shmtx_unlock(&ctx->shpool->mutex);
         *value_type = LUA_TNIL;
         return NGX_OK;
@@ -297,21 +492,28 @@ ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
             return NGX_ERROR;
         }
 
-        if (*value_type == SHDICT_TSTRING) {
+        if (*value_type == SHDICT_TSTRING
+            || *value_type == SHDICT_TRECORD
+            || *value_type == SHDICT_TTABLE)
+        {
             *str_value_buf = malloc(value.len);
             if (*str_value_buf == NULL) {
                 ngx_shmtx_unlock(&ctx->shpool->mutex);
                 *errmsg = "no memory";
                 return NGX_ERROR;
             }
+
+            buf = *str_value_buf;
         }
     }
 
     switch (*value_type) {
 
     case SHDICT_TSTRING:
+    case SHDICT_TRECORD:
+    case SHDICT_TTABLE:
         *str_value_len = value.len;
-        ngx_memcpy(*str_value_buf, value.data, value.len);
+        ngx_lua_shdict_read_value(sd, *str_value_buf);
         break;
 
     case SHDICT_TNUMBER:
@@ -352,6 +554,27 @@ ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
         *errmsg = "value is a list";
         return NGX_ERROR;
 
+    case SHDICT_TBITMAP:
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "value is a bitmap";
+        return NGX_ERROR;
+
+    case SHDICT_TBLOOM:
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "value is a bloom filter";
+        return NGX_ERROR;
+
+    case SHDICT_THLL:
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        *errmsg = "value is a hyperloglog";
+        return NGX_ERROR;
+
     default:
 
         ngx_shmtx_unlock(&ctx->shpool->mutex);
@@ -365,6 +588,30 @@ ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
 
     *user_flags = sd->user_flags;
 
+    if (opts && rc == NGX_OK && opts->early_refresh > 0) {
+        opts->refresh = ngx_lua_shdict_xfetch(sd, opts->early_refresh);
+    }
+
+    /*
+     * a stale value, or one due for an early refresh, is refilled under a
+     * lease; this comes last since making room for it may evict "sd"
+     */
+
+    if (opts && opts->lease && (rc == NGX_DONE || opts->refresh)
+        && ngx_lua_shdict_lease_grant(ctx, hash, key, key_len, opts->lease,
+                                      &opts->token)
+           != NGX_OK)
+    {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        if (buf) {
+            free(buf);
+        }
+
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
     if (get_stale) {
@@ -376,13 +623,333 @@ ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
 }
 
 
+int
+ngx_lua_ffi_shdict_fetch_helper(ngx_shm_zone_t *zone, int get_stale,
+    u_char *key, size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int *is_stale, char **errmsg)
+{
+    return ngx_lua_ffi_shdict_fetch_ext(zone, get_stale, key, key_len,
+                                        value_type, str_value_buf,
+                                        str_value_len, num_value, user_flags,
+                                        is_stale, NULL, errmsg);
+}
+
+
+/*
+ * the probabilistic early expiration of XFetch: a value is due for a
+ * refresh once now - cost * beta * ln(rand()) reaches its expiration time,
+ * which gets likely only in the last few recomputation times before it,
+ * and for a single or a few of the workers asking at about the same time,
+ * whose random numbers nginx seeds differently
+ */
+
+static ngx_int_t
+ngx_lua_shdict_xfetch(ngx_lua_shdict_node_t *sd, double beta)
+{
+    double                       rnd;
+    uint64_t                     now;
+    ngx_time_t                  *tp;
+
+    if (sd->expires == 0 || sd->cost == 0) {
+        return 0;
+    }
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    /* in (0, 1] */
+    rnd = ((double) (ngx_random() & 0x7fffffff) + 1) / 2147483648.0;
+
+    return now - sd->cost * beta * log(rnd) >= (double) sd->expires;
+}
+
+
+/*
+ * checks that a pinned item of "key_len" and "value_len" bytes, in chunks
+ * when "chunked" is set, replacing the item "old", keeps the pinned items
+ * of the zone within their limit; the sizes are those the namespaces
+ * charge the pinned bytes with
+ */
+
+static ngx_int_t
+ngx_lua_shdict_pin_check(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *old, size_t key_len, size_t value_len,
+    ngx_uint_t chunked, char **errmsg)
+{
+    size_t                       used, size;
+
+    if (ctx->pinned == 0) {
+        *errmsg = "pinned not enabled";
+        return NGX_DECLINED;
+    }
+
+    used = ctx->sh->pinned_bytes;
+
+    if (old != NULL && old->priority == NGX_LUA_SHDICT_PRIO_PINNED) {
+        used -= ngx_lua_shdict_ns_item_size(old);
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_lua_shdict_node_t, data)
+           + key_len;
+
+    if (chunked) {
+        size = ngx_align(size, NGX_ALIGNMENT)
+               + sizeof(ngx_lua_shdict_chunk_t *)
+               + ngx_lua_shdict_chunks_size(value_len);
+
+    } else {
+        size += value_len;
+    }
+
+    if (used + size > ctx->pinned) {
+        *errmsg = "pinned limit exceeded";
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * fetches the values of many keys, NGX_LUA_SHDICT_BATCH of them per lock
+ * acquisition; the string values are copied into "buf", which is replaced
+ * by a malloc()ed one when too small, like the list helpers do
+ */
+
+int
+ngx_lua_ffi_shdict_get_multi(ngx_shm_zone_t *zone, ngx_str_t *keys,
+    int nkeys, ngx_lua_shdict_value_t *values, u_char **buf,
+    size_t *buf_len, char **errmsg)
+{
+    int                          i, j, n;
+    size_t                       used;
+    u_char                      *orig;
+    uint64_t                     now;
+    ngx_uint_t                   hashes[NGX_LUA_SHDICT_BATCH];
+    ngx_time_t                  *tp;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd, *sds[NGX_LUA_SHDICT_BATCH];
+    ngx_lua_shdict_value_t      *v;
+
+    ctx = zone->data;
+
+    orig = *buf;
+    used = 0;
+
+    for (i = 0; i < nkeys; i += n) {
+        n = ngx_min(nkeys - i, NGX_LUA_SHDICT_BATCH);
+
+        for (j = 0; j < n; j++) {
+            hashes[j] = ngx_lua_shdict_hash(keys[i + j].data,
+                                            keys[i + j].len);
+        }
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        ngx_lua_shdict_expire(ctx, 1);
+
+        ngx_lua_shdict_lookup_batch(zone, hashes, &keys[i], n, sds);
+
+        tp = ngx_timeofday();
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+        for (j = 0; j < n; j++) {
+            v = &values[i + j];
+            sd = sds[j];
+
+            v->value_type = SHDICT_TNIL;
+
+            if (sd == NULL || (sd->expires != 0 && sd->expires <= now)) {
+                continue;
+            }
+
+            if (ngx_lua_shdict_copy_value(ctx, sd, v, buf, buf_len, &used,
+                                          orig, errmsg)
+                != NGX_OK)
+            {
+                goto failed;
+            }
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        if (values[i].value_type == SHDICT_TSTRING
+            || values[i].value_type == SHDICT_TRECORD
+            || values[i].value_type == SHDICT_TTABLE)
+        {
+            values[i].str_value_buf = *buf
+                                      + (uintptr_t) values[i].str_value_buf;
+        }
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (*buf != orig) {
+        free(*buf);
+        *buf = orig;
+    }
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * copies the value of the item "sd" into "v", a string one at the offset
+ * "*used" of "*buf", which is replaced by a malloc()ed one when too small;
+ * the string values are left as offsets, the buffer moving meanwhile, and
+ * "orig", the buffer of the caller, is never freed
+ */
+
+ngx_int_t
+ngx_lua_shdict_copy_value(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd, ngx_lua_shdict_value_t *v, u_char **buf,
+    size_t *buf_len, size_t *used, u_char *orig, char **errmsg)
+{
+    u_char                      *p;
+    size_t                       size;
+    ngx_str_t                    value;
+
+    value.data = sd->data + sd->key_len;
+    value.len = (size_t) sd->value_len;
+
+    switch (sd->value_type) {
+
+    case SHDICT_TSTRING:
+    case SHDICT_TRECORD:
+    case SHDICT_TTABLE:
+
+        if (*used + value.len > *buf_len) {
+            size = ngx_max(*buf_len * 2, *used + value.len);
+
+            p = malloc(size);
+            if (p == NULL) {
+                *errmsg = "no memory";
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(p, *buf, *used);
+
+            if (*buf != orig) {
+                free(*buf);
+            }
+
+            *buf = p;
+            *buf_len = size;
+        }
+
+        ngx_lua_shdict_read_value(sd, *buf + *used);
+
+        /* an offset until the buffer does not move anymore */
+        v->str_value_buf = (u_char *) (uintptr_t) *used;
+        v->str_value_len = value.len;
+
+        *used += value.len;
+        break;
+
+    case SHDICT_TNUMBER:
+
+        if (value.len != sizeof(double)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "bad lua number value size found for key %*s "
+                          "in shared_dict %V: %z", (size_t) sd->key_len,
+                          sd->data, &ctx->name, value.len);
+            *errmsg = "bad lua number value size found";
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(&v->num_value, value.data, sizeof(double));
+        break;
+
+    case SHDICT_TBOOLEAN:
+
+        if (value.len != sizeof(u_char)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "bad lua boolean value size found for key %*s "
+                          "in shared_dict %V: %z", (size_t) sd->key_len,
+                          sd->data, &ctx->name, value.len);
+            *errmsg = "bad lua boolean value size";
+            return NGX_ERROR;
+        }
+
+        v->num_value = value.data[0];
+        break;
+
+    case SHDICT_TLIST:
+
+        *errmsg = "value is a list";
+        return NGX_ERROR;
+
+    case SHDICT_TBITMAP:
+
+        *errmsg = "value is a bitmap";
+        return NGX_ERROR;
+
+    case SHDICT_TBLOOM:
+
+        *errmsg = "value is a bloom filter";
+        return NGX_ERROR;
+
+    case SHDICT_THLL:
+
+        *errmsg = "value is a hyperloglog";
+        return NGX_ERROR;
+
+    default:
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "bad value type found for key %*s in "
+                      "shared_dict %V: %d", (size_t) sd->key_len, sd->data,
+                      &ctx->name, sd->value_type);
+        *errmsg = "unsupported value type";
+        return NGX_ERROR;
+    }
+
+    v->value_type = sd->value_type;
+
+    return NGX_OK;
+}
+
+
 int
 ngx_lua_ffi_shdict_incr_helper(ngx_shm_zone_t *zone, u_char *key,
     size_t key_len, double *value, char **err, int has_init, double init,
     long init_ttl, int *forcible)
+{
+    int                          rc;
+    ngx_uint_t                   hash;
+    ngx_lua_shdict_ctx_t        *ctx;
+
+    ctx = zone->data;
+
+    hash = ngx_lua_shdict_hash(key, key_len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    rc = ngx_lua_shdict_incr_locked(zone, hash, key, key_len, value, err,
+                                    has_init, init, init_ttl, forcible);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return rc;
+}
+
+
+/* increments a number like the incr method does, with the zone locked */
+
+int
+ngx_lua_shdict_incr_locked(ngx_shm_zone_t *zone, ngx_uint_t hash,
+    u_char *key, size_t key_len, double *value, char **err, int has_init,
+    double init, long init_ttl, int *forcible)
 {
     int                          i, n;
-    uint32_t                     hash;
     ngx_int_t                    rc;
     ngx_time_t                  *tp;
     ngx_lua_shdict_ctx_t        *ctx;
@@ -390,18 +957,15 @@ ngx_lua_ffi_shdict_incr_helper(ngx_shm_zone_t *zone, u_char *key,
     double                       num;
     ngx_rbtree_node_t           *node;
     u_char                      *p;
-    ngx_queue_t                 *queue, *q;
 
     ctx = zone->data;
 
     *forcible = 0;
 
-    hash = ngx_crc32_short(key, key_len);
-
     dd("looking up key %.*s in shared dict %.*s", (int) key_len, key,
        (int) ctx->name.len, ctx->name.data);
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    (void) ngx_lua_shdict_lease_end(ctx, hash, key, key_len, 0);
 #if 1
     ngx_lua_shdict_expire(ctx, 1);
 #endif
@@ -411,7 +975,6 @@ ngx_lua_ffi_shdict_incr_helper(ngx_shm_zone_t *zone, u_char *key,
 
     if (rc == NGX_DECLINED || rc == NGX_DONE) {
         if (!has_init) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
             *err = "not found";
             return NGX_ERROR;
         }
@@ -424,14 +987,14 @@ ngx_lua_ffi_shdict_incr_helper(ngx_shm_zone_t *zone, u_char *key,
             /* found an expired item */
 
             if ((size_t) sd->value_len == sizeof(double)
-                && sd->value_type != SHDICT_TLIST)
+                && sd->value_type != SHDICT_TLIST
+                && !sd->chunked)
             {
                 ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
                                "lua shared dict incr: found old entry and "
                                "value size matched, reusing it");
 
-                ngx_queue_remove(&sd->queue);
-                ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+                ngx_lua_shdict_touch(ctx, sd);
 
                 dd("go to setvalue");
                 goto setvalue;
@@ -448,13 +1011,11 @@ ngx_lua_ffi_shdict_incr_helper(ngx_shm_zone_t *zone, u_char *key,
     /* rc == NGX_OK */
 
     if (sd->value_type != SHDICT_TNUMBER || sd->value_len != sizeof(double)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
         *err = "not a number";
         return NGX_ERROR;
     }
 
-    ngx_queue_remove(&sd->queue);
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    ngx_lua_shdict_touch(ctx, sd);
 
     dd("setting value type to %d", (int) sd->value_type);
 
@@ -465,7 +1026,7 @@ ngx_lua_ffi_shdict_incr_helper(ngx_shm_zone_t *zone, u_char *key,
 
     ngx_memcpy(p, (double *) &num, sizeof(double));
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_INCR, hash, key, key_len);
 
     *value = num;
     return NGX_OK;
@@ -476,28 +1037,7 @@ remove:
                    "lua shared dict incr: found old entry but value size "
                    "NOT matched, removing it first");
 
-    if (sd->value_type == SHDICT_TLIST) {
-        queue = ngx_lua_shdict_get_list_head(sd, key_len);
-
-        for (q = ngx_queue_head(queue);
-             q != ngx_queue_sentinel(queue);
-             q = ngx_queue_next(q))
-        {
-            p = (u_char *) ngx_queue_data(q, ngx_lua_shdict_list_node_t,
-                                          queue);
-
-            ngx_slab_free_locked(ctx->shpool, p);
-        }
-    }
-
-    ngx_queue_remove(&sd->queue);
-
-    node = (ngx_rbtree_node_t *)
-               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
-
-    ngx_rbtree_delete(&ctx->sh->rbtree, node);
-
-    ngx_slab_free_locked(ctx->shpool, node);
+    ngx_lua_shdict_remove(ctx, sd);
 
 insert:
 
@@ -509,6 +1049,10 @@ insert:
         + key_len
         + sizeof(double);
 
+    if (ngx_lua_shdict_ns_reserve(ctx, key, key_len, NULL, n)) {
+        *forcible = 1;
+    }
+
     node = ngx_slab_alloc_locked(ctx->shpool, n);
 
     if (node == NULL) {
@@ -531,8 +1075,6 @@ insert:
             }
         }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-
         *err = "no memory";
         return NGX_ERROR;
     }
@@ -546,14 +1088,23 @@ allocated:
     sd->key_len = (u_short) key_len;
 
     sd->value_len = (uint32_t) sizeof(double);
+    sd->value_type = (uint8_t) LUA_TNUMBER;
+    sd->priority = NGX_LUA_SHDICT_PRIO_NORMAL;
+    sd->chunked = 0;
+
+    /* the namespace of the item is the one of its key */
+
+    ngx_memcpy(sd->data, key, key_len);
 
     ngx_rbtree_insert(&ctx->sh->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    ngx_lua_shdict_ns_link(ctx, sd);
 
 setvalue:
 
     sd->user_flags = 0;
+    sd->cost = 0;
+    sd->stale_ttl = 0;
 
     if (init_ttl > 0) {
         tp = ngx_timeofday();
@@ -571,7 +1122,7 @@ setvalue:
     p = ngx_copy(sd->data, key, key_len);
     ngx_memcpy(p, (double *) &num, sizeof(double));
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_lua_shdict_change(ctx, NGX_LUA_SHDICT_CHANGE_INCR, hash, key, key_len);
 
     *value = num;
     return NGX_OK;
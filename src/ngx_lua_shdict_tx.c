@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+/*
+ * transactions: the operations queued by dict:multi() are run by a single
+ * FFI call, under a single acquisition of the zone lock, so that no other
+ * worker sees the zone between two of them. The guards, each checking that
+ * a key still holds the value the caller read, are all checked before
+ * anything is done, and a failed one aborts the whole transaction. The
+ * operations are not rolled back when a later one fails though, each of
+ * them having a result, or an error, of its own, as in Redis.
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+
+
+static ngx_int_t ngx_lua_shdict_tx_guard(ngx_shm_zone_t *zone,
+    ngx_lua_shdict_tx_op_t *op);
+
+
+int
+ngx_lua_ffi_shdict_exec(ngx_shm_zone_t *zone, ngx_lua_shdict_tx_op_t *ops,
+    int nops, u_char **buf, size_t *buf_len, char **errmsg)
+{
+    int                          i, len;
+    size_t                       used;
+    u_char                      *orig;
+    ngx_int_t                    rc;
+    ngx_uint_t                   hash;
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+    ngx_lua_shdict_tx_op_t      *op;
+
+    ctx = zone->data;
+
+    orig = *buf;
+    used = 0;
+
+    for (i = 0; i < nops; i++) {
+        ops[i].rc = NGX_OK;
+        ops[i].forcible = 0;
+        ops[i].errmsg = NULL;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ngx_lua_shdict_expire(ctx, 1);
+
+    for (i = 0; i < nops; i++) {
+        op = &ops[i];
+
+        if (op->op == NGX_LUA_SHDICT_TX_GUARD
+            && ngx_lua_shdict_tx_guard(zone, op) != NGX_OK)
+        {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            op->rc = NGX_DECLINED;
+            *errmsg = "guard failed";
+            return NGX_DECLINED;
+        }
+    }
+
+    for (i = 0; i < nops; i++) {
+        op = &ops[i];
+
+        hash = ngx_lua_shdict_hash(op->key.data, op->key.len);
+
+        switch (op->op) {
+
+        case NGX_LUA_SHDICT_TX_GET:
+
+            rc = ngx_lua_shdict_lookup(zone, hash, op->key.data, op->key.len,
+                                       &sd);
+
+            op->value.value_type = SHDICT_TNIL;
+
+            if (rc == NGX_OK) {
+                op->user_flags = sd->user_flags;
+                op->rc = ngx_lua_shdict_copy_value(ctx, sd, &op->value, buf,
+                                                   buf_len, &used, orig,
+                                                   &op->errmsg);
+            }
+
+            break;
+
+        case NGX_LUA_SHDICT_TX_STORE:
+
+            op->rc = ngx_lua_shdict_store_locked(zone, op->flags, hash,
+                                                 op->key.data, op->key.len,
+                                                 op->value.value_type,
+                                                 op->value.str_value_buf,
+                                                 op->value.str_value_len,
+                                                 op->value.num_value,
+                                                 op->exptime, op->user_flags,
+                                                 NULL, &op->errmsg,
+                                                 &op->forcible);
+            break;
+
+        case NGX_LUA_SHDICT_TX_INCR:
+
+            op->rc = ngx_lua_shdict_incr_locked(zone, hash, op->key.data,
+                                                op->key.len,
+                                                &op->value.num_value,
+                                                &op->errmsg, op->has_init,
+                                                op->init, op->exptime,
+                                                &op->forcible);
+            break;
+
+        case NGX_LUA_SHDICT_TX_PUSH:
+
+            op->rc = ngx_lua_shdict_list_push_locked(zone, hash, op->key.data,
+                                                     op->key.len, &op->value,
+                                                     1, 0, &len, op->flags,
+                                                     &op->errmsg,
+                                                     &op->forcible);
+            if (op->rc == NGX_OK) {
+                op->value.value_type = SHDICT_TNUMBER;
+                op->value.num_value = len;
+            }
+
+            break;
+
+        default: /* NGX_LUA_SHDICT_TX_GUARD */
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    for (i = 0; i < nops; i++) {
+        op = &ops[i];
+
+        if (op->op == NGX_LUA_SHDICT_TX_GET && op->rc == NGX_OK
+            && (op->value.value_type == SHDICT_TSTRING
+                || op->value.value_type == SHDICT_TRECORD
+                || op->value.value_type == SHDICT_TTABLE))
+        {
+            op->value.str_value_buf = *buf
+                                      + (uintptr_t) op->value.str_value_buf;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* whether the key of "op" holds its value, nil meaning no item */
+
+static ngx_int_t
+ngx_lua_shdict_tx_guard(ngx_shm_zone_t *zone, ngx_lua_shdict_tx_op_t *op)
+{
+    double                       num;
+    u_char                      *data;
+    ngx_int_t                    rc;
+    ngx_uint_t                   hash;
+    ngx_lua_shdict_node_t       *sd;
+
+    hash = ngx_lua_shdict_hash(op->key.data, op->key.len);
+
+    rc = ngx_lua_shdict_lookup(zone, hash, op->key.data, op->key.len, &sd);
+
+    if (rc != NGX_OK) {
+        return op->value.value_type == SHDICT_TNIL ? NGX_OK : NGX_DECLINED;
+    }
+
+    if (sd->value_type != op->value.value_type) {
+        return NGX_DECLINED;
+    }
+
+    data = sd->data + sd->key_len;
+
+    switch (sd->value_type) {
+
+    case SHDICT_TNUMBER:
+
+        if (sd->value_len != sizeof(double)) {
+            return NGX_DECLINED;
+        }
+
+        ngx_memcpy(&num, data, sizeof(double));
+
+        return num == op->value.num_value ? NGX_OK : NGX_DECLINED;
+
+    case SHDICT_TBOOLEAN:
+
+        return (data[0] != 0) == (op->value.num_value != 0)
+               ? NGX_OK : NGX_DECLINED;
+
+    case SHDICT_TSTRING:
+
+        if (sd->value_len != op->value.str_value_len) {
+            return NGX_DECLINED;
+        }
+
+        if (sd->chunked) {
+            return ngx_lua_shdict_chunks_cmp(*ngx_lua_shdict_get_chunks(sd),
+                                             op->value.str_value_buf,
+                                             sd->value_len)
+                   ? NGX_DECLINED : NGX_OK;
+        }
+
+        return ngx_memcmp(data, op->value.str_value_buf, sd->value_len)
+               ? NGX_DECLINED : NGX_OK;
+
+    default:
+        /* lists, records, and the other values cannot be compared */
+        return NGX_DECLINED;
+    }
+}
@@ -9,13 +9,51 @@
 
 int
 ngx_lua_shdict_expire(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t n)
+{
+    int                              freed;
+    ngx_lua_shdict_nss_t            *ns;
+
+    if (n == 0) {
+        return ngx_lua_shdict_expire_queue(ctx, ngx_lua_shdict_victim(ctx), 0);
+    }
+
+    /* the items of every priority class expire */
+
+    freed = ngx_lua_shdict_expire_queue(ctx, &ctx->sh->lru_queue, n)
+            + ngx_lua_shdict_expire_queue(ctx, &ctx->sh->low_queue, n)
+            + ngx_lua_shdict_expire_queue(ctx, &ctx->sh->pinned_queue, n);
+
+    ns = ctx->sh->ns;
+
+    if (ns == NULL || ns->n == 1) {
+        return freed;
+    }
+
+    /* and those of one of the other namespaces in turn */
+
+    if (++ns->next >= ns->n) {
+        ns->next = 1;
+    }
+
+    return freed + ngx_lua_shdict_expire_queue(ctx,
+                                               &ns->slots[ns->next].lru_queue,
+                                               n);
+}
+
+
+/* expires or evicts, as ngx_lua_shdict_expire() does, the items of "queue" */
+
+int
+ngx_lua_shdict_expire_queue(ngx_lua_shdict_ctx_t *ctx, ngx_queue_t *queue,
+    ngx_uint_t n)
 {
     ngx_time_t                      *tp;
     uint64_t                         now;
-    ngx_queue_t                     *q, *list_queue, *lq;
+    ngx_uint_t                       i, evict;
+    ngx_queue_t                     *q, *p, *list_queue, *lq;
     int64_t                          ms;
     ngx_rbtree_node_t               *node;
-    ngx_lua_shdict_node_t           *sd;
+    ngx_lua_shdict_node_t           *sd, *psd;
     int                              freed = 0;
     ngx_lua_shdict_list_node_t      *lnode;
 
@@ -27,15 +65,18 @@ ngx_lua_shdict_expire(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t n)
      * n == 1 deletes one or two expired entries
      * n == 0 deletes oldest entry by force
      *        and one or two zero rate entries
+     *
+     * the expired entries still within their stale_ttl are kept for
+     * get_stale, but are the first ones deleted by force
      */
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->lru_queue)) {
+        if (ngx_queue_empty(queue)) {
             return freed;
         }
 
-        q = ngx_queue_last(&ctx->sh->lru_queue);
+        q = ngx_queue_last(queue);
 
         sd = ngx_queue_data(q, ngx_lua_shdict_node_t, queue);
 
@@ -45,12 +86,39 @@ ngx_lua_shdict_expire(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t n)
                 return freed;
             }
 
-            ms = sd->expires - now;
+            ms = sd->expires + sd->stale_ttl - now;
             if (ms > 0) {
                 return freed;
             }
+
+        } else if (sd->expires == 0 || sd->expires > now) {
+
+            for (i = 0, p = ngx_queue_prev(q);
+                 i < NGX_LUA_SHDICT_EVICT_SCAN
+                 && p != ngx_queue_sentinel(queue);
+                 i++, p = ngx_queue_prev(p))
+            {
+                psd = ngx_queue_data(p, ngx_lua_shdict_node_t, queue);
+
+                if (psd->expires != 0 && psd->expires <= now) {
+                    q = p;
+                    sd = psd;
+                    break;
+                }
+            }
         }
 
+        evict = (sd->expires == 0 || sd->expires > now);
+
+        if (evict
+            && ctx->sh->ns
+            && sd->priority == NGX_LUA_SHDICT_PRIO_NORMAL)
+        {
+            ctx->sh->ns->slots[sd->ns].evictions++;
+        }
+
+        ngx_lua_shdict_ns_unlink(ctx, sd);
+
         if (sd->value_type == SHDICT_TLIST) {
             list_queue = ngx_lua_shdict_get_list_head(sd, sd->key_len);
 
@@ -65,11 +133,17 @@ ngx_lua_shdict_expire(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t n)
             }
         }
 
-        ngx_queue_remove(q);
+        if (sd->chunked) {
+            ngx_lua_shdict_chunks_free(ctx, *ngx_lua_shdict_get_chunks(sd));
+        }
 
         node = (ngx_rbtree_node_t *)
                    ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
 
+        ngx_lua_shdict_change(ctx, evict ? NGX_LUA_SHDICT_CHANGE_EVICT
+                                         : NGX_LUA_SHDICT_CHANGE_EXPIRE,
+                              node->key, sd->data, sd->key_len);
+
         ngx_rbtree_delete(&ctx->sh->rbtree, node);
 
         ngx_slab_free_locked(ctx->shpool, node);
@@ -95,6 +169,14 @@ ngx_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
 
     ctx = shm_zone->data;
 
+    if (ctx->sh->lfu) {
+        ngx_lua_shdict_lfu_add(ctx->sh->lfu, hash);
+    }
+
+    if (ctx->hot_sample && --ctx->hot_countdown == 0) {
+        ngx_lua_shdict_hot_sample(ctx, hash, kdata, klen);
+    }
+
     node = ctx->sh->rbtree.root;
     sentinel = ctx->sh->rbtree.sentinel;
 
@@ -117,8 +199,7 @@ ngx_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
         rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
 
         if (rc == 0) {
-            ngx_queue_remove(&sd->queue);
-            ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+            ngx_lua_shdict_touch(ctx, sd);
 
             *sdp = sd;
 
@@ -143,3 +224,188 @@ ngx_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
 
     return NGX_DECLINED;
 }
+
+
+/*
+ * looks up to NGX_LUA_SHDICT_BATCH keys at once, descending one level of
+ * the tree for every key in turn and prefetching the next node of each,
+ * so that the cache misses of the different walks overlap; expired items
+ * are returned as well, and found items become the most recently used
+ */
+
+void
+ngx_lua_shdict_lookup_batch(ngx_shm_zone_t *shm_zone, ngx_uint_t *hashes,
+    ngx_str_t *keys, ngx_uint_t n, ngx_lua_shdict_node_t **sds)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, active;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_rbtree_node_t           *cur[NGX_LUA_SHDICT_BATCH];
+    ngx_lua_shdict_ctx_t        *ctx;
+    ngx_lua_shdict_node_t       *sd;
+
+    ctx = shm_zone->data;
+
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    for (i = 0; i < n; i++) {
+        cur[i] = ctx->sh->rbtree.root;
+        sds[i] = NULL;
+
+        if (ctx->sh->lfu) {
+            ngx_lua_shdict_lfu_add(ctx->sh->lfu, hashes[i]);
+        }
+
+        if (ctx->hot_sample && --ctx->hot_countdown == 0) {
+            ngx_lua_shdict_hot_sample(ctx, hashes[i], keys[i].data,
+                                      keys[i].len);
+        }
+    }
+
+    do {
+        active = 0;
+
+        for (i = 0; i < n; i++) {
+            node = cur[i];
+
+            if (node == sentinel) {
+                continue;
+            }
+
+            if (hashes[i] < node->key) {
+                node = node->left;
+
+            } else if (hashes[i] > node->key) {
+                node = node->right;
+
+            } else {
+                sd = (ngx_lua_shdict_node_t *) &node->color;
+
+                rc = ngx_memn2cmp(keys[i].data, sd->data, keys[i].len,
+                                  (size_t) sd->key_len);
+
+                if (rc == 0) {
+                    sds[i] = sd;
+                    cur[i] = sentinel;
+                    continue;
+                }
+
+                node = (rc < 0) ? node->left : node->right;
+            }
+
+            cur[i] = node;
+
+            if (node != sentinel) {
+                ngx_lua_shdict_prefetch(node);
+                active++;
+            }
+        }
+
+    } while (active);
+
+    for (i = 0; i < n; i++) {
+        if (sds[i] != NULL) {
+            ngx_lua_shdict_touch(ctx, sds[i]);
+        }
+    }
+}
+
+
+/*
+ * allocates like the set method does, removing the least recently used
+ * items by force when out of memory, but never the item "sd" itself, the
+ * list or the bitmap being grown
+ */
+
+void *
+ngx_lua_shdict_alloc(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_node_t *sd, size_t size, int *forcible)
+{
+    int                          i;
+    void                        *p;
+
+    p = ngx_slab_alloc_locked(ctx->shpool, size);
+    if (p != NULL) {
+        return p;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict: overriding non-expired items "
+                   "due to memory shortage");
+
+    for (i = 0; i < 30; i++) {
+        if (sd != NULL
+            && ngx_queue_last(ngx_lua_shdict_victim(ctx)) == &sd->queue)
+        {
+            return NULL;
+        }
+
+        if (ngx_lua_shdict_expire(ctx, 0) == 0) {
+            return NULL;
+        }
+
+        *forcible = 1;
+
+        p = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * returns the LRU queue a forced eviction takes its victim from, that of
+ * the low priority items while there are any, then the one the namespaces
+ * pick, but never the one of the pinned items
+ */
+
+ngx_queue_t *
+ngx_lua_shdict_victim(ngx_lua_shdict_ctx_t *ctx)
+{
+    if (!ngx_queue_empty(&ctx->sh->low_queue)) {
+        return &ctx->sh->low_queue;
+    }
+
+    return ngx_lua_shdict_ns_victim(ctx);
+}
+
+
+/* removes the item "sd", with the nodes of a list or its chunks */
+
+void
+ngx_lua_shdict_remove(ngx_lua_shdict_ctx_t *ctx, ngx_lua_shdict_node_t *sd)
+{
+    ngx_queue_t                     *queue, *q, *next;
+    ngx_rbtree_node_t               *node;
+    ngx_lua_shdict_list_node_t      *lnode;
+
+    ngx_lua_shdict_ns_unlink(ctx, sd);
+
+    if (sd->value_type == SHDICT_TLIST) {
+        queue = ngx_lua_shdict_get_list_head(sd, sd->key_len);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = next)
+        {
+            next = ngx_queue_next(q);
+
+            lnode = ngx_queue_data(q, ngx_lua_shdict_list_node_t, queue);
+            ngx_slab_free_locked(ctx->shpool, lnode);
+        }
+    }
+
+    if (sd->chunked) {
+        ngx_lua_shdict_chunks_free(ctx, *ngx_lua_shdict_get_chunks(sd));
+    }
+
+    node = (ngx_rbtree_node_t *)
+                ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+    ngx_slab_free_locked(ctx->shpool, node);
+}
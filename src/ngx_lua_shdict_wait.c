@@ -0,0 +1,416 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#include "ngx_lua_shdict_common.h"
+#include <ngx_event.h>
+
+#if (NGX_HAVE_EVENTFD) && (NGX_HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#endif
+
+
+#define NGX_LUA_SHDICT_WAITING     0
+#define NGX_LUA_SHDICT_WOKEN       1
+#define NGX_LUA_SHDICT_POSTED      2
+
+
+typedef int (*ngx_lua_shdict_sema_post_pt)(void *sema, int n);
+
+
+/*
+ * one notification fd per worker slot, created by the master before
+ * forking so that every process can wake up any worker
+ */
+
+typedef struct {
+    ngx_uint_t                    nslots;
+    ngx_fd_t                     *read_fds;
+    ngx_fd_t                     *write_fds;
+    ngx_uint_t                    generation;
+    ngx_pid_t                     master;
+} ngx_lua_shdict_notify_t;
+
+
+static void ngx_lua_shdict_notify_cleanup(void *data);
+static void ngx_lua_shdict_notify_handler(ngx_event_t *ev);
+static void ngx_lua_shdict_notify(ngx_lua_shdict_waiter_t *w);
+
+
+static ngx_lua_shdict_notify_t  *ngx_lua_shdict_notify_channel;
+static ngx_uint_t                ngx_lua_shdict_notify_generation;
+static ngx_connection_t         *ngx_lua_shdict_notify_conn;
+
+
+ngx_int_t
+ngx_lua_shdict_wait_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                   i;
+    ngx_fd_t                     fds[2];
+    ngx_core_conf_t             *ccf;
+    ngx_pool_cleanup_t          *cln;
+    ngx_lua_shdict_notify_t     *notify;
+
+    ngx_lua_shdict_notify_channel = NULL;
+
+    if (ngx_get_conf(cycle->conf_ctx, ngx_lua_shdict_module) == NULL) {
+        /* no lua_shared_mem zones */
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    notify = ngx_pcalloc(cycle->pool, sizeof(ngx_lua_shdict_notify_t));
+    if (notify == NULL) {
+        return NGX_ERROR;
+    }
+
+    notify->nslots = ccf->master ? (ngx_uint_t) ccf->worker_processes : 1;
+    notify->generation = ++ngx_lua_shdict_notify_generation;
+    notify->master = ngx_pid;
+
+    notify->read_fds = ngx_palloc(cycle->pool,
+                                  2 * notify->nslots * sizeof(ngx_fd_t));
+    if (notify->read_fds == NULL) {
+        return NGX_ERROR;
+    }
+
+    notify->write_fds = notify->read_fds + notify->nslots;
+
+    for (i = 0; i < notify->nslots; i++) {
+        notify->read_fds[i] = (ngx_fd_t) -1;
+        notify->write_fds[i] = (ngx_fd_t) -1;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_lua_shdict_notify_cleanup;
+    cln->data = notify;
+
+    for (i = 0; i < notify->nslots; i++) {
+
+#if (NGX_HAVE_EVENTFD)
+        fds[0] = eventfd(0, 0);
+        if (fds[0] == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "lua shared dict: eventfd() failed");
+            return NGX_ERROR;
+        }
+
+        fds[1] = fds[0];
+#else
+        if (pipe(fds) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "lua shared dict: pipe() failed");
+            return NGX_ERROR;
+        }
+#endif
+
+        notify->read_fds[i] = fds[0];
+        notify->write_fds[i] = fds[1];
+
+        if (ngx_nonblocking(fds[0]) == -1
+            || ngx_nonblocking(fds[1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "lua shared dict: " ngx_nonblocking_n " failed");
+            return NGX_ERROR;
+        }
+
+        if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1
+            || fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "lua shared dict: fcntl(FD_CLOEXEC) failed");
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_lua_shdict_notify_channel = notify;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_lua_shdict_notify_cleanup(void *data)
+{
+    ngx_lua_shdict_notify_t  *notify = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < notify->nslots; i++) {
+
+        if (notify->write_fds[i] != (ngx_fd_t) -1
+            && notify->write_fds[i] != notify->read_fds[i])
+        {
+            (void) close(notify->write_fds[i]);
+        }
+
+        if (notify->read_fds[i] != (ngx_fd_t) -1) {
+            (void) close(notify->read_fds[i]);
+        }
+    }
+}
+
+
+ngx_int_t
+ngx_lua_shdict_wait_init_process(ngx_cycle_t *cycle)
+{
+    ngx_connection_t            *c;
+    ngx_lua_shdict_notify_t     *notify;
+
+    notify = ngx_lua_shdict_notify_channel;
+
+    if (notify == NULL
+        || (ngx_process != NGX_PROCESS_WORKER
+            && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker >= notify->nslots)
+    {
+        /* helper processes can wake up waiters, but never wait */
+        return NGX_OK;
+    }
+
+    c = ngx_get_connection(notify->read_fds[ngx_worker], cycle->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->data = notify;
+
+    c->read->handler = ngx_lua_shdict_notify_handler;
+    c->read->log = cycle->log;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) == NGX_ERROR) {
+        ngx_free_connection(c);
+        return NGX_ERROR;
+    }
+
+    ngx_lua_shdict_notify_conn = c;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_lua_shdict_notify_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                       i;
+    ngx_queue_t                     *q;
+    ngx_connection_t                *c;
+    ngx_shm_zone_t                 **zone;
+    ngx_lua_shdict_ctx_t            *ctx;
+    ngx_lua_shdict_conf_t           *lscf;
+    ngx_lua_shdict_waiter_t         *w;
+    ngx_lua_shdict_sema_post_pt      post;
+    ssize_t                          n;
+#if (NGX_HAVE_EVENTFD)
+    uint64_t                         count;
+#else
+    u_char                           buf[64];
+#endif
+
+    c = ev->data;
+
+#if (NGX_HAVE_EVENTFD)
+    n = read(c->fd, &count, sizeof(uint64_t));
+#else
+    do {
+        n = read(c->fd, buf, sizeof(buf));
+    } while (n > 0);
+#endif
+
+    if (n == -1 && ngx_errno != NGX_EAGAIN) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                      "lua shared dict: read() from notification fd failed");
+    }
+
+    lscf = (ngx_lua_shdict_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                                  ngx_lua_shdict_module);
+    if (lscf == NULL) {
+        return;
+    }
+
+    zone = lscf->shdict_zones->elts;
+
+    for (i = 0; i < lscf->shdict_zones->nelts; i++) {
+        ctx = zone[i]->data;
+
+        if (ctx->sh == NULL) {
+            continue;
+        }
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        for (q = ngx_queue_head(&ctx->sh->waiters);
+             q != ngx_queue_sentinel(&ctx->sh->waiters);
+             q = ngx_queue_next(q))
+        {
+            w = ngx_queue_data(q, ngx_lua_shdict_waiter_t, queue);
+
+            if (w->pid != ngx_pid || w->woken != NGX_LUA_SHDICT_WOKEN) {
+                continue;
+            }
+
+            w->woken = NGX_LUA_SHDICT_POSTED;
+
+            post = (ngx_lua_shdict_sema_post_pt) w->post;
+            (void) post(w->sema, 1);
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    }
+}
+
+
+static void
+ngx_lua_shdict_notify(ngx_lua_shdict_waiter_t *w)
+{
+    ssize_t                      n;
+    ngx_lua_shdict_notify_t     *notify;
+#if (NGX_HAVE_EVENTFD)
+    uint64_t                     count = 1;
+#else
+    u_char                       count = 1;
+#endif
+
+    notify = ngx_lua_shdict_notify_channel;
+
+    /*
+     * waiters of another nginx generation cannot be reached through our
+     * fds, they pick up the new elements when their wait slice times out
+     */
+
+    if (notify == NULL
+        || w->master != notify->master
+        || w->generation != notify->generation
+        || w->slot >= notify->nslots)
+    {
+        return;
+    }
+
+    n = write(notify->write_fds[w->slot], &count, sizeof(count));
+
+    /* EAGAIN means the worker has a pending notification already */
+
+    if (n == -1 && ngx_errno != NGX_EAGAIN) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "lua shared dict: write() to notification fd failed");
+    }
+}
+
+
+ngx_lua_shdict_waiter_t *
+ngx_lua_shdict_wait_add(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    ngx_msec_t timeout, void *sema, void *post)
+{
+    ngx_time_t                  *tp;
+    ngx_lua_shdict_waiter_t     *w;
+
+    if (ngx_lua_shdict_notify_conn == NULL || sema == NULL || post == NULL) {
+        return NULL;
+    }
+
+    w = ngx_slab_alloc_locked(ctx->shpool, sizeof(ngx_lua_shdict_waiter_t));
+    if (w == NULL) {
+        return NULL;
+    }
+
+    tp = ngx_timeofday();
+
+    w->id = ++ctx->sh->waiter_id;
+    w->deadline = (uint64_t) tp->sec * 1000 + tp->msec + timeout;
+    w->hash = hash;
+    w->slot = ngx_worker;
+    w->generation = ngx_lua_shdict_notify_channel->generation;
+    w->master = ngx_lua_shdict_notify_channel->master;
+    w->pid = ngx_pid;
+    w->woken = NGX_LUA_SHDICT_WAITING;
+    w->sema = sema;
+    w->post = post;
+
+    ngx_queue_insert_tail(&ctx->sh->waiters, &w->queue);
+
+    return w;
+}
+
+
+void
+ngx_lua_shdict_wait_del(ngx_lua_shdict_ctx_t *ctx,
+    ngx_lua_shdict_waiter_t *waiter, uint64_t id)
+{
+    ngx_queue_t                 *q;
+    ngx_lua_shdict_waiter_t     *w;
+
+    /*
+     * the waiter may have been reclaimed already by a push that found it
+     * past its deadline, so never dereference it before finding it
+     */
+
+    for (q = ngx_queue_head(&ctx->sh->waiters);
+         q != ngx_queue_sentinel(&ctx->sh->waiters);
+         q = ngx_queue_next(q))
+    {
+        w = ngx_queue_data(q, ngx_lua_shdict_waiter_t, queue);
+
+        if (w == waiter && w->id == id) {
+            ngx_queue_remove(q);
+            ngx_slab_free_locked(ctx->shpool, w);
+            return;
+        }
+    }
+}
+
+
+void
+ngx_lua_shdict_wakeup(ngx_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    ngx_uint_t n)
+{
+    uint64_t                     now;
+    ngx_time_t                  *tp;
+    ngx_queue_t                 *q, *next;
+    ngx_lua_shdict_waiter_t     *w;
+
+    if (ngx_queue_empty(&ctx->sh->waiters)) {
+        return;
+    }
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    for (q = ngx_queue_head(&ctx->sh->waiters);
+         q != ngx_queue_sentinel(&ctx->sh->waiters) && n > 0;
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        w = ngx_queue_data(q, ngx_lua_shdict_waiter_t, queue);
+
+        if (w->deadline < now) {
+
+            /* left behind by a worker that exited while waiting */
+
+            ngx_queue_remove(q);
+            ngx_slab_free_locked(ctx->shpool, w);
+            continue;
+        }
+
+        if (w->hash != hash || w->woken != NGX_LUA_SHDICT_WAITING) {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict: waking up process %P",
+                       w->pid);
+
+        w->woken = NGX_LUA_SHDICT_WOKEN;
+        n--;
+
+        ngx_lua_shdict_notify(w);
+    }
+}
@@ -22,6 +22,11 @@ our $HttpConfig = qq{
     lua_shared_mem dogs 1m;
 };
 
+our $ResizedHttpConfig = qq{
+    lua_package_path "$pwd/t/lib/?.lua;$pwd/lib/?.lua;;";
+    lua_shared_mem dogs 2m;
+};
+
 repeat_each(2);
 
 plan tests => repeat_each() * (blocks() * 3);
@@ -87,3 +92,60 @@ GET /test
 --- no_error_log
 [error]
 
+
+
+=== TEST 3: prepare items of all types before resizing the zone
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            dogs:delete("list")
+            dogs:rpush("list", "a", 2, "c")
+            dogs:set("flags", "hello", 0, 7)
+            dogs:set("ttl", true, 100)
+            dogs:set("gone", 1, 0.001)
+
+            ngx.say(dogs:capacity())
+        }
+    }
+--- request
+GET /test
+--- response_body
+1048576
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: retrieve the items after HUP reload with a larger zone
+--- http_config eval: $::ResizedHttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            ngx.say(dogs:capacity())
+            ngx.say(dogs:get("foo"), " ", dogs:get("bah"))
+            ngx.say(table.concat(dogs:lrange("list", 0, -1), ","))
+            ngx.say(dogs:get("flags"))
+
+            local ttl = dogs:ttl("ttl")
+            ngx.say(dogs:get("ttl"), " ", ttl > 0 and ttl <= 100)
+            ngx.say(dogs:get("gone"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+2097152
+32 10502
+a,2,c
+hello7
+true true
+nil
+--- no_error_log
+[error]
@@ -13,6 +13,12 @@ our $HttpConfig = qq{
     lua_shared_mem smalldogs 100k;
     lua_shared_mem dogs 1m;
     lua_shared_mem cats 1m;
+    lua_shared_mem hotdogs 1m hot_keys=4 hot_keys_sample=1;
+    lua_shared_mem lfudogs 100k admission=tinylfu;
+    lua_shared_mem changedogs 100k changes=8;
+    lua_shared_mem nsdogs 100k namespace=a::8k namespace_sep=: namespace_quota=4k;
+    lua_shared_mem pindogs 100k pinned=8k chunked=2k;
+    lua_shared_mem chunkdogs 100k chunked=4k;
 };
 
 #no_diff();
@@ -449,7 +455,7 @@ not ok: key too long
         content_by_lua '
             local t = require("resty.shdict")
             local dogs = t.dogs
-            local ok, err = dogs:set("foo", dogs)
+            local ok, err = dogs:set("foo", print)
             if not ok then
                 ngx.say("not ok: ", err)
                 return
@@ -2448,3 +2454,2163 @@ GET /test
 --- error_code: 500
 --- error_log
 bad "exptime" argument
+
+
+
+=== TEST 93: get_multi
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            dogs:set("str", "hello", 0, 3)
+            dogs:set("num", 3.14)
+            dogs:set("yes", true)
+            dogs:set("no", false)
+            dogs:set("long", string.rep("a", 5000))
+            dogs:set("old", "bye", 0.001)
+            dogs:set(42, "answer")
+
+            ngx.sleep(0.002)
+
+            local res, err = dogs:get_multi({"str", "num", "yes", "no", "missing",
+                                              "long", "old", 42})
+            if not res then
+                ngx.say("failed: ", err)
+                return
+            end
+
+            ngx.say(res.str, " ", res.num, " ", res.yes, " ", res.no, " ",
+                    res.missing, " ", #res.long, " ", res.old, " ", res["42"])
+
+            local n = 0
+            for _ in pairs(dogs:get_multi({})) do
+                n = n + 1
+            end
+            ngx.say(n)
+
+            ngx.say(dogs:get_multi({"str", ""}))
+        }
+    }
+--- request
+GET /test
+--- response_body
+hello 3.14 true false nil 5000 nil answer
+0
+nilempty key
+--- no_error_log
+[error]
+
+
+
+=== TEST 94: get_multi with more keys than a batch
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            local keys = {}
+            for i = 1, 100 do
+                keys[i] = "key" .. i
+                if i % 3 ~= 0 then
+                    dogs:set(keys[i], string.rep("v", i * 50))
+                end
+            end
+
+            local res = dogs:get_multi(keys)
+
+            local found, ok = 0, true
+            for i = 1, 100 do
+                local v = res[keys[i]]
+                if v then
+                    found = found + 1
+                    ok = ok and v == string.rep("v", i * 50)
+                end
+            end
+
+            ngx.say(found, " ", ok)
+
+            dogs:lpush("list", "a")
+            ngx.say(dogs:get_multi({"key1", "list"}))
+        }
+    }
+--- request
+GET /test
+--- response_body
+67 true
+nilvalue is a list
+--- no_error_log
+[error]
+
+
+
+=== TEST 95: hot_keys reports the most accessed keys
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.hotdogs
+
+            for i = 1, 10 do
+                dogs:set("cold" .. i, i)
+            end
+
+            for i = 1, 100 do
+                dogs:get("hot")
+            end
+
+            dogs:set("warm", 1)
+            for i = 1, 49 do
+                dogs:incr("warm", 1)
+            end
+
+            local keys = dogs:hot_keys(2)
+            for _, k in ipairs(keys) do
+                ngx.say(k.key, " ", k.count)
+            end
+
+            ngx.say(#dogs:hot_keys())
+        }
+    }
+--- request
+GET /test
+--- response_body
+hot 100
+warm 50
+4
+--- no_error_log
+[error]
+
+
+
+=== TEST 96: hot_keys with long keys and get_multi
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.hotdogs
+
+            local long = string.rep("k", 100)
+
+            dogs:set(long, 1)
+            dogs:get_multi({long, long, long})
+
+            local keys = dogs:hot_keys(1)
+            ngx.say(#keys, " ", keys[1].key == string.sub(long, 1, 64), " ",
+                    keys[1].count)
+        }
+    }
+--- request
+GET /test
+--- response_body
+1 true 4
+--- no_error_log
+[error]
+
+
+
+=== TEST 97: hot_keys not enabled, bad n
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+
+            ngx.say(t.dogs:hot_keys())
+
+            local ok, err = pcall(t.hotdogs.hot_keys, t.hotdogs, 0)
+            ngx.say(ok, " ", err:match('bad "n" argument'))
+
+            ngx.say(#t.hotdogs:hot_keys())
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilhot_keys not enabled
+false bad "n" argument
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 98: admission=tinylfu refuses keys less popular than the LRU victim
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.lfudogs
+
+            local value = string.rep("v", 100)
+            local last
+
+            -- fill the zone with keys read a few times, until a key either
+            -- displaces another one or is refused, depending on whether the
+            -- counters of the two keys were last halved in the same pass
+            for i = 1, 10000 do
+                local key = "popular" .. i
+
+                for _ = 1, 3 do
+                    dogs:get(key)
+                end
+
+                local ok, err, forcible = dogs:set(key, value)
+                if ok then
+                    last = key
+                end
+
+                if not ok or forcible then
+                    break
+                end
+            end
+
+            ngx.say(dogs:set("once", value))
+
+            for _ = 1, 10 do
+                dogs:get("once")
+            end
+
+            ngx.say(dogs:set("once", value))
+            ngx.say(dogs:get("once") == value)
+
+            -- a key in the zone is never refused
+            local ok, err = dogs:set(last, string.rep("v", 200))
+            ngx.say(ok, " ", err)
+        }
+    }
+--- request
+GET /test
+--- response_body
+falsenot admittedfalse
+trueniltrue
+true
+true nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 99: memory_report counts items by type and size
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            dogs:flush_all()
+
+            dogs:set("a", "hello")
+            dogs:set("bb", 3.14)
+            dogs:set("ccc", true)
+            dogs:rpush("list", "x", "yy")
+
+            local r = dogs:memory_report()
+
+            ngx.say(r.items, " ", r.expired, " ", r.list_values, " ", r.complete)
+            ngx.say(r.capacity, " ", type(r.slabs))
+
+            for _, name in ipairs({"string", "number", "boolean", "list"}) do
+                ngx.say(name, " ", r.types[name].items, " ", r.types[name].bytes > 0)
+            end
+
+            for _, h in ipairs({"key_sizes", "value_sizes"}) do
+                local sizes = {}
+                for size, n in pairs(r[h]) do
+                    sizes[#sizes + 1] = size .. ":" .. n
+                end
+                table.sort(sizes)
+                ngx.say(h, " ", table.concat(sizes, " "))
+            end
+
+            ngx.say(r.key_bytes, " ", r.value_bytes, " ",
+                    r.bytes == r.key_bytes + r.value_bytes + r.header_bytes
+                               + r.slack_bytes,
+                    " ", r.overhead > 0 and r.overhead < 1)
+        }
+    }
+--- request
+GET /test
+--- response_body
+4 0 2 true
+1048576 table
+string 1 true
+number 1 true
+boolean 1 true
+list 1 true
+key_sizes 1:1 2:1 4:2
+value_sizes 1:2 2:1 8:2
+10 17 true true
+--- no_error_log
+[error]
+
+
+
+=== TEST 100: memory_report walks large zones in batches, max_items
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            dogs:flush_all()
+
+            for i = 1, 3000 do
+                dogs:set("key" .. i, i)
+            end
+
+            local r = dogs:memory_report()
+            ngx.say(r.items, " ", r.complete, " ", r.types.number.items)
+
+            r = dogs:memory_report(10)
+            ngx.say(r.items, " ", r.complete)
+
+            local ok, err = pcall(dogs.memory_report, dogs, 0)
+            ngx.say(ok, " ", err:match('bad "max_items" argument'))
+        }
+    }
+--- request
+GET /test
+--- response_body
+3000 true 3000
+10 false
+false bad "max_items" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 101: get with early_refresh
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            dogs:set("costly", "v", 100, 7, {cost = 10})
+            ngx.say(dogs:get("costly", {early_refresh = 1e9}))
+            ngx.say(dogs:get("costly", {early_refresh = 1e-9}))
+            ngx.say(dogs:get("costly"))
+
+            -- no cost, or no expiration time
+            dogs:set("costly", "v", 100)
+            ngx.say(dogs:get("costly", {early_refresh = 1e9}))
+
+            dogs:set("costly", "v", 0, 0, {cost = 10})
+            ngx.say(dogs:get("costly", {early_refresh = 1e9}))
+
+            ngx.say(dogs:get("nokey", {early_refresh = 1}))
+
+            -- the chance grows as the expiration time nears: e^-1 here
+            dogs:set("costly", 1, 10, 0, {cost = 10})
+
+            local n = 0
+            for _ = 1, 1000 do
+                local _, _, refresh = dogs:get("costly", {early_refresh = 1})
+                if refresh then
+                    n = n + 1
+                end
+            end
+
+            ngx.say(n > 250 and n < 500)
+
+            local ok, err = pcall(dogs.get, dogs, "costly", {early_refresh = 0})
+            ngx.say(ok, " ", err:match('bad "early_refresh" option'))
+
+            ok, err = pcall(dogs.set, dogs, "costly", 1, 0, 0, {cost = -1})
+            ngx.say(ok, " ", err:match('bad "cost" option'))
+        }
+    }
+--- request
+GET /test
+--- response_body
+v7true
+v7false
+v7
+vnilfalse
+vnilfalse
+nil
+true
+false bad "early_refresh" option
+false bad "cost" option
+--- no_error_log
+[error]
+
+
+
+=== TEST 102: lock, unlock and semaphores
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            local token, err = dogs:lock("job")
+            ngx.say(type(token), " ", err)
+
+            -- the lock is apart from the items of the zone
+            ngx.say(dogs:get("job"))
+
+            ngx.say(dogs:lock("job", {timeout = 0}))
+            ngx.say(dogs:lock("job", {timeout = 0.05}))
+
+            ngx.say(dogs:unlock("job", token + 1))
+            ngx.say(dogs:unlock("job", token))
+            ngx.say(dogs:unlock("job", token))
+
+            token = dogs:lock("job", {timeout = 0})
+            ngx.say(type(token))
+            dogs:unlock("job", token)
+
+            -- a semaphore of 2 permits
+            local t1 = dogs:acquire("pool", 2, {timeout = 0})
+            local t2 = dogs:acquire("pool", 2, {timeout = 0})
+            ngx.say(t1 ~= t2, " ", dogs:acquire("pool", 2, {timeout = 0}))
+            ngx.say(dogs:release("pool", t1))
+            ngx.say(type(dogs:acquire("pool", 2, {timeout = 0})))
+
+            local ok, err = pcall(dogs.acquire, dogs, "pool", 0)
+            ngx.say(ok, " ", err:match('bad "limit" argument'))
+
+            ok, err = pcall(dogs.lock, dogs, "job", {exptime = -1})
+            ngx.say(ok, " ", err:match('bad "exptime" option'))
+
+            ok, err = pcall(dogs.unlock, dogs, "job", "x")
+            ngx.say(ok, " ", err:match('bad "token" argument'))
+
+            ngx.say(dogs:lock(nil))
+        }
+    }
+--- request
+GET /test
+--- response_body
+number nil
+nil
+niltimeout
+niltimeout
+nilnot held
+true
+nilnot held
+number
+true niltimeout
+true
+number
+false bad "limit" argument
+false bad "exptime" option
+false bad "token" argument
+nilnil key
+--- no_error_log
+[error]
+
+
+
+=== TEST 103: lock held by a dead holder expires
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            -- taken and never released
+            local token = dogs:lock("job", {exptime = 0.2})
+
+            local t0 = ngx.now()
+            local token2, err = dogs:lock("job", {timeout = 1})
+            local waited = ngx.now() - t0
+
+            ngx.say(type(token2), " ", err, " ", waited > 0.15 and waited < 0.6)
+
+            -- the expired permit cannot be given back any more
+            ngx.say(dogs:unlock("job", token))
+            ngx.say(dogs:unlock("job", token2))
+        }
+    }
+--- request
+GET /test
+--- response_body
+number nil true
+nilnot held
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 104: read-through leases
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            -- the first miss gets the lease, the others are told to wait
+            local v, flags, lease = dogs:get("page", {lease = 10})
+            ngx.say(v, " ", flags, " ", type(lease))
+            ngx.say(dogs:get("page", {lease = 10}))
+
+            ngx.say(dogs:set("page", "v1", 0.1, 3, {lease = lease}))
+            ngx.say(dogs:get("page", {lease = 10}))
+
+            -- the lease is used up
+            ngx.say(dogs:set("page", "v2", 0, 0, {lease = lease}))
+
+            -- the stale value goes to the workers waiting for the refill
+            ngx.sleep(0.2)
+
+            v, flags, lease = dogs:get("page", {lease = 10})
+            ngx.say(v, " ", flags, " ", type(lease))
+            ngx.say(dogs:get("page", {lease = 10}))
+
+            -- an invalidation in between refuses the stale fill
+            dogs:delete("page")
+            ngx.say(dogs:set("page", "old", 0, 0, {lease = lease}))
+            ngx.say(dogs:get("page"))
+
+            -- as does any other write, and flush_all
+            v, flags, lease = dogs:get("page", {lease = 10})
+            dogs:set("page", "newer")
+            ngx.say(dogs:set("page", "old", 0, 0, {lease = lease}))
+            ngx.say(dogs:get("page"))
+
+            dogs:delete("page")
+            v, flags, lease = dogs:get("page", {lease = 10})
+            dogs:flush_all()
+            ngx.say(dogs:set("page", "old", 0, 0, {lease = lease}))
+
+            -- an expired lease is handed out again
+            v, flags, lease = dogs:get("page", {lease = 0.05})
+            ngx.sleep(0.1)
+            local v2, flags2, lease2 = dogs:get("page", {lease = 10})
+            ngx.say(type(lease2), " ", lease2 ~= lease)
+            ngx.say(dogs:set("page", "old", 0, 0, {lease = lease}))
+            ngx.say(dogs:set("page", "new", 0, 0, {lease = lease2}))
+            ngx.say(dogs:get("page"))
+
+            local ok, err = pcall(dogs.get, dogs, "page", {lease = 0})
+            ngx.say(ok, " ", err:match('bad "lease" option'))
+
+            ok, err = pcall(dogs.set, dogs, "page", 1, 0, 0, {lease = "x"})
+            ngx.say(ok, " ", err:match('bad "lease" option'))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nil nil number
+nilnilfalse
+truenilfalse
+v13nil
+falseinvalid leasefalse
+v1 3 number
+v13false
+falseinvalid leasefalse
+nil
+falseinvalid leasefalse
+newer
+falseinvalid leasefalse
+number true
+falseinvalid leasefalse
+truenilfalse
+new
+false bad "lease" option
+false bad "lease" option
+--- no_error_log
+[error]
+
+
+
+=== TEST 105: leases with early refresh
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            dogs:set("costly", "v", 100, 0, {cost = 10})
+
+            -- a refresh due takes the lease, the other workers keep using the value
+            local v, _, lease = dogs:get("costly", {early_refresh = 1e9, lease = 10})
+            ngx.say(v, " ", type(lease))
+            ngx.say(dogs:get("costly", {early_refresh = 1e9, lease = 10}))
+            ngx.say(dogs:get("costly", {early_refresh = 1e-9, lease = 10}))
+
+            ngx.say(dogs:set("costly", "w", 100, 0, {cost = 10, lease = lease}))
+            ngx.say(dogs:get("costly"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+v number
+vnilnil
+vnilnil
+truenilfalse
+w
+--- no_error_log
+[error]
+
+
+
+=== TEST 106: stale_ttl keeps expired values for get_stale
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            dogs:set("grace", "old", 0.01, 0, {stale_ttl = 0.2})
+            dogs:set("nograce", "old", 0.01)
+
+            ngx.sleep(0.05)
+
+            ngx.say(dogs:get("grace"))
+            ngx.say(dogs:flush_expired())
+            ngx.say(dogs:get_stale("grace"))
+            ngx.say(dogs:get_stale("nograce"))
+
+            ngx.sleep(0.2)
+
+            ngx.say(dogs:flush_expired())
+            ngx.say(dogs:get_stale("grace"))
+
+            local ok, err = pcall(dogs.set, dogs, "grace", 1, 0, 0, {stale_ttl = -1})
+            ngx.say(ok, " ", err:match('bad "stale_ttl" option'))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nil
+1
+oldniltrue
+nil
+1
+nil
+false bad "stale_ttl" option
+--- no_error_log
+[error]
+
+
+
+=== TEST 107: stale values are evicted before live ones
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.tinydogs
+
+            dogs:flush_all()
+            dogs:flush_expired()
+
+            dogs:set("live", "v")
+            dogs:set("stale", "v", 0.01, 0, {stale_ttl = 100})
+
+            ngx.sleep(0.05)
+
+            for i = 1, 10000 do
+                local ok, err, forcible = dogs:set("key" .. i, string.rep("x", 100))
+                if forcible then
+                    break
+                end
+            end
+
+            ngx.say(dogs:get("live"))
+            ngx.say(dogs:get_stale("stale"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+v
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 108: changes: follow the changes of a zone
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.changedogs
+
+            local list, seq = dogs:changes()
+            ngx.say(#list, " ", seq)
+
+            dogs:set("a", 1)
+            dogs:incr("a", 2)
+            dogs:set("b", "x")
+            dogs:delete("b")
+            dogs:delete("nokey")
+            dogs:rpush("l", 1, 2)
+            dogs:lpop("l")
+            dogs:expire("a", 10)
+
+            list, seq = dogs:changes(seq)
+            for _, c in ipairs(list) do
+                ngx.say(c.seq, " ", c.op, " ", c.key)
+            end
+            ngx.say("last: ", seq)
+
+            list, seq = dogs:changes(seq)
+            ngx.say(#list, " ", seq)
+
+            dogs:flush_all()
+
+            list, seq = dogs:changes(seq, 2)
+            for _, c in ipairs(list) do
+                ngx.say(c.seq, " ", c.op, " ", c.key)
+            end
+
+            list, seq = dogs:changes(seq)
+            for _, c in ipairs(list) do
+                ngx.say(c.seq, " ", c.op, " ", c.key)
+            end
+            ngx.say("last: ", seq)
+        }
+    }
+--- request
+GET /test
+--- response_body
+0 0
+1 set a
+2 incr a
+3 set b
+4 delete b
+5 list l
+6 list l
+7 ttl a
+last: 7
+0 7
+8 flush nil
+9 expire a
+10 expire l
+last: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 109: changes: overflow, long keys and errors
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.changedogs
+
+            local _, seq = dogs:changes()
+
+            for i = 1, 10 do
+                dogs:set("k" .. i, i)
+            end
+
+            ngx.say(dogs:changes(seq))
+
+            local list, last = dogs:changes(2)
+            ngx.say(#list, " ", list[1].key, " ", last)
+
+            dogs:set(string.rep("x", 200), 1)
+
+            list = dogs:changes(last)
+            ngx.say(list[1].truncated, " ", #list[1].key)
+
+            -- a long key is kept whole until the spill area wraps round it
+            for i = 1, 3 do
+                dogs:set(string.rep(i, 200), i)
+            end
+
+            list = dogs:changes(last + 1)
+            ngx.say(list[1].truncated, " ", #list[1].key, " ", list[1].key_len,
+                    " ", list[3].truncated, " ", #list[3].key)
+
+            ngx.say(dogs:changes(100))
+            ngx.say(t.dogs:changes())
+
+            local ok, err = pcall(dogs.changes, dogs, -1)
+            ngx.say(ok, " ", err:match('bad "since" argument'))
+        }
+    }
+--- request
+GET /test
+--- response_body
+niloverflow10
+8 k3 10
+nil 200
+true 96 200 nil 200
+niloverflow14
+nilchanges not enabled
+false bad "since" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 110: replica: changes applied to a follower zone
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local replica = require("resty.shdict.replica")
+            local dogs, cats = t.changedogs, t.cats
+
+            -- a socket reading the frames sent by the leader
+            local function pipe(frames)
+                local buf, pos = table.concat(frames), 1
+
+                return {
+                    receive = function(self, n)
+                        if n == nil then
+                            local i = buf:find("\n", pos, true)
+                            if not i then
+                                return nil, "closed"
+                            end
+
+                            local line = buf:sub(pos, i - 1)
+                            pos = i + 1
+                            return line
+                        end
+
+                        local data = buf:sub(pos, pos + n - 1)
+                        pos = pos + n
+                        return data
+                    end,
+                }
+            end
+
+            local _, seq, epoch = dogs:changes()
+
+            dogs:set("a", "x", 0, 3)
+            dogs:set("n", 1.5)
+            dogs:set("b", true, 100)
+            dogs:rpush("l", "v1", 2)
+            dogs:set("gone", 1)
+            dogs:delete("gone")
+            cats:set("gone", "old")
+
+            local frames, last, n = replica.batch(dogs, epoch, seq, 100)
+            ngx.say(last, " ", n)
+
+            local e, s = replica.apply(cats, pipe(frames))
+            ngx.say(e == epoch, " ", s)
+
+            ngx.say(cats:get("a"))
+            ngx.say(cats:get("n"))
+            ngx.say(cats:get("b"))
+            ngx.say(cats:ttl("b") > 99)
+            ngx.say(table.concat(cats:lrange("l", 0, -1), ","))
+            ngx.say(cats:get("gone"))
+
+            frames, last, n = replica.batch(dogs, epoch, last, 100)
+            ngx.say(#frames, " ", last, " ", n)
+        }
+    }
+--- request
+GET /test
+--- response_body
+6 6
+true 6
+x3
+1.5
+true
+true
+v1,2
+nil
+1 6 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 111: replica: a follower behind, and long keys
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local replica = require("resty.shdict.replica")
+            local dogs, cats = t.changedogs, t.cats
+
+            -- a socket reading the frames sent by the leader
+            local function pipe(frames)
+                local buf, pos = table.concat(frames), 1
+
+                return {
+                    receive = function(self, n)
+                        if n == nil then
+                            local i = buf:find("\n", pos, true)
+                            if not i then
+                                return nil, "closed"
+                            end
+
+                            local line = buf:sub(pos, i - 1)
+                            pos = i + 1
+                            return line
+                        end
+
+                        local data = buf:sub(pos, pos + n - 1)
+                        pos = pos + n
+                        return data
+                    end,
+                }
+            end
+
+            local _, seq, epoch = dogs:changes()
+
+            for i = 1, 10 do
+                dogs:set("k" .. i, i)
+            end
+
+            cats:set("stale", 1)
+
+            local frames, last, n = replica.batch(dogs, epoch, seq, 100)
+            ngx.say(last, " ", n)
+
+            ngx.say(replica.apply(cats, pipe(frames)) == epoch)
+            ngx.say(#cats:get_keys(0), " ", cats:get("k1"), " ", cats:get("k10"))
+            ngx.say(cats:get("stale"))
+
+            dogs:set(string.rep("x", 200), "long")
+            frames, last, n = replica.batch(dogs, epoch, last, 100)
+            replica.apply(cats, pipe(frames))
+            ngx.say(last, " ", n, " ", cats:get(string.rep("x", 200)))
+
+            -- a key the change log lost the end of has the whole zone sent
+            local y = string.rep("y", 150)
+            cats:set(y .. "zz", "stale")
+
+            for i = 1, 4 do
+                dogs:set(y .. "a" .. i, i)
+            end
+
+            frames, last, n = replica.batch(dogs, epoch, last, 100)
+            replica.apply(cats, pipe(frames))
+            ngx.say(last, " ", n, " ", cats:get(y .. "a1"), " ",
+                    cats:get(y .. "a4"), " ", cats:get(y .. "zz"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+10 nil
+true
+10 1 10
+nil
+11 1 long
+15 nil 1 4 nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 112: records: set, get, update_fields and incr_field
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local ffi = require("ffi")
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            local Stat = dogs:record([[
+                struct {
+                    int64_t   hits;
+                    double    last_seen;
+                    uint32_t  flags, errors;
+                    uint8_t   level;
+                    bool      banned;
+                    char      name[8];
+                }
+            ]])
+
+            ngx.say(dogs:record() == Stat)
+
+            local s = Stat()
+            s.hits = 5
+            s.last_seen = 1.5
+            s.flags = 3
+            ffi.copy(s.name, "foo")
+
+            ngx.say(dogs:set("s", s, 0, 7))
+            s.hits = 0
+
+            local v, flags = dogs:get("s")
+            ngx.say(ffi.istype(Stat, v), " ", tonumber(v.hits), " ", v.last_seen, " ",
+                    v.flags, " ", ffi.string(v.name), " ", flags)
+
+            ngx.say(dogs:update_fields("s", { last_seen = 2.25, level = 255,
+                                              banned = true, errors = 4 }))
+            ngx.say(dogs:incr_field("s", "hits", 10))
+            ngx.say(dogs:incr_field("s", "level", 2))
+            ngx.say(dogs:incr_field("s", "last_seen", 0.5))
+            ngx.say(dogs:incr_field("s", "errors", -5))
+
+            v = dogs:get("s")
+            ngx.say(tonumber(v.hits), " ", v.last_seen, " ", v.flags, " ", v.errors,
+                    " ", v.level, " ", v.banned, " ", ffi.string(v.name))
+
+            local all = dogs:get_multi({ "s", "nokey" })
+            ngx.say(tonumber(all.s.hits), " ", all.nokey)
+        }
+    }
+--- request
+GET /test
+--- response_body
+true
+truenilfalse
+true 5 1.5 3 foo 7
+true
+15LL
+1
+2.75
+4294967295
+15 2.75 3 4294967295 1 true foo
+15 nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 113: records: errors
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local ffi = require("ffi")
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+            local cats = t.cats
+
+            ngx.say(dogs:update_fields("r", { a = 1 }))
+
+            local A = dogs:record("struct { int32_t a; int32_t b; }")
+
+            ngx.say(dogs:set("n", 1))
+            ngx.say(dogs:update_fields("n", { a = 1 }))
+            ngx.say(dogs:incr_field("r", "a", 1))
+            ngx.say(dogs:set("r", A()))
+            ngx.say(pcall(dogs.incr_field, dogs, "r", "c", 1))
+            ngx.say(pcall(dogs.record, dogs, "int32_t"))
+
+            -- not of the type declared for the zone
+            ngx.say(dogs:set("x", ffi.new("struct { int32_t a; int32_t b; }")))
+            ngx.say(cats:set("r", A()))
+
+            -- another worker declaring another schema
+            dogs:record("struct { int32_t a; int32_t c; }")
+            ngx.say(dogs:get("r"))
+            ngx.say(dogs:update_fields("r", { a = 1 }))
+
+            dogs:record("struct { int32_t a; int32_t b; }")
+            ngx.say(dogs:incr_field("r", "b", 3))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilno record schema
+truenilfalse
+nilnot a record
+nilnot found
+truenilfalse
+falsebad field "c"
+falsebad "schema" argument: struct expected
+falsebad value type
+falsebad value type
+nilrecord schema mismatch
+nilrecord schema mismatch
+3
+--- no_error_log
+[error]
+
+
+
+=== TEST 114: bitmaps: setbit, getbit, bitcount and bitop
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            ngx.say(dogs:getbit("b", 5), " ", dogs:bitcount("b"))
+
+            ngx.say(dogs:setbit("b", 7, 1))
+            ngx.say(dogs:setbit("b", 7, 1))
+            ngx.say(dogs:setbit("b", 100, 1))
+            for i = 1000, 1999, 3 do
+                dogs:setbit("b", i, 1)
+            end
+            ngx.say(dogs:getbit("b", 7), dogs:getbit("b", 8), dogs:getbit("b", 100),
+                    dogs:getbit("b", 99999))
+            ngx.say(dogs:bitcount("b"), " ", dogs:bitcount("b", 0, 0), " ",
+                    dogs:bitcount("b", 1, 12), " ", dogs:bitcount("b", -2))
+            ngx.say(dogs:setbit("b", 7, 0), " ", dogs:bitcount("b"))
+
+            dogs:setbit("c", 7, 1)
+            dogs:setbit("c", 8, 1)
+            ngx.say(dogs:bitop("and", "and", "b", "c"), " ", dogs:bitcount("and"))
+            ngx.say(dogs:bitop("or", "or", "b", "c"), " ", dogs:bitcount("or"))
+            ngx.say(dogs:bitop("xor", "c", "c", "c"), " ", dogs:bitcount("c"))
+            ngx.say(dogs:bitop("not", "not", "c"), " ", dogs:bitcount("not"))
+            ngx.say(dogs:bitop("or", "none", "nokey"), " ", dogs:get("none"))
+
+            ngx.say(dogs:get("b"))
+            ngx.say(dogs:set("s", "str"))
+            ngx.say(dogs:setbit("s", 1, 1))
+            ngx.say(pcall(dogs.setbit, dogs, "b", -1, 1))
+            ngx.say(pcall(dogs.setbit, dogs, "b", 1, 2))
+            ngx.say(dogs:setbit("b", 2 ^ 32, 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+0 0
+0nilfalse
+1nilfalse
+0nilfalse
+1010
+336 1 1 6
+1 335
+250 0
+250 337
+2 0
+2 16
+0 nil
+nilvalue is a bitmap
+truenilfalse
+nilnot a bitmapfalse
+falsebad "offset" argument
+falsebad "value" argument
+nilbit offset out of rangefalse
+--- no_error_log
+[error]
+
+
+
+=== TEST 115: bloom filters: bf_reserve, bf_add and bf_exists
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            ngx.say(dogs:bf_exists("bf", "a"))
+            ngx.say(dogs:bf_reserve("bf", 1000, 0.001))
+            ngx.say(dogs:bf_reserve("bf", 1000))
+
+            ngx.say(dogs:bf_add("bf", "a"))
+            ngx.say(dogs:bf_add("bf", "a"))
+            ngx.say(dogs:bf_add("bf", "b", "c", "a", 42))
+            ngx.say(dogs:bf_exists("bf", "a"), " ", dogs:bf_exists("bf", 42), " ",
+                    dogs:bf_exists("bf", "z"))
+
+            for i = 1, 1000 do
+                dogs:bf_add("bf", "key" .. i)
+            end
+
+            local fp = 0
+            for i = 1, 10000 do
+                if dogs:bf_exists("bf", "other" .. i) then
+                    fp = fp + 1
+                end
+            end
+            ngx.say(fp < 50)
+
+            for i = 1, 1000 do
+                if not dogs:bf_exists("bf", "key" .. i) then
+                    ngx.say("missing ", i)
+                end
+            end
+
+            -- created with the default size
+            ngx.say(dogs:bf_add("auto", "x", "y"))
+            ngx.say(dogs:bf_exists("auto", "y"))
+
+            ngx.say(dogs:get("bf"))
+            ngx.say(dogs:getbit("bf", 1))
+            dogs:set("s", 1)
+            ngx.say(dogs:bf_add("s", "a"))
+            ngx.say(dogs:bf_exists("s", "a"))
+            ngx.say(pcall(dogs.bf_reserve, dogs, "x", 0))
+            ngx.say(pcall(dogs.bf_reserve, dogs, "x", 10, 1))
+
+            local r = dogs:memory_report()
+            ngx.say(r.types.bloom.items)
+        }
+    }
+--- request
+GET /test
+--- response_body
+false
+truenilfalse
+nilexistsfalse
+1nilfalse
+0nilfalse
+3nilfalse
+true true false
+true
+2nilfalse
+true
+nilvalue is a bloom filter
+nilnot a bitmap
+nilnot a bloom filterfalse
+nilnot a bloom filter
+falsebad "capacity" argument
+falsebad "error_rate" argument
+2
+--- no_error_log
+[error]
+
+
+
+=== TEST 116: hyperloglogs: pfadd and pfcount, sparse and dense
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            ngx.say(dogs:pfcount("h"))
+            ngx.say(dogs:pfadd("h", "a"))
+            ngx.say(dogs:pfadd("h", "a"))
+            ngx.say(dogs:pfadd("h", "b", "c", "a", 1))
+            ngx.say(dogs:pfcount("h"))
+
+            for i = 1, 10000, 100 do
+                local items = {}
+                for j = i, i + 99 do
+                    items[#items + 1] = "item" .. j
+                end
+                dogs:pfadd("big", unpack(items))
+            end
+            local n = dogs:pfcount("big")
+            ngx.say(n > 9800 and n < 10200)
+            ngx.say(dogs:pfadd("big", "item1", "item5000"), " ", dogs:pfcount("big") == n)
+
+            local r = dogs:memory_report()
+            ngx.say(r.types.hyperloglog.items, " ", r.types.hyperloglog.bytes > 12288)
+
+            ngx.say(dogs:pfadd("e"), " ", dogs:pfcount("e"))
+            ngx.say(dogs:get("h"))
+            ngx.say(pcall(dogs.pfadd, dogs, "h", nil))
+            ngx.say(pcall(dogs.pfcount, dogs))
+        }
+    }
+--- request
+GET /test
+--- response_body
+0
+truenilfalse
+falsenilfalse
+truenilfalse
+4
+true
+false true
+2 true
+true 0
+nilvalue is a hyperloglog
+falsebad "item" argument
+falsebad number of keys
+--- no_error_log
+[error]
+
+
+
+=== TEST 117: hyperloglogs: pfmerge and the union of pfcount
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            for i = 1, 500 do
+                dogs:pfadd("a", i)
+            end
+            for i = 301, 2000 do
+                dogs:pfadd("b", i)
+            end
+
+            local function near(n, expected)
+                return math.abs(n - expected) < expected * 0.03
+            end
+
+            ngx.say(near(dogs:pfcount("a"), 500), " ", near(dogs:pfcount("b"), 1700))
+            ngx.say(near(dogs:pfcount("a", "b", "nokey"), 2000))
+
+            ngx.say(dogs:pfmerge("u", "a", "b"))
+            ngx.say(near(dogs:pfcount("u"), 2000))
+            ngx.say(dogs:pfmerge("a", "b"))
+            ngx.say(dogs:pfcount("a") == dogs:pfcount("u"))
+            ngx.say(dogs:pfmerge("n"), " ", dogs:pfcount("n"))
+
+            dogs:set("s", "str")
+            ngx.say(dogs:pfadd("s", "x"))
+            ngx.say(dogs:pfcount("a", "s"))
+            ngx.say(dogs:pfmerge("u", "s"))
+            ngx.say(dogs:pfmerge("s", "a"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+true true
+true
+truenilfalse
+true
+truenilfalse
+true
+true 0
+nilnot a hyperloglogfalse
+nilnot a hyperloglog
+nilnot a hyperloglogfalse
+nilnot a hyperloglogfalse
+--- no_error_log
+[error]
+
+
+
+=== TEST 118: tables: set and get round trip
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            local function dump(v)
+                if type(v) ~= "table" then
+                    return type(v) == "string" and string.format("%q", v) or tostring(v)
+                end
+
+                local keys = {}
+                for k in pairs(v) do
+                    keys[#keys + 1] = k
+                end
+                table.sort(keys, function (a, b) return tostring(a) < tostring(b) end)
+
+                local out = {}
+                for _, k in ipairs(keys) do
+                    out[#out + 1] = dump(k) .. "=" .. dump(v[k])
+                end
+                return "[" .. table.concat(out, ",") .. "]"
+            end
+
+            local value = {
+                1, -1, 127, 128, -32, -33, 255, 65535, 65536, -129, -40000,
+                4294967296, -4294967297, 2 ^ 53 - 1, 0.5, -1.25e300,
+                true, false, "", string.rep("x", 40), {}, { a = { b = { "c" } } },
+            }
+
+            ngx.say(dogs:set("t", value, 0, 7))
+            local v, flags = dogs:get("t")
+            ngx.say(dump(v) == dump(value), " ", flags, " ", #v)
+            ngx.say(dump(v[22]), " ", v[14] == 2 ^ 53 - 1, " ", v[16])
+
+            local big = { s = string.rep("y", 70000), [1.5] = 2, [true] = "t" }
+            ngx.say(dogs:set("big", big))
+            ngx.say(dump(dogs:get("big")) == dump(big))
+
+            ngx.say(dump(dogs:get_multi({ "t", "big", "none" })["t"]) == dump(value))
+
+            ngx.say(dogs:set("e", {}))
+            ngx.say(dump(dogs:get("e")))
+            ngx.say(dogs:memory_report().types.table.items)
+        }
+    }
+--- request
+GET /test
+--- response_body
+truenilfalse
+true 7 22
+["a"=["b"=[1="c"]]] true -1.25e+300
+truenilfalse
+true
+true
+truenilfalse
+[]
+3
+--- no_error_log
+[error]
+
+
+
+=== TEST 119: tables: values which cannot be serialized
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            local cyclic = {}
+            cyclic.self = cyclic
+
+            ngx.say(dogs:set("t", { 1 }))
+            ngx.say(dogs:set("t", { f = print }))
+            ngx.say(dogs:set("t", cyclic))
+            ngx.say(dogs:set("t", { [{}] = 1 }))
+
+            local deep = {}
+            for i = 1, 200 do
+                deep = { deep }
+            end
+            ngx.say(dogs:set("t", deep))
+
+            ngx.say(dogs:get("t")[1])
+            ngx.say(dogs:add("t", { 2 }))
+            ngx.say(dogs:replace("t", { 3 }))
+            ngx.say(dogs:get("t")[1])
+            ngx.say(dogs:incr("t", 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+truenilfalse
+falsecannot serialize a function
+falsecannot serialize a cyclic table
+falsecannot serialize a key of type table
+falsetable too deep
+1
+falseexistsfalse
+truenilfalse
+3
+nilnot a number
+--- no_error_log
+[error]
+
+
+
+=== TEST 120: namespaces: a noisy namespace evicts its own keys
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.nsdogs
+
+            dogs:set("a:hot", "x")
+            dogs:set("hot", "y")
+
+            local v = string.rep("v", 100)
+            for i = 1, 200 do
+                local ok, err = dogs:set("b:" .. i, v)
+                if not ok then
+                    ngx.say("set failed: ", err)
+                    return
+                end
+            end
+
+            ngx.say("a:hot: ", dogs:get("a:hot"))
+            ngx.say("hot: ", dogs:get("hot"))
+            ngx.say("b:1: ", dogs:get("b:1"))
+            ngx.say("b:200: ", dogs:get("b:200"))
+
+            local b = dogs:stats().namespaces["b:"]
+            ngx.say("b: within quota: ", b.used <= b.quota, ", quota: ", b.quota)
+            ngx.say("b: evicted: ", b.evictions > 0, ", kept: ", b.items < 200)
+        }
+    }
+--- request
+GET /test
+--- response_body
+a:hot: x
+hot: y
+b:1: nil
+b:200: vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv
+b: within quota: true, quota: 4096
+b: evicted: true, kept: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 121: namespaces: stats
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.nsdogs
+
+            dogs:set("a:1", "x")
+            dogs:set("a:2", "y")
+            dogs:set("c:1", "z")
+            dogs:set("plain", 1)
+            dogs:lpush("c:list", 1, 2)
+            dogs:delete("a:2")
+
+            local ns = dogs:stats().namespaces
+            local names = {}
+            for name in pairs(ns) do
+                names[#names + 1] = name
+            end
+            table.sort(names)
+
+            for _, name in ipairs(names) do
+                local s = ns[name]
+                ngx.say('"', name, '": quota ', s.quota, ", items ", s.items,
+                        ", used ", s.used > 0, ", evictions ", s.evictions)
+            end
+
+            dogs:delete("c:1")
+            dogs:delete("c:list")
+            ngx.say("c: after delete: ", dogs:stats().namespaces["c:"])
+
+            ngx.say("dogs: ", t.dogs:stats().namespaces)
+        }
+    }
+--- request
+GET /test
+--- response_body
+"": quota 0, items 1, used true, evictions 0
+"a:": quota 8192, items 1, used true, evictions 0
+"c:": quota 4096, items 2, used true, evictions 0
+c: after delete: nil
+dogs: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 122: priority: pinned items survive, low ones go first
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.pindogs
+
+            assert(dogs:set("flag", "on", 0, 0, { priority = "pinned" }))
+            for i = 1, 10 do
+                assert(dogs:set("low" .. i, "x", 0, 0, { priority = "low" }))
+            end
+            assert(dogs:set("normal", "y"))
+
+            local v = string.rep("v", 100)
+            local i = 0
+            repeat
+                i = i + 1
+                local ok, err, forcible = dogs:set("fill" .. i, v)
+                assert(ok, err)
+            until forcible
+
+            ngx.say("low1: ", dogs:get("low1"))
+            ngx.say("normal: ", dogs:get("normal"))
+
+            for j = i + 1, i + 2000 do
+                assert(dogs:set("fill" .. j, v))
+            end
+
+            ngx.say("low10: ", dogs:get("low10"))
+            ngx.say("normal: ", dogs:get("normal"))
+            ngx.say("flag: ", dogs:get("flag"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+low1: nil
+normal: y
+low10: nil
+normal: nil
+flag: on
+--- no_error_log
+[error]
+
+
+
+=== TEST 123: priority: the pinned limit
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.pindogs
+            local pinned = { priority = "pinned" }
+
+            local ok, err = t.dogs:set("flag", "on", 0, 0, pinned)
+            ngx.say(ok, " ", err)
+
+            local v = string.rep("v", 1000)
+            local n = 0
+            while true do
+                local ok, err = dogs:set("route" .. n + 1, v, 0, 0, pinned)
+                if not ok then
+                    ngx.say("after ", n, ": ", err)
+                    break
+                end
+                n = n + 1
+            end
+
+            local stats = dogs:stats()
+            ngx.say("within limit: ", stats.pinned_bytes <= stats.pinned_limit,
+                    ", limit: ", stats.pinned_limit)
+
+            -- replacing a pinned item counts its old size out
+            ngx.say("replaced: ", (dogs:set("route1", string.rep("w", 1000), 0, 0,
+                                           pinned)))
+
+            -- a store with the normal priority makes it a normal item again
+            local before = stats.pinned_bytes
+            assert(dogs:set("route2", "short", 0, 0, { priority = "normal" }))
+            ngx.say("unpinned: ", dogs:stats().pinned_bytes < before)
+
+            local ok, err = pcall(dogs.set, dogs, "k", "v", 0, 0, { priority = "hi" })
+            ngx.say(ok, " ", err:match('bad "priority" option'))
+        }
+    }
+--- request
+GET /test
+--- response_body
+false pinned not enabled
+after 7: pinned limit exceeded
+within limit: true, limit: 8192
+replaced: true
+unpinned: true
+false bad "priority" option
+--- no_error_log
+[error]
+
+
+
+=== TEST 124: multi: operations run in one transaction
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            assert(dogs:set("marker", "old"))
+
+            local res, err = dogs:multi()
+                :incr("quota", 1, 0)
+                :get("marker")
+                :rpush("audit", "a", "b")
+                :set("marker", "new", 0, 7)
+                :set("doc", { id = 1, tags = { "x" } })
+                :get("doc")
+                :get("missing")
+                :exec()
+
+            ngx.say("n: ", res.n, " err: ", err)
+            ngx.say("quota: ", res[1], " marker: ", res[2])
+            ngx.say("audit: ", res[3], " ", res[4], " set: ", res[5])
+            ngx.say("doc: ", res[7].id, " ", res[7].tags[1], " missing: ", res[8])
+
+            ngx.say("marker: ", dogs:get("marker"), " ", select(2, dogs:get("marker")))
+            ngx.say("audit: ", table.concat(dogs:lrange("audit", 0, -1), ","))
+            ngx.say("quota: ", dogs:get("quota"))
+
+            res, err = dogs:multi():get("quota"):exec()
+            ngx.say("again: ", res[1])
+        }
+    }
+--- request
+GET /test
+--- response_body
+n: 8 err: nil
+quota: 1 marker: old
+audit: 1 2 set: true
+doc: 1 x missing: nil
+marker: new 7
+audit: a,b
+quota: 1
+again: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 125: multi: guards and errors
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            assert(dogs:set("version", 3))
+
+            local res, err = dogs:multi()
+                :guard("version", 2)
+                :set("data", "stale")
+                :exec()
+            ngx.say(res, " ", err, " data: ", dogs:get("data"))
+
+            res, err = dogs:multi()
+                :guard("version", 3)
+                :guard("lock", nil)
+                :set("data", "fresh")
+                :incr("version", 1)
+                :exec()
+            ngx.say("ok: ", res[1], " ", res[2], " ", res[3], " version: ", res[4])
+
+            -- a failed operation does not undo the others
+            res = dogs:multi()
+                :add("data", "again")
+                :incr("data", 1)
+                :lpush("log", "x")
+                :exec()
+            ngx.say(res[1], " ", res.errors[1], ", ", res[2], " ", res.errors[2],
+                    ", ", res[3])
+
+            res, err = dogs:multi():get(nil):set("k", "v"):exec()
+            ngx.say(res, " ", err)
+            res, err = dogs:multi():set("k", function () end):exec()
+            ngx.say(res, " ", err, " k: ", dogs:get("k"))
+
+            local tx = dogs:multi()
+            local ok, err = pcall(tx.guard, tx, "k", {})
+            ngx.say(ok, " ", err:match('bad "value" argument'))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nil guard failed data: nil
+ok: true true true version: 4
+false exists, false not a number, 1
+nil nil key
+nil bad value type k: nil
+false bad "value" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 126: chunked: large values are stored in chunks
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.chunkdogs
+
+            local free = dogs:free_space()
+            local big = string.rep("0123456789", 1000)
+
+            assert(dogs:set("big", big, 0, 3))
+            local v, flags = dogs:get("big")
+            ngx.say("get: ", v == big, " ", flags)
+
+            -- stored again in place, then as a short value
+            local other = string.rep("9876543210", 1000)
+            assert(dogs:set("big", other))
+            ngx.say("replaced: ", dogs:get("big") == other)
+
+            local doc = { body = string.rep("x", 8000), n = 1 }
+            assert(dogs:set("doc", doc))
+            local vals = dogs:get_multi({ "big", "doc", "none" })
+            ngx.say("multi: ", vals.big == other, " ", #vals.doc.body, " ", vals.doc.n)
+
+            assert(dogs:set("big", "short"))
+            ngx.say("short: ", dogs:get("big"))
+
+            assert(dogs:set("big", big .. big))
+            ngx.say("longer: ", dogs:get("big") == big .. big)
+
+            dogs:delete("big")
+            dogs:delete("doc")
+            ngx.say("freed: ", dogs:free_space() == free, " ", dogs:get("big"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+get: true 3
+replaced: true
+multi: true 8000 1
+short: short
+longer: true
+freed: true nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 127: chunked: the chunks of a value in reports and transactions
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.chunkdogs
+
+            dogs:flush_all()
+
+            local big = string.rep("0123456789", 1000)
+            assert(dogs:set("big", big))
+
+            -- a node of 128 bytes, 4 full chunks and a last one, of 2048 bytes each
+            local report = dogs:memory_report()
+            ngx.say("bytes: ", report.types.string.bytes, " value: ", report.value_bytes)
+
+            local res, err = dogs:multi():guard("big", big):get("big"):exec()
+            ngx.say("guard: ", res and res[2] == big, " ", err)
+            res, err = dogs:multi():guard("big", big .. "x"):exec()
+            ngx.say("guard: ", res, " ", err)
+
+            local ok, err = dogs:incr("big", 1)
+            ngx.say(ok, " ", err)
+            ok, err = dogs:lpush("big", 1)
+            ngx.say(ok, " ", err)
+
+            assert(dogs:set("big", big, 0.001))
+            ngx.sleep(0.002)
+            ngx.say("stale: ", dogs:get_stale("big") == big, " ", dogs:get("big"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+bytes: 10368 value: 10000
+guard: true nil
+guard: nil guard failed
+nil not a number
+nil value not a list
+stale: true nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 128: leases end with the list writes
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.dogs
+
+            -- each list write of the key, even a failed one, refuses the fill
+            -- of the lease
+            local writes = {
+                function () return dogs:rpush("jobs", "a") end,
+                function () return dogs:lpop("jobs") end,
+                function () return dogs:lset("jobs", 1, "b") end,
+                function () return dogs:ltrim("jobs", 0, 0) end,
+            }
+
+            for i, write in ipairs(writes) do
+                local _, _, lease = dogs:get("jobs", {lease = 10})
+                write()
+                local ok, err = dogs:set("jobs", "old", 0, 0, {lease = lease})
+                ngx.say(i, ": ", ok, " ", err)
+                dogs:delete("jobs")
+            end
+        }
+    }
+--- request
+GET /test
+--- response_body
+1: false invalid lease
+2: false invalid lease
+3: false invalid lease
+4: false invalid lease
+--- no_error_log
+[error]
+
+
+
+=== TEST 129: priority: pinned values in chunks
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.pindogs
+            local pinned = { priority = "pinned" }
+
+            local v = string.rep("v", 3000)
+            assert(dogs:set("page1", v, 0, 0, pinned))
+            assert(dogs:set("page2", v, 0, 0, pinned))
+
+            local ok, err = dogs:set("page3", v, 0, 0, pinned)
+            ngx.say("third: ", ok, " ", err)
+
+            -- the old value counts out with its chunks
+            ok, err = dogs:set("page1", string.rep("w", 3000), 0, 0, pinned)
+            ngx.say("replaced: ", ok, " ", err)
+
+            local stats = dogs:stats()
+            ngx.say("within limit: ", stats.pinned_bytes <= stats.pinned_limit,
+                    " ", stats.pinned_bytes > 6000)
+        }
+    }
+--- request
+GET /test
+--- response_body
+third: false pinned limit exceeded
+replaced: true nil
+within limit: true true
+--- no_error_log
+[error]
+
+
+
+=== TEST 130: namespaces: inferred ones come and go with their items
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.nsdogs
+
+            -- a store which fails takes no namespace
+            local ok, err = dogs:set("big:1", string.rep("x", 200 * 1024))
+            ngx.say(ok, " ", err, " ", dogs:stats().namespaces["big:"])
+
+            -- 62 namespaces are inferred besides "a:" and the default one
+            for i = 1, 62 do
+                assert(dogs:set("t" .. i .. ":k", i))
+            end
+
+            assert(dogs:set("late:k", 1))
+            local ns = dogs:stats().namespaces
+            ngx.say("late: ", ns["late:"], ", default items: ", ns[""].items)
+
+            -- the slot of a namespace is freed with its last item
+            dogs:delete("t7:k")
+            dogs:delete("late:k")
+            assert(dogs:set("late:k", 1))
+            ns = dogs:stats().namespaces
+            ngx.say("t7: ", ns["t7:"], ", late: ", ns["late:"].items,
+                    ", t8: ", ns["t8:"].items)
+        }
+    }
+--- request
+GET /test
+--- response_body
+false no memory nil
+late: nil, default items: 1
+t7: nil, late: 1, t8: 1
+--- error_log
+no namespace left for "late:"
+--- no_error_log
+[error]
+
+
+
+=== TEST 131: lset: evicts to make room, reads keep the list hot
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.smalldogs
+
+            assert(dogs:rpush("list", "a", "b", "c"))
+            assert(dogs:set("old", 1))
+
+            -- the zone is filled up, the list being read all along
+            local v = string.rep("v", 100)
+            local i = 0
+            repeat
+                i = i + 1
+                dogs:lrange("list", 0, 0)
+                local ok, err, forcible = dogs:set("fill" .. i, v)
+                assert(ok, err)
+            until forcible
+
+            ngx.say("old: ", dogs:get("old"), ", list: ", dogs:llen("list"))
+
+            -- a larger element still fits, by evicting
+            local ok, err = dogs:lset("list", 1, string.rep("x", 2000))
+            ngx.say(ok, " ", err, " ", #dogs:lindex("list", 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+old: nil, list: 3
+true nil 2000
+--- no_error_log
+[error]
+
+
+
+=== TEST 132: replica: the whole zone in bounded batches, unreplicated keys removed
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local replica = require("resty.shdict.replica")
+            local dogs, cats = t.changedogs, t.cats
+
+            -- a socket reading the frames sent by the leader
+            local function pipe(frames)
+                local buf, pos = table.concat(frames), 1
+
+                return {
+                    receive = function(self, n)
+                        if n == nil then
+                            local i = buf:find("\n", pos, true)
+                            if not i then
+                                return nil, "closed"
+                            end
+
+                            local line = buf:sub(pos, i - 1)
+                            pos = i + 1
+                            return line
+                        end
+
+                        local data = buf:sub(pos, pos + n - 1)
+                        pos = pos + n
+                        return data
+                    end,
+                }
+            end
+
+            local _, _, epoch = dogs:changes()
+
+            dogs:flush_all()
+            dogs:flush_expired()
+
+            for i = 1, 20 do
+                dogs:set("s" .. i, i)
+            end
+
+            dogs:setbit("bits", 3, 1)
+            cats:set("bits", "stale")
+
+            -- a follower connecting for the first time
+            local all, batches, since, n = {}, 0
+
+            repeat
+                local frames
+                frames, since, n = replica.batch(dogs, epoch, since, 8)
+                batches = batches + 1
+
+                for i = 1, #frames do
+                    all[#all + 1] = frames[i]
+                end
+            until type(since) ~= "table"
+
+            ngx.say(batches, " ", n)
+
+            ngx.say(replica.apply(cats, pipe(all)) == epoch)
+            ngx.say(cats:get("s1"), " ", cats:get("s20"), " ", cats:get("bits"))
+
+            -- a bitmap changed later is removed from the follower too
+            cats:set("bits", "stale")
+            dogs:setbit("bits", 4, 1)
+
+            local frames = replica.batch(dogs, epoch, since, 8)
+            replica.apply(cats, pipe(frames))
+            ngx.say(cats:get("bits"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+3 nil
+true
+1 20 nil
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 133: bitop: sources evicted to make room for the result
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.tinydogs
+
+            dogs:flush_all()
+            dogs:flush_expired()
+
+            -- two bitmaps filling the zone
+            assert(dogs:setbit("a", 70000, 1))
+            assert(dogs:setbit("b", 70000, 1))
+
+            local len, err = dogs:bitop("or", "dst", "a", "b")
+            ngx.say(len, " ", err)
+            ngx.say(dogs:get("dst"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nil no memory
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 134: priority: a store without the option keeps the item pinned
+--- http_config eval: $::HttpConfig
+--- config
+    location = /test {
+        content_by_lua_block {
+            local t = require("resty.shdict")
+            local dogs = t.pindogs
+
+            dogs:flush_all()
+            dogs:flush_expired()
+
+            assert(dogs:set("flag", "on", 0, 0, { priority = "pinned" }))
+            local pinned = dogs:stats().pinned_bytes
+
+            -- overwritten by values of the same size by a plain store, with other
+            -- options, and in a transaction
+            assert(dogs:set("flag", "no"))
+            ngx.say("set: ", dogs:stats().pinned_bytes == pinned)
+
+            assert(dogs:set("flag", "on", 0, 0, { cost = 1 }))
+            ngx.say("opts: ", dogs:stats().pinned_bytes == pinned)
+
+            assert(dogs:multi():set("flag", "ok"):exec())
+            ngx.say("tx: ", dogs:stats().pinned_bytes == pinned, " ", dogs:get("flag"))
+
+            -- a new item is a normal one
+            assert(dogs:set("other", "v"))
+            ngx.say("new: ", dogs:stats().pinned_bytes == pinned)
+
+            -- a value going over the limit makes it a normal item
+            ngx.say(dogs:set("flag", string.rep("v", 9000)))
+            ngx.say("grown: ", dogs:stats().pinned_bytes)
+        }
+    }
+--- request
+GET /test
+--- response_body
+set: true
+opts: true
+tx: true ok
+new: true
+truenilfalse
+grown: 0
+--- no_error_log
+[error]
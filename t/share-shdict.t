@@ -528,3 +528,52 @@ http get: bar
 stream get success
 --- no_error_log
 [error]
+
+
+
+=== TEST 9: stream's replica server & a follower in the same nginx
+--- stream_config
+    lua_package_path "$TEST_NGINX_LUA_PACK_PATH";
+    lua_shared_mem leader 1m changes=1024;
+    lua_shared_mem follower 1m;
+
+    server {
+        listen 1987;
+
+        content_by_lua_block {
+            require("resty.shdict.replica").serve("leader",
+                                                  { interval = 0.01 })
+        }
+    }
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local replica = require("resty.shdict.replica")
+        local leader, follower = t.leader, t.follower
+
+        leader:set("before", 1)
+        leader:set("gone", 1)
+
+        assert(replica.follow("follower", { host = "127.0.0.1",
+                                            port = 1987 }))
+
+        ngx.sleep(0.3)
+
+        ngx.say(follower:get("before"), " ", follower:get("gone"))
+
+        leader:set("after", "x", 0, 7)
+        leader:rpush("list", 1, 2)
+        leader:delete("gone")
+
+        ngx.sleep(0.3)
+
+        local value, flags = follower:get("after")
+
+        ngx.say(value, " ", flags, " ", follower:llen("list"), " ",
+                follower:get("gone"))
+    }
+--- stream_response
+1 1
+x 7 2 nil
+--- no_error_log
+[error]
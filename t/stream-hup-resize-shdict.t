@@ -0,0 +1,196 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+our $SkipReason;
+
+BEGIN {
+    if ($ENV{TEST_NGINX_CHECK_LEAK}) {
+        $SkipReason = "unavailable for the hup tests";
+
+    } else {
+        $ENV{TEST_NGINX_USE_HUP} = 1;
+        undef $ENV{TEST_NGINX_USE_STAP};
+    }
+}
+
+use Test::Nginx::Socket::Lua::Stream $SkipReason ? (skip_all => $SkipReason) : ();
+use Cwd qw(cwd);
+
+my $pwd = cwd();
+
+our $StreamConfig = qq{
+    lua_package_path "$pwd/t/lib/?.lua;$pwd/lib/?.lua;;";
+    lua_shared_mem cats 1m;
+};
+
+our $ResizedStreamConfig = qq{
+    lua_package_path "$pwd/t/lib/?.lua;$pwd/lib/?.lua;;";
+    lua_shared_mem cats 2m;
+};
+
+our $ChangesStreamConfig = qq{
+    lua_package_path "$pwd/t/lib/?.lua;$pwd/lib/?.lua;;";
+    lua_shared_mem cats 1m changes=8;
+};
+
+our $MoreChangesStreamConfig = qq{
+    lua_package_path "$pwd/t/lib/?.lua;$pwd/lib/?.lua;;";
+    lua_shared_mem cats 1m changes=16;
+};
+
+# a zone is only resized by the first reload with a new size
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 3 + 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+no_shuffle();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: prepare items of all types before growing the zone
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local cats = t.cats
+
+        cats:flush_all()
+        cats:flush_expired()
+
+        cats:rpush("list", "a", 2, "c")
+        cats:set("flags", "hello", 0, 7)
+        cats:set("ttl", true, 100)
+        cats:set("gone", 1, 0.001)
+
+        ngx.sleep(0.002)
+
+        ngx.say(cats:capacity())
+    }
+--- stream_response
+1048576
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: the items are carried over to the larger zone
+--- stream_config eval: $::ResizedStreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local cats = t.cats
+
+        ngx.say(cats:capacity())
+        ngx.say(table.concat(cats:lrange("list", 0, -1), ","))
+        ngx.say(cats:get("flags"))
+        ngx.say(cats:get("ttl"), " ", cats:get("gone"))
+    }
+--- stream_response
+2097152
+a,2,c
+hello7
+true nil
+--- error_log eval
+qr/lua shared dict "cats" resized: 3 items carried over, 0 dropped for lack of memory or over a quota, 1 expired/
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: fill the larger zone
+--- stream_config eval: $::ResizedStreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local cats = t.cats
+        local value = string.rep("x", 500)
+        local evicted = 0
+
+        for i = 1, 1500 do
+            local ok, err, forcible = cats:set("k" .. i, value)
+            if not ok then
+                ngx.say("failed to set: ", err)
+                return
+            end
+
+            if forcible then
+                evicted = evicted + 1
+            end
+        end
+
+        ngx.say("evicted: ", evicted)
+    }
+--- stream_response
+evicted: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: a smaller zone keeps the most recently used items
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local cats = t.cats
+
+        ngx.say(cats:capacity())
+        ngx.say(cats:get("k1"), " ", cats:get("list"))
+        ngx.say(#cats:get("k1500"))
+    }
+--- stream_response
+1048576
+nil nil
+500
+--- error_log eval
+qr/lua shared dict "cats" resized: \d+ items carried over, [1-9]\d* dropped for lack of memory or over a quota, 0 expired/
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: a change log added on reload
+--- stream_config eval: $::ChangesStreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local cats = t.cats
+
+        local ok = cats:set("x", 1)
+        local changes, last = cats:changes()
+        ngx.say(ok, " ", #changes, " ", last > 0)
+    }
+--- stream_response
+true 0 true
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: the change log is kept when its size changes on reload
+--- stream_config eval: $::MoreChangesStreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local cats = t.cats
+
+        local _, last = cats:changes()
+        cats:set("x", 2)
+        cats:set("y", 3)
+
+        local changes = cats:changes(last)
+        ngx.say(#changes, " ", changes[1].key, " ", changes[2].key)
+    }
+--- stream_response
+2 x y
+--- error_log
+lua shared dict "cats" keeps its change log of 8 records until a restart
+--- no_error_log
+[error]
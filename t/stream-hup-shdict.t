@@ -22,6 +22,11 @@ our $StreamConfig = qq{
     lua_shared_mem dogs 1m;
 };
 
+our $ResizedStreamConfig = qq{
+    lua_package_path "$pwd/t/lib/?.lua;$pwd/lib/?.lua;;";
+    lua_shared_mem dogs 2m;
+};
+
 repeat_each(2);
 
 plan tests => repeat_each() * (blocks() * 3);
@@ -79,3 +84,52 @@ __DATA__
 --- no_error_log
 [error]
 
+
+
+=== TEST 3: prepare items of all types before resizing the zone
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dogs = t.dogs
+
+        dogs:delete("list")
+        dogs:rpush("list", "a", 2, "c")
+        dogs:set("flags", "hello", 0, 7)
+        dogs:set("ttl", true, 100)
+        dogs:set("gone", 1, 0.001)
+
+        ngx.say(dogs:capacity())
+    }
+--- stream_response
+1048576
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: retrieve the items after HUP reload with a larger zone
+--- stream_config eval: $::ResizedStreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dogs = t.dogs
+
+        ngx.say(dogs:capacity())
+        ngx.say(dogs:get("foo"), " ", dogs:get("bah"))
+        ngx.say(table.concat(dogs:lrange("list", 0, -1), ","))
+        ngx.say(dogs:get("flags"))
+
+        local ttl = dogs:ttl("ttl")
+        ngx.say(dogs:get("ttl"), " ", ttl > 0 and ttl <= 100)
+        ngx.say(dogs:get("gone"))
+    }
+--- stream_response
+2097152
+32 10502
+a,2,c
+hello7
+true true
+nil
+--- no_error_log
+[error]
@@ -452,8 +452,8 @@ bar nil
         for i = 1, N do
             local key = string.format("%05d", i)
 
-            local len , err = dict:lpush(key, i)
-            if not len then
+            local len, err, forcible = dict:lpush(key, i)
+            if not len or forcible then
                 max = i
                 break
             end
@@ -472,8 +472,8 @@ bar nil
         for i = 100000, 1, -1 do
             local key = string.format("%05d", i)
 
-            local len, err = dict:lpush(key, i)
-            if not len then
+            local len, err, forcible = dict:lpush(key, i)
+            if not len or forcible then
                 ngx.say("loop again, max matched: ", N + 1 - i == max)
                 break
             end
@@ -486,8 +486,8 @@ bar nil
         for i = 1, N do
             local key = string.format("%05d", i)
 
-            local len, err = dict:lpush(key, i)
-            if not len then
+            local len, err, forcible = dict:lpush(key, i)
+            if not len or forcible then
                 ngx.say("loop again, max matched: ", i == max)
                 break
             end
@@ -535,8 +535,8 @@ loop again, max matched: true
         for i = 1, N do
             local key = string.format("%05d", i)
 
-            local len, err = dict:lpush(key, i)
-            if not len then
+            local len, err, forcible = dict:lpush(key, i)
+            if not len or forcible then
                 break
             end
         end
@@ -667,3 +667,325 @@ foofoofoofoofoofoofoofoofoofoo
 done
 --- no_error_log
 [error]
+
+
+
+=== TEST 20: multi-value lpush and rpush
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        local len, err = dict:lpush("foo", 1, 2, 3)
+        ngx.say(len, " ", err)
+
+        local len, err = dict:rpush("foo", "a", "b")
+        ngx.say(len, " ", err)
+
+        local vals, err = dict:lrange("foo", 0, -1)
+        ngx.say(table.concat(vals, ","), " ", err)
+
+        local len, err = dict:lpush("foo", "c", true)
+        ngx.say(len, " ", err)
+
+        ngx.say(dict:llen("foo"))
+    }
+--- stream_response
+3 nil
+5 nil
+3,2,1,a,b nil
+nil bad value type
+5
+--- no_error_log
+[error]
+
+
+
+=== TEST 21: lpop and rpop with count
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        dict:rpush("foo", 1, 2, 3, 4, 5)
+
+        local vals = dict:lpop("foo", 2)
+        ngx.say(#vals, ": ", table.concat(vals, ","))
+
+        local vals = dict:rpop("foo", 2)
+        ngx.say(#vals, ": ", table.concat(vals, ","))
+
+        local vals = dict:rpop("foo", 10)
+        ngx.say(#vals, ": ", table.concat(vals, ","))
+
+        ngx.say(dict:llen("foo"), " ", dict:rpop("foo", 1))
+
+        local ok, err = pcall(dict.rpop, dict, "foo", 0)
+        ngx.say(ok, " ", err:match('bad "count" argument'))
+    }
+--- stream_response
+2: 1,2
+2: 5,4
+1: 3
+0 nil
+false bad "count" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 22: lrange and lindex
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        local long_str = string.rep("foo", 2000)
+
+        dict:rpush("foo", "a", 2, long_str, "d", "e")
+
+        ngx.say(table.concat(dict:lrange("foo", 0, 1), ","))
+        ngx.say(table.concat(dict:lrange("foo", -2, -1), ","))
+        ngx.say(table.concat(dict:lrange("foo", 3, 100), ","))
+        ngx.say(#dict:lrange("foo", 4, 1), " ", #dict:lrange("bar", 0, -1))
+        ngx.say(#dict:lrange("foo", 0, -1)[3] == #long_str)
+
+        ngx.say(dict:lindex("foo", 0), " ", dict:lindex("foo", 1), " ",
+                dict:lindex("foo", -1), " ", dict:lindex("foo", 5))
+
+        ngx.say(dict:llen("foo"))
+    }
+--- stream_response
+a,2
+d,e
+d,e
+0 0
+true
+a 2 e nil
+5
+--- no_error_log
+[error]
+
+
+
+=== TEST 23: lset and ltrim
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        dict:rpush("foo", "a", "b", "c", "d", "e")
+
+        ngx.say(dict:lset("foo", 1, "bb"))
+        ngx.say(dict:lset("foo", -1, 5))
+        ngx.say(dict:lset("foo", 5, "x"))
+        ngx.say(dict:lset("bar", 0, "x"))
+        ngx.say(table.concat(dict:lrange("foo", 0, -1), ","))
+
+        ngx.say(dict:ltrim("foo", 1, -2))
+        ngx.say(table.concat(dict:lrange("foo", 0, -1), ","))
+
+        ngx.say(dict:ltrim("foo", 5, 10))
+        ngx.say(dict:llen("foo"), " ", dict:get("foo"))
+    }
+--- stream_response
+true
+true
+nilindex out of range
+nilnot found
+a,bb,c,d,5
+3
+bb,c,d
+0
+0 nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 24: list range operations on key-value type
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        dict:set("foo", "bar")
+
+        ngx.say(dict:lrange("foo", 0, -1))
+        ngx.say(dict:lindex("foo", 0))
+        ngx.say(dict:lset("foo", 0, "x"))
+        ngx.say(dict:ltrim("foo", 0, 1))
+        ngx.say(dict:get("foo"))
+    }
+--- stream_response
+nilvalue not a list
+nilvalue not a list
+nilvalue not a list
+nilvalue not a list
+bar
+--- no_error_log
+[error]
+
+
+
+=== TEST 25: blpop and brpop on non-empty lists
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        dict:rpush("foo", 1, 2, 3)
+
+        ngx.say(dict:blpop("foo", 1))
+        ngx.say(dict:brpop("foo", 1))
+        ngx.say(dict:brpop("foo"))
+        ngx.say(dict:llen("foo"))
+
+        dict:set("bar", "hello")
+        ngx.say(dict:blpop("bar", 1))
+
+        local ok, err = pcall(dict.blpop, dict, "foo", -1)
+        ngx.say(ok, " ", err:match('bad "timeout" argument'))
+    }
+--- stream_response
+1
+3
+2
+0
+nilvalue not a list
+false bad "timeout" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 26: blpop times out
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        local begin = ngx.now()
+
+        local val, err = dict:blpop("foo", 0.1)
+        ngx.say(val, " ", err)
+
+        ngx.update_time()
+        local elapsed = ngx.now() - begin
+        ngx.say(elapsed >= 0.099 and elapsed < 0.5)
+
+        ngx.say(dict:llen("foo"))
+    }
+--- stream_response
+nil timeout
+true
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 27: blpop woken up by a push
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        local ok, err = ngx.timer.at(0.05, function ()
+            dict:rpush("foo", "a", "b")
+        end)
+        if not ok then
+            ngx.say("failed to create timer: ", err)
+            return
+        end
+
+        local begin = ngx.now()
+
+        ngx.say(dict:blpop("foo", 3))
+
+        ngx.update_time()
+        ngx.say(ngx.now() - begin < 1)
+
+        ngx.say(dict:brpop("foo", 3))
+    }
+--- stream_response
+a
+true
+b
+--- no_error_log
+[error]
+
+
+
+=== TEST 28: capped list
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        ngx.say(dict:rpush("foo", 1, 2, 3, 4, 5, {max_len = 3}))
+        ngx.say(table.concat(dict:lrange("foo", 0, -1), ","))
+
+        ngx.say(dict:lpush("foo", "a", {max_len = 3}))
+        ngx.say(table.concat(dict:lrange("foo", 0, -1), ","))
+
+        ngx.say(dict:rpush("foo", "b", "c", {max_len = 4}))
+        ngx.say(table.concat(dict:lrange("foo", 0, -1), ","))
+
+        ngx.say(dict:rpush("foo", "d", {}))
+
+        local ok, err = pcall(dict.rpush, dict, "foo", "e", {max_len = 0})
+        ngx.say(ok, " ", err:match('bad "max_len" option'))
+    }
+--- stream_response
+3nilfalse
+3,4,5
+3nilfalse
+a,3,4
+4nilfalse
+3,4,b,c
+5nilfalse
+false bad "max_len" option
+--- no_error_log
+[error]
+
+
+
+=== TEST 29: push removes other valid items forcibly
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    content_by_lua_block {
+        local t = require("resty.shdict")
+        local dict = t.dict
+
+        local long_str = string.rep("x", 1000)
+
+        for i = 1, 100000 do
+            local len, err, forcible = dict:rpush("list" .. i, long_str)
+            if not len then
+                ngx.say("push err: ", err)
+                return
+            end
+
+            if forcible then
+                ngx.say("forcible: ", len, " ", i > 10)
+                break
+            end
+        end
+
+        ngx.say(dict:llen("list1"))
+    }
+--- stream_response
+forcible: 1 true
+0
+--- no_error_log
+[error]